@@ -61,12 +61,16 @@
 //#define CBOR_TAG_BASE64 (22)
 #define CBOR_TAG_BASE16 (23)
 #define CBOR_TAG_CBOR (24) /* following byte string is embedded CBOR data */
+#define CBOR_TAG_STRINGREF (25) /* index of a string earlier in the enclosing namespace */
 
 #define CBOR_TAG_URI 32
 //#define CBOR_TAG_BASE64URL 33
 //#define CBOR_TAG_BASE64 34
 #define CBOR_TAG_REGEX 35
 #define CBOR_TAG_MIME 36 /* following text is MIME message, headers, separators and all */
+#define CBOR_TAG_UUID 37 /* 16 byte string follows */
+#define CBOR_TAG_STRINGREF_NAMESPACE 256 /* strings inside may be referred to by tag 25 */
+#define CBOR_TAG_SET 258 /* array of distinct items follows */
 #define CBOR_TAG_CBOR_FILEHEADER 55799  /* can open a file with 0xd9d9f7 */
 
 
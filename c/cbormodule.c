@@ -1,12 +1,25 @@
 #include "Python.h"
+#include "structmember.h"
+
+// dumps/loads(semantic_tags=True) use the datetime C API from 3.7
+#define HAS_SEMANTIC_TAGS (PY_VERSION_HEX >= 0x03070000)
+#if HAS_SEMANTIC_TAGS
+#include "datetime.h"
+#endif
+
+// |exponent| limit for bigfloat -> Decimal; 2**65536 is already ~20k digits
+#define BIGFLOAT_MAX_EXPONENT 65536
 
 #include "cbor.h"
 
+#include <float.h>
 #include <math.h>
 #include <stdint.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 //#include <stdio.h>
-#include <arpa/inet.h>
 
 
 #ifndef DEBUG_LOGGING
@@ -29,10 +42,128 @@
 
 #endif
 
+#ifdef PY_BIG_ENDIAN
+#define CBOR_BIG_ENDIAN PY_BIG_ENDIAN
+#elif defined(WORDS_BIGENDIAN)
+#define CBOR_BIG_ENDIAN 1
+#else
+#define CBOR_BIG_ENDIAN 0
+#endif
+
+// Free-threaded builds start at 3.13, which has these (empty with the
+// GIL). Before that the GIL is all the locking there is.
+#ifndef Py_BEGIN_CRITICAL_SECTION
+#define Py_BEGIN_CRITICAL_SECTION(op) {
+#define Py_END_CRITICAL_SECTION() }
+#endif
+
+#if PY_VERSION_HEX < 0x030D0000
+// New in 3.13: strong references, so an item stays alive if another
+// thread takes it out of the container.
+static PyObject* PyList_GetItemRef(PyObject* list, Py_ssize_t i) {
+    PyObject* item = PyList_GetItem(list, i);  // Borrowed ref
+    Py_XINCREF(item);
+    return item;
+}
+
+static int PyDict_GetItemRef(PyObject* dict, PyObject* key, PyObject** result) {
+#if IS_PY3
+    *result = PyDict_GetItemWithError(dict, key);  // Borrowed ref
+#else
+    *result = PyDict_GetItem(dict, key);  // Borrowed ref
+#endif
+    if (*result == NULL) {
+        return PyErr_Occurred() ? -1 : 0;
+    }
+    Py_INCREF(*result);
+    return 1;
+}
+#endif
+
+// dumps(float_mode=)
+#define FLOAT_MODE_DOUBLE 0    /* always float64 */
+#define FLOAT_MODE_SHORTEST 1  /* float16 or float32 when that decodes to exactly the same value */
+
+#define DEFAULT_TYPE_CACHE_SIZE 8
+#define DEFAULT_TYPE_SLOT(type) ((((uintptr_t)(type)) >> 4) & (DEFAULT_TYPE_CACHE_SIZE - 1))
+
+// per-module state, below
+typedef struct _CborState CborState;
+
 typedef struct {
+    CborState* state;
     unsigned int sort_keys;
+    unsigned int float_mode;
+    // write datetime, Decimal, UUID, re.Pattern and sets as their standard tags
+    unsigned int semantic_tags;
+    // dumps(class_tags=): sequence of cbor.tagmap.ClassTag, borrowed from kwargs
+    PyObject* class_tags;
+    // {type: (tag_number, encode_function) or None}, filled in as types are seen
+    PyObject* class_tag_cache;
+    // dumps(default=): called for objects of types not otherwise handled
+    PyObject* default_fn;
+    // Types that went to default_fn, direct-mapped by address, so more of
+    // the same type go straight there. Holds a reference to each.
+    PyTypeObject* default_types[DEFAULT_TYPE_CACHE_SIZE];
+    // dumps(canonical=True): RFC 8949 core deterministic encoding, map keys
+    // (and set items) in bytewise order of their encoding, shortest floats
+    unsigned int canonical;
+    // dumps(string_referencing=True): wrap the output in a stringref namespace
+    unsigned int string_referencing;
+    // {str: index} and {bytes: index} of the strings in the current
+    // namespace, NULL outside of one
+    PyObject* stringrefs_text;
+    PyObject* stringrefs_bytes;
 } EncodeOptions;
 
+// Map keys tend to be the same few strings over and over. The decoder
+// keeps recently seen keys in a small direct-mapped table keyed by their
+// UTF-8 bytes, so a repeated key is the same str object (with its hash
+// already computed) instead of a newly decoded one. A key that lands on a
+// full slot replaces what was there.
+#define KEY_CACHE_MAX_KEY_LEN 32
+#define KEY_CACHE_DEFAULT_SIZE 128
+#define KEY_CACHE_MAX_SIZE 65536
+// keys decoded before the table is allocated, so that loads() of a small
+// document doesn't pay for setting up a cache it won't get much use out of
+#define KEY_CACHE_WARMUP 32
+
+typedef struct {
+    PyObject* key;
+    Py_ssize_t len;
+    uint8_t raw[KEY_CACHE_MAX_KEY_LEN];
+} KeyCacheEntry;
+
+typedef struct {
+    // allocated after KEY_CACHE_WARMUP keys
+    KeyCacheEntry* entries;
+    // number of entries, a power of 2. 0 turns the cache off.
+    Py_ssize_t size;
+    Py_ssize_t warmup;
+} KeyCache;
+
+typedef struct {
+    CborState* state;
+    // loads(bytes_as_memoryview=True) returns byte strings as slices of this
+    // memoryview over the input, which starts at bytes_base_start.
+    PyObject* bytes_base;
+    uint8_t* bytes_base_start;
+    KeyCache key_cache;
+    // decoding from this BufferReader can take the buffer_loads() fast path
+    struct _BufferReader* buffer_reader;
+    // loads(class_tags=): {tag_number: decode_function}
+    PyObject* tag_decoders;
+    int raise_on_unknown_tag;
+    // loads(tag_hook=, object_hook=): called with each Tag and each dict decoded
+    PyObject* tag_hook;
+    PyObject* object_hook;
+    // decode the standard tags for datetime, Decimal, UUID, regex and set
+    int semantic_tags;
+    // strings tag 25 can refer to in the current tag 256 namespace, NULL
+    // outside of one. Owned by loads_stringref_namespace().
+    PyObject* stringrefs;
+} DecodeOptions;
+
 // Hey Look! It's a polymorphic object structure in C!
 
 // read(, len): read len bytes and return in buffer, or NULL on error
@@ -54,15 +185,17 @@ typedef struct _Reader {
     READER_FUNCTIONS;
 } Reader;
 
+typedef struct _BufferReader BufferReader;
 static Reader* NewBufferReader(PyObject* ob);
-static Reader* NewObjectReader(PyObject* ob);
+static Reader* NewObjectReader(PyObject* ob, int consume_ahead);
 #if HAS_FILE_READER
 static Reader* NewFileReader(PyObject* ob);
 #endif
 
 
-static PyObject* loads_tag(Reader* rin, uint64_t aux);
-static int loads_kv(PyObject* out, Reader* rin);
+static PyObject* loads_tag(DecodeOptions *optp, Reader* rin, uint64_t aux);
+static int loads_kv(DecodeOptions *optp, PyObject* out, Reader* rin);
+static PyObject* loads_map_key(DecodeOptions *optp, Reader* rin, uint8_t c);
 
 typedef struct VarBufferPart {
     void* start;
@@ -84,49 +217,119 @@ static int logprintf(const char* fmt, ...) {
     return ret;
 }
 
-// TODO: portably work this out at compile time
-static int _is_big_endian = 0;
-
-static int is_big_endian(void) {
-    uint32_t val = 1234;
-    _is_big_endian = val == htonl(val);
-    //logprintf("is_big_endian=%d\n", _is_big_endian);
-    return _is_big_endian;
-}
-
 
-PyObject* decodeFloat16(Reader* rin) {
+static double decode_half(uint16_t half) {
     // float16 parsing adapted from example code in spec
-    uint8_t hibyte, lobyte;// = raw[pos];
-    int err;
+    uint8_t hibyte = half >> 8;
+    uint8_t lobyte = half & 0xff;
     int exp;
     int mant;
     double val;
 
-    err = rin->read1(rin, &hibyte);
-    if (err) { logprintf("fail in float16[0]\n"); return NULL; }
-    err = rin->read1(rin, &lobyte);
-    if (err) { logprintf("fail in float16[1]\n"); return NULL; }
-
     exp = (hibyte >> 2) & 0x1f;
     mant = ((hibyte & 0x3) << 8) | lobyte;
     if (exp == 0) {
 	val = ldexp(mant, -24);
     } else if (exp != 31) {
 	val = ldexp(mant + 1024, exp - 25);
+    } else if (mant == 0) {
+	val = INFINITY;
     } else {
-	val = mant == 0 ? INFINITY : NAN;
+	// NaN, keep the sign and payload bits
+	union { uint64_t u; double d; } nan;
+	nan.u = (((uint64_t)(hibyte & 0x80)) << 56) | (((uint64_t)0x7ff) << 52) | (((uint64_t)mant) << 42);
+	return nan.d;
     }
     if (hibyte & 0x80) {
 	val = -val;
     }
-    return PyFloat_FromDouble(val);
+    return val;
+}
+
+// Return 1 if raw[0:len] is all 7 bit ASCII.
+static int is_ascii(const uint8_t* raw, Py_ssize_t len) {
+    Py_ssize_t i = 0;
+    uint64_t acc = 0;
+#if defined(__SSE2__)
+    for (; i + 16 <= len; i += 16) {
+        if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(raw + i)))) {
+            return 0;
+        }
+    }
+#endif
+    for (; i + 8 <= len; i += 8) {
+        uint64_t chunk;
+        memcpy(&chunk, raw + i, 8);
+        acc |= chunk;
+    }
+    for (; i < len; i++) {
+        acc |= raw[i];
+    }
+    return (acc & 0x8080808080808080ULL) == 0;
+}
+
+// Return new str from UTF-8 raw[0:len], or NULL on error.
+// ASCII is copied straight into a new compact ASCII str without going through the UTF-8 decoder.
+static PyObject* text_from_utf8(const uint8_t* raw, Py_ssize_t len) {
+#if IS_PY3
+    if ((len > 1) && is_ascii(raw, len)) {
+        PyObject* out = PyUnicode_New(len, 127);
+        if (out == NULL) {
+            return NULL;
+        }
+        memcpy(PyUnicode_1BYTE_DATA(out), raw, len);
+        return out;
+    }
+#endif
+    // empty and 1 character strings come from the interpreter's cache
+    return PyUnicode_DecodeUTF8((const char*)raw, len, "strict");
+}
+
+// Stringref (tags 25 and 256, http://cbor.schmorp.de/stringref): a string
+// of at least this many bytes goes in the namespace's table as entry
+// index, which is when a tag 25 reference to it is shorter than it.
+static inline Py_ssize_t stringref_min_len(Py_ssize_t index) {
+    if (index < 24) {
+        return 3;
+    } else if (index < 256) {
+        return 4;
+    } else if (index < 65536) {
+        return 5;
+    } else if ((uint64_t)index < 0x100000000ULL) {
+        return 7;
+    }
+    return 11;
+}
+
+// Add string s, len bytes encoded, to the current stringref table if there
+// is one and s is long enough. Steals s; returns it, or NULL on error.
+static inline PyObject* loads_stringref_note(DecodeOptions *optp, PyObject* s, Py_ssize_t len) {
+    if ((optp->stringrefs == NULL) || (s == NULL) ||
+        (len < stringref_min_len(PyList_GET_SIZE(optp->stringrefs)))) {
+        return s;
+    }
+    if (PyList_Append(optp->stringrefs, s)) {
+        Py_DECREF(s);
+        return NULL;
+    }
+    return s;
+}
+
+PyObject* decodeFloat16(Reader* rin) {
+    uint8_t hibyte, lobyte;
+    int err;
+
+    err = rin->read1(rin, &hibyte);
+    if (err) { logprintf("fail in float16[0]\n"); return NULL; }
+    err = rin->read1(rin, &lobyte);
+    if (err) { logprintf("fail in float16[1]\n"); return NULL; }
+    return PyFloat_FromDouble(decode_half((hibyte << 8) | lobyte));
 }
 PyObject* decodeFloat32(Reader* rin) {
     float val;
     uint8_t* raw = rin->read(rin, 4);
     if (!raw) { logprintf("fail in float32\n"); return NULL; }
-    if (_is_big_endian) {
+    if (CBOR_BIG_ENDIAN) {
 	// easy!
 	val = *((float*)raw);
     } else {
@@ -195,18 +398,37 @@ static int handle_info_bits(Reader* rin, uint8_t cbor_info, uint64_t* auxP) {
     return 0;
 }
 
-static PyObject* inner_loads_c(Reader* rin, uint8_t c);
+static PyObject* inner_loads_c(DecodeOptions *optp, Reader* rin, uint8_t c);
+static PyObject* call_decode_hook(PyObject* hook, PyObject* ob);
+static PyObject* buffer_loads(DecodeOptions *optp, BufferReader* br);
 
-static PyObject* inner_loads(Reader* rin) {
+static PyObject* inner_loads(DecodeOptions *optp, Reader* rin) {
     uint8_t c;
     int err;
 
+    if (rin == (Reader*)optp->buffer_reader) {
+        return buffer_loads(optp, optp->buffer_reader);
+    }
     err = rin->read1(rin, &c);
     if (err) { logprintf("fail in loads tag\n"); return NULL; }
-    return inner_loads_c(rin, c);
+    return inner_loads_c(optp, rin, c);
+}
+
+static PyObject* inner_loads_item(DecodeOptions *optp, Reader* rin, uint8_t c);
+
+// Decode the item that starts with byte c. Arrays, maps and tags call back
+// in here for what they hold, so as in buffer_loads() the depth is limited.
+PyObject* inner_loads_c(DecodeOptions *optp, Reader* rin, uint8_t c) {
+    PyObject* out;
+    if (Py_EnterRecursiveCall(" while decoding nested CBOR")) {
+        return NULL;
+    }
+    out = inner_loads_item(optp, rin, c);
+    Py_LeaveRecursiveCall();
+    return out;
 }
 
-PyObject* inner_loads_c(Reader* rin, uint8_t c) {
+static PyObject* inner_loads_item(DecodeOptions *optp, Reader* rin, uint8_t c) {
     uint8_t cbor_type;
     uint8_t cbor_info;
     uint64_t aux;
@@ -318,28 +540,39 @@ PyObject* inner_loads_c(Reader* rin, uint8_t c) {
 		raw = rin->read(rin, aux);
 		if (!raw) { logprintf("bytes read failed\n"); return NULL; }
 	    }
-	    out = PyBytes_FromStringAndSize(raw, (Py_ssize_t)aux);
+	    if (optp->bytes_base != NULL) {
+		// slice of the input, no copy
+		Py_ssize_t start = (aux == 0) ? 0 : ((uint8_t*)raw - optp->bytes_base_start);
+		out = PySequence_GetSlice(optp->bytes_base, start, start + (Py_ssize_t)aux);
+	    } else {
+		out = PyBytes_FromStringAndSize(raw, (Py_ssize_t)aux);
+	    }
             if (out == NULL) {
                 PyErr_SetString(PyExc_RuntimeError, "unknown error decoding BYTES");
             }
             if (aux != 0) {
                 rin->return_buffer(rin, raw);
             }
+	    out = loads_stringref_note(optp, out, (Py_ssize_t)aux);
 	}
         return out;
     case CBOR_TEXT:
 	if (cbor_info == CBOR_VAR_FOLLOWS) {
 	    PyObject* parts = PyList_New(0);
 	    PyObject* joiner = PyUnicode_FromString("");
+	    // neither the chunks nor the whole go in the stringref table
+	    PyObject* stringrefs = optp->stringrefs;
 	    uint8_t sc;
+	    optp->stringrefs = NULL;
 	    if (rin->read1(rin, &sc)) { logprintf("r1 fail in var text tag\n"); return NULL; }
 	    while (sc != CBOR_BREAK) {
-		PyObject* subitem = inner_loads_c(rin, sc);
+		PyObject* subitem = inner_loads_c(optp, rin, sc);
 		if (subitem == NULL) { logprintf("fail in var text subitem\n"); return NULL; }
 		PyList_Append(parts, subitem);
                 Py_DECREF(subitem);
 		if (rin->read1(rin, &sc)) { logprintf("r1 fail in var text tag\n"); return NULL; }
 	    }
+	    optp->stringrefs = stringrefs;
 	    // Done
 	    out = PyUnicode_Join(joiner, parts);
 	    Py_DECREF(joiner);
@@ -356,13 +589,14 @@ PyObject* inner_loads_c(Reader* rin, uint8_t c) {
                 raw = rin->read(rin, aux);
                 if (!raw) { logprintf("read text failed\n"); return NULL; }
             }
-	    out = PyUnicode_FromStringAndSize((char*)raw, (Py_ssize_t)aux);
+	    out = text_from_utf8((const uint8_t*)raw, (Py_ssize_t)aux);
             if (out == NULL) {
                 PyErr_SetString(PyExc_RuntimeError, "unknown error decoding TEXT");
             }
             if (aux != 0) {
                 rin->return_buffer(rin, raw);
             }
+	    out = loads_stringref_note(optp, out, (Py_ssize_t)aux);
 	}
         return out;
     case CBOR_ARRAY:
@@ -371,7 +605,7 @@ PyObject* inner_loads_c(Reader* rin, uint8_t c) {
 	    out = PyList_New(0);
 	    if (rin->read1(rin, &sc)) { logprintf("r1 fail in var array tag\n"); return NULL; }
 	    while (sc != CBOR_BREAK) {
-		PyObject* subitem = inner_loads_c(rin, sc);
+		PyObject* subitem = inner_loads_c(optp, rin, sc);
 		if (subitem == NULL) { logprintf("fail in var array subitem\n"); return NULL; }
 		PyList_Append(out, subitem);
                 Py_DECREF(subitem);
@@ -385,7 +619,7 @@ PyObject* inner_loads_c(Reader* rin, uint8_t c) {
             unsigned int i;
 	    out = PyList_New((Py_ssize_t)aux);
 	    for (i = 0; i < aux; i++) {
-		PyObject* subitem = inner_loads(rin);
+		PyObject* subitem = inner_loads(optp, rin);
 		if (subitem == NULL) { logprintf("array subitem[%d] (of %d) failed\n", i, aux); return NULL; }
 		PyList_SetItem(out, (Py_ssize_t)i, subitem);
                 // PyList_SetItem became the owner of the reference count of subitem, we don't need to DECREF it
@@ -401,10 +635,10 @@ PyObject* inner_loads_c(Reader* rin, uint8_t c) {
 	    uint8_t sc;
 	    if (rin->read1(rin, &sc)) { logprintf("r1 fail in var map tag\n"); return NULL; }
 	    while (sc != CBOR_BREAK) {
-		PyObject* key = inner_loads_c(rin, sc);
+		PyObject* key = loads_map_key(optp, rin, sc);
 		PyObject* value;
 		if (key == NULL) { logprintf("var map key fail\n"); return NULL; }
-		value = inner_loads(rin);
+		value = inner_loads(optp, rin);
 		if (value == NULL) { logprintf("var map val vail\n"); return NULL; }
 		PyDict_SetItem(out, key, value);
                 Py_DECREF(key);
@@ -418,7 +652,7 @@ PyObject* inner_loads_c(Reader* rin, uint8_t c) {
 	} else {
             unsigned int i;
 	    for (i = 0; i < aux; i++) {
-		if (loads_kv(out, rin) != 0) {
+		if (loads_kv(optp, out, rin) != 0) {
 		    logprintf("map kv[%d] failed\n", i);
 		    return NULL;
 		}
@@ -427,9 +661,9 @@ PyObject* inner_loads_c(Reader* rin, uint8_t c) {
                 PyErr_SetString(PyExc_RuntimeError, "unknown error decoding MAP");
             }
 	}
-        return out;
+        return call_decode_hook(optp->object_hook, out);
     case CBOR_TAG:
-	return loads_tag(rin, aux);
+	return loads_tag(optp, rin, aux);
     case CBOR_7:
 	if (aux == 20) {
 	    out = Py_False;
@@ -460,11 +694,134 @@ PyObject* inner_loads_c(Reader* rin, uint8_t c) {
 #pragma GCC diagnostic pop
 }
 
-static int loads_kv(PyObject* out, Reader* rin) {
-    PyObject* key = inner_loads(rin);
+// Set up kc to hold up to size keys (rounded up to a power of 2), 0 for none.
+static void KeyCache_init(KeyCache* kc, Py_ssize_t size) {
+    Py_ssize_t pow2 = 1;
+    kc->entries = NULL;
+    kc->warmup = KEY_CACHE_WARMUP;
+    if (size <= 0) {
+        kc->size = 0;
+        return;
+    }
+    if (size > KEY_CACHE_MAX_SIZE) {
+        size = KEY_CACHE_MAX_SIZE;
+    }
+    while (pow2 < size) {
+        pow2 <<= 1;
+    }
+    kc->size = pow2;
+}
+
+static void KeyCache_clear(KeyCache* kc) {
+    if (kc->entries != NULL) {
+        Py_ssize_t i;
+        for (i = 0; i < kc->size; i++) {
+            Py_XDECREF(kc->entries[i].key);
+        }
+        PyMem_Free(kc->entries);
+        kc->entries = NULL;
+    }
+}
+
+// Return new reference to the str for UTF-8 raw[0:len], from the cache if it's there.
+static PyObject* KeyCache_get(KeyCache* kc, const uint8_t* raw, Py_ssize_t len) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    Py_ssize_t i;
+    KeyCacheEntry* entry;
+    PyObject* key;
+    if (kc->entries == NULL) {
+        if (kc->warmup > 0) {
+            kc->warmup--;
+            return text_from_utf8(raw, len);
+        }
+        kc->entries = (KeyCacheEntry*)PyMem_Malloc(kc->size * sizeof(KeyCacheEntry));
+        if (kc->entries == NULL) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+        for (i = 0; i < kc->size; i++) {
+            kc->entries[i].key = NULL;
+        }
+    }
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ raw[i]) * 16777619u;
+    }
+    entry = kc->entries + (hash & (uint32_t)(kc->size - 1));
+    if ((entry->key != NULL) && (entry->len == len) && (memcmp(entry->raw, raw, len) == 0)) {
+        Py_INCREF(entry->key);
+        return entry->key;
+    }
+    key = text_from_utf8(raw, len);
+    if (key == NULL) {
+        return NULL;
+    }
+    Py_XDECREF(entry->key);
+    Py_INCREF(key);
+    entry->key = key;
+    entry->len = len;
+    memcpy(entry->raw, raw, len);
+    return key;
+}
+
+// Decode a map key whose first byte c has been read.
+// Short definite length text goes through the key cache, anything else is decoded as usual.
+static PyObject* loads_map_key(DecodeOptions *optp, Reader* rin, uint8_t c) {
+    uint8_t len;
+    void* raw;
+    PyObject* key;
+    if ((optp->key_cache.size == 0) || ((c & CBOR_TYPE_MASK) != CBOR_TEXT)) {
+        return inner_loads_c(optp, rin, c);
+    }
+    if ((c & CBOR_INFO_BITS) < CBOR_UINT8_FOLLOWS) {
+        len = c & CBOR_INFO_BITS;
+    } else if ((c & CBOR_INFO_BITS) == CBOR_UINT8_FOLLOWS) {
+        if (rin->read1(rin, &len)) { logprintf("r1 fail in map key\n"); return NULL; }
+    } else {
+        return inner_loads_c(optp, rin, c);
+    }
+    if (len == 0) {
+        return PyUnicode_FromStringAndSize("", 0);
+    }
+    raw = rin->read(rin, len);
+    if (!raw) { logprintf("read map key failed\n"); return NULL; }
+    if (len <= KEY_CACHE_MAX_KEY_LEN) {
+        key = KeyCache_get(&(optp->key_cache), (const uint8_t*)raw, len);
+    } else {
+        key = text_from_utf8((const uint8_t*)raw, len);
+    }
+    rin->return_buffer(rin, raw);
+    return loads_stringref_note(optp, key, len);
+}
+
+static void DecodeOptions_clear(DecodeOptions *optp) {
+    optp->buffer_reader = NULL;
+    Py_CLEAR(optp->bytes_base);
+    Py_CLEAR(optp->tag_decoders);
+    Py_CLEAR(optp->tag_hook);
+    Py_CLEAR(optp->object_hook);
+    KeyCache_clear(&(optp->key_cache));
+}
+
+// Return hook(ob), or ob if there is no hook. Steals the reference to ob.
+static PyObject* call_decode_hook(PyObject* hook, PyObject* ob) {
+    PyObject* out;
+    if ((hook == NULL) || (ob == NULL)) {
+        return ob;
+    }
+    out = PyObject_CallFunctionObjArgs(hook, ob, NULL);
+    Py_DECREF(ob);
+    return out;
+}
+
+static int loads_kv(DecodeOptions *optp, PyObject* out, Reader* rin) {
+    uint8_t c;
+    PyObject* key;
     PyObject* value;
+    if (rin->read1(rin, &c)) { logprintf("r1 fail in map key\n"); return -1; }
+    key = loads_map_key(optp, rin, c);
     if (key == NULL) { logprintf("map key fail\n"); return -1; }
-    value = inner_loads(rin);
+    value = inner_loads(optp, rin);
     if (value == NULL) { logprintf("map val fail\n"); return -1; }
     PyDict_SetItem(out, key, value);
     Py_DECREF(key);
@@ -472,151 +829,991 @@ static int loads_kv(PyObject* out, Reader* rin) {
     return 0;
 }
 
-static PyObject* loads_bignum(Reader* rin, uint8_t c) {
-    PyObject* out = NULL;
+// Unsigned big-endian bytes to a Python int in one pass.
+static PyObject* biguint_from_bytes(const uint8_t* raw, Py_ssize_t len) {
+    if (len == 0) {
+	return PyLong_FromLong(0);
+    }
+#if PY_VERSION_HEX >= 0x030D0000
+    return PyLong_FromUnsignedNativeBytes(raw, len, Py_ASNATIVEBYTES_BIG_ENDIAN);
+#else
+    return _PyLong_FromByteArray(raw, len, 0 /* big endian */, 0 /* unsigned */);
+#endif
+}
 
-    uint8_t bytes_info = c & CBOR_INFO_BITS;
-    if (bytes_info < 24) {
-        int i;
-	PyObject* eight = PyLong_FromLong(8);
-	out = PyLong_FromLong(0);
-	for (i = 0; i < bytes_info; i++) {
-	    // TODO: is this leaking like crazy?
-	    PyObject* curbyte;
-	    PyObject* tout = PyNumber_Lshift(out, eight);
-	    Py_DECREF(out);
-	    out = tout;
-	    uint8_t cb;
-	    if (rin->read1(rin, &cb)) {
-                logprintf("r1 fail in bignum %d/%d\n", i, bytes_info);
-                Py_DECREF(eight);
-                Py_DECREF(out);
-                return NULL;
-            }
-	    curbyte = PyLong_FromLong(cb);
-	    tout = PyNumber_Or(out, curbyte);
-	    Py_DECREF(curbyte);
-	    Py_DECREF(out);
-	    out = tout;
-	}
-        Py_DECREF(eight);
+// c is the BYTES head following tag 2 or 3; any length, definite or not.
+static PyObject* loads_bignum(DecodeOptions *optp, Reader* rin, uint8_t c) {
+    PyObject* out;
+    uint64_t aux;
+    void* raw;
+
+    if ((c & CBOR_INFO_BITS) == CBOR_VAR_FOLLOWS) {
+	// chunks are joined into one bytes object by the normal path
+	PyObject* blob = inner_loads_c(optp, rin, c);
+	if (blob == NULL) { logprintf("var bytes fail in bignum\n"); return NULL; }
+	out = biguint_from_bytes((const uint8_t*)PyBytes_AS_STRING(blob), PyBytes_GET_SIZE(blob));
+	Py_DECREF(blob);
 	return out;
-    } else {
-	PyErr_Format(PyExc_NotImplementedError, "TODO: TAG BIGNUM for bigger bignum bytes_info=%d, len(ull)=%lu\n", bytes_info, sizeof(unsigned long long));
+    }
+    if (handle_info_bits(rin, c & CBOR_INFO_BITS, &aux)) { logprintf("info bits fail in bignum\n"); return NULL; }
+    if (aux == 0) {
+	return PyLong_FromLong(0);
+    }
+    if (aux > PY_SSIZE_T_MAX) {
+	PyErr_Format(PyExc_ValueError, "bignum of %llu bytes is too long", (unsigned long long)aux);
 	return NULL;
     }
+    raw = rin->read(rin, (Py_ssize_t)aux);
+    if (!raw) { logprintf("r fail in bignum\n"); return NULL; }
+    out = biguint_from_bytes((const uint8_t*)raw, (Py_ssize_t)aux);
+    rin->return_buffer(rin, raw);
+    return out;
 }
 
 
-// returns a PyObject for cbor.cbor.Tag
-// Returned PyObject* is a BORROWED reference from the module dict
-static PyObject* getCborTagClass(void) {
-    PyObject* cbor_module = PyImport_ImportModule("cbor.cbor");
-    PyObject* moddict = PyModule_GetDict(cbor_module);
-    PyObject* tag_class = PyDict_GetItemString(moddict, "Tag");
-    // moddict and tag_class are 'borrowed reference'
-    Py_DECREF(cbor_module);
+// Tag(tag, value): a tagged item without a more specific Python type.
+// Also importable as cbor.cbor.Tag so both implementations make and accept
+// the same objects.
+typedef struct {
+    PyObject_HEAD
+    PyObject* tag;
+    PyObject* value;
+} CborTag;
+
+static PyTypeObject CborTagType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+};
 
-    return tag_class;
+// return a new Tag of exactly CborTagType, borrowing tag and value
+static PyObject* Tag_New(PyObject* tag, PyObject* value) {
+    CborTag* thiz = PyObject_GC_New(CborTag, &CborTagType);
+    if (thiz == NULL) {
+        return NULL;
+    }
+    Py_INCREF(tag);
+    thiz->tag = tag;
+    Py_INCREF(value);
+    thiz->value = value;
+    PyObject_GC_Track((PyObject*)thiz);
+    return (PyObject*)thiz;
 }
 
+static PyObject* Tag_tp_new(PyTypeObject* type, PyObject* args, PyObject* kwargs) {
+    CborTag* thiz = (CborTag*)type->tp_alloc(type, 0);
+    if (thiz == NULL) {
+        return NULL;
+    }
+    Py_INCREF(Py_None);
+    thiz->tag = Py_None;
+    Py_INCREF(Py_None);
+    thiz->value = Py_None;
+    return (PyObject*)thiz;
+}
 
-static PyObject* loads_tag(Reader* rin, uint64_t aux) {
-    PyObject* out = NULL;
-    // return an object CBORTag(tagnum, nextob)
-    if (aux == CBOR_TAG_BIGNUM) {
-	// If the next object is bytes, interpret it here without making a PyObject for it.
-	uint8_t sc;
-	if (rin->read1(rin, &sc)) { logprintf("r1 fail in bignum tag\n"); return NULL; }
-	if ((sc & CBOR_TYPE_MASK) == CBOR_BYTES) {
-	    return loads_bignum(rin, sc);
-	} else {
-	    PyErr_Format(PyExc_ValueError, "TAG BIGNUM not followed by bytes but %02x", sc);
-	    return NULL;
-	}
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunreachable-code"
-	PyErr_Format(PyExc_ValueError, "TODO: WRITEME CBOR TAG BIGNUM %02x ...\n", sc);
-	return NULL;
-#pragma GCC diagnostic pop
-    } else if (aux == CBOR_TAG_NEGBIGNUM) {
-	// If the next object is bytes, interpret it here without making a PyObject for it.
-	uint8_t sc;
-	if (rin->read1(rin, &sc)) { logprintf("r1 fail in negbignum tag\n"); return NULL; }
-	if ((sc & CBOR_TYPE_MASK) == CBOR_BYTES) {
-	    out = loads_bignum(rin, sc);
-            if (out == NULL) { logprintf("loads_bignum fail inside TAG_NEGBIGNUM\n"); return NULL; }
-            PyObject* minusOne = PyLong_FromLong(-1);
-            PyObject* tout = PyNumber_Subtract(minusOne, out);
-            Py_DECREF(minusOne);
-            Py_DECREF(out);
-            out = tout;
-            return out;
-	} else {
-	    PyErr_Format(PyExc_ValueError, "TAG NEGBIGNUM not followed by bytes but %02x", sc);
-	    return NULL;
-	}
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunreachable-code"
-	PyErr_Format(PyExc_ValueError, "TODO: WRITEME CBOR TAG NEGBIGNUM %02x ...\n", sc);
-	return NULL;
-#pragma GCC diagnostic pop
+static int Tag_init(CborTag* thiz, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"tag", "value", NULL};
+    PyObject* tag = Py_None;
+    PyObject* value = Py_None;
+    PyObject* old;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OO:Tag", kwlist, &tag, &value)) {
+        return -1;
     }
-    out = inner_loads(rin);
-    if (out == NULL) { return NULL; }
-    {
-        PyObject* tag_class = getCborTagClass();
-	PyObject* args = Py_BuildValue("(K,O)", aux, out);
-        PyObject* tout = PyObject_CallObject(tag_class, args);
-	Py_DECREF(args);
-	Py_DECREF(out);
-        // tag_class was just a borrowed reference
-	out = tout;
+    old = thiz->tag;
+    Py_INCREF(tag);
+    thiz->tag = tag;
+    Py_XDECREF(old);
+    old = thiz->value;
+    Py_INCREF(value);
+    thiz->value = value;
+    Py_XDECREF(old);
+    return 0;
+}
+
+#if PY_VERSION_HEX >= 0x03090000
+// Tag(...) without building an args tuple, for the exact type only
+// (tp_vectorcall is not inherited, so subclasses go through __new__/__init__).
+static PyObject* Tag_vectorcall(PyObject* type, PyObject* const* args, size_t nargsf, PyObject* kwnames) {
+    Py_ssize_t nargs = PyVectorcall_NARGS(nargsf);
+    PyObject* tag = NULL;
+    PyObject* value = NULL;
+    Py_ssize_t i;
+    if (nargs > 2) {
+        PyErr_Format(PyExc_TypeError, "Tag() takes at most 2 arguments (%zd given)", nargs);
+        return NULL;
     }
-    return out;
+    if (nargs > 0) { tag = args[0]; }
+    if (nargs > 1) { value = args[1]; }
+    if (kwnames != NULL) {
+        for (i = 0; i < PyTuple_GET_SIZE(kwnames); i++) {
+            PyObject* name = PyTuple_GET_ITEM(kwnames, i);
+            PyObject** dest;
+            if (PyUnicode_CompareWithASCIIString(name, "tag") == 0) {
+                dest = &tag;
+            } else if (PyUnicode_CompareWithASCIIString(name, "value") == 0) {
+                dest = &value;
+            } else {
+                PyErr_Format(PyExc_TypeError, "Tag() got an unexpected keyword argument '%U'", name);
+                return NULL;
+            }
+            if (*dest != NULL) {
+                PyErr_Format(PyExc_TypeError, "Tag() got multiple values for argument '%U'", name);
+                return NULL;
+            }
+            *dest = args[nargs + i];
+        }
+    }
+    return Tag_New((tag != NULL) ? tag : Py_None, (value != NULL) ? value : Py_None);
 }
+#endif
 
+static int Tag_traverse(CborTag* thiz, visitproc visit, void* arg) {
+    Py_VISIT(thiz->tag);
+    Py_VISIT(thiz->value);
+    return 0;
+}
 
-static PyObject*
-cbor_loads(PyObject* noself, PyObject* args) {
-    PyObject* ob;
-    is_big_endian();
-    if (PyType_IsSubtype(Py_TYPE(args), &PyList_Type)) {
-	ob = PyList_GetItem(args, 0);
-    } else if (PyType_IsSubtype(Py_TYPE(args), &PyTuple_Type)) {
-	ob = PyTuple_GetItem(args, 0);
-    } else {
-	PyErr_Format(PyExc_ValueError, "args not list or tuple: %R\n", args);
-	return NULL;
+static int Tag_clear(CborTag* thiz) {
+    Py_CLEAR(thiz->tag);
+    Py_CLEAR(thiz->value);
+    return 0;
+}
+
+static void Tag_dealloc(CborTag* thiz) {
+    PyObject_GC_UnTrack(thiz);
+    Tag_clear(thiz);
+    Py_TYPE(thiz)->tp_free((PyObject*)thiz);
+}
+
+static PyObject* Tag_repr(CborTag* thiz) {
+#if IS_PY3
+    return PyUnicode_FromFormat("Tag(%R, %R)", thiz->tag ? thiz->tag : Py_None, thiz->value ? thiz->value : Py_None);
+#else
+    PyObject* out = NULL;
+    PyObject* tag_repr = PyObject_Repr(thiz->tag ? thiz->tag : Py_None);
+    PyObject* value_repr = PyObject_Repr(thiz->value ? thiz->value : Py_None);
+    if ((tag_repr != NULL) && (value_repr != NULL)) {
+        out = PyString_FromFormat("Tag(%s, %s)", PyString_AsString(tag_repr), PyString_AsString(value_repr));
     }
+    Py_XDECREF(tag_repr);
+    Py_XDECREF(value_repr);
+    return out;
+#endif
+}
 
-    if (ob == Py_None) {
-	PyErr_SetString(PyExc_ValueError, "got None for buffer to decode in loads");
-	return NULL;
+static PyObject* Tag_richcompare(PyObject* a, PyObject* b, int op) {
+    int eq;
+    if ((op != Py_EQ) && (op != Py_NE)) {
+        Py_INCREF(Py_NotImplemented);
+        return Py_NotImplemented;
+    }
+    if (!PyObject_TypeCheck(b, &CborTagType)) {
+        // never equal to anything but another Tag
+        eq = 0;
+    } else {
+        CborTag* ta = (CborTag*)a;
+        CborTag* tb = (CborTag*)b;
+        eq = PyObject_RichCompareBool(ta->tag ? ta->tag : Py_None, tb->tag ? tb->tag : Py_None, Py_EQ);
+        if (eq > 0) {
+            eq = PyObject_RichCompareBool(ta->value ? ta->value : Py_None, tb->value ? tb->value : Py_None, Py_EQ);
+        }
+        if (eq < 0) {
+            return NULL;
+        }
+    }
+    if (eq == (op == Py_EQ)) {
+        Py_RETURN_TRUE;
     }
+    Py_RETURN_FALSE;
+}
 
-    {
-        PyObject* out = NULL;
-	Reader* r = NewBufferReader(ob);
-	if (!r) {
-	    return NULL;
-	}
-	out = inner_loads(r);
-        r->delete(r);
-        return out;
+// hash((tag, value)), so a Tag of hashable things can be a dict key
+static Py_hash_t Tag_hash(CborTag* thiz) {
+    Py_hash_t out;
+    PyObject* pair = PyTuple_Pack(2, thiz->tag ? thiz->tag : Py_None, thiz->value ? thiz->value : Py_None);
+    if (pair == NULL) {
+        return -1;
     }
+    out = PyObject_Hash(pair);
+    Py_DECREF(pair);
+    return out;
 }
 
+static PyObject* Tag_reduce(CborTag* thiz, PyObject* noargs) {
+    return Py_BuildValue("(O(OO))", Py_TYPE(thiz), thiz->tag ? thiz->tag : Py_None, thiz->value ? thiz->value : Py_None);
+}
 
-#if HAS_FILE_READER
+static PyMemberDef Tag_members[] = {
+    {"tag", T_OBJECT, offsetof(CborTag, tag), 0, "tag number"},
+    {"value", T_OBJECT, offsetof(CborTag, value), 0, "the tagged item"},
+    {NULL, 0, 0, 0, NULL}        /* Sentinel */
+};
 
-typedef struct _FileReader {
-    READER_FUNCTIONS;
-    FILE* fin;
-    void* dst;
-    Py_ssize_t dst_size;
-    Py_ssize_t read_count;
-} FileReader;
+static PyMethodDef Tag_methods[] = {
+    {"__reduce__", (PyCFunction)Tag_reduce, METH_NOARGS, NULL},
+    {NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+static int Tag_init_type(void) {
+    CborTagType.tp_name = "cbor._cbor.Tag";
+    CborTagType.tp_basicsize = sizeof(CborTag);
+    CborTagType.tp_dealloc = (destructor)Tag_dealloc;
+    CborTagType.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC;
+    CborTagType.tp_doc = "Tag(tag=None, value=None)\nCBOR tag number and the item it applies to.";
+    CborTagType.tp_traverse = (traverseproc)Tag_traverse;
+    CborTagType.tp_clear = (inquiry)Tag_clear;
+    CborTagType.tp_repr = (reprfunc)Tag_repr;
+    CborTagType.tp_richcompare = Tag_richcompare;
+    CborTagType.tp_hash = (hashfunc)Tag_hash;
+    CborTagType.tp_members = Tag_members;
+    CborTagType.tp_methods = Tag_methods;
+    CborTagType.tp_init = (initproc)Tag_init;
+    CborTagType.tp_new = Tag_tp_new;
+#if PY_VERSION_HEX >= 0x03090000
+    CborTagType.tp_vectorcall = Tag_vectorcall;
+#endif
+    return PyType_Ready(&CborTagType);
+}
+
+// Types for semantic_tags=True, imported the first time they are needed.
+typedef struct {
+    int ready;
+#ifdef Py_GIL_DISABLED
+    PyMutex mutex;
+#endif
+    PyObject* decimal_type;  // decimal.Decimal
+    PyObject* uuid_type;     // uuid.UUID
+    PyObject* uuid_unknown;  // uuid.SafeUUID.unknown
+    PyObject* int_name;      // "int"
+    PyObject* is_safe_name;  // "is_safe"
+    PyObject* pattern_type;  // re.Pattern
+    PyObject* re_compile;    // re.compile
+} SemanticTypes;
+
+// What the module makes or imports, kept per module rather than in C
+// globals, so each interpreter has its own. Module functions find it from
+// their module object, and Encoder, Decoder and StreamDecoder objects from
+// their type (see own_module()).
+struct _CborState {
+    // cbor._cbor.UnknownTagException, raised for loads(class_tags=, raise_on_unknown_tag=True)
+    PyObject* UnknownTagException;
+    SemanticTypes semantic;
+};
+
+#if IS_PY3
+#define cbor_state(module) ((CborState*)PyModule_GetState(module))
+
+// From 3.9 the module is set up in phases, and makes Encoder, Decoder and
+// StreamDecoder heap types of its own that know their module. Before that
+// there is one module per interpreter, found with PyState_FindModule().
+#define CBOR_HEAP_TYPES (PY_VERSION_HEX >= 0x03090000)
+
+static PyModuleDef cbor_moduledef;
+#else
+// Python 2 modules have no state of their own, and only one interpreter matters
+static CborState legacy_state;
+#define cbor_state(module) (&legacy_state)
+#endif
+
+// New reference to a tuple of the ClassTag sequence class_tags. A tuple
+// copy, unlike PySequence_Fast(), can't change under us if another thread
+// changes a list passed in.
+static PyObject* class_tags_tuple(PyObject* class_tags) {
+    if (!PySequence_Check(class_tags)) {
+        PyErr_SetString(PyExc_TypeError, "class_tags must be a sequence of ClassTag");
+        return NULL;
+    }
+    return PySequence_Tuple(class_tags);
+}
+
+// Parse class_tags= and raise_on_unknown_tag= for loads() and load(),
+// like cbor.tagmap.TagMapper. The first ClassTag for a tag number wins.
+// Return 0 on success.
+static int tag_decoders_kwarg(DecodeOptions *optp, PyObject* kwargs) {
+    PyObject* class_tags;
+    PyObject* seq;
+    PyObject* raise_unknown;
+    Py_ssize_t i;
+    if (kwargs == NULL) {
+        return 0;
+    }
+    class_tags = PyDict_GetItemString(kwargs, "class_tags");  // Borrowed ref
+    if ((class_tags == NULL) || (class_tags == Py_None)) {
+        return 0;
+    }
+    raise_unknown = PyDict_GetItemString(kwargs, "raise_on_unknown_tag");  // Borrowed ref
+    if (raise_unknown != NULL) {
+        optp->raise_on_unknown_tag = PyObject_IsTrue(raise_unknown);
+        if (optp->raise_on_unknown_tag < 0) {
+            return -1;
+        }
+    }
+    seq = class_tags_tuple(class_tags);
+    if (seq == NULL) {
+        return -1;
+    }
+    optp->tag_decoders = PyDict_New();
+    if (optp->tag_decoders == NULL) {
+        Py_DECREF(seq);
+        return -1;
+    }
+    for (i = 0; i < PyTuple_GET_SIZE(seq); i++) {
+        PyObject* ct = PyTuple_GET_ITEM(seq, i);
+        PyObject* tag_number = PyObject_GetAttrString(ct, "tag_number");
+        PyObject* decode_function;
+        int err = 0;
+        if (tag_number == NULL) {
+            Py_DECREF(seq);
+            return -1;
+        }
+        decode_function = PyObject_GetAttrString(ct, "decode_function");
+        if (decode_function == NULL) {
+            err = -1;
+        } else if ((decode_function != Py_None) && (PyDict_GetItem(optp->tag_decoders, tag_number) == NULL)) {
+            err = PyDict_SetItem(optp->tag_decoders, tag_number, decode_function);
+        }
+        Py_XDECREF(decode_function);
+        Py_DECREF(tag_number);
+        if (err) {
+            Py_DECREF(seq);
+            return -1;
+        }
+    }
+    Py_DECREF(seq);
+    return 0;
+}
+
+// Parse tag_hook= and object_hook= for loads() and load(). Return 0 on success.
+static int decode_hooks_kwarg(DecodeOptions *optp, PyObject* kwargs) {
+    static const char* names[] = {"tag_hook", "object_hook"};
+    PyObject** dests[] = {&(optp->tag_hook), &(optp->object_hook)};
+    int i;
+    if (kwargs == NULL) {
+        return 0;
+    }
+    for (i = 0; i < 2; i++) {
+        PyObject* hook = PyDict_GetItemString(kwargs, names[i]);  // Borrowed ref
+        if ((hook == NULL) || (hook == Py_None)) {
+            continue;
+        }
+        if (!PyCallable_Check(hook)) {
+            PyErr_Format(PyExc_TypeError, "%s must be callable", names[i]);
+            return -1;
+        }
+        Py_INCREF(hook);
+        *(dests[i]) = hook;
+    }
+    return 0;
+}
+
+// Tag aux with loads(class_tags=): a known tag number goes through its
+// decode_function. As with TagMapper.decode(), nothing inside a tag is
+// mapped, so the value is decoded with the mapping turned off.
+static PyObject* loads_mapped_tag(DecodeOptions *optp, Reader* rin, uint64_t aux) {
+    PyObject* decoders = optp->tag_decoders;
+    PyObject* tag_num = PyLong_FromUnsignedLongLong(aux);
+    PyObject* decoder;
+    PyObject* value;
+    PyObject* out = NULL;
+    if (tag_num == NULL) {
+        return NULL;
+    }
+    decoder = PyDict_GetItem(decoders, tag_num);  // Borrowed ref
+    if ((decoder == NULL) && optp->raise_on_unknown_tag) {
+        PyObject* msg = PyObject_Str(tag_num);
+        if (msg != NULL) {
+            PyErr_SetObject(optp->state->UnknownTagException, msg);
+            Py_DECREF(msg);
+        }
+        Py_DECREF(tag_num);
+        return NULL;
+    }
+    Py_XINCREF(decoder);
+    optp->tag_decoders = NULL;
+    value = inner_loads(optp, rin);
+    optp->tag_decoders = decoders;
+    if (value != NULL) {
+        if (decoder != NULL) {
+            out = PyObject_CallFunctionObjArgs(decoder, value, NULL);
+        } else {
+            out = call_decode_hook(optp->tag_hook, Tag_New(tag_num, value));
+        }
+        Py_DECREF(value);
+    }
+    Py_XDECREF(decoder);
+    Py_DECREF(tag_num);
+    return out;
+}
+
+// Return 1 if class_tags has a decode_function for tag aux, 0 if not, -1 on error.
+static int has_tag_decoder(DecodeOptions *optp, uint64_t aux) {
+    PyObject* tag_num;
+    int found;
+    if (optp->tag_decoders == NULL) {
+        return 0;
+    }
+    tag_num = PyLong_FromUnsignedLongLong(aux);
+    if (tag_num == NULL) {
+        return -1;
+    }
+    found = PyDict_Contains(optp->tag_decoders, tag_num);
+    Py_DECREF(tag_num);
+    return found;
+}
+
+
+// new reference to module_name.attr, or NULL on error
+static PyObject* import_attr(const char* module_name, const char* attr) {
+    PyObject* out;
+    PyObject* module = PyImport_ImportModule(module_name);
+    if (module == NULL) {
+        return NULL;
+    }
+    out = PyObject_GetAttrString(module, attr);
+    Py_DECREF(module);
+    return out;
+}
+
+
+#if HAS_SEMANTIC_TAGS
+// Import what st holds. With the GIL, another thread can get in while an
+// import runs, so whoever finishes second drops what it got.
+static int import_semantic_types(SemanticTypes* st) {
+    PyObject* decimal_type;
+    PyObject* uuid_type;
+    PyObject* pattern_type;
+    PyObject* re_compile;
+    PyObject* uuid_unknown;
+    PyObject* int_name;
+    PyObject* is_safe_name;
+    if (PyDateTimeAPI == NULL) {
+        PyDateTime_IMPORT;
+        if (PyDateTimeAPI == NULL) {
+            return -1;
+        }
+    }
+    decimal_type = import_attr("decimal", "Decimal");
+    uuid_type = import_attr("uuid", "UUID");
+    pattern_type = import_attr("re", "Pattern");
+    re_compile = import_attr("re", "compile");
+    uuid_unknown = import_attr("uuid", "SafeUUID");
+    int_name = PyUnicode_InternFromString("int");
+    is_safe_name = PyUnicode_InternFromString("is_safe");
+    if (uuid_unknown != NULL) {
+        PyObject* safe_uuid = uuid_unknown;
+        uuid_unknown = PyObject_GetAttrString(safe_uuid, "unknown");
+        Py_DECREF(safe_uuid);
+    }
+    if ((decimal_type == NULL) || (uuid_type == NULL) || (pattern_type == NULL) ||
+        (re_compile == NULL) || (uuid_unknown == NULL) || (int_name == NULL) ||
+        (is_safe_name == NULL) || st->ready) {
+        int err = !st->ready;
+        Py_XDECREF(decimal_type);
+        Py_XDECREF(uuid_type);
+        Py_XDECREF(pattern_type);
+        Py_XDECREF(re_compile);
+        Py_XDECREF(uuid_unknown);
+        Py_XDECREF(int_name);
+        Py_XDECREF(is_safe_name);
+        if (!err) {
+            PyErr_Clear();
+        }
+        return err ? -1 : 0;
+    }
+    st->decimal_type = decimal_type;
+    st->uuid_type = uuid_type;
+    st->pattern_type = pattern_type;
+    st->re_compile = re_compile;
+    st->uuid_unknown = uuid_unknown;
+    st->int_name = int_name;
+    st->is_safe_name = is_safe_name;
+#ifdef Py_GIL_DISABLED
+    _Py_atomic_store_int_release(&(st->ready), 1);
+#else
+    st->ready = 1;
+#endif
+    return 0;
+}
+
+// Return the semantic types of state once they are ready, NULL on error.
+static SemanticTypes* load_semantic_types(CborState* state) {
+    SemanticTypes* st = &(state->semantic);
+    int err = 0;
+#ifdef Py_GIL_DISABLED
+    if (_Py_atomic_load_int_acquire(&(st->ready))) {
+        return st;
+    }
+    PyMutex_Lock(&(st->mutex));
+    if (!st->ready) {
+        err = import_semantic_types(st);
+    }
+    PyMutex_Unlock(&(st->mutex));
+#else
+    if (!st->ready) {
+        err = import_semantic_types(st);
+    }
+#endif
+    return err ? NULL : st;
+}
+
+// value of n decimal digits at s, or -1 if they aren't all digits
+static int parse_digits(const char* s, int n) {
+    int out = 0;
+    int i;
+    for (i = 0; i < n; i++) {
+        if ((s[i] < '0') || (s[i] > '9')) {
+            return -1;
+        }
+        out = (out * 10) + (s[i] - '0');
+    }
+    return out;
+}
+
+// RFC 3339 date-time (tag 0) to an aware datetime.
+// Fractions of a second past microseconds are dropped.
+static PyObject* datetime_from_rfc3339(const char* s, Py_ssize_t len) {
+    int year, month, day, hour, minute, second;
+    int usec = 0;
+    int offset = 0;  // seconds east of UTC
+    Py_ssize_t pos = 19;
+    PyObject* tz;
+    PyObject* out;
+
+    if ((len < 20) || (s[4] != '-') || (s[7] != '-') ||
+        ((s[10] != 'T') && (s[10] != 't') && (s[10] != ' ')) ||
+        (s[13] != ':') || (s[16] != ':')) {
+        goto bad;
+    }
+    year = parse_digits(s, 4);
+    month = parse_digits(s + 5, 2);
+    day = parse_digits(s + 8, 2);
+    hour = parse_digits(s + 11, 2);
+    minute = parse_digits(s + 14, 2);
+    second = parse_digits(s + 17, 2);
+    if ((year < 0) || (month < 0) || (day < 0) || (hour < 0) || (minute < 0) || (second < 0)) {
+        goto bad;
+    }
+    if (s[pos] == '.') {
+        int scale = 100000;
+        Py_ssize_t start = ++pos;
+        while ((pos < len) && (s[pos] >= '0') && (s[pos] <= '9')) {
+            usec += (s[pos] - '0') * scale;
+            scale /= 10;
+            pos++;
+        }
+        if (pos == start) {
+            goto bad;
+        }
+    }
+    if (pos >= len) {
+        goto bad;
+    }
+    if ((s[pos] == 'Z') || (s[pos] == 'z')) {
+        pos++;
+    } else if (((s[pos] == '+') || (s[pos] == '-')) && (len - pos == 6) && (s[pos + 3] == ':')) {
+        int oh = parse_digits(s + pos + 1, 2);
+        int om = parse_digits(s + pos + 4, 2);
+        if ((oh < 0) || (om < 0) || (oh > 23) || (om > 59)) {
+            goto bad;
+        }
+        offset = ((oh * 60) + om) * 60;
+        if (s[pos] == '-') {
+            offset = -offset;
+        }
+        pos += 6;
+    }
+    if (pos != len) {
+        goto bad;
+    }
+    if (offset == 0) {
+        tz = PyDateTime_TimeZone_UTC;
+        Py_INCREF(tz);
+    } else {
+        PyObject* delta = PyDelta_FromDSU(0, offset, 0);
+        if (delta == NULL) {
+            return NULL;
+        }
+        tz = PyTimeZone_FromOffset(delta);
+        Py_DECREF(delta);
+        if (tz == NULL) {
+            return NULL;
+        }
+    }
+    // out of range fields get ValueError from here
+    out = PyDateTimeAPI->DateTime_FromDateAndTime(year, month, day, hour, minute, second, usec, tz, PyDateTimeAPI->DateTimeType);
+    Py_DECREF(tz);
+    return out;
+bad:
+    PyErr_Format(PyExc_ValueError, "tag 0 is not an RFC 3339 date-time: %.100s", s);
+    return NULL;
+}
+
+// m * 2**e as an exact Decimal, for tag 5
+static PyObject* decimal_from_bigfloat(SemanticTypes* st, PyObject* exponent, PyObject* mantissa) {
+    int overflow = 0;
+    long e = PyLong_AsLongAndOverflow(exponent, &overflow);
+    PyObject* scaled;
+    PyObject* text;
+    PyObject* out;
+    if ((e == -1) && PyErr_Occurred()) {
+        return NULL;
+    }
+    // the exact value has about 0.7 digits per bit of exponent
+    if (overflow || (e > BIGFLOAT_MAX_EXPONENT) || (e < -BIGFLOAT_MAX_EXPONENT)) {
+        PyErr_SetString(PyExc_ValueError, "tag 5 exponent out of range");
+        return NULL;
+    }
+    if (e >= 0) {
+        PyObject* shift = PyLong_FromLong(e);
+        if (shift == NULL) {
+            return NULL;
+        }
+        scaled = PyNumber_Lshift(mantissa, shift);
+        Py_DECREF(shift);
+        if (scaled == NULL) {
+            return NULL;
+        }
+        text = PyObject_Str(scaled);
+    } else {
+        // m * 2**-k == m * 5**k * 10**-k
+        PyObject* five = PyLong_FromLong(5);
+        PyObject* k = PyLong_FromLong(-e);
+        PyObject* power = NULL;
+        scaled = NULL;
+        if ((five != NULL) && (k != NULL)) {
+            power = PyNumber_Power(five, k, Py_None);
+        }
+        if (power != NULL) {
+            scaled = PyNumber_Multiply(mantissa, power);
+        }
+        Py_XDECREF(five);
+        Py_XDECREF(k);
+        Py_XDECREF(power);
+        if (scaled == NULL) {
+            return NULL;
+        }
+        text = PyUnicode_FromFormat("%SE%ld", scaled, e);
+    }
+    Py_DECREF(scaled);
+    if (text == NULL) {
+        return NULL;
+    }
+    out = PyObject_CallFunctionObjArgs(st->decimal_type, text, NULL);
+    Py_DECREF(text);
+    return out;
+}
+
+// UUID for 16 bytes, set up the way UUID(bytes=raw) does it without
+// going through its Python __init__.
+static PyObject* uuid_from_bytes(SemanticTypes* st, const uint8_t* raw) {
+    PyObject* value;
+    PyObject* args = PyTuple_New(0);
+    PyObject* out;
+    if (args == NULL) {
+        return NULL;
+    }
+    out = PyBaseObject_Type.tp_new((PyTypeObject*)st->uuid_type, args, NULL);
+    Py_DECREF(args);
+    if (out == NULL) {
+        return NULL;
+    }
+    value = biguint_from_bytes(raw, 16);
+    if ((value == NULL) ||
+        PyObject_GenericSetAttr(out, st->int_name, value) ||
+        PyObject_GenericSetAttr(out, st->is_safe_name, st->uuid_unknown)) {
+        Py_XDECREF(value);
+        Py_DECREF(out);
+        return NULL;
+    }
+    Py_DECREF(value);
+    return out;
+}
+
+// Return 1 if tag number aux is one semantic_tags=True decodes.
+static int is_semantic_tag(uint64_t aux) {
+    switch (aux) {
+    case CBOR_TAG_DATE_STRING:
+    case CBOR_TAG_DATE_ARRAY:
+    case CBOR_TAG_DECIMAL:
+    case CBOR_TAG_BIGFLOAT:
+    case CBOR_TAG_REGEX:
+    case CBOR_TAG_UUID:
+    case CBOR_TAG_SET:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Python object for tag aux and its already decoded value, for semantic_tags=True
+static PyObject* semantic_from_value(DecodeOptions *optp, uint64_t aux, PyObject* value) {
+    SemanticTypes* st = load_semantic_types(optp->state);
+    if (st == NULL) {
+        return NULL;
+    }
+    switch (aux) {
+    case CBOR_TAG_DATE_STRING:
+        if (PyUnicode_Check(value)) {
+            Py_ssize_t len;
+            const char* s = PyUnicode_AsUTF8AndSize(value, &len);
+            if (s == NULL) {
+                return NULL;
+            }
+            return datetime_from_rfc3339(s, len);
+        }
+        break;
+    case CBOR_TAG_DATE_ARRAY:
+        if ((PyLong_Check(value) || PyFloat_Check(value)) && !PyBool_Check(value)) {
+            return PyObject_CallMethod((PyObject*)PyDateTimeAPI->DateTimeType, "fromtimestamp", "OO", value, PyDateTime_TimeZone_UTC);
+        }
+        break;
+    case CBOR_TAG_DECIMAL:
+    case CBOR_TAG_BIGFLOAT:
+        if (PyList_Check(value) && (PyList_GET_SIZE(value) == 2) &&
+            PyLong_Check(PyList_GET_ITEM(value, 0)) && PyLong_Check(PyList_GET_ITEM(value, 1))) {
+            PyObject* exponent = PyList_GET_ITEM(value, 0);
+            PyObject* mantissa = PyList_GET_ITEM(value, 1);
+            if (aux == CBOR_TAG_DECIMAL) {
+                PyObject* out;
+                PyObject* text = PyUnicode_FromFormat("%SE%S", mantissa, exponent);
+                if (text == NULL) {
+                    return NULL;
+                }
+                out = PyObject_CallFunctionObjArgs(st->decimal_type, text, NULL);
+                Py_DECREF(text);
+                return out;
+            }
+            return decimal_from_bigfloat(st, exponent, mantissa);
+        }
+        break;
+    case CBOR_TAG_REGEX:
+        if (PyUnicode_Check(value)) {
+            return PyObject_CallFunctionObjArgs(st->re_compile, value, NULL);
+        }
+        break;
+    case CBOR_TAG_UUID:
+        if (PyBytes_Check(value) && (PyBytes_GET_SIZE(value) == 16)) {
+            return uuid_from_bytes(st, (const uint8_t*)PyBytes_AS_STRING(value));
+        }
+        if (PyObject_CheckBuffer(value)) {
+            PyObject* out = NULL;
+            PyObject* args = PyTuple_New(0);
+            PyObject* kwargs = NULL;
+            // UUID() wants bytes, not loads(bytes_as_memoryview=True) slices
+            PyObject* raw = PyBytes_Check(value) ? (Py_INCREF(value), value) : PyBytes_FromObject(value);
+            if ((args != NULL) && (raw != NULL)) {
+                kwargs = Py_BuildValue("{sO}", "bytes", raw);
+            }
+            if (kwargs != NULL) {
+                out = PyObject_Call(st->uuid_type, args, kwargs);
+            }
+            Py_XDECREF(args);
+            Py_XDECREF(kwargs);
+            Py_XDECREF(raw);
+            return out;
+        }
+        break;
+    case CBOR_TAG_SET:
+        if (PyList_Check(value)) {
+            return PySet_New(value);
+        }
+        break;
+    }
+    PyErr_Format(PyExc_ValueError, "bad value for tag %llu: %.200s", (unsigned long long)aux, Py_TYPE(value)->tp_name);
+    return NULL;
+}
+
+static PyObject* loads_semantic_tag(DecodeOptions *optp, Reader* rin, uint64_t aux) {
+    PyObject* out;
+    PyObject* value = inner_loads(optp, rin);
+    if (value == NULL) {
+        return NULL;
+    }
+    out = semantic_from_value(optp, aux, value);
+    Py_DECREF(value);
+    return out;
+}
+#endif /* HAS_SEMANTIC_TAGS */
+
+// Parse semantic_tags= into *flagp. Return 0 on success.
+static int semantic_tags_kwarg(PyObject* kwargs, int* flagp) {
+    PyObject* flag;
+    if (kwargs == NULL) {
+        return 0;
+    }
+    flag = PyDict_GetItemString(kwargs, "semantic_tags");  // Borrowed ref
+    if (flag == NULL) {
+        return 0;
+    }
+    *flagp = PyObject_IsTrue(flag);
+    if (*flagp < 0) {
+        return -1;
+    }
+#if !HAS_SEMANTIC_TAGS
+    if (*flagp) {
+        PyErr_SetString(PyExc_NotImplementedError, "semantic_tags needs Python 3.7 or later");
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+// Tag 256: decode the tagged item with a new, empty stringref table.
+static PyObject* loads_stringref_namespace(DecodeOptions *optp, Reader* rin) {
+    PyObject* outer = optp->stringrefs;
+    PyObject* table = PyList_New(0);
+    PyObject* out;
+    if (table == NULL) {
+        return NULL;
+    }
+    optp->stringrefs = table;
+    out = inner_loads(optp, rin);
+    optp->stringrefs = outer;
+    Py_DECREF(table);
+    return out;
+}
+
+// Tag 25 inside a namespace: the string at the index that follows.
+static PyObject* loads_stringref(DecodeOptions *optp, Reader* rin) {
+    uint8_t c;
+    uint64_t index;
+    PyObject* out;
+    if (rin->read1(rin, &c)) { logprintf("r1 fail in stringref\n"); return NULL; }
+    if (((c & CBOR_TYPE_MASK) != CBOR_UINT) || ((c & CBOR_INFO_BITS) > CBOR_UINT64_FOLLOWS)) {
+        PyErr_Format(PyExc_ValueError, "stringref index is not an unsigned int: %02x", c);
+        return NULL;
+    }
+    if (handle_info_bits(rin, c & CBOR_INFO_BITS, &index)) { return NULL; }
+    if (index >= (uint64_t)PyList_GET_SIZE(optp->stringrefs)) {
+        PyErr_Format(PyExc_ValueError, "stringref %llu past the %zd strings so far",
+                     (unsigned long long)index, PyList_GET_SIZE(optp->stringrefs));
+        return NULL;
+    }
+    out = PyList_GET_ITEM(optp->stringrefs, (Py_ssize_t)index);
+    Py_INCREF(out);
+    return out;
+}
+
+// Tag 2 or 3 inside a stringref namespace. The byte string is a string
+// like any other there, and may itself be a tag 25 reference.
+static PyObject* loads_stringref_bignum(DecodeOptions *optp, Reader* rin, uint64_t aux) {
+    PyObject* out = NULL;
+    Py_buffer view;
+    PyObject* blob = inner_loads(optp, rin);
+    if (blob == NULL) {
+        return NULL;
+    }
+    if (!PyBytes_Check(blob) && !PyMemoryView_Check(blob)) {
+        PyErr_Format(PyExc_ValueError, "TAG BIGNUM not followed by bytes but %.200s", Py_TYPE(blob)->tp_name);
+        Py_DECREF(blob);
+        return NULL;
+    }
+    if (PyObject_GetBuffer(blob, &view, PyBUF_SIMPLE) == 0) {
+        out = biguint_from_bytes((const uint8_t*)view.buf, view.len);
+        PyBuffer_Release(&view);
+    }
+    Py_DECREF(blob);
+    if ((out != NULL) && (aux == CBOR_TAG_NEGBIGNUM)) {
+        PyObject* minusOne = PyLong_FromLong(-1);
+        PyObject* tout = (minusOne == NULL) ? NULL : PyNumber_Subtract(minusOne, out);
+        Py_XDECREF(minusOne);
+        Py_DECREF(out);
+        out = tout;
+    }
+    return out;
+}
+
+static PyObject* loads_tag(DecodeOptions *optp, Reader* rin, uint64_t aux) {
+    PyObject* out = NULL;
+    if (aux == CBOR_TAG_STRINGREF_NAMESPACE) {
+        return loads_stringref_namespace(optp, rin);
+    }
+    if (optp->stringrefs != NULL) {
+        if (aux == CBOR_TAG_STRINGREF) {
+            return loads_stringref(optp, rin);
+        }
+        if ((aux == CBOR_TAG_BIGNUM) || (aux == CBOR_TAG_NEGBIGNUM)) {
+            return loads_stringref_bignum(optp, rin, aux);
+        }
+    }
+    // return an object CBORTag(tagnum, nextob)
+    if (aux == CBOR_TAG_BIGNUM) {
+	// If the next object is bytes, interpret it here without making a PyObject for it.
+	uint8_t sc;
+	if (rin->read1(rin, &sc)) { logprintf("r1 fail in bignum tag\n"); return NULL; }
+	if ((sc & CBOR_TYPE_MASK) == CBOR_BYTES) {
+	    return loads_bignum(optp, rin, sc);
+	} else {
+	    PyErr_Format(PyExc_ValueError, "TAG BIGNUM not followed by bytes but %02x", sc);
+	    return NULL;
+	}
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunreachable-code"
+	PyErr_Format(PyExc_ValueError, "TODO: WRITEME CBOR TAG BIGNUM %02x ...\n", sc);
+	return NULL;
+#pragma GCC diagnostic pop
+    } else if (aux == CBOR_TAG_NEGBIGNUM) {
+	// If the next object is bytes, interpret it here without making a PyObject for it.
+	uint8_t sc;
+	if (rin->read1(rin, &sc)) { logprintf("r1 fail in negbignum tag\n"); return NULL; }
+	if ((sc & CBOR_TYPE_MASK) == CBOR_BYTES) {
+	    out = loads_bignum(optp, rin, sc);
+            if (out == NULL) { logprintf("loads_bignum fail inside TAG_NEGBIGNUM\n"); return NULL; }
+            PyObject* minusOne = PyLong_FromLong(-1);
+            PyObject* tout = PyNumber_Subtract(minusOne, out);
+            Py_DECREF(minusOne);
+            Py_DECREF(out);
+            out = tout;
+            return out;
+	} else {
+	    PyErr_Format(PyExc_ValueError, "TAG NEGBIGNUM not followed by bytes but %02x", sc);
+	    return NULL;
+	}
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunreachable-code"
+	PyErr_Format(PyExc_ValueError, "TODO: WRITEME CBOR TAG NEGBIGNUM %02x ...\n", sc);
+	return NULL;
+#pragma GCC diagnostic pop
+    }
+#if HAS_SEMANTIC_TAGS
+    // a ClassTag for the tag number wins, as it does in dumps()
+    if (optp->semantic_tags && is_semantic_tag(aux)) {
+        int mapped = has_tag_decoder(optp, aux);
+        if (mapped < 0) {
+            return NULL;
+        }
+        if (!mapped) {
+            return loads_semantic_tag(optp, rin, aux);
+        }
+    }
+#endif
+    if (optp->tag_decoders != NULL) {
+        return loads_mapped_tag(optp, rin, aux);
+    }
+    out = inner_loads(optp, rin);
+    if (out == NULL) { return NULL; }
+    {
+        PyObject* tag_num = PyLong_FromUnsignedLongLong(aux);
+        PyObject* tout = NULL;
+        if (tag_num != NULL) {
+            tout = Tag_New(tag_num, out);
+            Py_DECREF(tag_num);
+        }
+	Py_DECREF(out);
+	out = tout;
+    }
+    return call_decode_hook(optp->tag_hook, out);
+}
+
+
+#if HAS_FILE_READER
+
+typedef struct _FileReader {
+    READER_FUNCTIONS;
+    FILE* fin;
+    void* dst;
+    Py_ssize_t dst_size;
+    Py_ssize_t read_count;
+} FileReader;
 
 // read from a python builtin file which contains a C FILE*
 static void* FileReader_read(void* self, Py_ssize_t len) {
@@ -632,860 +1829,4187 @@ static void* FileReader_read(void* self, Py_ssize_t len) {
 	thiz->dst = PyMem_Malloc(len);
 	thiz->dst_size = len;
     }
-    opos = (uintptr_t)(thiz->dst);
-    while (1) {
-	size_t rlen = fread((void*)opos, 1, len, thiz->fin);
-	if (rlen == 0) {
-	    // file isn't going to give any more
-	    PyErr_Format(PyExc_ValueError, "only got %zd bytes with %zd stil to read from file", rtotal, len);
-	    PyMem_Free(thiz->dst);
-	    thiz->dst = NULL;
-            thiz->dst_size = 0;
-	    return NULL;
+    opos = (uintptr_t)(thiz->dst);
+    while (1) {
+	size_t rlen = fread((void*)opos, 1, len, thiz->fin);
+	if (rlen == 0) {
+	    // file isn't going to give any more
+	    PyErr_Format(PyExc_ValueError, "only got %zd bytes with %zd stil to read from file", rtotal, len);
+	    PyMem_Free(thiz->dst);
+	    thiz->dst = NULL;
+            thiz->dst_size = 0;
+	    return NULL;
+	}
+	thiz->read_count += rlen;
+	rtotal += rlen;
+	opos += rlen;
+	len -= rlen;
+	if (rtotal >= len) {
+            if (thiz->dst == NULL) {
+                PyErr_SetString(PyExc_RuntimeError, "known error in file reader, NULL dst");
+                return NULL;
+            }
+	    return thiz->dst;
+	}
+    }
+}
+static int FileReader_read1(void* self, uint8_t* oneByte) {
+    FileReader* thiz = (FileReader*)self;
+    size_t didread = fread((void*)oneByte, 1, 1, thiz->fin);
+    if (didread == 0) {
+	logprintf("failed to read 1 from file\n");
+	PyErr_SetString(PyExc_ValueError, "got nothing reading 1 from file");
+	return -1;
+    }
+    thiz->read_count++;
+    return 0;
+}
+static void FileReader_return_buffer(void* self, void* buffer) {
+    // Nothing to do, we hold onto the buffer and maybe reuse it for next read
+}
+static void FileReader_delete(void* self) {
+    FileReader* thiz = (FileReader*)self;
+    if (thiz->dst) {
+	PyMem_Free(thiz->dst);
+    }
+    PyMem_Free(thiz);
+}
+static Reader* NewFileReader(PyObject* ob) {
+    FileReader* fr = (FileReader*)PyMem_Malloc(sizeof(FileReader));
+    if (fr == NULL) {
+        PyErr_SetString(PyExc_MemoryError, "failed to allocate FileReader");
+        return NULL;
+    }
+    fr->fin = PyFile_AsFile(ob);
+    if (fr->fin == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "PyFile_AsFile NULL");
+        PyMem_Free(fr);
+        return NULL;
+    }
+    fr->dst = NULL;
+    fr->dst_size = 0;
+    fr->read_count = 0;
+    SET_READER_FUNCTIONS(fr, FileReader);
+    return (Reader*)fr;
+}
+
+#endif /* Python 2.7 FileReader */
+
+
+// ObjectReader reads from a python file-like object in blocks and
+// decodes out of that window instead of calling .read() for every byte.
+// How it gets bytes, and how it gives back the bytes it read past the
+// end of the object, depends on what the object supports:
+//   OBJECT_READER_SEEK: ob.seekable(). read() blocks, then seek() back over what wasn't used
+//   OBJECT_READER_PEEK: ob.peek() (io.BufferedReader on a pipe or socket). peek() blocks, then read() just what was used
+//   OBJECT_READER_EXACT: only .read(n). Only ever read as many bytes as are known to be needed.
+//   OBJECT_READER_CONSUME_AHEAD: load(fp, consume_ahead=True) on a stream without seek or peek.
+//     read() blocks like SEEK but can't give back the extra bytes, which are dropped.
+//     For streams that hold exactly one object, like one message per connection.
+#define OBJECT_READER_SEEK 1
+#define OBJECT_READER_PEEK 2
+#define OBJECT_READER_EXACT 3
+#define OBJECT_READER_CONSUME_AHEAD 4
+
+// Blocks start small so that load() of a small object doesn't read a lot
+// it has to give back, and double on each refill.
+#define OBJECT_READER_MIN_BLOCK 512
+#define OBJECT_READER_MAX_BLOCK (64 * 1024)
+
+typedef struct _ObjectReader {
+    READER_FUNCTIONS;
+    PyObject* ob;
+    int mode;
+
+    // The current block from ob.read() or ob.peek().
+    // window_pos is how much of it has been used.
+    PyObject* window;
+    uint8_t* window_bytes;
+    Py_ssize_t window_pos;
+    Py_ssize_t window_len;
+    int window_peeked;
+    Py_ssize_t block_size;
+
+    // A read that straddled blocks was copied here. Free() on return_buffer().
+    void* dst;
+
+    Py_ssize_t read_count;
+    int exception_is_external;
+} ObjectReader;
+
+// Check that ob.read() or ob.peek() gave us bytes, steal retval into the window.
+static int ObjectReader_set_window(ObjectReader* thiz, PyObject* retval, int peeked) {
+    if (!PyBytes_Check(retval)) {
+        logprintf("object.read() is not bytes\n");
+        PyErr_SetString(PyExc_ValueError, "expected ob.read() to return a bytes object\n");
+        Py_DECREF(retval);
+        return -1;
+    }
+    thiz->window = retval;
+    thiz->window_bytes = (uint8_t*)PyBytes_AS_STRING(retval);
+    thiz->window_pos = 0;
+    thiz->window_len = PyBytes_GET_SIZE(retval);
+    thiz->window_peeked = peeked;
+    return 0;
+}
+
+// Drop the current window, telling the stream about what we used if it was only peeked at.
+static int ObjectReader_release_window(ObjectReader* thiz) {
+    if (thiz->window == NULL) {
+        return 0;
+    }
+    if (thiz->window_peeked && (thiz->window_pos > 0)) {
+        PyObject* retval = PyObject_CallMethod(thiz->ob, "read", "n", thiz->window_pos);
+        if (retval == NULL) {
+            thiz->exception_is_external = 1;
+            return -1;
+        }
+        if (!PyBytes_Check(retval) || (PyBytes_GET_SIZE(retval) != thiz->window_pos)) {
+            PyErr_SetString(PyExc_ValueError, "ob.read() after ob.peek() didn't return the peeked bytes\n");
+            Py_DECREF(retval);
+            return -1;
+        }
+        Py_DECREF(retval);
+    }
+    Py_CLEAR(thiz->window);
+    thiz->window_bytes = NULL;
+    thiz->window_pos = 0;
+    thiz->window_len = 0;
+    thiz->window_peeked = 0;
+    return 0;
+}
+
+// Get a new window with (hopefully) at least want bytes in it.
+// Return the number of bytes available, 0 at EOF, -1 on error.
+static Py_ssize_t ObjectReader_fill(ObjectReader* thiz, Py_ssize_t want) {
+    PyObject* retval;
+    Py_ssize_t rlen = want;
+    int peeked = 0;
+    if (ObjectReader_release_window(thiz)) {
+        return -1;
+    }
+    if ((thiz->mode == OBJECT_READER_SEEK) || (thiz->mode == OBJECT_READER_CONSUME_AHEAD)) {
+        if (rlen < thiz->block_size) {
+            rlen = thiz->block_size;
+        }
+        if (thiz->block_size < OBJECT_READER_MAX_BLOCK) {
+            thiz->block_size *= 2;
+        }
+    }
+    if ((thiz->mode == OBJECT_READER_PEEK) && (want == 1)) {
+        // When we know exactly how many bytes we need we just read() them,
+        // otherwise peek at whatever the stream has buffered.
+        retval = PyObject_CallMethod(thiz->ob, "peek", "n", (Py_ssize_t)1);
+        peeked = 1;
+    } else {
+        retval = PyObject_CallMethod(thiz->ob, "read", "n", rlen);
+    }
+    if (retval == NULL) {
+        thiz->exception_is_external = 1;
+        logprintf("exception in object.read()\n");
+        return -1;
+    }
+    if (ObjectReader_set_window(thiz, retval, peeked)) {
+        return -1;
+    }
+    if (!peeked && (thiz->window_len > rlen)) {
+        logprintf("object.read() is too much!\n");
+        PyErr_Format(PyExc_ValueError, "ob.read() returned %zd bytes but only wanted %zd\n", thiz->window_len, rlen);
+        return -1;
+    }
+    return thiz->window_len;
+}
+
+static void* ObjectReader_read(void* context, Py_ssize_t len) {
+    ObjectReader* thiz = (ObjectReader*)context;
+    Py_ssize_t avail = thiz->window_len - thiz->window_pos;
+    uint8_t* opos;
+    void* out;
+    //logprintf("ob read %d\n", len);
+    assert(!thiz->dst);
+    if (avail == 0) {
+        avail = ObjectReader_fill(thiz, len);
+        if (avail < 0) {
+            return NULL;
+        }
+    }
+    if (avail >= len) {
+        // best case, all in the current window
+        out = thiz->window_bytes + thiz->window_pos;
+        thiz->window_pos += len;
+        thiz->read_count += len;
+        return out;
+    }
+    // straddles the end of the window, gather it into dst
+    thiz->dst = PyMem_Malloc(len);
+    if (thiz->dst == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    opos = (uint8_t*)thiz->dst;
+    while (1) {
+        Py_ssize_t rlen = (avail < len) ? avail : len;
+        memcpy(opos, thiz->window_bytes + thiz->window_pos, rlen);
+        thiz->window_pos += rlen;
+        thiz->read_count += rlen;
+        opos += rlen;
+        len -= rlen;
+        if (len == 0) {
+            return thiz->dst;
+        }
+        avail = ObjectReader_fill(thiz, len);
+        if (avail <= 0) {
+            if (avail == 0) {
+                PyErr_Format(PyExc_ValueError, "only got %zd bytes with %zd stil to read from object", thiz->read_count, len);
+            }
+            PyMem_Free(thiz->dst);
+            thiz->dst = NULL;
+            return NULL;
+        }
+    }
+}
+static int ObjectReader_read1(void* self, uint8_t* oneByte) {
+    ObjectReader* thiz = (ObjectReader*)self;
+    if (thiz->window_pos == thiz->window_len) {
+        Py_ssize_t avail = ObjectReader_fill(thiz, 1);
+        if (avail < 0) {
+            //logprintf("call ob read(1) failed\n");
+            return -1;
+        }
+        if (avail == 0) {
+            PyErr_SetString(PyExc_ValueError, "got nothing reading 1");
+            return -1;
+        }
+    }
+    *oneByte = thiz->window_bytes[thiz->window_pos];
+    thiz->window_pos++;
+    thiz->read_count++;
+    return 0;
+}
+static void ObjectReader_return_buffer(void* context, void* buffer) {
+    ObjectReader* thiz = (ObjectReader*)context;
+    if ((buffer == thiz->dst) && (buffer != NULL)) {
+	PyMem_Free(thiz->dst);
+	thiz->dst = NULL;
+    }
+    // else it points into the window, which we keep
+}
+// Give back bytes read past the end of what was decoded so the stream
+// is positioned right after the object. Return 0 on success.
+static int ObjectReader_finish(ObjectReader* thiz) {
+    Py_ssize_t unread = thiz->window_len - thiz->window_pos;
+    if ((thiz->mode == OBJECT_READER_SEEK) && (unread > 0)) {
+        PyObject* retval = PyObject_CallMethod(thiz->ob, "seek", "ni", -unread, 1);
+        if (retval == NULL) {
+            thiz->exception_is_external = 1;
+            return -1;
+        }
+        Py_DECREF(retval);
+        thiz->window_pos = thiz->window_len;
+    }
+    return ObjectReader_release_window(thiz);
+}
+static void ObjectReader_delete(void* context) {
+    ObjectReader* thiz = (ObjectReader*)context;
+    Py_XDECREF(thiz->window);
+    if (thiz->dst != NULL) {
+	PyMem_Free(thiz->dst);
+    }
+    PyMem_Free(thiz);
+}
+// Work out how to read ahead on ob. Return OBJECT_READER_* mode, or -1 on error.
+static int ObjectReader_mode(PyObject* ob, int consume_ahead) {
+    PyObject* retval = PyObject_CallMethod(ob, "seekable", NULL);
+    if (retval != NULL) {
+        int seekable = PyObject_IsTrue(retval);
+        Py_DECREF(retval);
+        if (seekable < 0) {
+            return -1;
+        }
+        if (seekable) {
+            return OBJECT_READER_SEEK;
+        }
+    } else if (PyErr_ExceptionMatches(PyExc_AttributeError)) {
+        PyErr_Clear();
+    } else {
+        return -1;
+    }
+    if (PyObject_HasAttrString(ob, "peek")) {
+        return OBJECT_READER_PEEK;
+    }
+    if (consume_ahead) {
+        return OBJECT_READER_CONSUME_AHEAD;
+    }
+    return OBJECT_READER_EXACT;
+}
+static Reader* NewObjectReader(PyObject* ob, int consume_ahead) {
+    ObjectReader* r;
+    int mode = ObjectReader_mode(ob, consume_ahead);
+    if (mode < 0) {
+        return NULL;
+    }
+    r = (ObjectReader*)PyMem_Malloc(sizeof(ObjectReader));
+    if (r == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    r->ob = ob;
+    r->mode = mode;
+    r->window = NULL;
+    r->window_bytes = NULL;
+    r->window_pos = 0;
+    r->window_len = 0;
+    r->window_peeked = 0;
+    r->block_size = OBJECT_READER_MIN_BLOCK;
+    r->dst = NULL;
+    r->read_count = 0;
+    r->exception_is_external = 0;
+    SET_READER_FUNCTIONS(r, ObjectReader);
+    return (Reader*)r;
+}
+
+struct _BufferReader {
+    READER_FUNCTIONS;
+    uint8_t* raw;
+    // next byte to read, and the end of the buffer
+    uint8_t* pos;
+    uint8_t* end;
+    // held from NewBufferReader() until delete()
+    Py_buffer view;
+};
+
+// read from a buffer, aka loads()
+static void* BufferReader_read(void* context, Py_ssize_t len) {
+    BufferReader* thiz = (BufferReader*)context;
+    if (len <= (thiz->end - thiz->pos)) {
+	void* out = (void*)thiz->pos;
+	thiz->pos += len;
+	assert(out);
+	return out;
+    }
+    PyErr_Format(PyExc_ValueError, "buffer read for %zd but only have %zd\n", len, (Py_ssize_t)(thiz->end - thiz->pos));
+    return NULL;
+}
+static int BufferReader_read1(void* self, uint8_t* oneByte) {
+    BufferReader* thiz = (BufferReader*)self;
+    if (thiz->pos >= thiz->end) {
+	PyErr_SetString(PyExc_LookupError, "buffer exhausted");
+	return -1;
+    }
+    *oneByte = *(thiz->pos);
+    thiz->pos += 1;
+    return 0;
+}
+static void BufferReader_return_buffer(void* context, void* buffer) {
+    // nothing to do
+}
+static void BufferReader_delete(void* context) {
+    BufferReader* thiz = (BufferReader*)context;
+    PyBuffer_Release(&(thiz->view));
+    PyMem_Free(thiz);
+}
+// Decode from anything with a C-contiguous buffer: bytes, bytearray,
+// memoryview (including slices), mmap, array, ...
+// The buffer is held, not copied, until PyBuffer_Release(&(r->view)).
+// Return 0 on success.
+static int BufferReader_init(BufferReader* r, PyObject* ob) {
+    SET_READER_FUNCTIONS(r, BufferReader);
+    if (PyObject_GetBuffer(ob, &(r->view), PyBUF_SIMPLE) != 0) {
+        if (PyErr_ExceptionMatches(PyExc_TypeError)) {
+            PyErr_Clear();
+            PyErr_Format(PyExc_ValueError, "input of unknown type %.200s does not support the buffer protocol", Py_TYPE(ob)->tp_name);
+        } else if (PyErr_ExceptionMatches(PyExc_BufferError)) {
+            PyErr_Clear();
+            PyErr_SetString(PyExc_ValueError, "input buffer is not C-contiguous");
+        }
+        return -1;
+    }
+    r->raw = (uint8_t*)r->view.buf;
+    r->pos = r->raw;
+    r->end = r->raw + r->view.len;
+    if (r->view.len == 0) {
+	PyErr_SetString(PyExc_ValueError, "got zero length string in loads");
+	PyBuffer_Release(&(r->view));
+	return -1;
+    }
+    if (r->raw == NULL) {
+	PyErr_SetString(PyExc_ValueError, "got NULL buffer for string");
+	PyBuffer_Release(&(r->view));
+	return -1;
+    }
+    return 0;
+}
+
+// BufferReader_init() on the heap, released by delete()
+static Reader* NewBufferReader(PyObject* ob) {
+    BufferReader* r = (BufferReader*)PyMem_Malloc(sizeof(BufferReader));
+    if (r == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    if (BufferReader_init(r, ob)) {
+        PyMem_Free(r);
+        return NULL;
+    }
+    return (Reader*)r;
+}
+
+
+// Decoding core for loads(), specialized for BufferReader. Reads straight
+// from br->pos up to br->end instead of calling read1()/read() for every
+// byte, and decode_table says what to do with the first byte of an item.
+// Rare things (indefinite length strings, unusual simple values, malformed
+// bytes) go to the generic inner_loads_c() on the same BufferReader, which
+// shares br->pos with this code.
+
+// decode_table actions
+#define DT_GENERIC 0
+#define DT_UINT 1
+#define DT_NEGINT 2
+#define DT_BYTES 3
+#define DT_TEXT 4
+#define DT_ARRAY 5
+#define DT_ARRAY_VAR 6
+#define DT_MAP 7
+#define DT_MAP_VAR 8
+#define DT_TAG 9
+#define DT_FALSE 10
+#define DT_TRUE 11
+#define DT_NULL 12
+#define DT_FLOAT16 13
+#define DT_FLOAT32 14
+#define DT_FLOAT64 15
+
+typedef struct {
+    uint8_t action;
+    // bytes of argument after the first byte: 0, 1, 2, 4 or 8
+    uint8_t extra;
+} DecodeTableEntry;
+
+// What to do with each first byte. A constant, so every interpreter and
+// thread can read it with nothing to set up or lock.
+#define DT_0(a) {a, 0}
+#define DT_0x4(a) DT_0(a), DT_0(a), DT_0(a), DT_0(a)
+#define DT_0x24(a) DT_0x4(a), DT_0x4(a), DT_0x4(a), DT_0x4(a), DT_0x4(a), DT_0x4(a)
+// one major type with a count: 0-23 in the first byte, then 1, 2, 4 or 8
+// bytes of count, 3 reserved, then indefinite length
+#define DT_COUNTED(a, var) DT_0x24(a), {a, 1}, {a, 2}, {a, 4}, {a, 8}, \
+        DT_0(DT_GENERIC), DT_0(DT_GENERIC), DT_0(DT_GENERIC), DT_0(var)
+
+static const DecodeTableEntry decode_table[256] = {
+    DT_COUNTED(DT_UINT, DT_GENERIC),
+    DT_COUNTED(DT_NEGINT, DT_GENERIC),
+    // indefinite length strings go the generic way
+    DT_COUNTED(DT_BYTES, DT_GENERIC),
+    DT_COUNTED(DT_TEXT, DT_GENERIC),
+    DT_COUNTED(DT_ARRAY, DT_ARRAY_VAR),
+    DT_COUNTED(DT_MAP, DT_MAP_VAR),
+    DT_COUNTED(DT_TAG, DT_GENERIC),
+    // CBOR_7: simple values 0-19
+    DT_0x4(DT_GENERIC), DT_0x4(DT_GENERIC), DT_0x4(DT_GENERIC), DT_0x4(DT_GENERIC), DT_0x4(DT_GENERIC),
+    // false, true, null, undefined (js `undefined`, closest is py None)
+    DT_0(DT_FALSE), DT_0(DT_TRUE), DT_0(DT_NULL), DT_0(DT_NULL),
+    // simple value in a byte, floats, reserved, break
+    DT_0(DT_GENERIC), {DT_FLOAT16, 2}, {DT_FLOAT32, 4}, {DT_FLOAT64, 8},
+    DT_0(DT_GENERIC), DT_0(DT_GENERIC), DT_0(DT_GENERIC), DT_0(DT_GENERIC),
+};
+
+#undef DT_COUNTED
+#undef DT_0x24
+#undef DT_0x4
+#undef DT_0
+
+// Big-endian loads written as shifts; compilers turn these into one load and a byte swap.
+static inline uint64_t load_be(const uint8_t* p, int len) {
+    switch (len) {
+    case 1:
+        return p[0];
+    case 2:
+        return ((uint64_t)p[0] << 8) | p[1];
+    case 4:
+        return ((uint64_t)p[0] << 24) | ((uint64_t)p[1] << 16) | ((uint64_t)p[2] << 8) | p[3];
+    default:
+        return ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) | ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+            ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) | ((uint64_t)p[6] << 8) | p[7];
+    }
+}
+
+static void buffer_short(BufferReader* br, uint64_t need) {
+    PyErr_Format(PyExc_ValueError, "buffer read for %llu but only have %zd\n", (unsigned long long)need, (Py_ssize_t)(br->end - br->pos));
+}
+
+#if PY_VERSION_HEX >= 0x030D0000
+#define new_presized_dict(n) PyDict_New()
+#else
+#define new_presized_dict(n) _PyDict_NewPresized(n)
+#endif
+
+static PyObject* buffer_loads_map_key(DecodeOptions *optp, BufferReader* br) {
+    const uint8_t* p = br->pos;
+    uint8_t c;
+    Py_ssize_t len;
+    if (p >= br->end) {
+        PyErr_SetString(PyExc_LookupError, "buffer exhausted");
+        return NULL;
+    }
+    c = *p;
+    if ((optp->key_cache.size == 0) || ((c & CBOR_TYPE_MASK) != CBOR_TEXT) || ((c & CBOR_INFO_BITS) > CBOR_UINT8_FOLLOWS)) {
+        return buffer_loads(optp, br);
+    }
+    p++;
+    if ((c & CBOR_INFO_BITS) == CBOR_UINT8_FOLLOWS) {
+        if (p >= br->end) {
+            br->pos = (uint8_t*)p;
+            buffer_short(br, 1);
+            return NULL;
+        }
+        len = *p;
+        p++;
+    } else {
+        len = c & CBOR_INFO_BITS;
+    }
+    br->pos = (uint8_t*)p;
+    if ((br->end - br->pos) < len) {
+        buffer_short(br, len);
+        return NULL;
+    }
+    br->pos += len;
+    if (len <= KEY_CACHE_MAX_KEY_LEN) {
+        return loads_stringref_note(optp, KeyCache_get(&(optp->key_cache), p, len), len);
+    }
+    return loads_stringref_note(optp, text_from_utf8(p, len), len);
+}
+
+// buffer_loads() of an array, map or tag, which holds more items to
+// decode. action is its decode_table entry's, aux its count or tag number.
+static PyObject* buffer_loads_nested(DecodeOptions *optp, BufferReader* br, uint8_t action, uint64_t aux) {
+    PyObject* out;
+
+    switch (action) {
+    case DT_ARRAY: {
+        Py_ssize_t i;
+        // every item is at least one byte, so a count past the end of the buffer is bogus
+        if ((uint64_t)(br->end - br->pos) < aux) {
+            buffer_short(br, aux);
+            return NULL;
+        }
+        out = PyList_New((Py_ssize_t)aux);
+        if (out == NULL) { return NULL; }
+        for (i = 0; i < (Py_ssize_t)aux; i++) {
+            PyObject* subitem = buffer_loads(optp, br);
+            if (subitem == NULL) {
+                logprintf("array subitem[%zd] (of %llu) failed\n", i, aux);
+                Py_DECREF(out);
+                return NULL;
+            }
+            PyList_SET_ITEM(out, i, subitem);
+        }
+        return out;
+    }
+    case DT_ARRAY_VAR:
+        out = PyList_New(0);
+        if (out == NULL) { return NULL; }
+        while (1) {
+            PyObject* subitem;
+            if (br->pos >= br->end) {
+                PyErr_SetString(PyExc_LookupError, "buffer exhausted");
+                Py_DECREF(out);
+                return NULL;
+            }
+            if (*(br->pos) == CBOR_BREAK) {
+                br->pos++;
+                return out;
+            }
+            subitem = buffer_loads(optp, br);
+            if ((subitem == NULL) || PyList_Append(out, subitem)) {
+                Py_XDECREF(subitem);
+                Py_DECREF(out);
+                return NULL;
+            }
+            Py_DECREF(subitem);
+        }
+    case DT_MAP:
+    case DT_MAP_VAR: {
+        uint64_t i;
+        int var = action == DT_MAP_VAR;
+        if (var) {
+            out = PyDict_New();
+        } else {
+            // every key and value is at least one byte
+            if ((uint64_t)(br->end - br->pos) / 2 < aux) {
+                buffer_short(br, aux * 2);
+                return NULL;
+            }
+            out = new_presized_dict((Py_ssize_t)aux);
+        }
+        if (out == NULL) { return NULL; }
+        for (i = 0; var || (i < aux); i++) {
+            PyObject* key;
+            PyObject* value;
+            int err;
+            if (var) {
+                if (br->pos >= br->end) {
+                    PyErr_SetString(PyExc_LookupError, "buffer exhausted");
+                    Py_DECREF(out);
+                    return NULL;
+                }
+                if (*(br->pos) == CBOR_BREAK) {
+                    br->pos++;
+                    break;
+                }
+            }
+            key = buffer_loads_map_key(optp, br);
+            if (key == NULL) {
+                logprintf("map key[%llu] failed\n", i);
+                Py_DECREF(out);
+                return NULL;
+            }
+            value = buffer_loads(optp, br);
+            if (value == NULL) {
+                logprintf("map value[%llu] failed\n", i);
+                Py_DECREF(key);
+                Py_DECREF(out);
+                return NULL;
+            }
+            err = PyDict_SetItem(out, key, value);
+            Py_DECREF(key);
+            Py_DECREF(value);
+            if (err) {
+                Py_DECREF(out);
+                return NULL;
+            }
+        }
+        return call_decode_hook(optp->object_hook, out);
+    }
+    case DT_TAG:
+        return loads_tag(optp, (Reader*)br, aux);
+    default:
+        PyErr_Format(PyExc_RuntimeError, "cbor library internal error, decode action %d", (int)action);
+        return NULL;
+    }
+}
+
+static PyObject* buffer_loads(DecodeOptions *optp, BufferReader* br) {
+    uint8_t c;
+    const DecodeTableEntry* entry;
+    uint64_t aux;
+    PyObject* out;
+
+    if (br->pos >= br->end) {
+        PyErr_SetString(PyExc_LookupError, "buffer exhausted");
+        return NULL;
+    }
+    c = *(br->pos);
+    br->pos++;
+    entry = decode_table + c;
+    if (entry->action == DT_GENERIC) {
+        return inner_loads_c(optp, (Reader*)br, c);
+    }
+    if (entry->extra == 0) {
+        aux = c & CBOR_INFO_BITS;
+    } else {
+        if ((br->end - br->pos) < entry->extra) {
+            buffer_short(br, entry->extra);
+            return NULL;
+        }
+        aux = load_be(br->pos, entry->extra);
+        br->pos += entry->extra;
+    }
+
+    if ((entry->action >= DT_ARRAY) && (entry->action <= DT_TAG)) {
+        // each level of nesting is another C call, so limit how deep input
+        // can go before it runs off the end of the stack
+        if (Py_EnterRecursiveCall(" while decoding nested CBOR")) {
+            return NULL;
+        }
+        out = buffer_loads_nested(optp, br, entry->action, aux);
+        Py_LeaveRecursiveCall();
+        return out;
+    }
+    switch (entry->action) {
+    case DT_UINT:
+        return PyLong_FromUnsignedLongLong(aux);
+    case DT_NEGINT:
+        if (aux > 0x7fffffffffffffff) {
+            PyObject* bignum = PyLong_FromUnsignedLongLong(aux);
+            PyObject* minusOne;
+            if (bignum == NULL) { return NULL; }
+            minusOne = PyLong_FromLong(-1);
+            out = PyNumber_Subtract(minusOne, bignum);
+            Py_DECREF(minusOne);
+            Py_DECREF(bignum);
+            return out;
+        }
+        return PyLong_FromLongLong((long long)(((long long)-1) - aux));
+    case DT_BYTES:
+        if ((uint64_t)(br->end - br->pos) < aux) {
+            buffer_short(br, aux);
+            return NULL;
+        }
+        if (optp->bytes_base != NULL) {
+            // slice of the input, no copy
+            Py_ssize_t start = br->pos - optp->bytes_base_start;
+            out = PySequence_GetSlice(optp->bytes_base, start, start + (Py_ssize_t)aux);
+        } else {
+            out = PyBytes_FromStringAndSize((const char*)br->pos, (Py_ssize_t)aux);
+        }
+        br->pos += aux;
+        return loads_stringref_note(optp, out, (Py_ssize_t)aux);
+    case DT_TEXT:
+        if ((uint64_t)(br->end - br->pos) < aux) {
+            buffer_short(br, aux);
+            return NULL;
+        }
+        out = text_from_utf8(br->pos, (Py_ssize_t)aux);
+        br->pos += aux;
+        return loads_stringref_note(optp, out, (Py_ssize_t)aux);
+    case DT_FALSE:
+        Py_RETURN_FALSE;
+    case DT_TRUE:
+        Py_RETURN_TRUE;
+    case DT_NULL:
+        Py_RETURN_NONE;
+    case DT_FLOAT16:
+        return PyFloat_FromDouble(decode_half((uint16_t)aux));
+    case DT_FLOAT32: {
+        union { uint32_t u; float f; } val;
+        val.u = (uint32_t)aux;
+        return PyFloat_FromDouble(val.f);
+    }
+    case DT_FLOAT64: {
+        union { uint64_t u; double d; } val;
+        val.u = aux;
+        return PyFloat_FromDouble(val.d);
+    }
+    default:
+        PyErr_Format(PyExc_RuntimeError, "cbor library internal error, bad decode action for %02x", c);
+        return NULL;
+    }
+}
+
+
+// Get key_cache_size=N out of kwargs (may be NULL) into *sizep. Return 0 on success.
+static int key_cache_size_kwarg(PyObject* kwargs, Py_ssize_t* sizep) {
+    PyObject* kcs;
+    if (kwargs == NULL) {
+        return 0;
+    }
+    kcs = PyDict_GetItemString(kwargs, "key_cache_size");  // Borrowed ref
+    if (kcs != NULL) {
+        Py_ssize_t size = PyNumber_AsSsize_t(kcs, PyExc_OverflowError);
+        if ((size == -1) && PyErr_Occurred()) {
+            return -1;
+        }
+        *sizep = size;
+    }
+    return 0;
+}
+
+// Make the memoryview that loads(bytes_as_memoryview=True) slices byte strings out of.
+// Return 0 on success.
+static int setup_bytes_base(DecodeOptions *optp, PyObject* ob, Reader* r) {
+    PyObject* base = PyMemoryView_FromObject(ob);
+    if (base == NULL) {
+        return -1;
+    }
+    if ((((BufferReader*)r)->view.itemsize != 1) || (PyMemoryView_GET_BUFFER(base)->ndim != 1)) {
+        // so that slice indexes are byte offsets
+        PyObject* cast = PyObject_CallMethod(base, "cast", "s", "B");
+        Py_DECREF(base);
+        if (cast == NULL) {
+            return -1;
+        }
+        base = cast;
+    }
+    optp->bytes_base = base;
+    optp->bytes_base_start = ((BufferReader*)r)->raw;
+    return 0;
+}
+
+static PyObject*
+cbor_loads(PyObject* module, PyObject* args, PyObject* kwargs) {
+    PyObject* ob;
+    DecodeOptions opts = {0};
+    DecodeOptions *optp = &opts;
+    int bytes_as_memoryview = 0;
+    Py_ssize_t key_cache_size = KEY_CACHE_DEFAULT_SIZE;
+    optp->state = cbor_state(module);
+    if (PyType_IsSubtype(Py_TYPE(args), &PyList_Type)) {
+	ob = PyList_GetItem(args, 0);
+    } else if (PyType_IsSubtype(Py_TYPE(args), &PyTuple_Type)) {
+	ob = PyTuple_GetItem(args, 0);
+    } else {
+	PyErr_Format(PyExc_ValueError, "args not list or tuple: %R\n", args);
+	return NULL;
+    }
+    if (ob == NULL) {
+        return NULL;
+    }
+
+    if (ob == Py_None) {
+	PyErr_SetString(PyExc_ValueError, "got None for buffer to decode in loads");
+	return NULL;
+    }
+    if (kwargs != NULL) {
+        PyObject* bam = PyDict_GetItemString(kwargs, "bytes_as_memoryview");  // Borrowed ref
+        if (bam != NULL) {
+            bytes_as_memoryview = PyObject_IsTrue(bam);
+            if (bytes_as_memoryview < 0) {
+                return NULL;
+            }
+        }
+    }
+    if (key_cache_size_kwarg(kwargs, &key_cache_size)) {
+        return NULL;
+    }
+    if (tag_decoders_kwarg(optp, kwargs) || decode_hooks_kwarg(optp, kwargs) ||
+        semantic_tags_kwarg(kwargs, &(optp->semantic_tags))) {
+        DecodeOptions_clear(optp);
+        return NULL;
+    }
+    KeyCache_init(&(optp->key_cache), key_cache_size);
+
+    {
+        PyObject* out = NULL;
+	Reader* r = NewBufferReader(ob);
+	if (!r) {
+	    DecodeOptions_clear(optp);
+	    return NULL;
+	}
+	if (bytes_as_memoryview && setup_bytes_base(optp, ob, r)) {
+	    r->delete(r);
+	    DecodeOptions_clear(optp);
+	    return NULL;
+	}
+	optp->buffer_reader = (BufferReader*)r;
+	out = inner_loads(optp, r);
+        r->delete(r);
+        DecodeOptions_clear(optp);
+        return out;
+    }
+}
+
+
+static PyObject*
+cbor_load(PyObject* module, PyObject* args, PyObject* kwargs) {
+    PyObject* ob;
+    Reader* reader;
+    DecodeOptions opts = {0};
+    DecodeOptions *optp = &opts;
+    int consume_ahead = 0;
+    Py_ssize_t key_cache_size = KEY_CACHE_DEFAULT_SIZE;
+    optp->state = cbor_state(module);
+    if (PyType_IsSubtype(Py_TYPE(args), &PyList_Type)) {
+	ob = PyList_GetItem(args, 0);
+    } else if (PyType_IsSubtype(Py_TYPE(args), &PyTuple_Type)) {
+	ob = PyTuple_GetItem(args, 0);
+    } else {
+	PyErr_Format(PyExc_ValueError, "args not list or tuple: %R\n", args);
+	return NULL;
+    }
+    if (ob == NULL) {
+        return NULL;
+    }
+
+    if (ob == Py_None) {
+	PyErr_SetString(PyExc_ValueError, "got None for buffer to decode in loads");
+	return NULL;
+    }
+    if (kwargs != NULL) {
+        PyObject* ca = PyDict_GetItemString(kwargs, "consume_ahead");  // Borrowed ref
+        if (ca != NULL) {
+            consume_ahead = PyObject_IsTrue(ca);
+            if (consume_ahead < 0) {
+                return NULL;
+            }
+        }
+    }
+    if (key_cache_size_kwarg(kwargs, &key_cache_size)) {
+        return NULL;
+    }
+    if (tag_decoders_kwarg(optp, kwargs) || decode_hooks_kwarg(optp, kwargs) ||
+        semantic_tags_kwarg(kwargs, &(optp->semantic_tags))) {
+        DecodeOptions_clear(optp);
+        return NULL;
+    }
+    KeyCache_init(&(optp->key_cache), key_cache_size);
+    PyObject* retval;
+#if HAS_FILE_READER
+    if (PyFile_Check(ob)) {
+	reader = NewFileReader(ob);
+        if (reader == NULL) {
+            DecodeOptions_clear(optp);
+            return NULL;
+        }
+	retval = inner_loads(optp, reader);
+        if ((retval == NULL) &&
+            (((FileReader*)reader)->read_count == 0) &&
+            (feof(((FileReader*)reader)->fin) != 0)) {
+	    // never got anything, started at EOF
+	    PyErr_Clear();
+	    PyErr_SetString(PyExc_EOFError, "read nothing, apparent EOF");
+        }
+        reader->delete(reader);
+    } else
+#endif
+    {
+	ObjectReader* oreader;
+	reader = NewObjectReader(ob, consume_ahead);
+	if (reader == NULL) {
+	    DecodeOptions_clear(optp);
+	    return NULL;
+	}
+	oreader = (ObjectReader*)reader;
+	retval = inner_loads(optp, reader);
+	if ((retval == NULL) &&
+	    (!oreader->exception_is_external) &&
+	    oreader->read_count == 0) {
+	    // never got anything, assume EOF
+	    PyErr_Clear();
+	    PyErr_SetString(PyExc_EOFError, "read nothing, apparent EOF");
+	}
+	if (retval != NULL) {
+	    if (ObjectReader_finish(oreader)) {
+		Py_CLEAR(retval);
+	    }
+	} else {
+	    // try to leave the stream where the bad object stopped, but keep the first error
+	    PyObject *etype, *evalue, *etb;
+	    PyErr_Fetch(&etype, &evalue, &etb);
+	    if (ObjectReader_finish(oreader)) {
+		PyErr_Clear();
+	    }
+	    PyErr_Restore(etype, evalue, etb);
+	}
+        reader->delete(reader);
+    }
+    DecodeOptions_clear(optp);
+    return retval;
+}
+
+
+// Encoded output goes through a Writer.
+// out[0:len] is the current output window and pos is the next byte to write.
+// grow(, need): make room for at least `need` more bytes, return 0 on success
+#define WRITER_FUNCTIONS \
+    uint8_t* out; \
+    Py_ssize_t pos; \
+    Py_ssize_t len; \
+    int (*grow)(void* self, Py_ssize_t need);
+
+typedef struct _Writer {
+    WRITER_FUNCTIONS;
+} Writer;
+
+// return a pointer to the next n bytes of output, or NULL on error
+static inline uint8_t* Writer_reserve(Writer* w, Py_ssize_t n) {
+    uint8_t* out;
+    if ((w->len - w->pos) < n) {
+        if (w->grow(w, n)) {
+            return NULL;
+        }
+    }
+    out = w->out + w->pos;
+    w->pos += n;
+    return out;
+}
+
+// append len bytes from src, return 0 on success
+static int Writer_write(Writer* w, const void* src, Py_ssize_t len) {
+    const uint8_t* pos = (const uint8_t*)src;
+    Py_ssize_t avail = w->len - w->pos;
+    while (len > avail) {
+        memcpy(w->out + w->pos, pos, avail);
+        w->pos += avail;
+        pos += avail;
+        len -= avail;
+        if (w->grow(w, len)) {
+            return -1;
+        }
+        avail = w->len - w->pos;
+    }
+    memcpy(w->out + w->pos, pos, len);
+    w->pos += len;
+    return 0;
+}
+
+
+// dumps() writes directly into the bytes object it will return.
+// The object is grown with _PyBytes_Resize() as needed and trimmed to
+// the final length at the end, so there is no final copy.
+#define BYTES_WRITER_INITIAL_SIZE 128
+
+typedef struct _BytesWriter {
+    WRITER_FUNCTIONS;
+    PyObject* bytes;
+} BytesWriter;
+
+static int BytesWriter_grow(void* self, Py_ssize_t need) {
+    BytesWriter* thiz = (BytesWriter*)self;
+    Py_ssize_t nlen = thiz->len * 2;
+    if (nlen - thiz->pos < need) {
+        if (need > PY_SSIZE_T_MAX - thiz->pos) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        nlen = thiz->pos + need;
+    }
+    if (_PyBytes_Resize(&(thiz->bytes), nlen)) {
+        // bytes was freed and set to NULL
+        thiz->out = NULL;
+        thiz->len = 0;
+        return -1;
+    }
+    thiz->out = (uint8_t*)PyBytes_AS_STRING(thiz->bytes);
+    thiz->len = nlen;
+    return 0;
+}
+
+static int BytesWriter_init(BytesWriter* thiz) {
+    thiz->bytes = PyBytes_FromStringAndSize(NULL, BYTES_WRITER_INITIAL_SIZE);
+    if (thiz->bytes == NULL) {
+        return -1;
+    }
+    thiz->out = (uint8_t*)PyBytes_AS_STRING(thiz->bytes);
+    thiz->pos = 0;
+    thiz->len = BYTES_WRITER_INITIAL_SIZE;
+    thiz->grow = BytesWriter_grow;
+    return 0;
+}
+
+// returns a new reference to the finished bytes object, or NULL on error
+static PyObject* BytesWriter_finish(BytesWriter* thiz) {
+    PyObject* out;
+    if (_PyBytes_Resize(&(thiz->bytes), thiz->pos)) {
+        return NULL;
+    }
+    out = thiz->bytes;
+    thiz->bytes = NULL;
+    return out;
+}
+
+static void BytesWriter_clear(BytesWriter* thiz) {
+    Py_CLEAR(thiz->bytes);
+}
+
+
+// dump() encodes into a bounded buffer and hands it to fp.write() each
+// time it fills, so memory use doesn't depend on the size of the object.
+// The buffer starts small and doubles up to max_len.
+#define DUMP_BUFFER_SIZE (64 * 1024)
+#define DUMP_BUFFER_MIN_SIZE 64
+#define DUMP_BUFFER_INITIAL_SIZE 256
+
+typedef struct _ObjectWriter {
+    WRITER_FUNCTIONS;
+    PyObject* write;  // bound method fp.write
+#if HAS_FILE_READER
+    FILE* fout;
+#endif
+    Py_ssize_t max_len;
+} ObjectWriter;
+
+// write out everything buffered so far, return 0 on success
+static int ObjectWriter_flush(ObjectWriter* thiz) {
+    PyObject* chunk;
+    PyObject* ret;
+    if (thiz->pos == 0) {
+        return 0;
+    }
+#if HAS_FILE_READER
+    if (thiz->fout != NULL) {
+        size_t wlen = fwrite(thiz->out, 1, thiz->pos, thiz->fout);
+        if (wlen != (size_t)thiz->pos) {
+            PyErr_SetFromErrno(PyExc_IOError);
+            return -1;
+        }
+        thiz->pos = 0;
+        return 0;
+    }
+#endif
+    chunk = PyBytes_FromStringAndSize((char*)thiz->out, thiz->pos);
+    if (chunk == NULL) {
+        return -1;
+    }
+    //logprintf("write %zd bytes to %p\n", thiz->pos, thiz->write);
+    ret = PyObject_CallFunctionObjArgs(thiz->write, chunk, NULL);
+    Py_DECREF(chunk);
+    if (ret == NULL) {
+        // exception in fp.write()
+        return -1;
+    }
+    Py_DECREF(ret);
+    thiz->pos = 0;
+    return 0;
+}
+
+static int ObjectWriter_grow(void* self, Py_ssize_t need) {
+    ObjectWriter* thiz = (ObjectWriter*)self;
+    Py_ssize_t nlen;
+    void* nout;
+    if ((thiz->len == thiz->max_len) || (need > thiz->max_len - thiz->pos)) {
+        if (ObjectWriter_flush(thiz)) {
+            return -1;
+        }
+        if ((thiz->len == thiz->max_len) || (need <= thiz->len)) {
+            // Writer_write() fills a full size buffer in pieces
+            return 0;
+        }
+    }
+    nlen = thiz->len * 2;
+    if (nlen - thiz->pos < need) {
+        nlen = thiz->pos + need;
+    }
+    if (nlen > thiz->max_len) {
+        nlen = thiz->max_len;
+    }
+    nout = PyMem_Realloc(thiz->out, nlen);
+    if (nout == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    thiz->out = (uint8_t*)nout;
+    thiz->len = nlen;
+    return 0;
+}
+
+static int ObjectWriter_init(ObjectWriter* thiz, PyObject* fp, Py_ssize_t max_len) {
+    if (max_len < DUMP_BUFFER_MIN_SIZE) {
+        max_len = DUMP_BUFFER_MIN_SIZE;
+    }
+    thiz->write = NULL;
+#if HAS_FILE_READER
+    thiz->fout = NULL;
+    if (PyFile_Check(fp)) {
+        thiz->fout = PyFile_AsFile(fp);
+    } else
+#endif
+    {
+        thiz->write = PyObject_GetAttrString(fp, "write");
+        if (thiz->write == NULL) {
+            return -1;
+        }
+    }
+    thiz->len = (max_len < DUMP_BUFFER_INITIAL_SIZE) ? max_len : DUMP_BUFFER_INITIAL_SIZE;
+    thiz->out = (uint8_t*)PyMem_Malloc(thiz->len);
+    if (thiz->out == NULL) {
+        Py_CLEAR(thiz->write);
+        PyErr_NoMemory();
+        return -1;
+    }
+    thiz->pos = 0;
+    thiz->max_len = max_len;
+    thiz->grow = ObjectWriter_grow;
+    return 0;
+}
+
+static void ObjectWriter_clear(ObjectWriter* thiz) {
+    PyMem_Free(thiz->out);
+    thiz->out = NULL;
+    Py_CLEAR(thiz->write);
+}
+
+
+static int tag_u64_out(uint8_t cbor_type, uint64_t aux, Writer* w) {
+    uint8_t* out = Writer_reserve(w, 9);
+    if (out == NULL) { return -1; }
+    out[0] = cbor_type | CBOR_UINT64_FOLLOWS;
+    out[1] = (aux >> 56) & 0x0ff;
+    out[2] = (aux >> 48) & 0x0ff;
+    out[3] = (aux >> 40) & 0x0ff;
+    out[4] = (aux >> 32) & 0x0ff;
+    out[5] = (aux >> 24) & 0x0ff;
+    out[6] = (aux >> 16) & 0x0ff;
+    out[7] = (aux >>  8) & 0x0ff;
+    out[8] = aux & 0x0ff;
+    return 0;
+}
+
+
+static int tag_aux_out(uint8_t cbor_type, uint64_t aux, Writer* w) {
+    uint8_t* out;
+    if (aux <= 23) {
+	// tiny literal
+	out = Writer_reserve(w, 1);
+	if (out == NULL) { return -1; }
+	out[0] = cbor_type | aux;
+    } else if (aux <= 0x0ff) {
+	// one byte value
+	out = Writer_reserve(w, 2);
+	if (out == NULL) { return -1; }
+	out[0] = cbor_type | CBOR_UINT8_FOLLOWS;
+	out[1] = aux;
+    } else if (aux <= 0x0ffff) {
+	// two byte value
+	out = Writer_reserve(w, 3);
+	if (out == NULL) { return -1; }
+	out[0] = cbor_type | CBOR_UINT16_FOLLOWS;
+	out[1] = (aux >> 8) & 0x0ff;
+	out[2] = aux & 0x0ff;
+    } else if (aux <= 0x0ffffffffL) {
+	// four byte value
+	out = Writer_reserve(w, 5);
+	if (out == NULL) { return -1; }
+	out[0] = cbor_type | CBOR_UINT32_FOLLOWS;
+	out[1] = (aux >> 24) & 0x0ff;
+	out[2] = (aux >> 16) & 0x0ff;
+	out[3] = (aux >>  8) & 0x0ff;
+	out[4] = aux & 0x0ff;
+    } else {
+	// eight byte value
+	return tag_u64_out(cbor_type, aux, w);
+    }
+    return 0;
+}
+
+static int inner_dumps(EncodeOptions *optp, PyObject* ob, Writer* w);
+
+// Inside a string_referencing namespace, with table the one for ob's type:
+// if ob was written before write a tag 25 reference to it and return 1.
+// Otherwise remember it if it's long enough to be referred to later and
+// return 0 for the caller to write it out. -1 on error.
+static int dumps_stringref(EncodeOptions *optp, PyObject* table, PyObject* ob, Py_ssize_t len, Writer* w) {
+    PyObject* index = PyDict_GetItem(table, ob);  // Borrowed ref
+    Py_ssize_t count;
+    if (index != NULL) {
+        if (tag_aux_out(CBOR_TAG, CBOR_TAG_STRINGREF, w) ||
+            tag_aux_out(CBOR_UINT, PyLong_AsUnsignedLongLong(index), w)) {
+            return -1;
+        }
+        return 1;
+    }
+    // text and bytes are numbered together
+    count = PyDict_Size(optp->stringrefs_text) + PyDict_Size(optp->stringrefs_bytes);
+    if (len >= stringref_min_len(count)) {
+        int err;
+        index = PyLong_FromSsize_t(count);
+        if (index == NULL) {
+            return -1;
+        }
+        err = PyDict_SetItem(table, ob, index);
+        Py_DECREF(index);
+        if (err) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Tag 256 and ob, with strings in ob written as tag 25 references after
+// their first time.
+static int dumps_stringref_namespace(EncodeOptions *optp, PyObject* ob, Writer* w) {
+    PyObject* outer_text = optp->stringrefs_text;
+    PyObject* outer_bytes = optp->stringrefs_bytes;
+    int err = -1;
+    optp->stringrefs_text = PyDict_New();
+    optp->stringrefs_bytes = PyDict_New();
+    if ((optp->stringrefs_text != NULL) && (optp->stringrefs_bytes != NULL) &&
+        (tag_aux_out(CBOR_TAG, CBOR_TAG_STRINGREF_NAMESPACE, w) == 0)) {
+        err = inner_dumps(optp, ob, w);
+    }
+    Py_XDECREF(optp->stringrefs_text);
+    Py_XDECREF(optp->stringrefs_bytes);
+    optp->stringrefs_text = outer_text;
+    optp->stringrefs_bytes = outer_bytes;
+    return err;
+}
+
+// A map key or set item for canonical=True, encoded into a scratch buffer
+typedef struct {
+    Py_ssize_t start;
+    Py_ssize_t len;
+    const uint8_t* raw;  // scratch + start, once the scratch buffer is done growing
+    PyObject* value;     // map value to write after it, NULL for a set item
+} CanonicalItem;
+
+// bytewise lexicographic, a prefix before anything longer
+static int CanonicalItem_cmp(const void* a, const void* b) {
+    const CanonicalItem* ia = (const CanonicalItem*)a;
+    const CanonicalItem* ib = (const CanonicalItem*)b;
+    int c = memcmp(ia->raw, ib->raw, (ia->len < ib->len) ? ia->len : ib->len);
+    if (c != 0) {
+        return c;
+    }
+    return (ia->len > ib->len) - (ia->len < ib->len);
+}
+
+// canonical=True: write the n items of dict or set ob sorted by their
+// encoding. Each key is encoded once, into one scratch buffer, and copied
+// from there once sorted. The caller writes the map or array head.
+static int dumps_canonical_items(EncodeOptions *optp, PyObject* ob, Py_ssize_t n, Writer* w) {
+    int is_map = PyDict_Check(ob);
+    CanonicalItem* items;
+    BytesWriter scratch;
+    PyObject* it = NULL;
+    Py_ssize_t count = 0;
+    Py_ssize_t i;
+    int err = -1;
+
+    if (n == 0) {
+        return 0;
+    }
+    items = (CanonicalItem*)PyMem_Malloc(n * sizeof(CanonicalItem));
+    if (items == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (BytesWriter_init(&scratch)) {
+        PyMem_Free(items);
+        return -1;
+    }
+    if (is_map) {
+        Py_ssize_t dictpos = 0;
+        PyObject* key;
+        PyObject* value;
+        int kerr = 0;
+        Py_BEGIN_CRITICAL_SECTION(ob);
+        while ((count < n) && PyDict_Next(ob, &dictpos, &key, &value)) {
+            Py_ssize_t start = scratch.pos;
+            // held in case encoding a key runs code that changes the dict
+            Py_INCREF(key);
+            Py_INCREF(value);
+            items[count].value = value;
+            count++;
+            kerr = inner_dumps(optp, key, (Writer*)&scratch);
+            Py_DECREF(key);
+            if (kerr) {
+                break;
+            }
+            items[count - 1].start = start;
+            items[count - 1].len = scratch.pos - start;
+        }
+        Py_END_CRITICAL_SECTION();
+        if (kerr) {
+            goto done;
+        }
+    } else {
+        PyObject* item;
+        it = PyObject_GetIter(ob);
+        if (it == NULL) {
+            goto done;
+        }
+        while ((count < n) && ((item = PyIter_Next(it)) != NULL)) {
+            Py_ssize_t start = scratch.pos;
+            int ierr = inner_dumps(optp, item, (Writer*)&scratch);
+            Py_DECREF(item);
+            if (ierr) {
+                goto done;
+            }
+            items[count].start = start;
+            items[count].len = scratch.pos - start;
+            items[count].value = NULL;
+            count++;
+        }
+    }
+    if (PyErr_Occurred()) {
+        goto done;
+    }
+    if (count != n) {
+        PyErr_SetString(PyExc_RuntimeError, "container changed size during dumps");
+        goto done;
+    }
+    for (i = 0; i < count; i++) {
+        items[i].raw = scratch.out + items[i].start;
+    }
+    qsort(items, count, sizeof(CanonicalItem), CanonicalItem_cmp);
+    for (i = 0; i < count; i++) {
+        if ((i > 0) && (CanonicalItem_cmp(items + i - 1, items + i) == 0)) {
+            PyErr_SetString(PyExc_ValueError, "canonical encoding has two equal map keys or set items");
+            goto done;
+        }
+        if (Writer_write(w, items[i].raw, items[i].len)) {
+            goto done;
+        }
+        if (is_map && inner_dumps(optp, items[i].value, w)) {
+            goto done;
+        }
+    }
+    err = 0;
+done:
+    if (is_map) {
+        for (i = 0; i < count; i++) {
+            Py_DECREF(items[i].value);
+        }
+    }
+    Py_XDECREF(it);
+    BytesWriter_clear(&scratch);
+    PyMem_Free(items);
+    return err;
+}
+
+static int dumps_dict(EncodeOptions *optp, PyObject* ob, Writer* w) {
+    Py_ssize_t dictlen = PyDict_Size(ob);
+    PyObject* key;
+    PyObject* val;
+    int err;
+
+    err = tag_aux_out(CBOR_MAP, dictlen, w);
+    if (err != 0) { return err; }
+
+    if (optp->canonical) {
+        return dumps_canonical_items(optp, ob, dictlen, w);
+    } else if (optp->sort_keys) {
+        Py_ssize_t index = 0;
+        PyObject* keylist = PyDict_Keys(ob);
+        if (keylist == NULL) {
+            return -1;
+        }
+        if (PyList_Sort(keylist)) {
+            Py_DECREF(keylist);
+            return -1;
+        }
+
+        //fprintf(stderr, "sortking keys\n");
+        for (index = 0; index < PyList_GET_SIZE(keylist); index++) {
+            key = PyList_GET_ITEM(keylist, index); // Borrowed ref, keylist is ours
+            err = PyDict_GetItemRef(ob, key, &val);
+            if (err == 0) {
+                PyErr_SetString(PyExc_RuntimeError, "dict changed during dumps");
+                err = -1;
+            } else if (err > 0) {
+                err = inner_dumps(optp, key, w);
+                if (err == 0) {
+                    err = inner_dumps(optp, val, w);
+                }
+                Py_DECREF(val);
+            }
+            if (err != 0) {
+                Py_DECREF(keylist);
+                return err;
+            }
+        }
+        Py_DECREF(keylist);
+    } else {
+        Py_ssize_t dictiter = 0;
+        Py_ssize_t count = 0;
+        //fprintf(stderr, "unsorted keys\n");
+        // In free-threaded builds the dict is locked while it is walked,
+        // and key and val are held in case encoding one of them unlocks it.
+        Py_BEGIN_CRITICAL_SECTION(ob);
+        while (PyDict_Next(ob, &dictiter, &key, &val)) {
+            Py_INCREF(key);
+            Py_INCREF(val);
+            count++;
+            err = inner_dumps(optp, key, w);
+            if (err == 0) {
+                err = inner_dumps(optp, val, w);
+            }
+            Py_DECREF(key);
+            Py_DECREF(val);
+            if (err != 0) { break; }
+        }
+        Py_END_CRITICAL_SECTION();
+        if (err != 0) { return err; }
+        if (count != dictlen) {
+            PyErr_SetString(PyExc_RuntimeError, "container changed size during dumps");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+// Write tag (2 or 3) and the non-negative int val as big-endian bytes.
+static int dumps_bignum(EncodeOptions *optp, uint8_t tag, PyObject* val, Writer* w) {
+    Py_ssize_t nbytes;
+    PyObject* blob;
+    int err;
+    // not PyLong_AsNativeBytes(val, NULL, 0, ...), which may ask for a
+    // byte more than the value needs, and CBOR wants the shortest
+    size_t nbits = _PyLong_NumBits(val);
+#if PY_VERSION_HEX >= 0x030D0000
+    const int flags = Py_ASNATIVEBYTES_BIG_ENDIAN | Py_ASNATIVEBYTES_UNSIGNED_BUFFER | Py_ASNATIVEBYTES_REJECT_NEGATIVE;
+#endif
+    if ((nbits == (size_t)-1) && PyErr_Occurred()) { return -1; }
+    nbytes = (Py_ssize_t)((nbits + 7) / 8);
+    // Converted apart from the output, which may not have room for all of
+    // it at once: dump() flushes a buffer of at most buffer_size bytes.
+    blob = PyBytes_FromStringAndSize(NULL, nbytes);
+    if (blob == NULL) { return -1; }
+#if PY_VERSION_HEX >= 0x030D0000
+    err = PyLong_AsNativeBytes(val, PyBytes_AS_STRING(blob), nbytes, flags) < 0;
+#else
+    err = _PyLong_AsByteArray((PyLongObject*)val, (unsigned char*)PyBytes_AS_STRING(blob), nbytes, 0 /* big endian */, 0 /* unsigned */);
+#endif
+    if (err == 0) {
+        err = tag_aux_out(CBOR_TAG, tag, w);
+    }
+    if (err == 0) {
+        if (optp->stringrefs_bytes != NULL) {
+            // the byte string may be a reference, or referred to later
+            err = inner_dumps(optp, blob, w);
+        } else {
+            err = tag_aux_out(CBOR_BYTES, nbytes, w) || Writer_write(w, PyBytes_AS_STRING(blob), nbytes);
+        }
+    }
+    Py_DECREF(blob);
+    return err ? -1 : 0;
+}
+
+// val >= 2**63: major type cbor_type when it fits in 64 bits, else bignum tag
+static int dumps_big_uint(EncodeOptions *optp, uint8_t cbor_type, uint8_t tag, PyObject* val, Writer* w) {
+    unsigned long long uval = PyLong_AsUnsignedLongLong(val);
+    if ((uval == (unsigned long long)-1) && PyErr_Occurred()) {
+	if (!PyErr_ExceptionMatches(PyExc_OverflowError)) { return -1; }
+	PyErr_Clear();
+	return dumps_bignum(optp, tag, val, w);
+    }
+    return tag_aux_out(cbor_type, uval, w);
+}
+
+static int dumps_tag(EncodeOptions *optp, CborTag* ob, Writer* w) {
+    PyObject* tag_num = ob->tag;
+    unsigned long long val;
+
+    if (tag_num == NULL) {
+        PyErr_SetString(PyExc_ValueError, "broken Tag object with no .tag");
+        return -1;
+    }
+#ifdef Py_INTOBJECT_H
+    if (PyInt_Check(tag_num)) {
+        long ival = PyInt_AsLong(tag_num);
+        if (ival < 0) {
+            PyErr_Format(PyExc_ValueError, "tag cannot be a negative int: %ld", ival);
+            return -1;
+        }
+        val = ival;
+    } else
+#endif
+    if (PyLong_Check(tag_num)) {
+        int overflow = 0;
+        long long sval = PyLong_AsLongLongAndOverflow(tag_num, &overflow);
+        if ((overflow < 0) || ((overflow == 0) && (sval < 0))) {
+            PyErr_SetString(PyExc_ValueError, "tag cannot be a negative int");
+            return -1;
+        }
+        if (overflow == 0) {
+            val = sval;
+        } else {
+            val = PyLong_AsUnsignedLongLong(tag_num);
+            if ((val == (unsigned long long)-1) && PyErr_Occurred()) {
+                PyErr_Clear();
+                PyErr_SetString(PyExc_ValueError, "tag number too large");
+                return -1;
+            }
+        }
+    } else {
+        PyErr_Format(PyExc_ValueError, "tag number must be an int, not %.200s", Py_TYPE(tag_num)->tp_name);
+        return -1;
+    }
+    if (tag_aux_out(CBOR_TAG, val, w)) {
+        return -1;
+    }
+    return inner_dumps(optp, (ob->value != NULL) ? ob->value : Py_None, w);
+}
+
+#if HAS_SEMANTIC_TAGS
+// Tag 0 text for datetime ob: whole minute UTC offsets are kept, a
+// naive datetime is taken to be UTC and anything else is converted to UTC.
+static int dumps_datetime(EncodeOptions *optp, PyObject* ob, Writer* w) {
+    char text[48];
+    int len;
+    long offset = 0;  // minutes east of UTC
+    PyObject* dt = ob;
+    PyObject* delta = PyObject_CallMethod(ob, "utcoffset", NULL);
+    if (delta == NULL) {
+        return -1;
+    }
+    if (delta != Py_None) {
+        long seconds = (PyDateTime_DELTA_GET_DAYS(delta) * 86400L) + PyDateTime_DELTA_GET_SECONDS(delta);
+        if (((seconds % 60) != 0) || (PyDateTime_DELTA_GET_MICROSECONDS(delta) != 0)) {
+            dt = PyObject_CallMethod(ob, "astimezone", "O", PyDateTime_TimeZone_UTC);
+            if (dt == NULL) {
+                Py_DECREF(delta);
+                return -1;
+            }
+        } else {
+            offset = seconds / 60;
+        }
+    }
+    Py_DECREF(delta);
+    len = snprintf(text, sizeof(text), "%04d-%02d-%02dT%02d:%02d:%02d",
+                   PyDateTime_GET_YEAR(dt), PyDateTime_GET_MONTH(dt), PyDateTime_GET_DAY(dt),
+                   PyDateTime_DATE_GET_HOUR(dt), PyDateTime_DATE_GET_MINUTE(dt), PyDateTime_DATE_GET_SECOND(dt));
+    if (PyDateTime_DATE_GET_MICROSECOND(dt) != 0) {
+        len += snprintf(text + len, sizeof(text) - len, ".%06d", PyDateTime_DATE_GET_MICROSECOND(dt));
+    }
+    if (dt != ob) {
+        Py_DECREF(dt);
+    }
+    if (offset == 0) {
+        text[len++] = 'Z';
+    } else {
+        long mag = (offset < 0) ? -offset : offset;
+        len += snprintf(text + len, sizeof(text) - len, "%c%02ld:%02ld", (offset < 0) ? '-' : '+', mag / 60, mag % 60);
+    }
+    if (tag_aux_out(CBOR_TAG, CBOR_TAG_DATE_STRING, w)) {
+        return -1;
+    }
+    if (optp->stringrefs_text != NULL) {
+        // a string like any other to the stringref table
+        int err;
+        PyObject* s = PyUnicode_FromStringAndSize(text, len);
+        if (s == NULL) {
+            return -1;
+        }
+        err = inner_dumps(optp, s, w);
+        Py_DECREF(s);
+        return err;
+    }
+    if (tag_aux_out(CBOR_TEXT, len, w)) {
+        return -1;
+    }
+    return Writer_write(w, text, len);
+}
+
+// Tag 4 [exponent, mantissa] for a finite Decimal, a float for NaN and infinities
+static int dumps_decimal(EncodeOptions *optp, PyObject* ob, Writer* w) {
+    PyObject* parts = PyObject_CallMethod(ob, "as_tuple", NULL);
+    PyObject* digits;
+    PyObject* exponent;
+    PyObject* mantissa = NULL;
+    Py_ssize_t i, n;
+    char* text;
+    int err = -1;
+    if (parts == NULL) {
+        return -1;
+    }
+    if (!PyTuple_Check(parts) || (PyTuple_GET_SIZE(parts) != 3) || !PyTuple_Check(PyTuple_GET_ITEM(parts, 1))) {
+        PyErr_SetString(PyExc_ValueError, "unexpected Decimal.as_tuple()");
+        Py_DECREF(parts);
+        return -1;
+    }
+    digits = PyTuple_GET_ITEM(parts, 1);
+    exponent = PyTuple_GET_ITEM(parts, 2);
+    if (!PyLong_Check(exponent)) {
+        // 'n', 'N' or 'F'
+        PyObject* val = PyNumber_Float(ob);
+        Py_DECREF(parts);
+        if (val == NULL) {
+            return -1;
+        }
+        err = inner_dumps(optp, val, w);
+        Py_DECREF(val);
+        return err;
+    }
+    n = PyTuple_GET_SIZE(digits);
+    text = (char*)PyMem_Malloc(n + 2);
+    if (text == NULL) {
+        Py_DECREF(parts);
+        PyErr_NoMemory();
+        return -1;
+    }
+    text[0] = (PyObject_IsTrue(PyTuple_GET_ITEM(parts, 0)) == 1) ? '-' : '+';
+    for (i = 0; i < n; i++) {
+        long d = PyLong_AsLong(PyTuple_GET_ITEM(digits, i));
+        text[i + 1] = '0' + (char)d;
+    }
+    text[n + 1] = '\0';
+    if (!PyErr_Occurred()) {
+        mantissa = PyLong_FromString(text, NULL, 10);
+    }
+    PyMem_Free(text);
+    if (mantissa != NULL) {
+        err = tag_aux_out(CBOR_TAG, CBOR_TAG_DECIMAL, w) || tag_aux_out(CBOR_ARRAY, 2, w) ||
+            inner_dumps(optp, exponent, w) || inner_dumps(optp, mantissa, w);
+        Py_DECREF(mantissa);
+    }
+    Py_DECREF(parts);
+    return err ? -1 : 0;
+}
+
+// semantic_tags=True: datetime, Decimal, UUID, re.Pattern, set and
+// frozenset as their standard tags. Return 1 if ob was written, 0 if it
+// isn't one of those, -1 on error.
+static int dumps_semantic(EncodeOptions *optp, PyObject* ob, Writer* w) {
+    int err;
+    SemanticTypes* st = load_semantic_types(optp->state);
+    if (st == NULL) {
+        return -1;
+    }
+    if (PyDateTime_Check(ob)) {
+        err = dumps_datetime(optp, ob, w);
+    } else if (PyAnySet_Check(ob) && optp->canonical) {
+        err = tag_aux_out(CBOR_TAG, CBOR_TAG_SET, w) || tag_aux_out(CBOR_ARRAY, PySet_GET_SIZE(ob), w)
+            || dumps_canonical_items(optp, ob, PySet_GET_SIZE(ob), w);
+    } else if (PyAnySet_Check(ob)) {
+        PyObject* it = PyObject_GetIter(ob);
+        PyObject* item;
+        if (it == NULL) {
+            return -1;
+        }
+        err = tag_aux_out(CBOR_TAG, CBOR_TAG_SET, w) || tag_aux_out(CBOR_ARRAY, PySet_GET_SIZE(ob), w);
+        while ((err == 0) && ((item = PyIter_Next(it)) != NULL)) {
+            err = inner_dumps(optp, item, w);
+            Py_DECREF(item);
+        }
+        Py_DECREF(it);
+        if (PyErr_Occurred()) {
+            err = -1;
+        }
+    } else if (PyObject_TypeCheck(ob, (PyTypeObject*)st->decimal_type)) {
+        err = dumps_decimal(optp, ob, w);
+    } else if (PyObject_TypeCheck(ob, (PyTypeObject*)st->uuid_type)) {
+        PyObject* raw = PyObject_GetAttrString(ob, "bytes");
+        if (raw == NULL) {
+            return -1;
+        }
+        err = tag_aux_out(CBOR_TAG, CBOR_TAG_UUID, w) || inner_dumps(optp, raw, w);
+        Py_DECREF(raw);
+    } else if (PyObject_TypeCheck(ob, (PyTypeObject*)st->pattern_type)) {
+        PyObject* pattern = PyObject_GetAttrString(ob, "pattern");
+        if (pattern == NULL) {
+            return -1;
+        }
+        if (!PyUnicode_Check(pattern)) {
+            // tag 35 is text, leave bytes patterns to default
+            Py_DECREF(pattern);
+            return 0;
+        }
+        err = tag_aux_out(CBOR_TAG, CBOR_TAG_REGEX, w) || inner_dumps(optp, pattern, w);
+        Py_DECREF(pattern);
+    } else {
+        return 0;
+    }
+    return err ? -1 : 1;
+}
+#endif /* HAS_SEMANTIC_TAGS */
+
+
+// Write the CBOR_7 head byte and nbytes of big-endian bits. return 0 on success
+static int float_bits_out(uint8_t head, uint64_t bits, int nbytes, Writer* w) {
+    int i;
+    uint8_t* out = Writer_reserve(w, 1 + nbytes);
+    if (out == NULL) {
+        return -1;
+    }
+    out[0] = head;
+    for (i = nbytes; i > 0; i--) {
+        out[i] = (uint8_t)bits;
+        bits >>= 8;
+    }
+    return 0;
+}
+
+// If val is exactly representable as a float16, set *halfp to its bits and return 1.
+// val is not NaN.
+static int double_to_half(double val, uint16_t* halfp) {
+    union { uint32_t u; float f; } single;
+    uint16_t sign;
+    int exp;
+    uint32_t mant;
+    if (isinf(val)) {
+        *halfp = (val < 0) ? 0xfc00 : 0x7c00;
+        return 1;
+    }
+    if ((val > 65504.0) || (val < -65504.0)) {
+        return 0;
+    }
+    single.f = (float)val;
+    if ((double)single.f != val) {
+        return 0;
+    }
+    sign = (single.u >> 16) & 0x8000;
+    exp = (int)((single.u >> 23) & 0xff) - 127;
+    mant = single.u & 0x7fffff;
+    if ((exp == -127) && (mant == 0)) {
+        // +/- 0
+        *halfp = sign;
+        return 1;
+    }
+    if (exp >= -14) {
+        // normal float16, 10 bits of mantissa
+        if (mant & 0x1fff) {
+            return 0;
+        }
+        *halfp = sign | ((exp + 15) << 10) | (mant >> 13);
+        return 1;
+    }
+    if (exp >= -24) {
+        // subnormal float16, value is (half mantissa) * 2^-24
+        int shift = -1 - exp;
+        mant |= 0x800000;
+        if (mant & ((1u << shift) - 1)) {
+            return 0;
+        }
+        *halfp = sign | (mant >> shift);
+        return 1;
+    }
+    return 0;
+}
+
+// Write val as float16, float32 or float64, whichever is smallest and
+// decodes to the same value. NaN keeps its sign and payload bits.
+// return 0 on success
+static int dumps_float_shortest(double val, Writer* w) {
+    union { uint64_t u; double d; } bits;
+    union { uint32_t u; float f; } single;
+    uint16_t half;
+    bits.d = val;
+    if (val != val) {
+        // NaN. Converting to float may change the payload, so do it by hand.
+        uint64_t sign = bits.u >> 63;
+        uint64_t mant = bits.u & 0xfffffffffffffULL;
+        if ((mant & 0x3ffffffffffULL) == 0) {
+            return float_bits_out(CBOR_FLOAT16, (sign << 15) | 0x7c00 | (mant >> 42), 2, w);
+        }
+        if ((mant & 0x1fffffffULL) == 0) {
+            return float_bits_out(CBOR_FLOAT32, (sign << 31) | 0x7f800000 | (mant >> 29), 4, w);
+        }
+        return float_bits_out(CBOR_FLOAT64, bits.u, 8, w);
+    }
+    if (double_to_half(val, &half)) {
+        return float_bits_out(CBOR_FLOAT16, half, 2, w);
+    }
+    if ((val >= -FLT_MAX) && (val <= FLT_MAX)) {
+        single.f = (float)val;
+        if ((double)single.f == val) {
+            return float_bits_out(CBOR_FLOAT32, single.u, 4, w);
+        }
+    }
+    return float_bits_out(CBOR_FLOAT64, bits.u, 8, w);
+}
+
+// Encode ob onto the end of w.
+// return err, 0=OK
+// Find what dumps(class_tags=) does with objects of ob's type: the first
+// ClassTag whose class_type ob is an instance of, as in TagMapper.encode().
+// Return a BORROWED (tag_number, encode_function) tuple, Py_None if no
+// ClassTag applies, or NULL on error. Answers are kept per exact type.
+static PyObject* class_tag_lookup(EncodeOptions *optp, PyObject* ob) {
+    PyObject* type = (PyObject*)Py_TYPE(ob);
+    PyObject* entry;
+    PyObject* seq;
+    Py_ssize_t i;
+    int err;
+    if (optp->class_tag_cache == NULL) {
+        optp->class_tag_cache = PyDict_New();
+        if (optp->class_tag_cache == NULL) {
+            return NULL;
+        }
+    } else {
+        entry = PyDict_GetItem(optp->class_tag_cache, type);  // Borrowed ref
+        if (entry != NULL) {
+            return entry;
+        }
+    }
+    seq = class_tags_tuple(optp->class_tags);
+    if (seq == NULL) {
+        return NULL;
+    }
+    Py_INCREF(Py_None);
+    entry = Py_None;
+    for (i = 0; i < PyTuple_GET_SIZE(seq); i++) {
+        PyObject* ct = PyTuple_GET_ITEM(seq, i);
+        PyObject* class_type = PyObject_GetAttrString(ct, "class_type");
+        PyObject* encode_function = NULL;
+        int match = 0;
+        if (class_type != NULL) {
+            encode_function = PyObject_GetAttrString(ct, "encode_function");
+        }
+        if (encode_function == NULL) {
+            match = -1;
+        } else if ((class_type != Py_None) && (encode_function != Py_None)) {
+            match = PyObject_IsInstance(ob, class_type);
+        }
+        if (match > 0) {
+            PyObject* tag_number = PyObject_GetAttrString(ct, "tag_number");
+            if (tag_number == NULL) {
+                match = -1;
+            } else {
+                Py_DECREF(entry);
+                entry = PyTuple_Pack(2, tag_number, encode_function);
+                Py_DECREF(tag_number);
+                if (entry == NULL) {
+                    match = -1;
+                }
+            }
+        }
+        Py_XDECREF(class_type);
+        Py_XDECREF(encode_function);
+        if (match < 0) {
+            Py_XDECREF(entry);
+            Py_DECREF(seq);
+            return NULL;
+        }
+        if (match > 0) {
+            break;
+        }
+    }
+    Py_DECREF(seq);
+    err = PyDict_SetItem(optp->class_tag_cache, type, entry);
+    // the cache holds on to it from here
+    Py_DECREF(entry);
+    if (err) {
+        return NULL;
+    }
+    return entry;
+}
+
+// Return 1 if ob was written as Tag(tag_number, encode_function(ob)) by
+// dumps(class_tags=), 0 if no ClassTag applies to it, -1 on error.
+// What encode_function returns is written without mapping, like TagMapper.encode().
+static int dumps_class_tag(EncodeOptions *optp, PyObject* ob, Writer* w) {
+    PyObject* entry = class_tag_lookup(optp, ob);
+    PyObject* class_tags;
+    PyObject* tag;
+    PyObject* value;
+    int err;
+    if (entry == NULL) {
+        return -1;
+    }
+    if (entry == Py_None) {
+        return 0;
+    }
+    value = PyObject_CallFunctionObjArgs(PyTuple_GET_ITEM(entry, 1), ob, NULL);
+    if (value == NULL) {
+        return -1;
+    }
+    tag = Tag_New(PyTuple_GET_ITEM(entry, 0), value);
+    Py_DECREF(value);
+    if (tag == NULL) {
+        return -1;
+    }
+    class_tags = optp->class_tags;
+    optp->class_tags = NULL;
+    err = dumps_tag(optp, (CborTag*)tag, w);
+    optp->class_tags = class_tags;
+    Py_DECREF(tag);
+    return (err == 0) ? 1 : -1;
+}
+
+// Write default_fn(ob) in place of ob, which dumps has no other way to write.
+static int dumps_default(EncodeOptions *optp, PyObject* ob, Writer* w) {
+    PyObject* replacement = PyObject_CallFunctionObjArgs(optp->default_fn, ob, NULL);
+    int err;
+    if (replacement == NULL) {
+        return -1;
+    }
+    // default returning something that also needs default, forever
+    if (Py_EnterRecursiveCall(" while encoding the result of default")) {
+        Py_DECREF(replacement);
+        return -1;
+    }
+    err = inner_dumps(optp, replacement, w);
+    Py_LeaveRecursiveCall();
+    Py_DECREF(replacement);
+    return err;
+}
+
+static void EncodeOptions_clear(EncodeOptions *optp) {
+    int i;
+    optp->class_tags = NULL;
+    Py_CLEAR(optp->class_tag_cache);
+    optp->default_fn = NULL;
+    for (i = 0; i < DEFAULT_TYPE_CACHE_SIZE; i++) {
+        Py_CLEAR(optp->default_types[i]);
+    }
+}
+
+static int inner_dumps(EncodeOptions *optp, PyObject* ob, Writer* w) {
+    int err = 0;
+
+    if (optp->class_tags != NULL) {
+        err = dumps_class_tag(optp, ob, w);
+        if (err != 0) {
+            return (err > 0) ? 0 : -1;
+        }
+    }
+    if ((optp->default_fn != NULL) && (optp->default_types[DEFAULT_TYPE_SLOT(Py_TYPE(ob))] == Py_TYPE(ob))) {
+        return dumps_default(optp, ob, w);
+    }
+
+    if (ob == Py_None) {
+	uint8_t* out = Writer_reserve(w, 1);
+	if (out == NULL) { return -1; }
+	out[0] = CBOR_NULL;
+    } else if (PyBool_Check(ob)) {
+	uint8_t* out = Writer_reserve(w, 1);
+	if (out == NULL) { return -1; }
+	if (ob == Py_True) {
+	    out[0] = CBOR_TRUE;
+	} else {
+	    out[0] = CBOR_FALSE;
 	}
-	thiz->read_count += rlen;
-	rtotal += rlen;
-	opos += rlen;
-	len -= rlen;
-	if (rtotal >= len) {
-            if (thiz->dst == NULL) {
-                PyErr_SetString(PyExc_RuntimeError, "known error in file reader, NULL dst");
-                return NULL;
+    } else if (PyDict_Check(ob)) {
+	err = dumps_dict(optp, ob, w);
+    } else if (PyList_Check(ob)) {
+        Py_ssize_t i;
+	Py_ssize_t listlen = PyList_Size(ob);
+	err = tag_aux_out(CBOR_ARRAY, listlen, w);
+	for (i = 0; (err == 0) && (i < listlen); i++) {
+	    PyObject* item = PyList_GetItemRef(ob, i);
+	    if (item == NULL) { return -1; }
+	    err = inner_dumps(optp, item, w);
+	    Py_DECREF(item);
+	}
+    } else if (PyTuple_Check(ob)) {
+        Py_ssize_t i;
+	Py_ssize_t listlen = PyTuple_Size(ob);
+	err = tag_aux_out(CBOR_ARRAY, listlen, w);
+	for (i = 0; (err == 0) && (i < listlen); i++) {
+	    err = inner_dumps(optp, PyTuple_GET_ITEM(ob, i), w);
+	}
+	// TODO: accept other enumerables and emit a variable length array
+#ifdef Py_INTOBJECT_H
+	// PyInt exists in Python 2 but not 3
+    } else if (PyInt_Check(ob)) {
+	long val = PyInt_AsLong(ob);
+	if (val >= 0) {
+	    err = tag_aux_out(CBOR_UINT, val, w);
+	} else {
+	    err = tag_aux_out(CBOR_NEGINT, -1 - val, w);
+	}
+#endif
+    } else if (PyLong_Check(ob)) {
+	int overflow = 0;
+	long long val = PyLong_AsLongLongAndOverflow(ob, &overflow);
+	if (overflow == 0) {
+	    if (val >= 0) {
+		err = tag_aux_out(CBOR_UINT, val, w);
+	    } else {
+		err = tag_aux_out(CBOR_NEGINT, -1L - val, w);
+	    }
+	} else if (overflow < 0) {
+	    // NEGINT below long long, bignum past 64 bits
+	    PyObject* minusone = PyLong_FromLongLong(-1L);
+	    PyObject* val = PyNumber_Subtract(minusone, ob);
+	    Py_DECREF(minusone);
+	    if (val == NULL) { return -1; }
+	    err = dumps_big_uint(optp, CBOR_NEGINT, CBOR_TAG_NEGBIGNUM, val, w);
+	    Py_DECREF(val);
+	} else {
+	    err = dumps_big_uint(optp, CBOR_UINT, CBOR_TAG_BIGNUM, ob, w);
+	}
+    } else if (PyFloat_Check(ob)) {
+	double val = PyFloat_AsDouble(ob);
+	if (optp->float_mode == FLOAT_MODE_SHORTEST) {
+	    err = dumps_float_shortest(val, w);
+	} else {
+	    err = tag_u64_out(CBOR_7, *((uint64_t*)(&val)), w);
+	}
+    } else if (PyBytes_Check(ob)) {
+	Py_ssize_t len = PyBytes_Size(ob);
+	if (optp->stringrefs_bytes != NULL) {
+	    err = dumps_stringref(optp, optp->stringrefs_bytes, ob, len, w);
+	    if (err != 0) {
+		return (err > 0) ? 0 : -1;
+	    }
+	}
+	err = tag_aux_out(CBOR_BYTES, len, w);
+	if (err == 0) {
+	    err = Writer_write(w, PyBytes_AsString(ob), len);
+	}
+    } else if (PyUnicode_Check(ob)) {
+#if IS_PY3
+	Py_ssize_t len;
+	const char* utf8;
+#if PY_VERSION_HEX < 0x030C0000
+	if (PyUnicode_READY(ob)) { return -1; }
+#endif
+	if (PyUnicode_IS_COMPACT_ASCII(ob)) {
+	    // the str's own storage is already valid UTF-8
+	    len = PyUnicode_GET_LENGTH(ob);
+	    utf8 = (const char*)PyUnicode_1BYTE_DATA(ob);
+	} else {
+	    // converted once and cached in the str
+	    utf8 = PyUnicode_AsUTF8AndSize(ob, &len);
+	    if (utf8 == NULL) { return -1; }
+	}
+	if (optp->stringrefs_text != NULL) {
+	    err = dumps_stringref(optp, optp->stringrefs_text, ob, len, w);
+	    if (err != 0) {
+		return (err > 0) ? 0 : -1;
+	    }
+	}
+	err = tag_aux_out(CBOR_TEXT, len, w);
+	if (err == 0) {
+	    err = Writer_write(w, utf8, len);
+	}
+#else
+	PyObject* utf8 = PyUnicode_AsUTF8String(ob);
+	Py_ssize_t len;
+	if (utf8 == NULL) { return -1; }
+	len = PyBytes_Size(utf8);
+	if (optp->stringrefs_text != NULL) {
+	    err = dumps_stringref(optp, optp->stringrefs_text, ob, len, w);
+	    if (err != 0) {
+		Py_DECREF(utf8);
+		return (err > 0) ? 0 : -1;
+	    }
+	}
+	err = tag_aux_out(CBOR_TEXT, len, w);
+	if (err == 0) {
+	    err = Writer_write(w, PyBytes_AsString(utf8), len);
+	}
+	Py_DECREF(utf8);
+#endif
+    } else {
+        int handled = 0;
+        if (PyObject_TypeCheck(ob, &CborTagType)) {
+            // TagMapper.encode() passes a Tag through as is, so class_tags don't apply in it
+            PyObject* class_tags = optp->class_tags;
+            PyObject* tag_num = ((CborTag*)ob)->tag;
+            int overflow = 0;
+            optp->class_tags = NULL;
+            // a tag number too big for a long is left for dumps_tag() to check
+            if ((optp->stringrefs_text != NULL) && (tag_num != NULL) && PyLong_Check(tag_num) &&
+                (PyLong_AsLongAndOverflow(tag_num, &overflow) == CBOR_TAG_STRINGREF_NAMESPACE)) {
+                // a nested namespace starts over with no strings
+                err = dumps_stringref_namespace(optp, ((CborTag*)ob)->value, w);
+            } else {
+                err = dumps_tag(optp, (CborTag*)ob, w);
             }
-	    return thiz->dst;
+            optp->class_tags = class_tags;
+            handled = 1;
+        }
+
+#if HAS_SEMANTIC_TAGS
+        if (!handled && optp->semantic_tags) {
+            err = dumps_semantic(optp, ob, w);
+            if (err < 0) {
+                return -1;
+            }
+            handled = err;
+            err = 0;
+        }
+#endif
+
+        // TODO: other special object serializations here
+
+        if (!handled && (optp->default_fn != NULL)) {
+            // Nothing above depends on more than the type, so the next one can skip the checks.
+            // Except a bytes re.Pattern, which semantic_tags leaves for default but not a str one.
+            // (dumps_semantic() has loaded the semantic types by now.)
+            int cacheable = 1;
+#if HAS_SEMANTIC_TAGS
+            cacheable = !(optp->semantic_tags && PyObject_TypeCheck(ob, (PyTypeObject*)optp->state->semantic.pattern_type));
+#endif
+            if (cacheable) {
+                PyTypeObject** slot = &(optp->default_types[DEFAULT_TYPE_SLOT(Py_TYPE(ob))]);
+                PyTypeObject* old = *slot;
+                Py_INCREF(Py_TYPE(ob));
+                *slot = Py_TYPE(ob);
+                Py_XDECREF(old);
+            }
+            return dumps_default(optp, ob, w);
+        }
+        if (!handled) {
+#if IS_PY3
+            PyErr_Format(PyExc_ValueError, "cannot serialize unknown object: %R", ob);
+#else
+            PyObject* badtype = PyObject_Type(ob);
+            PyObject* badtypename = PyObject_Str(badtype);
+            PyErr_Format(PyExc_ValueError, "cannot serialize unknown object of type %s", PyString_AsString(badtypename));
+            Py_DECREF(badtypename);
+            Py_DECREF(badtype);
+#endif
+            return -1;
+        }
+    }
+    return err;
+}
+
+static int _dumps_kwargs(EncodeOptions *optp, PyObject* kwargs) {
+    if (kwargs == NULL) {
+    } else if (!PyDict_Check(kwargs)) {
+	PyErr_Format(PyExc_ValueError, "kwargs not dict: %R\n", kwargs);
+	return 0;
+    } else {
+	PyObject* sort_keys = PyDict_GetItemString(kwargs, "sort_keys");  // Borrowed ref
+	PyObject* float_mode = PyDict_GetItemString(kwargs, "float_mode");  // Borrowed ref
+	PyObject* class_tags = PyDict_GetItemString(kwargs, "class_tags");  // Borrowed ref
+	PyObject* default_fn = PyDict_GetItemString(kwargs, "default");  // Borrowed ref
+	if ((class_tags != NULL) && (class_tags != Py_None)) {
+	    optp->class_tags = class_tags;
+	}
+	if ((default_fn != NULL) && (default_fn != Py_None)) {
+	    if (!PyCallable_Check(default_fn)) {
+		PyErr_SetString(PyExc_TypeError, "default must be callable");
+		return 0;
+	    }
+	    optp->default_fn = default_fn;
+	}
+	{
+	    int semantic_tags = 0;
+	    if (semantic_tags_kwarg(kwargs, &semantic_tags)) {
+		return 0;
+	    }
+	    optp->semantic_tags = semantic_tags;
+	}
+	{
+	    PyObject* string_referencing = PyDict_GetItemString(kwargs, "string_referencing");  // Borrowed ref
+	    if (string_referencing != NULL) {
+		int flag = PyObject_IsTrue(string_referencing);
+		if (flag < 0) {
+		    return 0;
+		}
+		optp->string_referencing = flag;
+	    }
+	}
+	if (sort_keys != NULL) {
+            optp->sort_keys = PyObject_IsTrue(sort_keys);
+            //fprintf(stderr, "sort_keys=%d\n", optp->sort_keys);
+	}
+	if ((float_mode != NULL) && (float_mode != Py_None)) {
+#if IS_PY3
+	    const char* mode = PyUnicode_Check(float_mode) ? PyUnicode_AsUTF8(float_mode) : NULL;
+#else
+	    const char* mode = PyString_Check(float_mode) ? PyString_AsString(float_mode) : NULL;
+#endif
+	    if ((mode != NULL) && (strcmp(mode, "shortest") == 0)) {
+		optp->float_mode = FLOAT_MODE_SHORTEST;
+	    } else if ((mode != NULL) && (strcmp(mode, "double") == 0)) {
+		optp->float_mode = FLOAT_MODE_DOUBLE;
+	    } else {
+		PyErr_Format(PyExc_ValueError, "float_mode must be 'double' or 'shortest', got %R", float_mode);
+		return 0;
+	    }
+	}
+	{
+	    PyObject* canonical = PyDict_GetItemString(kwargs, "canonical");  // Borrowed ref
+	    if (canonical != NULL) {
+		int flag = PyObject_IsTrue(canonical);
+		if (flag < 0) {
+		    return 0;
+		}
+		optp->canonical = flag;
+	    }
+	    if (optp->canonical) {
+		if (optp->string_referencing) {
+		    PyErr_SetString(PyExc_ValueError, "canonical and string_referencing can't be used together");
+		    return 0;
+		}
+		// deterministic encoding always uses the shortest float
+		optp->float_mode = FLOAT_MODE_SHORTEST;
+	    }
 	}
     }
+    return 1;
+}
+
+// inner_dumps() for the object passed to dumps() or dump()
+static int dumps_top(EncodeOptions *optp, PyObject* ob, Writer* w) {
+    if (optp->string_referencing) {
+        return dumps_stringref_namespace(optp, ob, w);
+    }
+    return inner_dumps(optp, ob, w);
+}
+
+// returns new bytes object with the encoding of ob, or NULL on error
+static PyObject* dumps_to_bytes(EncodeOptions *optp, PyObject* ob) {
+    BytesWriter w;
+    if (BytesWriter_init(&w)) {
+        return NULL;
+    }
+    if (dumps_top(optp, ob, (Writer*)&w) != 0) {
+        BytesWriter_clear(&w);
+        return NULL;
+    }
+    return BytesWriter_finish(&w);
+}
+
+static PyObject*
+cbor_dumps(PyObject* module, PyObject* args, PyObject* kwargs) {
+
+    PyObject* ob;
+    EncodeOptions opts = {0};
+    EncodeOptions *optp = &opts;
+    optp->state = cbor_state(module);
+    if (PyType_IsSubtype(Py_TYPE(args), &PyList_Type)) {
+	ob = PyList_GetItem(args, 0);
+    } else if (PyType_IsSubtype(Py_TYPE(args), &PyTuple_Type)) {
+	ob = PyTuple_GetItem(args, 0);
+    } else {
+	PyErr_Format(PyExc_ValueError, "args not list or tuple: %R\n", args);
+	return NULL;
+    }
+    if (ob == NULL) {
+        return NULL;
+    }
+
+    if (!_dumps_kwargs(optp, kwargs)) {
+        return NULL;
+    }
+
+    {
+        PyObject* out = dumps_to_bytes(optp, ob);
+        EncodeOptions_clear(optp);
+        return out;
+    }
 }
-static int FileReader_read1(void* self, uint8_t* oneByte) {
-    FileReader* thiz = (FileReader*)self;
-    size_t didread = fread((void*)oneByte, 1, 1, thiz->fin);
-    if (didread == 0) {
-	logprintf("failed to read 1 from file\n");
-	PyErr_SetString(PyExc_ValueError, "got nothing reading 1 from file");
-	return -1;
+
+// dumps_into() writes into a writable buffer the caller owns. When that
+// runs out the rest of the encoding goes to a scratch buffer that is only
+// there to be counted, so the error can say how much room it would take.
+#define INTO_DISCARD_SIZE 4096
+
+typedef struct _IntoWriter {
+    WRITER_FUNCTIONS;
+    // bytes that didn't fit, not counting the current window
+    Py_ssize_t dropped;
+    uint8_t* discard;
+    Py_ssize_t discard_len;
+} IntoWriter;
+
+static int IntoWriter_grow(void* self, Py_ssize_t need) {
+    IntoWriter* thiz = (IntoWriter*)self;
+    Py_ssize_t nlen = (need > INTO_DISCARD_SIZE) ? need : INTO_DISCARD_SIZE;
+    if (thiz->discard_len < nlen) {
+        uint8_t* nd = (uint8_t*)PyMem_Realloc(thiz->discard, nlen);
+        if (nd == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        thiz->discard = nd;
+        thiz->discard_len = nlen;
     }
-    thiz->read_count++;
+    thiz->dropped += thiz->pos;
+    thiz->out = thiz->discard;
+    thiz->pos = 0;
+    thiz->len = thiz->discard_len;
     return 0;
 }
-static void FileReader_return_buffer(void* self, void* buffer) {
-    // Nothing to do, we hold onto the buffer and maybe reuse it for next read
+
+// raise cbor.cbor.BufferTooSmallError(required, available)
+static void raise_buffer_too_small(Py_ssize_t required, Py_ssize_t available) {
+    PyObject* cls = import_attr("cbor.cbor", "BufferTooSmallError");
+    PyObject* err;
+    if (cls == NULL) {
+        return;
+    }
+    err = PyObject_CallFunction(cls, "nn", required, available);
+    if (err != NULL) {
+        PyErr_SetObject(cls, err);
+        Py_DECREF(err);
+    }
+    Py_DECREF(cls);
 }
-static void FileReader_delete(void* self) {
-    FileReader* thiz = (FileReader*)self;
-    if (thiz->dst) {
-	PyMem_Free(thiz->dst);
+
+// Encode ob into buf[offset:]. Return the number of bytes written, -1 on error.
+static Py_ssize_t dumps_into_buffer(EncodeOptions *optp, PyObject* ob, PyObject* buf, Py_ssize_t offset) {
+    Py_buffer view;
+    IntoWriter w;
+    Py_ssize_t out = -1;
+    if (PyObject_GetBuffer(buf, &view, PyBUF_WRITABLE) != 0) {
+        if (PyErr_ExceptionMatches(PyExc_BufferError)) {
+            PyErr_Clear();
+            PyErr_Format(PyExc_TypeError, "dumps_into needs a writable C-contiguous buffer, got %.200s", Py_TYPE(buf)->tp_name);
+        }
+        return -1;
     }
-    PyMem_Free(thiz);
+    if ((offset < 0) || (offset > view.len)) {
+        PyErr_Format(PyExc_ValueError, "offset %zd is outside of the buffer of %zd bytes", offset, view.len);
+        PyBuffer_Release(&view);
+        return -1;
+    }
+    w.out = (uint8_t*)view.buf + offset;
+    w.pos = 0;
+    w.len = view.len - offset;
+    w.grow = IntoWriter_grow;
+    w.dropped = 0;
+    w.discard = NULL;
+    w.discard_len = 0;
+    if (dumps_top(optp, ob, (Writer*)&w) == 0) {
+        if (w.discard != NULL) {
+            raise_buffer_too_small(w.dropped + w.pos, view.len - offset);
+        } else {
+            out = w.pos;
+        }
+    }
+    PyMem_Free(w.discard);
+    PyBuffer_Release(&view);
+    return out;
 }
-static Reader* NewFileReader(PyObject* ob) {
-    FileReader* fr = (FileReader*)PyMem_Malloc(sizeof(FileReader));
-    if (fr == NULL) {
-        PyErr_SetString(PyExc_MemoryError, "failed to allocate FileReader");
+
+static PyObject*
+cbor_dumps_into(PyObject* module, PyObject* args, PyObject* kwargs) {
+    PyObject* ob;
+    PyObject* buf;
+    Py_ssize_t offset = 0;
+    Py_ssize_t written;
+    EncodeOptions opts = {0};
+    EncodeOptions *optp = &opts;
+    optp->state = cbor_state(module);
+    if (!PyArg_ParseTuple(args, "OO|n:dumps_into", &ob, &buf, &offset)) {
         return NULL;
     }
-    fr->fin = PyFile_AsFile(ob);
-    if (fr->fin == NULL) {
-        PyErr_SetString(PyExc_RuntimeError, "PyFile_AsFile NULL");
-        PyMem_Free(fr);
+    if (kwargs != NULL) {
+        PyObject* offset_ob = PyDict_GetItemString(kwargs, "offset");  // Borrowed ref
+        if (offset_ob != NULL) {
+            offset = PyNumber_AsSsize_t(offset_ob, PyExc_OverflowError);
+            if ((offset == -1) && PyErr_Occurred()) {
+                return NULL;
+            }
+        }
+    }
+    if (!_dumps_kwargs(optp, kwargs)) {
         return NULL;
     }
-    fr->dst = NULL;
-    fr->dst_size = 0;
-    fr->read_count = 0;
-    SET_READER_FUNCTIONS(fr, FileReader);
-    return (Reader*)fr;
+    written = dumps_into_buffer(optp, ob, buf, offset);
+    EncodeOptions_clear(optp);
+    if (written < 0) {
+        return NULL;
+    }
+    return PyLong_FromSsize_t(written);
 }
 
-#endif /* Python 2.7 FileReader */
-
-
-typedef struct _ObjectReader {
-    READER_FUNCTIONS;
+static PyObject*
+cbor_dump(PyObject* module, PyObject* args, PyObject *kwargs) {
+    // args should be (obj, fp)
     PyObject* ob;
+    PyObject* fp;
+    EncodeOptions opts = {0};
+    EncodeOptions *optp = &opts;
+    optp->state = cbor_state(module);
+    if (PyType_IsSubtype(Py_TYPE(args), &PyList_Type)) {
+	ob = PyList_GetItem(args, 0);
+	fp = PyList_GetItem(args, 1);
+    } else if (PyType_IsSubtype(Py_TYPE(args), &PyTuple_Type)) {
+	ob = PyTuple_GetItem(args, 0);
+	fp = PyTuple_GetItem(args, 1);
+    } else {
+	PyErr_Format(PyExc_ValueError, "args not list or tuple: %R\n", args);
+	return NULL;
+    }
+    if ((ob == NULL) || (fp == NULL)) {
+        return NULL;
+    }
 
-    // We got one object with all the bytes neccessary, and need to
-    // DECREF it later.
-    PyObject* retval;
-    void* bytes;
-
-    // OR, we got several objects, we DECREFed them as we went, and
-    // need to Free() this buffer at the end.
-    void* dst;
+    if (!_dumps_kwargs(optp, kwargs)) {
+        return NULL;
+    }
 
-    Py_ssize_t read_count;
-    int exception_is_external;
-} ObjectReader;
+    {
+	ObjectWriter w;
+	int err;
+	PyObject* buffer_size = NULL;
+	Py_ssize_t max_len = DUMP_BUFFER_SIZE;
 
-// read from a python file-like object which has a .read(n) method
-static void* ObjectReader_read(void* context, Py_ssize_t len) {
-    ObjectReader* thiz = (ObjectReader*)context;
-    Py_ssize_t rtotal = 0;
-    uintptr_t opos = 0;
-    //logprintf("ob read %d\n", len);
-    assert(!thiz->dst);
-    assert(!thiz->bytes);
-    while (rtotal < len) {
-	PyObject* retval = PyObject_CallMethod(thiz->ob, "read", "n", len - rtotal, NULL);
-	Py_ssize_t rlen;
-	if (retval == NULL) {
-	    thiz->exception_is_external = 1;
-            logprintf("exception in object.read()\n");
-	    return NULL;
+	if (kwargs != NULL) {
+	    buffer_size = PyDict_GetItemString(kwargs, "buffer_size");  // Borrowed ref
 	}
-	if (!PyBytes_Check(retval)) {
-            logprintf("object.read() is not bytes\n");
-	    PyErr_SetString(PyExc_ValueError, "expected ob.read() to return a bytes object\n");
-            Py_DECREF(retval);
-	    return NULL;
+	if ((buffer_size != NULL) && (buffer_size != Py_None)) {
+	    max_len = PyNumber_AsSsize_t(buffer_size, PyExc_OverflowError);
+	    if ((max_len == -1) && PyErr_Occurred()) {
+		return NULL;
+	    }
+	    if (max_len <= 0) {
+		PyErr_Format(PyExc_ValueError, "buffer_size must be positive, got %zd", max_len);
+		return NULL;
+	    }
 	}
-	rlen = PyBytes_Size(retval);
-	thiz->read_count += rlen;
-	if (rlen > len - rtotal) {
-            logprintf("object.read() is too much!\n");
-            PyErr_Format(PyExc_ValueError, "ob.read() returned %ld bytes but only wanted %lu\n", rlen, len - rtotal);
-            Py_DECREF(retval);
-            return NULL;
+
+	if (ObjectWriter_init(&w, fp, max_len)) {
+	    return NULL;
 	}
-	if (rlen == len) {
-	    // best case! All in one call to read()
-	    // We _keep_ a reference to retval until later.
-	    thiz->retval = retval;
-	    thiz->bytes = PyBytes_AsString(retval);
-	    assert(thiz->bytes);
-	    thiz->dst = NULL;
-	    opos = 0;
-	    return thiz->bytes;
+	err = dumps_top(optp, ob, (Writer*)&w);
+	if (err == 0) {
+	    err = ObjectWriter_flush(&w);
 	}
-	if (thiz->dst == NULL) {
-	    thiz->dst = PyMem_Malloc(len);
-	    opos = (uintptr_t)thiz->dst;
+	ObjectWriter_clear(&w);
+	EncodeOptions_clear(optp);
+	if (err != 0) {
+	    return NULL;
 	}
-	// else, not enough all in one go
-	memcpy((void*)opos, PyBytes_AsString(retval), rlen);
-	Py_DECREF(retval);
-	opos += rlen;
-	rtotal += rlen;
     }
-    assert(thiz->dst);
-    return thiz->dst;
+
+    Py_RETURN_NONE;
 }
-static int ObjectReader_read1(void* self, uint8_t* oneByte) {
-    ObjectReader* thiz = (ObjectReader*)self;
-    PyObject* retval = PyObject_CallMethod(thiz->ob, "read", "i", 1, NULL);
-    Py_ssize_t rlen;
-    if (retval == NULL) {
-	thiz->exception_is_external = 1;
-	//logprintf("call ob read(1) failed\n");
-	return -1;
+
+
+// Encoder and Decoder: dumps() and loads() with their options parsed once,
+// for programs that encode and decode lots of small messages. Besides the
+// options they keep what dumps() and loads() would set up on every call:
+// the class_tags and default type caches, the map key cache, the reader,
+// and the Encoder's output buffer.
+
+// Encoder.encode() writes into a scratch buffer kept between calls and
+// copies the result into a bytes object of exactly the right size, one
+// allocation per call instead of allocating and resizing as it goes.
+#define ENCODER_SCRATCH_INITIAL_SIZE 256
+// bigger than this the scratch buffer is freed after the call
+#define ENCODER_SCRATCH_KEEP_SIZE (1024 * 1024)
+
+typedef struct _ScratchWriter {
+    WRITER_FUNCTIONS;
+} ScratchWriter;
+
+static int ScratchWriter_grow(void* self, Py_ssize_t need) {
+    ScratchWriter* thiz = (ScratchWriter*)self;
+    Py_ssize_t nlen = (thiz->len > 0) ? thiz->len * 2 : ENCODER_SCRATCH_INITIAL_SIZE;
+    uint8_t* nout;
+    if (nlen - thiz->pos < need) {
+        if (need > PY_SSIZE_T_MAX - thiz->pos) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        nlen = thiz->pos + need;
     }
-    if (!PyBytes_Check(retval)) {
-	PyErr_SetString(PyExc_ValueError, "expected ob.read() to return a bytes object\n");
-	return -1;
+    nout = (uint8_t*)PyMem_Realloc(thiz->out, nlen);
+    if (nout == NULL) {
+        PyErr_NoMemory();
+        return -1;
     }
-    rlen = PyBytes_Size(retval);
-    thiz->read_count += rlen;
-    if (rlen > 1) {
-	PyErr_Format(PyExc_ValueError, "TODO: raise exception: WAT ob.read() returned %ld bytes but only wanted 1\n", rlen);
-	return -1;
+    thiz->out = nout;
+    thiz->len = nlen;
+    return 0;
+}
+
+static void ScratchWriter_clear(ScratchWriter* thiz) {
+    PyMem_Free(thiz->out);
+    thiz->out = NULL;
+    thiz->pos = 0;
+    thiz->len = 0;
+}
+
+// New reference to the cbor._cbor module an object of type (one of the
+// types here, or a subclass) belongs to, which holds its state.
+static PyObject* own_module(PyTypeObject* type) {
+#if CBOR_HEAP_TYPES
+#if PY_VERSION_HEX >= 0x030B0000
+    PyObject* m = PyType_GetModuleByDef(type, &cbor_moduledef);  // Borrowed ref
+#else
+    // what PyType_GetModuleByDef() does from 3.11
+    PyObject* m = NULL;
+    PyObject* mro = type->tp_mro;
+    Py_ssize_t i;
+    for (i = 0; (mro != NULL) && (i < PyTuple_GET_SIZE(mro)); i++) {
+        PyTypeObject* base = (PyTypeObject*)PyTuple_GET_ITEM(mro, i);
+        if (PyType_HasFeature(base, Py_TPFLAGS_HEAPTYPE)) {
+            PyObject* bm = PyType_GetModule(base);  // Borrowed ref
+            if ((bm != NULL) && (PyModule_GetDef(bm) == &cbor_moduledef)) {
+                m = bm;
+                break;
+            }
+            PyErr_Clear();
+        }
     }
-    if (rlen == 1) {
-	*oneByte = PyBytes_AsString(retval)[0];
-	Py_DECREF(retval);
-	return 0;
+    if (m == NULL) {
+        PyErr_Format(PyExc_TypeError, "%s is not a cbor._cbor type", type->tp_name);
+    }
+#endif
+    Py_XINCREF(m);
+    return m;
+#elif IS_PY3
+    PyObject* m = PyState_FindModule(&cbor_moduledef);  // Borrowed ref
+    if (m == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "cbor._cbor is not loaded in this interpreter");
+        return NULL;
     }
-    PyErr_SetString(PyExc_ValueError, "got nothing reading 1");
-    return -1;
+    Py_INCREF(m);
+    return m;
+#else
+    Py_RETURN_NONE;
+#endif
 }
-static void ObjectReader_return_buffer(void* context, void* buffer) {
-    ObjectReader* thiz = (ObjectReader*)context;
-    if (buffer == thiz->bytes) {
-	Py_DECREF(thiz->retval);
-	thiz->retval = NULL;
-	thiz->bytes = NULL;
-    } else if (buffer == thiz->dst) {
-	PyMem_Free(thiz->dst);
-	thiz->dst = NULL;
+
+// Free an object of one of the types here. A heap type is kept alive by
+// its objects, so the last one to go lets go of it.
+static void cbor_object_free(PyObject* ob) {
+    PyTypeObject* type = Py_TYPE(ob);
+    type->tp_free(ob);
+#if CBOR_HEAP_TYPES
+    Py_DECREF(type);
+#endif
+}
+
+// Py_VISIT() the type of ob if it is a heap type, as tp_traverse must.
+#if CBOR_HEAP_TYPES
+#define VISIT_HEAP_TYPE(ob) Py_VISIT(Py_TYPE(ob))
+#else
+#define VISIT_HEAP_TYPE(ob)
+#endif
+
+// The objects here let one call at a time use their buffers and caches. A
+// call that finds one busy, because a hook called back in or because
+// another thread has it, takes a slower way or raises. In free-threaded
+// builds the flag is only touched in the object's critical section, so two
+// threads can't both get it. Return 1 if the caller got it.
+static int claim_busy(PyObject* owner, int* busyp) {
+    int was;
+    Py_BEGIN_CRITICAL_SECTION(owner);
+    was = *busyp;
+    *busyp = 1;
+    Py_END_CRITICAL_SECTION();
+    return !was;
+}
+
+static void release_busy(PyObject* owner, int* busyp) {
+    Py_BEGIN_CRITICAL_SECTION(owner);
+    *busyp = 0;
+    Py_END_CRITICAL_SECTION();
+}
+
+// The settings of src, none of its caches, for a call that can't use them.
+static void EncodeOptions_copy_settings(EncodeOptions* dst, const EncodeOptions* src) {
+    memset(dst, 0, sizeof(EncodeOptions));
+    dst->state = src->state;
+    dst->sort_keys = src->sort_keys;
+    dst->float_mode = src->float_mode;
+    dst->semantic_tags = src->semantic_tags;
+    dst->class_tags = src->class_tags;
+    dst->default_fn = src->default_fn;
+    dst->canonical = src->canonical;
+    dst->string_referencing = src->string_referencing;
+}
+
+typedef struct {
+    PyObject_HEAD
+    EncodeOptions opts;
+    // copy of the keyword arguments, owns what opts borrows from them
+    PyObject* kwargs;
+    PyObject* module;  // owns opts.state
+    ScratchWriter scratch;
+    // in encode() or encode_into(), which a default function or another
+    // thread can call too
+    int busy;
+} Encoder;
+
+static PyTypeObject EncoderType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+};
+
+static int Encoder_init(Encoder* thiz, PyObject* args, PyObject* kwargs) {
+    EncodeOptions opts;
+    PyObject* kwcopy;
+    if (PyTuple_GET_SIZE(args) != 0) {
+        PyErr_SetString(PyExc_TypeError, "Encoder() takes only keyword arguments");
+        return -1;
+    }
+    if (!claim_busy((PyObject*)thiz, &(thiz->busy))) {
+        PyErr_SetString(PyExc_RuntimeError, "Encoder.__init__() called while it is encoding");
+        return -1;
+    }
+    memset(&opts, 0, sizeof(EncodeOptions));
+    kwcopy = (kwargs != NULL) ? PyDict_Copy(kwargs) : PyDict_New();
+    if (kwcopy == NULL) {
+        release_busy((PyObject*)thiz, &(thiz->busy));
+        return -1;
+    }
+    opts.state = cbor_state(thiz->module);
+    if (!_dumps_kwargs(&opts, kwcopy)) {
+        Py_DECREF(kwcopy);
+        release_busy((PyObject*)thiz, &(thiz->busy));
+        return -1;
+    }
+    // Swap the new options in all at once, as a call that finds the Encoder
+    // busy copies them (see Encoder_copy_settings()), and let go of the old
+    // ones after.
+    {
+        EncodeOptions old_opts;
+        PyObject* old_kwargs;
+        Py_BEGIN_CRITICAL_SECTION(thiz);
+        old_opts = thiz->opts;
+        old_kwargs = thiz->kwargs;
+        thiz->opts = opts;
+        thiz->kwargs = kwcopy;
+        Py_END_CRITICAL_SECTION();
+        EncodeOptions_clear(&old_opts);
+        Py_XDECREF(old_kwargs);
+    }
+    release_busy((PyObject*)thiz, &(thiz->busy));
+    return 0;
+}
+
+// For a call that finds thiz busy: copy its settings to opts, and return a
+// new reference to the keyword arguments they borrow from, to hold until
+// the call is done, so that __init__() in another thread can't free them
+// meanwhile. The caller EncodeOptions_clear()s opts and Py_XDECREF()s that.
+static PyObject* Encoder_copy_settings(Encoder* thiz, EncodeOptions* opts) {
+    PyObject* kwargs;
+    Py_BEGIN_CRITICAL_SECTION(thiz);
+    EncodeOptions_copy_settings(opts, &(thiz->opts));
+    kwargs = thiz->kwargs;
+    Py_XINCREF(kwargs);
+    Py_END_CRITICAL_SECTION();
+    return kwargs;
+}
+
+// Set up what encode() needs, so an Encoder whose __init__() was skipped
+// works with the default options.
+static PyObject* Encoder_new(PyTypeObject* type, PyObject* args, PyObject* kwargs) {
+    Encoder* thiz = (Encoder*)PyType_GenericNew(type, args, kwargs);
+    if (thiz == NULL) {
+        return NULL;
+    }
+    thiz->scratch.grow = ScratchWriter_grow;
+    thiz->module = own_module(type);
+    if (thiz->module == NULL) {
+        Py_DECREF(thiz);
+        return NULL;
+    }
+    thiz->opts.state = cbor_state(thiz->module);
+    return (PyObject*)thiz;
+}
+
+static PyObject* Encoder_encode(Encoder* thiz, PyObject* ob) {
+    PyObject* out;
+    if (!claim_busy((PyObject*)thiz, &(thiz->busy))) {
+        EncodeOptions opts;
+        PyObject* kwargs = Encoder_copy_settings(thiz, &opts);
+        out = dumps_to_bytes(&opts, ob);
+        EncodeOptions_clear(&opts);
+        Py_XDECREF(kwargs);
+        return out;
+    }
+    thiz->scratch.pos = 0;
+    if (dumps_top(&(thiz->opts), ob, (Writer*)&(thiz->scratch)) != 0) {
+        out = NULL;
     } else {
-	logprintf("TODO: raise exception, could not release buffer %p, wanted dst=%p or bytes=%p\n", buffer, thiz->dst, thiz->bytes);
+        out = PyBytes_FromStringAndSize((const char*)thiz->scratch.out, thiz->scratch.pos);
+    }
+    if (thiz->scratch.len > ENCODER_SCRATCH_KEEP_SIZE) {
+        ScratchWriter_clear(&(thiz->scratch));
     }
+    release_busy((PyObject*)thiz, &(thiz->busy));
+    return out;
 }
-static void ObjectReader_delete(void* context) {
-    ObjectReader* thiz = (ObjectReader*)context;
-    if (thiz->retval != NULL) {
-	Py_DECREF(thiz->retval);
+
+static PyObject* encode_into_args(Encoder* thiz, PyObject* const* args, Py_ssize_t nargs) {
+    Py_ssize_t offset = 0;
+    Py_ssize_t written;
+    if ((nargs < 2) || (nargs > 3)) {
+        PyErr_Format(PyExc_TypeError, "encode_into() takes 2 or 3 arguments (%zd given)", nargs);
+        return NULL;
     }
-    if (thiz->dst != NULL) {
-	PyMem_Free(thiz->dst);
+    if (nargs == 3) {
+        offset = PyNumber_AsSsize_t(args[2], PyExc_OverflowError);
+        if ((offset == -1) && PyErr_Occurred()) {
+            return NULL;
+        }
     }
-    PyMem_Free(thiz);
+    if (claim_busy((PyObject*)thiz, &(thiz->busy))) {
+        written = dumps_into_buffer(&(thiz->opts), args[0], args[1], offset);
+        release_busy((PyObject*)thiz, &(thiz->busy));
+    } else {
+        EncodeOptions opts;
+        PyObject* kwargs = Encoder_copy_settings(thiz, &opts);
+        written = dumps_into_buffer(&opts, args[0], args[1], offset);
+        EncodeOptions_clear(&opts);
+        Py_XDECREF(kwargs);
+    }
+    if (written < 0) {
+        return NULL;
+    }
+    return PyLong_FromSsize_t(written);
 }
-static Reader* NewObjectReader(PyObject* ob) {
-    ObjectReader* r = (ObjectReader*)PyMem_Malloc(sizeof(ObjectReader));
-    r->ob = ob;
-    r->retval = NULL;
-    r->bytes = NULL;
-    r->dst = NULL;
-    r->read_count = 0;
-    r->exception_is_external = 0;
-    SET_READER_FUNCTIONS(r, ObjectReader);
-    return (Reader*)r;
+
+#if PY_VERSION_HEX >= 0x03070000
+#define ENCODE_INTO_FLAGS METH_FASTCALL
+static PyObject* Encoder_encode_into(Encoder* thiz, PyObject* const* args, Py_ssize_t nargs) {
+    return encode_into_args(thiz, args, nargs);
+}
+#else
+#define ENCODE_INTO_FLAGS METH_VARARGS
+static PyObject* Encoder_encode_into(Encoder* thiz, PyObject* args) {
+    return encode_into_args(thiz, &PyTuple_GET_ITEM(args, 0), PyTuple_GET_SIZE(args));
+}
+#endif
+
+static int Encoder_traverse(Encoder* thiz, visitproc visit, void* arg) {
+    VISIT_HEAP_TYPE(thiz);
+    Py_VISIT(thiz->kwargs);
+    Py_VISIT(thiz->module);
+    Py_VISIT(thiz->opts.class_tag_cache);
+    return 0;
 }
 
-typedef struct _BufferReader {
-    READER_FUNCTIONS;
-    uint8_t* raw;
-    Py_ssize_t len;
-    uintptr_t pos;
-} BufferReader;
+static int Encoder_clear(Encoder* thiz) {
+    EncodeOptions_clear(&(thiz->opts));
+    Py_CLEAR(thiz->kwargs);
+    Py_CLEAR(thiz->module);
+    return 0;
+}
 
-// read from a buffer, aka loads()
-static void* BufferReader_read(void* context, Py_ssize_t len) {
-    BufferReader* thiz = (BufferReader*)context;
-    //logprintf("br %p %d (%d)\n", thiz, len, thiz->len);
-    if (len <= thiz->len) {
-	void* out = (void*)thiz->pos;
-	thiz->pos += len;
-	thiz->len -= len;
-	assert(out);
-	return out;
-    }
-    PyErr_Format(PyExc_ValueError, "buffer read for %zd but only have %zd\n", len, thiz->len);
-    return NULL;
+static void Encoder_dealloc(Encoder* thiz) {
+    PyObject_GC_UnTrack(thiz);
+    Encoder_clear(thiz);
+    ScratchWriter_clear(&(thiz->scratch));
+    cbor_object_free((PyObject*)thiz);
 }
-static int BufferReader_read1(void* self, uint8_t* oneByte) {
-    BufferReader* thiz = (BufferReader*)self;
-    //logprintf("br %p _1_ (%d)\n", thiz, thiz->len);
-    if (thiz->len <= 0) {
-	PyErr_SetString(PyExc_LookupError, "buffer exhausted");
-	return -1;
+
+static PyMethodDef Encoder_methods[] = {
+    {"encode", (PyCFunction)Encoder_encode, METH_O,
+     "encode(obj)\nSerialize obj to bytes, as dumps(obj, **options) would.\n"},
+    {"encode_into", (PyCFunction)(void(*)(void))Encoder_encode_into, ENCODE_INTO_FLAGS,
+     "encode_into(obj, buf, offset=0)\nSerialize obj into buf at offset, as dumps_into(obj, buf, offset, **options)\n"
+     "would, and return the number of bytes written.\n"},
+    {NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+// Fill in EncoderType, for add_type()
+static void Encoder_init_type(void) {
+    EncoderType.tp_name = "cbor._cbor.Encoder";
+    EncoderType.tp_basicsize = sizeof(Encoder);
+    EncoderType.tp_dealloc = (destructor)Encoder_dealloc;
+    EncoderType.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC;
+    EncoderType.tp_doc =
+        "Encoder(**options)\n"
+        "dumps() with its options (sort_keys, float_mode, class_tags, default, semantic_tags,\n"
+        "string_referencing, canonical) parsed once. Keeps its caches and output buffer\n"
+        "between encode() calls. Threads can share one, but a call made while another\n"
+        "is running goes without them.";
+    EncoderType.tp_traverse = (traverseproc)Encoder_traverse;
+    EncoderType.tp_clear = (inquiry)Encoder_clear;
+    EncoderType.tp_methods = Encoder_methods;
+    EncoderType.tp_init = (initproc)Encoder_init;
+    EncoderType.tp_new = Encoder_new;
+}
+
+typedef struct {
+    PyObject_HEAD
+    DecodeOptions opts;
+    PyObject* module;  // owns opts.state
+    int bytes_as_memoryview;
+    BufferReader reader;
+    // in decode(), which a hook or another thread can call too
+    int busy;
+} Decoder;
+
+static PyTypeObject DecoderType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+};
+
+// Set up optp, which may hold options from before, from the loads() keyword
+// arguments of a Decoder or StreamDecoder of module. Return 0 on success.
+static int decoder_options_init(DecodeOptions *optp, PyObject* module, PyObject* kwargs, int* bytes_as_memoryviewp) {
+    Py_ssize_t key_cache_size = KEY_CACHE_DEFAULT_SIZE;
+    DecodeOptions_clear(optp);
+    memset(optp, 0, sizeof(DecodeOptions));
+    *bytes_as_memoryviewp = 0;
+    optp->state = cbor_state(module);
+    if (kwargs != NULL) {
+        PyObject* bam = PyDict_GetItemString(kwargs, "bytes_as_memoryview");  // Borrowed ref
+        if (bam != NULL) {
+            *bytes_as_memoryviewp = PyObject_IsTrue(bam);
+            if (*bytes_as_memoryviewp < 0) {
+                return -1;
+            }
+        }
     }
-    *oneByte = *((uint8_t*)thiz->pos);
-    thiz->pos += 1;
-    thiz->len -= 1;
+    if (key_cache_size_kwarg(kwargs, &key_cache_size)) {
+        return -1;
+    }
+    if (tag_decoders_kwarg(optp, kwargs) || decode_hooks_kwarg(optp, kwargs) ||
+        semantic_tags_kwarg(kwargs, &(optp->semantic_tags))) {
+        return -1;
+    }
+    // one cache for everything this decoder decodes
+    KeyCache_init(&(optp->key_cache), key_cache_size);
     return 0;
 }
-static void BufferReader_return_buffer(void* context, void* buffer) {
-    // nothing to do
-}
-static void BufferReader_delete(void* context) {
-    BufferReader* thiz = (BufferReader*)context;
-    PyMem_Free(thiz);
-}
-static Reader* NewBufferReader(PyObject* ob) {
-    BufferReader* r = (BufferReader*)PyMem_Malloc(sizeof(BufferReader));
-    SET_READER_FUNCTIONS(r, BufferReader);
-    if (PyByteArray_Check(ob)) {
-        r->raw = (uint8_t*)PyByteArray_AsString(ob);
-        r->len = PyByteArray_Size(ob);
-    } else if (PyBytes_Check(ob)) {
-        r->raw = (uint8_t*)PyBytes_AsString(ob);
-        r->len = PyBytes_Size(ob);
-    } else {
-        PyErr_SetString(PyExc_ValueError, "input of unknown type not bytes or bytearray");
+
+static PyObject* Decoder_new(PyTypeObject* type, PyObject* args, PyObject* kwargs) {
+    Decoder* thiz = (Decoder*)PyType_GenericNew(type, args, kwargs);
+    if (thiz == NULL) {
         return NULL;
     }
-    r->pos = (uintptr_t)r->raw;
-    if (r->len == 0) {
-	PyErr_SetString(PyExc_ValueError, "got zero length string in loads");
-	return NULL;
-    }
-    if (r->raw == NULL) {
-	PyErr_SetString(PyExc_ValueError, "got NULL buffer for string");
-	return NULL;
+    thiz->module = own_module(type);
+    if (thiz->module == NULL) {
+        Py_DECREF(thiz);
+        return NULL;
     }
-    //logprintf("NBR(%llu, %ld)\n", r->pos, r->len);
-    return (Reader*)r;
+    thiz->opts.state = cbor_state(thiz->module);
+    return (PyObject*)thiz;
 }
 
-
-static PyObject*
-cbor_load(PyObject* noself, PyObject* args) {
-    PyObject* ob;
-    Reader* reader;
-    is_big_endian();
-    if (PyType_IsSubtype(Py_TYPE(args), &PyList_Type)) {
-	ob = PyList_GetItem(args, 0);
-    } else if (PyType_IsSubtype(Py_TYPE(args), &PyTuple_Type)) {
-	ob = PyTuple_GetItem(args, 0);
+static int Decoder_init(Decoder* thiz, PyObject* args, PyObject* kwargs) {
+    DecodeOptions opts;
+    int bytes_as_memoryview;
+    int err;
+    if (PyTuple_GET_SIZE(args) != 0) {
+        PyErr_SetString(PyExc_TypeError, "Decoder() takes only keyword arguments");
+        return -1;
+    }
+    if (!claim_busy((PyObject*)thiz, &(thiz->busy))) {
+        PyErr_SetString(PyExc_RuntimeError, "Decoder.__init__() called while it is decoding");
+        return -1;
+    }
+    memset(&opts, 0, sizeof(DecodeOptions));
+    err = decoder_options_init(&opts, thiz->module, kwargs, &bytes_as_memoryview);
+    if (err) {
+        DecodeOptions_clear(&opts);
     } else {
-	PyErr_Format(PyExc_ValueError, "args not list or tuple: %R\n", args);
-	return NULL;
+        // swapped in all at once, as for Encoder_init()
+        DecodeOptions old_opts;
+        Py_BEGIN_CRITICAL_SECTION(thiz);
+        old_opts = thiz->opts;
+        thiz->opts = opts;
+        thiz->bytes_as_memoryview = bytes_as_memoryview;
+        Py_END_CRITICAL_SECTION();
+        DecodeOptions_clear(&old_opts);
+    }
+    release_busy((PyObject*)thiz, &(thiz->busy));
+    return err;
+}
+
+// loads() of data with optp and a BufferReader to set up at br
+static PyObject* decode_buffer(DecodeOptions *optp, BufferReader* br, PyObject* data, int bytes_as_memoryview) {
+    PyObject* out = NULL;
+    if (BufferReader_init(br, data)) {
+        return NULL;
     }
+    if (!bytes_as_memoryview || !setup_bytes_base(optp, data, (Reader*)br)) {
+        optp->buffer_reader = br;
+        out = buffer_loads(optp, br);
+        optp->buffer_reader = NULL;
+    }
+    Py_CLEAR(optp->bytes_base);
+    PyBuffer_Release(&(br->view));
+    return out;
+}
 
-    if (ob == Py_None) {
+static PyObject* Decoder_decode(Decoder* thiz, PyObject* data) {
+    PyObject* out;
+    if (data == Py_None) {
 	PyErr_SetString(PyExc_ValueError, "got None for buffer to decode in loads");
 	return NULL;
     }
-    PyObject* retval;
-#if HAS_FILE_READER
-    if (PyFile_Check(ob)) {
-	reader = NewFileReader(ob);
-        if (reader == NULL) { return NULL; }
-	retval = inner_loads(reader);
-        if ((retval == NULL) &&
-            (((FileReader*)reader)->read_count == 0) &&
-            (feof(((FileReader*)reader)->fin) != 0)) {
-	    // never got anything, started at EOF
-	    PyErr_Clear();
-	    PyErr_SetString(PyExc_EOFError, "read nothing, apparent EOF");
-        }
-        reader->delete(reader);
-    } else
-#endif
-    {
-	reader = NewObjectReader(ob);
-	retval = inner_loads(reader);
-	if ((retval == NULL) &&
-	    (!((ObjectReader*)reader)->exception_is_external) &&
-	    ((ObjectReader*)reader)->read_count == 0) {
-	    // never got anything, assume EOF
-	    PyErr_Clear();
-	    PyErr_SetString(PyExc_EOFError, "read nothing, apparent EOF");
-	}
-        reader->delete(reader);
+    if (!claim_busy((PyObject*)thiz, &(thiz->busy))) {
+        // the same options, with a reader and no key cache of its own, and
+        // references to the hooks so __init__() in another thread can't
+        // free them meanwhile
+        DecodeOptions opts;
+        BufferReader br;
+        int bytes_as_memoryview;
+        memset(&opts, 0, sizeof(DecodeOptions));
+        Py_BEGIN_CRITICAL_SECTION(thiz);
+        opts.state = thiz->opts.state;
+        opts.tag_decoders = thiz->opts.tag_decoders;
+        Py_XINCREF(opts.tag_decoders);
+        opts.raise_on_unknown_tag = thiz->opts.raise_on_unknown_tag;
+        opts.tag_hook = thiz->opts.tag_hook;
+        Py_XINCREF(opts.tag_hook);
+        opts.object_hook = thiz->opts.object_hook;
+        Py_XINCREF(opts.object_hook);
+        opts.semantic_tags = thiz->opts.semantic_tags;
+        bytes_as_memoryview = thiz->bytes_as_memoryview;
+        Py_END_CRITICAL_SECTION();
+        KeyCache_init(&(opts.key_cache), 0);
+        out = decode_buffer(&opts, &br, data, bytes_as_memoryview);
+        DecodeOptions_clear(&opts);
+        return out;
     }
-    return retval;
+    out = decode_buffer(&(thiz->opts), &(thiz->reader), data, thiz->bytes_as_memoryview);
+    release_busy((PyObject*)thiz, &(thiz->busy));
+    return out;
 }
 
+static int Decoder_traverse(Decoder* thiz, visitproc visit, void* arg) {
+    VISIT_HEAP_TYPE(thiz);
+    Py_VISIT(thiz->module);
+    Py_VISIT(thiz->opts.tag_decoders);
+    Py_VISIT(thiz->opts.tag_hook);
+    Py_VISIT(thiz->opts.object_hook);
+    return 0;
+}
 
-static void tag_u64_out(uint8_t cbor_type, uint64_t aux, uint8_t* out, uintptr_t* posp) {
-    uintptr_t pos = *posp;
-    if (out != NULL) {
-	out[pos] = cbor_type | CBOR_UINT64_FOLLOWS;
-	out[pos+1] = (aux >> 56) & 0x0ff;
-	out[pos+2] = (aux >> 48) & 0x0ff;
-	out[pos+3] = (aux >> 40) & 0x0ff;
-	out[pos+4] = (aux >> 32) & 0x0ff;
-	out[pos+5] = (aux >> 24) & 0x0ff;
-	out[pos+6] = (aux >> 16) & 0x0ff;
-	out[pos+7] = (aux >>  8) & 0x0ff;
-	out[pos+8] = aux & 0x0ff;
-    }
-    pos += 9;
-    *posp = pos;
+static int Decoder_clear(Decoder* thiz) {
+    DecodeOptions_clear(&(thiz->opts));
+    Py_CLEAR(thiz->module);
+    return 0;
 }
 
+static void Decoder_dealloc(Decoder* thiz) {
+    PyObject_GC_UnTrack(thiz);
+    Decoder_clear(thiz);
+    cbor_object_free((PyObject*)thiz);
+}
 
-static void tag_aux_out(uint8_t cbor_type, uint64_t aux, uint8_t* out, uintptr_t* posp) {
-    uintptr_t pos = *posp;
-    if (aux <= 23) {
-	// tiny literal
-	if (out != NULL) {
-	    out[pos] = cbor_type | aux;
-	}
-	pos += 1;
-    } else if (aux <= 0x0ff) {
-	// one byte value
-	if (out != NULL) {
-	    out[pos] = cbor_type | CBOR_UINT8_FOLLOWS;
-	    out[pos+1] = aux;
-	}
-	pos += 2;
-    } else if (aux <= 0x0ffff) {
-	// two byte value
-	if (out != NULL) {
-	    out[pos] = cbor_type | CBOR_UINT16_FOLLOWS;
-	    out[pos+1] = (aux >> 8) & 0x0ff;
-	    out[pos+2] = aux & 0x0ff;
-	}
-	pos += 3;
-    } else if (aux <= 0x0ffffffffL) {
-	// four byte value
-	if (out != NULL) {
-	    out[pos] = cbor_type | CBOR_UINT32_FOLLOWS;
-	    out[pos+1] = (aux >> 24) & 0x0ff;
-	    out[pos+2] = (aux >> 16) & 0x0ff;
-	    out[pos+3] = (aux >>  8) & 0x0ff;
-	    out[pos+4] = aux & 0x0ff;
-	}
-	pos += 5;
-    } else {
-	// eight byte value
-	tag_u64_out(cbor_type, aux, out, posp);
-	return;
-    }
-    *posp = pos;
-    return;
+static PyMethodDef Decoder_methods[] = {
+    {"decode", (PyCFunction)Decoder_decode, METH_O,
+     "decode(data)\nParse cbor from data buffer to objects, as loads(data, **options) would.\n"},
+    {NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+// Fill in DecoderType, for add_type()
+static void Decoder_init_type(void) {
+    DecoderType.tp_name = "cbor._cbor.Decoder";
+    DecoderType.tp_basicsize = sizeof(Decoder);
+    DecoderType.tp_dealloc = (destructor)Decoder_dealloc;
+    DecoderType.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC;
+    DecoderType.tp_doc =
+        "Decoder(**options)\n"
+        "loads() with its options (bytes_as_memoryview, key_cache_size, class_tags,\n"
+        "raise_on_unknown_tag, tag_hook, object_hook, semantic_tags) parsed once. The map key\n"
+        "cache is kept between decode() calls. Threads can share one, but a call made while\n"
+        "another is running goes without it.";
+    DecoderType.tp_traverse = (traverseproc)Decoder_traverse;
+    DecoderType.tp_clear = (inquiry)Decoder_clear;
+    DecoderType.tp_methods = Decoder_methods;
+    DecoderType.tp_init = (initproc)Decoder_init;
+    DecoderType.tp_new = Decoder_new;
 }
 
-static int inner_dumps(EncodeOptions *optp, PyObject* ob, uint8_t* out, uintptr_t* posp);
 
-static int dumps_dict(EncodeOptions *optp, PyObject* ob, uint8_t* out, uintptr_t* posp) {
-    uintptr_t pos = *posp;
-    Py_ssize_t dictlen = PyDict_Size(ob);
-    PyObject* key;
-    PyObject* val;
-    int err;
+// Iterate over a CBOR Sequence (RFC 8742), concatenated CBOR items,
+// decoding one item per next() from one Reader that lives as long as the
+// iterator. Returned by iter_load() and loads_seq().
+typedef struct {
+    PyObject_HEAD
+    PyObject* source;  // the file-like or buffer being read
+    Reader* reader;
+    int is_buffer;     // reader is a BufferReader, else an ObjectReader
+    int with_offsets;  // yield (offset, item)
+    DecodeOptions opts;
+    PyObject* module;  // owns opts.state
+    // in next() or close(), which a hook or another thread may call
+    int busy;
+} SequenceIterator;
 
-    tag_aux_out(CBOR_MAP, dictlen, out, &pos);
+static PyTypeObject SequenceIteratorType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+};
 
-    if (optp->sort_keys) {
-        Py_ssize_t index = 0;
-        PyObject* keylist = PyDict_Keys(ob);
-        PyList_Sort(keylist);
+// bytes of the sequence used so far
+static Py_ssize_t SequenceIterator_offset(SequenceIterator* thiz) {
+    if (thiz->is_buffer) {
+        BufferReader* br = (BufferReader*)thiz->reader;
+        return (Py_ssize_t)(br->pos - br->raw);
+    }
+    return ((ObjectReader*)thiz->reader)->read_count;
+}
 
-        //fprintf(stderr, "sortking keys\n");
-        for (index = 0; index < PyList_Size(keylist); index++) {
-            key = PyList_GetItem(keylist, index); // Borrowed ref
-            val = PyDict_GetItem(ob, key); // Borrowed ref
-            err = inner_dumps(optp, key, out, &pos);
-            if (err != 0) { return err; }
-            err = inner_dumps(optp, val, out, &pos);
-            if (err != 0) { return err; }
-        }
-        Py_DECREF(keylist);
+// Return 1 if there is nothing left to read, 0 if there is more, -1 on error.
+static int SequenceIterator_at_end(SequenceIterator* thiz) {
+    if (thiz->is_buffer) {
+        return ((BufferReader*)thiz->reader)->pos >= ((BufferReader*)thiz->reader)->end;
     } else {
-        Py_ssize_t dictiter = 0;
-        //fprintf(stderr, "unsorted keys\n");
-        while (PyDict_Next(ob, &dictiter, &key, &val)) {
-            err = inner_dumps(optp, key, out, &pos);
-            if (err != 0) { return err; }
-            err = inner_dumps(optp, val, out, &pos);
-            if (err != 0) { return err; }
+        ObjectReader* oreader = (ObjectReader*)thiz->reader;
+        if (oreader->window_pos < oreader->window_len) {
+            return 0;
+        }
+        {
+            Py_ssize_t avail = ObjectReader_fill(oreader, 1);
+            if (avail < 0) {
+                return -1;
+            }
+            return avail == 0;
+        }
+    }
+}
+
+// Give back read-ahead to the stream and drop the reader. Return 0 on success.
+static int SequenceIterator_release(SequenceIterator* thiz) {
+    int err = 0;
+    if (thiz->reader == NULL) {
+        return 0;
+    }
+    if (!thiz->is_buffer) {
+        err = ObjectReader_finish((ObjectReader*)thiz->reader);
+    }
+    thiz->reader->delete(thiz->reader);
+    thiz->reader = NULL;
+    DecodeOptions_clear(&(thiz->opts));
+    return err;
+}
+
+static PyObject* SequenceIterator_next_item(SequenceIterator* thiz) {
+    PyObject* out;
+    Py_ssize_t offset;
+    int at_end;
+    if (thiz->reader == NULL) {
+        return NULL;
+    }
+    at_end = SequenceIterator_at_end(thiz);
+    if (at_end != 0) {
+        if (at_end > 0) {
+            // clean end of sequence, StopIteration
+            SequenceIterator_release(thiz);
         }
+        return NULL;
+    }
+    offset = SequenceIterator_offset(thiz);
+    out = inner_loads(&(thiz->opts), thiz->reader);
+    if (out == NULL) {
+        return NULL;
+    }
+    if (thiz->with_offsets) {
+        PyObject* tout = Py_BuildValue("(nN)", offset, out);
+        out = tout;
     }
+    return out;
+}
 
-    *posp = pos;
+// Return 0 if the caller has the iterator to itself now.
+static int SequenceIterator_claim(SequenceIterator* thiz) {
+    if (!claim_busy((PyObject*)thiz, &(thiz->busy))) {
+        PyErr_SetString(PyExc_RuntimeError, "SequenceIterator already in use, by a hook or another thread");
+        return -1;
+    }
     return 0;
 }
 
+static PyObject* SequenceIterator_next(SequenceIterator* thiz) {
+    PyObject* out;
+    if (SequenceIterator_claim(thiz)) {
+        return NULL;
+    }
+    out = SequenceIterator_next_item(thiz);
+    release_busy((PyObject*)thiz, &(thiz->busy));
+    return out;
+}
 
-static void dumps_bignum(EncodeOptions *optp, uint8_t tag, PyObject* val, uint8_t* out, uintptr_t* posp) {
-    uintptr_t pos = (posp != NULL) ? *posp : 0;
-    PyObject* eight = PyLong_FromLong(8);
-    PyObject* bytemask = NULL;
-    PyObject* nval = NULL;
-    uint8_t* revbytes = NULL;
-    int revbytepos = 0;
-    int val_is_orig = 1;
-    if (out != NULL) {
-	bytemask = PyLong_FromLongLong(0x0ff);
-	revbytes = PyMem_Malloc(23);
-    }
-    while (PyObject_IsTrue(val) && (revbytepos < 23)) {
-	if (revbytes != NULL) {
-	    PyObject* tbyte = PyNumber_And(val, bytemask);
-	    revbytes[revbytepos] = PyLong_AsLong(tbyte);
-	    Py_DECREF(tbyte);
-	}
-	revbytepos++;
-	nval = PyNumber_InPlaceRshift(val, eight);
-        if (val_is_orig) {
-            val_is_orig = 0;
-        } else {
-            Py_DECREF(val);
-        }
-        val = nval;
-    }
-    if (revbytes != NULL) {
-	out[pos] = CBOR_TAG | tag;
-	pos++;
-	out[pos] = CBOR_BYTES | revbytepos;
-	pos++;
-	revbytepos--;
-	while (revbytepos >= 0) {
-	    out[pos] = revbytes[revbytepos];
-	    pos++;
-	    revbytepos--;
-	}
-        PyMem_Free(revbytes);
-	Py_DECREF(bytemask);
-    } else {
-	pos += 2 + revbytepos;
+static PyObject* SequenceIterator_close(SequenceIterator* thiz, PyObject* noargs) {
+    int err;
+    if (SequenceIterator_claim(thiz)) {
+        return NULL;
     }
-    if (!val_is_orig) {
-        Py_DECREF(val);
+    err = SequenceIterator_release(thiz);
+    release_busy((PyObject*)thiz, &(thiz->busy));
+    if (err) {
+        return NULL;
     }
-    Py_DECREF(eight);
-    *posp = pos;
+    Py_RETURN_NONE;
 }
 
-static int dumps_tag(EncodeOptions *optp, PyObject* ob, uint8_t* out, uintptr_t* posp) {
-    uintptr_t pos = (posp != NULL) ? *posp : 0;
-    int err = 0;
+static void SequenceIterator_dealloc(SequenceIterator* thiz) {
+    if (thiz->reader != NULL) {
+        PyObject *etype, *evalue, *etb;
+        PyErr_Fetch(&etype, &evalue, &etb);
+        if (SequenceIterator_release(thiz)) {
+            PyErr_Clear();
+        }
+        PyErr_Restore(etype, evalue, etb);
+    }
+    Py_XDECREF(thiz->source);
+    Py_XDECREF(thiz->module);
+    Py_TYPE(thiz)->tp_free((PyObject*)thiz);
+}
 
+static PyMethodDef SequenceIterator_methods[] = {
+    {"close", (PyCFunction)SequenceIterator_close, METH_NOARGS,
+     "Stop iterating. Seekable and peekable streams are left right after the last item returned.\n"},
+    {NULL, NULL, 0, NULL}        /* Sentinel */
+};
 
-    PyObject* tag_num;
-    PyObject* tag_value;
-    err = 0;
+static int SequenceIterator_init_type(void) {
+    SequenceIteratorType.tp_name = "cbor._cbor.SequenceIterator";
+    SequenceIteratorType.tp_basicsize = sizeof(SequenceIterator);
+    SequenceIteratorType.tp_dealloc = (destructor)SequenceIterator_dealloc;
+    SequenceIteratorType.tp_flags = Py_TPFLAGS_DEFAULT;
+    SequenceIteratorType.tp_doc = "iterator over the items of a CBOR Sequence, from iter_load() or loads_seq()";
+    SequenceIteratorType.tp_iter = PyObject_SelfIter;
+    SequenceIteratorType.tp_iternext = (iternextfunc)SequenceIterator_next;
+    SequenceIteratorType.tp_methods = SequenceIterator_methods;
+    return PyType_Ready(&SequenceIteratorType);
+}
 
-    tag_num = PyObject_GetAttrString(ob, "tag");
-    if (tag_num != NULL) {
-        tag_value = PyObject_GetAttrString(ob, "value");
-        if (tag_value != NULL) {
-#ifdef Py_INTOBJECT_H
-            if (PyInt_Check(tag_num)) {
-                long val = PyInt_AsLong(tag_num);
-                if (val >= 0) {
-                    tag_aux_out(CBOR_TAG, val, out, &pos);
-                    err = inner_dumps(optp, tag_value, out, &pos);
-                } else {
-                    PyErr_Format(PyExc_ValueError, "tag cannot be a negative int: %ld", val);
-                    err = -1;
-                }
-            } else
-#endif
-            if (PyLong_Check(tag_num)) {
-                int overflow = -1;
-                long long val = PyLong_AsLongLongAndOverflow(tag_num, &overflow);
-                if (overflow == 0) {
-                    if (val >= 0) {
-                        tag_aux_out(CBOR_TAG, val, out, &pos);
-                        err = inner_dumps(optp, tag_value, out, &pos);
-                    } else {
-                        PyErr_Format(PyExc_ValueError, "tag cannot be a negative long: %lld", val);
-                        err = -1;
-                    }
-                } else {
-                    PyErr_SetString(PyExc_ValueError, "tag number too large");
-                    err = -1;
-                }
-            }
-            Py_DECREF(tag_value);
-        } else {
-            PyErr_SetString(PyExc_ValueError, "broken Tag object has .tag but not .value");
-            err = -1;
+static PyObject* new_sequence_iterator(PyObject* module, PyObject* source, int with_offsets, int consume_ahead, int buffer_only, Py_ssize_t key_cache_size, int semantic_tags) {
+    SequenceIterator* thiz;
+    int is_buffer = PyObject_CheckBuffer(source);
+    if (buffer_only && !is_buffer) {
+        PyErr_Format(PyExc_ValueError, "input of unknown type %.200s does not support the buffer protocol", Py_TYPE(source)->tp_name);
+        return NULL;
+    }
+    thiz = PyObject_New(SequenceIterator, &SequenceIteratorType);
+    if (thiz == NULL) {
+        return NULL;
+    }
+    memset(&(thiz->opts), 0, sizeof(DecodeOptions));
+    Py_XINCREF(module);
+    thiz->module = module;
+    thiz->busy = 0;
+    thiz->opts.state = cbor_state(module);
+    // one cache for the whole sequence
+    KeyCache_init(&(thiz->opts.key_cache), key_cache_size);
+    thiz->opts.semantic_tags = semantic_tags;
+    thiz->is_buffer = is_buffer;
+    thiz->with_offsets = with_offsets;
+    thiz->reader = NULL;
+    thiz->source = NULL;
+    if (is_buffer) {
+        // An empty buffer is an empty sequence, but NewBufferReader() won't take it.
+        Py_buffer view;
+        Py_ssize_t len;
+        if (PyObject_GetBuffer(source, &view, PyBUF_SIMPLE) != 0) {
+            Py_DECREF(thiz);
+            return NULL;
         }
-        Py_DECREF(tag_num);
+        len = view.len;
+        PyBuffer_Release(&view);
+        if (len == 0) {
+            Py_INCREF(source);
+            thiz->source = source;
+            return (PyObject*)thiz;
+        }
+        thiz->reader = NewBufferReader(source);
+        thiz->opts.buffer_reader = (BufferReader*)thiz->reader;
     } else {
-        PyErr_SetString(PyExc_ValueError, "broken Tag object with no .tag");
-        err = -1;
+        thiz->reader = NewObjectReader(source, consume_ahead);
     }
-    if (err != 0) { return err; }
+    if (thiz->reader == NULL) {
+        Py_DECREF(thiz);
+        return NULL;
+    }
+    Py_INCREF(source);
+    thiz->source = source;
+    return (PyObject*)thiz;
+}
 
-    *posp = pos;
-    return err;
+static PyObject*
+cbor_iter_load(PyObject* module, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"fp", "offsets", "consume_ahead", "key_cache_size", "semantic_tags", NULL};
+    PyObject* fp;
+    int offsets = 0;
+    int consume_ahead = 1;
+    Py_ssize_t key_cache_size = KEY_CACHE_DEFAULT_SIZE;
+    int semantic_tags = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iini:iter_load", kwlist, &fp, &offsets, &consume_ahead, &key_cache_size, &semantic_tags)) {
+        return NULL;
+    }
+    if (semantic_tags && !HAS_SEMANTIC_TAGS) {
+        PyErr_SetString(PyExc_NotImplementedError, "semantic_tags needs Python 3.7 or later");
+        return NULL;
+    }
+    return new_sequence_iterator(module, fp, offsets, consume_ahead, 0, key_cache_size, semantic_tags);
+}
+
+static PyObject*
+cbor_loads_seq(PyObject* module, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"data", "offsets", "key_cache_size", "semantic_tags", NULL};
+    PyObject* data;
+    int offsets = 0;
+    Py_ssize_t key_cache_size = KEY_CACHE_DEFAULT_SIZE;
+    int semantic_tags = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|ini:loads_seq", kwlist, &data, &offsets, &key_cache_size, &semantic_tags)) {
+        return NULL;
+    }
+    if (semantic_tags && !HAS_SEMANTIC_TAGS) {
+        PyErr_SetString(PyExc_NotImplementedError, "semantic_tags needs Python 3.7 or later");
+        return NULL;
+    }
+    return new_sequence_iterator(module, data, offsets, 0, 1, key_cache_size, semantic_tags);
 }
 
+// Scanner: walk the structure of CBOR data to find where items end and
+// check that they are well-formed, without building any Python objects.
+// The state is kept in a ScanState so that a scan can stop when it runs
+// out of bytes and pick up again when more arrive.
 
-// With out=NULL it just counts the length.
-// return err, 0=OK
-static int inner_dumps(EncodeOptions *optp, PyObject* ob, uint8_t* out, uintptr_t* posp) {
-    uintptr_t pos = (posp != NULL) ? *posp : 0;
+#define SCAN_FRAME_DEFINITE 0      /* array or map with a count */
+#define SCAN_FRAME_INDEFINITE 1    /* array or map ended by BREAK */
+#define SCAN_FRAME_INDEFINITE_MAP 2
+#define SCAN_FRAME_CHUNKS 3        /* indefinite length byte or text string */
 
-    if (ob == Py_None) {
-	if (out != NULL) {
-	    out[pos] = CBOR_NULL;
-	}
-	pos += 1;
-    } else if (PyBool_Check(ob)) {
-	if (out != NULL) {
-	    if (PyObject_IsTrue(ob)) {
-		out[pos] = CBOR_TRUE;
-	    } else {
-		out[pos] = CBOR_FALSE;
-	    }
-	}
-	pos += 1;
-    } else if (PyDict_Check(ob)) {
-	int err = dumps_dict(optp, ob, out, &pos);
-	if (err != 0) { return err; }
-    } else if (PyList_Check(ob)) {
-        Py_ssize_t i;
-	Py_ssize_t listlen = PyList_Size(ob);
-	tag_aux_out(CBOR_ARRAY, listlen, out, &pos);
-	for (i = 0; i < listlen; i++) {
-	    int err = inner_dumps(optp, PyList_GetItem(ob, i), out, &pos);
-	    if (err != 0) { return err; }
-	}
-    } else if (PyTuple_Check(ob)) {
-        Py_ssize_t i;
-	Py_ssize_t listlen = PyTuple_Size(ob);
-	tag_aux_out(CBOR_ARRAY, listlen, out, &pos);
-	for (i = 0; i < listlen; i++) {
-	    int err = inner_dumps(optp, PyTuple_GetItem(ob, i), out, &pos);
-	    if (err != 0) { return err; }
-	}
-	// TODO: accept other enumerables and emit a variable length array
-#ifdef Py_INTOBJECT_H
-	// PyInt exists in Python 2 but not 3
-    } else if (PyInt_Check(ob)) {
-	long val = PyInt_AsLong(ob);
-	if (val >= 0) {
-	    tag_aux_out(CBOR_UINT, val, out, &pos);
-	} else {
-	    tag_aux_out(CBOR_NEGINT, -1 - val, out, &pos);
-	}
+#define SCAN_SMALL_STACK 32
+
+#if IS_PY3
+#define SCAN_BUFFER_FORMAT "y*"
+#else
+#define SCAN_BUFFER_FORMAT "s*"
 #endif
-    } else if (PyLong_Check(ob)) {
-	int overflow = 0;
-	long long val = PyLong_AsLongLongAndOverflow(ob, &overflow);
-	if (overflow == 0) {
-	    if (val >= 0) {
-		tag_aux_out(CBOR_UINT, val, out, &pos);
-	    } else {
-		tag_aux_out(CBOR_NEGINT, -1L - val, out, &pos);
-	    }
-	} else {
-	    if (overflow < 0) {
-		// BIG NEGINT
-		PyObject* minusone = PyLong_FromLongLong(-1L);
-		PyObject* val = PyNumber_Subtract(minusone, ob);
-		Py_DECREF(minusone);
-		dumps_bignum(optp, CBOR_TAG_NEGBIGNUM, val, out, &pos);
-		Py_DECREF(val);
-	    } else {
-		// BIG INT
-		dumps_bignum(optp, CBOR_TAG_BIGNUM, ob, out, &pos);
-	    }
-	}
-    } else if (PyFloat_Check(ob)) {
-	double val = PyFloat_AsDouble(ob);
-	tag_u64_out(CBOR_7, *((uint64_t*)(&val)), out, &pos);
-    } else if (PyBytes_Check(ob)) {
-	Py_ssize_t len = PyBytes_Size(ob);
-	tag_aux_out(CBOR_BYTES, len, out, &pos);
-	if (out != NULL) {
-	    memcpy(out + pos, PyBytes_AsString(ob), len);
-	}
-	pos += len;
-    } else if (PyUnicode_Check(ob)) {
-	PyObject* utf8 = PyUnicode_AsUTF8String(ob);
-	Py_ssize_t len = PyBytes_Size(utf8);
-	tag_aux_out(CBOR_TEXT, len, out, &pos);
-	if (out != NULL) {
-	    memcpy(out + pos, PyBytes_AsString(utf8), len);
-	}
-	pos += len;
-	Py_DECREF(utf8);
-    } else {
-        int handled = 0;
-        {
-            PyObject* tag_class = getCborTagClass();
-            if (PyObject_IsInstance(ob, tag_class)) {
-                int err = dumps_tag(optp, ob, out, &pos);
-                if (err != 0) { return err; }
-                handled = 1;
+
+typedef struct {
+    // items still to come in a definite container (a map counts keys and values)
+    // or items so far in an indefinite container
+    uint64_t count;
+    uint8_t kind;
+    // SCAN_FRAME_CHUNKS: CBOR_BYTES or CBOR_TEXT
+    uint8_t chunk_type;
+} ScanFrame;
+
+typedef struct {
+    ScanFrame* stack;
+    Py_ssize_t depth;
+    Py_ssize_t stack_size;
+    // string payload bytes still to skip
+    uint64_t skip;
+    // a tag was read and the item it tags hasn't started yet
+    int pending_tag;
+    ScanFrame small_stack[SCAN_SMALL_STACK];
+} ScanState;
+
+#define SCAN_ERROR (-1)
+#define SCAN_NEED_MORE 0
+#define SCAN_DONE 1
+
+static void ScanState_init(ScanState* st) {
+    st->stack = st->small_stack;
+    st->depth = 0;
+    st->stack_size = SCAN_SMALL_STACK;
+    st->skip = 0;
+    st->pending_tag = 0;
+}
+
+static void ScanState_clear(ScanState* st) {
+    if (st->stack != st->small_stack) {
+        PyMem_Free(st->stack);
+    }
+    ScanState_init(st);
+}
+
+static int ScanState_push(ScanState* st, uint8_t kind, uint64_t count, uint8_t chunk_type) {
+    ScanFrame* frame;
+    if (st->depth == st->stack_size) {
+        Py_ssize_t nsize = st->stack_size * 2;
+        ScanFrame* nstack;
+        if (st->stack == st->small_stack) {
+            nstack = (ScanFrame*)PyMem_Malloc(nsize * sizeof(ScanFrame));
+            if (nstack != NULL) {
+                memcpy(nstack, st->small_stack, sizeof(st->small_stack));
             }
-            // tag_class was just a borrowed reference
+        } else {
+            nstack = (ScanFrame*)PyMem_Realloc(st->stack, nsize * sizeof(ScanFrame));
+        }
+        if (nstack == NULL) {
+            PyErr_NoMemory();
+            return -1;
         }
+        st->stack = nstack;
+        st->stack_size = nsize;
+    }
+    frame = st->stack + st->depth;
+    frame->count = count;
+    frame->kind = kind;
+    frame->chunk_type = chunk_type;
+    st->depth++;
+    return 0;
+}
 
-        // TODO: other special object serializations here
+// One item (or string chunk) finished. Pop every container it finishes.
+// Return SCAN_DONE if that finished the top level item.
+static int ScanState_item_done(ScanState* st) {
+    while (st->depth > 0) {
+        ScanFrame* frame = st->stack + (st->depth - 1);
+        if (frame->kind == SCAN_FRAME_DEFINITE) {
+            frame->count--;
+            if (frame->count > 0) {
+                return SCAN_NEED_MORE;
+            }
+            // container is complete, which completes an item in its parent
+            st->depth--;
+        } else {
+            // indefinite container or chunked string keeps going until BREAK
+            frame->count++;
+            return SCAN_NEED_MORE;
+        }
+    }
+    return SCAN_DONE;
+}
 
-        if (!handled) {
-#if IS_PY3
-            PyErr_Format(PyExc_ValueError, "cannot serialize unknown object: %R", ob);
-#else
-            PyObject* badtype = PyObject_Type(ob);
-            PyObject* badtypename = PyObject_Str(badtype);
-            PyErr_Format(PyExc_ValueError, "cannot serialize unknown object of type %s", PyString_AsString(badtypename));
-            Py_DECREF(badtypename);
-            Py_DECREF(badtype);
-#endif
-            return -1;
+// Scan data[*posp:len] until the end of the current top level item.
+// Return SCAN_DONE with *posp just past the item, SCAN_NEED_MORE with all
+// of data used up (call again with more data to continue), or SCAN_ERROR
+// with a ValueError set if the data is not well-formed.
+static int scan_item(ScanState* st, const uint8_t* data, Py_ssize_t len, Py_ssize_t* posp) {
+    Py_ssize_t pos = *posp;
+    while (1) {
+        uint8_t c, cbor_type, cbor_info;
+        uint64_t aux;
+        Py_ssize_t head_len;
+        int done;
+
+        if (st->skip > 0) {
+            if ((uint64_t)(len - pos) < st->skip) {
+                st->skip -= (len - pos);
+                *posp = len;
+                return SCAN_NEED_MORE;
+            }
+            pos += st->skip;
+            st->skip = 0;
+            done = ScanState_item_done(st);
+            if (done == SCAN_DONE) {
+                *posp = pos;
+                return SCAN_DONE;
+            }
+        }
+
+        if (pos >= len) {
+            *posp = pos;
+            return SCAN_NEED_MORE;
+        }
+        c = data[pos];
+        cbor_type = c & CBOR_TYPE_MASK;
+        cbor_info = c & CBOR_INFO_BITS;
+
+        if (c == CBOR_BREAK) {
+            ScanFrame* frame;
+            if ((st->depth == 0) || st->pending_tag ||
+                (st->stack[st->depth - 1].kind == SCAN_FRAME_DEFINITE)) {
+                PyErr_Format(PyExc_ValueError, "unexpected BREAK at %zd", pos);
+                return SCAN_ERROR;
+            }
+            frame = st->stack + (st->depth - 1);
+            if ((frame->kind == SCAN_FRAME_INDEFINITE_MAP) && (frame->count & 1)) {
+                PyErr_Format(PyExc_ValueError, "map key with no value before BREAK at %zd", pos);
+                return SCAN_ERROR;
+            }
+            pos++;
+            st->depth--;
+            done = ScanState_item_done(st);
+            if (done == SCAN_DONE) {
+                *posp = pos;
+                return SCAN_DONE;
+            }
+            continue;
+        }
+
+        // read the whole head or none of it, so a resumed scan starts on a head
+        if (cbor_info < CBOR_UINT8_FOLLOWS) {
+            head_len = 1;
+            aux = cbor_info;
+        } else if (cbor_info <= CBOR_UINT64_FOLLOWS) {
+            const uint8_t* raw = data + pos + 1;
+            head_len = 1 + (1 << (cbor_info - CBOR_UINT8_FOLLOWS));
+            if (len - pos < head_len) {
+                *posp = pos;
+                return SCAN_NEED_MORE;
+            }
+            switch (cbor_info) {
+            case CBOR_UINT8_FOLLOWS:
+                aux = raw[0];
+                break;
+            case CBOR_UINT16_FOLLOWS:
+                aux = ((uint64_t)raw[0] << 8) | raw[1];
+                break;
+            case CBOR_UINT32_FOLLOWS:
+                aux = ((uint64_t)raw[0] << 24) | ((uint64_t)raw[1] << 16) | ((uint64_t)raw[2] << 8) | raw[3];
+                break;
+            default:
+                aux = ((uint64_t)raw[0] << 56) | ((uint64_t)raw[1] << 48) | ((uint64_t)raw[2] << 40) | ((uint64_t)raw[3] << 32) |
+                    ((uint64_t)raw[4] << 24) | ((uint64_t)raw[5] << 16) | ((uint64_t)raw[6] << 8) | raw[7];
+                break;
+            }
+        } else if (cbor_info == CBOR_VAR_FOLLOWS) {
+            head_len = 1;
+            aux = 0;
+        } else {
+            PyErr_Format(PyExc_ValueError, "reserved additional information %d at %zd", cbor_info, pos);
+            return SCAN_ERROR;
+        }
+
+        if ((st->depth > 0) && (st->stack[st->depth - 1].kind == SCAN_FRAME_CHUNKS)) {
+            // inside an indefinite length string only definite strings of the same type may appear
+            if ((cbor_type != st->stack[st->depth - 1].chunk_type) || (cbor_info == CBOR_VAR_FOLLOWS)) {
+                PyErr_Format(PyExc_ValueError, "bad chunk %02x in indefinite length string at %zd", c, pos);
+                return SCAN_ERROR;
+            }
+        }
+        st->pending_tag = 0;
+        pos += head_len;
+
+        switch (cbor_type) {
+        case CBOR_UINT:
+        case CBOR_NEGINT:
+            if (cbor_info == CBOR_VAR_FOLLOWS) {
+                PyErr_Format(PyExc_ValueError, "indefinite length integer at %zd", pos - 1);
+                return SCAN_ERROR;
+            }
+            done = ScanState_item_done(st);
+            break;
+        case CBOR_BYTES:
+        case CBOR_TEXT:
+            if (cbor_info == CBOR_VAR_FOLLOWS) {
+                if (ScanState_push(st, SCAN_FRAME_CHUNKS, 0, cbor_type)) { return SCAN_ERROR; }
+                done = SCAN_NEED_MORE;
+            } else if (aux == 0) {
+                done = ScanState_item_done(st);
+            } else {
+                // done after skipping the payload, at the top of the loop
+                st->skip = aux;
+                done = SCAN_NEED_MORE;
+            }
+            break;
+        case CBOR_ARRAY:
+        case CBOR_MAP:
+            if (cbor_info == CBOR_VAR_FOLLOWS) {
+                if (ScanState_push(st, (cbor_type == CBOR_MAP) ? SCAN_FRAME_INDEFINITE_MAP : SCAN_FRAME_INDEFINITE, 0, 0)) { return SCAN_ERROR; }
+                done = SCAN_NEED_MORE;
+            } else if (aux == 0) {
+                done = ScanState_item_done(st);
+            } else {
+                if (cbor_type == CBOR_MAP) {
+                    if (aux > (UINT64_MAX / 2)) {
+                        PyErr_Format(PyExc_ValueError, "map too long at %zd", pos - head_len);
+                        return SCAN_ERROR;
+                    }
+                    aux *= 2;
+                }
+                if (ScanState_push(st, SCAN_FRAME_DEFINITE, aux, 0)) { return SCAN_ERROR; }
+                done = SCAN_NEED_MORE;
+            }
+            break;
+        case CBOR_TAG:
+            if (cbor_info == CBOR_VAR_FOLLOWS) {
+                PyErr_Format(PyExc_ValueError, "indefinite length tag at %zd", pos - 1);
+                return SCAN_ERROR;
+            }
+            // the tagged item that follows completes this item
+            st->pending_tag = 1;
+            done = SCAN_NEED_MORE;
+            break;
+        default:  // CBOR_7
+            if ((cbor_info == CBOR_UINT8_FOLLOWS) && (aux < 32)) {
+                PyErr_Format(PyExc_ValueError, "simple value %d in two bytes at %zd", (int)aux, pos - head_len);
+                return SCAN_ERROR;
+            }
+            // simple values and floats
+            done = ScanState_item_done(st);
+            break;
+        }
+        if (done == SCAN_DONE) {
+            *posp = pos;
+            return SCAN_DONE;
         }
     }
-    if (posp != NULL) {
-	*posp = pos;
+}
+
+// Scan data for up to count (all if count < 0) consecutive items starting at offset.
+// Calls item_end(context, end offset) after each. Return 0 on success.
+static int scan_items(const uint8_t* data, Py_ssize_t len, Py_ssize_t offset, Py_ssize_t count,
+                      int (*item_end)(void* context, Py_ssize_t end), void* context) {
+    ScanState st;
+    Py_ssize_t pos = offset;
+    int err = 0;
+    ScanState_init(&st);
+    while ((count != 0) && (pos < len)) {
+        int r = scan_item(&st, data, len, &pos);
+        if (r == SCAN_ERROR) {
+            err = -1;
+            break;
+        }
+        if (r == SCAN_NEED_MORE) {
+            PyErr_Format(PyExc_ValueError, "truncated CBOR item, data ends at %zd", len);
+            err = -1;
+            break;
+        }
+        if ((item_end != NULL) && item_end(context, pos)) {
+            err = -1;
+            break;
+        }
+        if (count > 0) {
+            count--;
+        }
     }
-    return 0;
+    ScanState_clear(&st);
+    return err;
 }
 
-static int _dumps_kwargs(EncodeOptions *optp, PyObject* kwargs) {
-    if (kwargs == NULL) {
-    } else if (!PyDict_Check(kwargs)) {
-	PyErr_Format(PyExc_ValueError, "kwargs not dict: %R\n", kwargs);
-	return 0;
-    } else {
-	PyObject* sort_keys = PyDict_GetItemString(kwargs, "sort_keys");  // Borrowed ref
-	if (sort_keys != NULL) {
-            optp->sort_keys = PyObject_IsTrue(sort_keys);
-            //fprintf(stderr, "sort_keys=%d\n", optp->sort_keys);
-	}
+static int scan_append_end(void* context, Py_ssize_t end) {
+    PyObject* pyend = PyLong_FromSsize_t(end);
+    int err;
+    if (pyend == NULL) {
+        return -1;
     }
-    return 1;
+    err = PyList_Append((PyObject*)context, pyend);
+    Py_DECREF(pyend);
+    return err;
 }
 
 static PyObject*
-cbor_dumps(PyObject* noself, PyObject* args, PyObject* kwargs) {
-
-    PyObject* ob;
-    EncodeOptions opts = {0};
-    EncodeOptions *optp = &opts;
-    is_big_endian();
-    if (PyType_IsSubtype(Py_TYPE(args), &PyList_Type)) {
-	ob = PyList_GetItem(args, 0);
-    } else if (PyType_IsSubtype(Py_TYPE(args), &PyTuple_Type)) {
-	ob = PyTuple_GetItem(args, 0);
-    } else {
-	PyErr_Format(PyExc_ValueError, "args not list or tuple: %R\n", args);
-	return NULL;
+cbor_scan(PyObject* noself, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"data", "offset", "count", NULL};
+    Py_buffer view;
+    Py_ssize_t offset = 0;
+    Py_ssize_t count = -1;
+    PyObject* out;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, SCAN_BUFFER_FORMAT "|nn:scan", kwlist, &view, &offset, &count)) {
+        return NULL;
     }
-    if (ob == NULL) {
+    if ((offset < 0) || (offset > view.len)) {
+        PyBuffer_Release(&view);
+        PyErr_Format(PyExc_ValueError, "offset %zd outside of data of length %zd", offset, view.len);
         return NULL;
     }
+    out = PyList_New(0);
+    if (out != NULL) {
+        if (scan_items((const uint8_t*)view.buf, view.len, offset, count, scan_append_end, out)) {
+            Py_CLEAR(out);
+        }
+    }
+    PyBuffer_Release(&view);
+    return out;
+}
 
-    if (!_dumps_kwargs(optp, kwargs)) {
+static PyObject*
+cbor_validate(PyObject* noself, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"data", "sequence", NULL};
+    Py_buffer view;
+    int sequence = 0;
+    int ok = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, SCAN_BUFFER_FORMAT "|i:validate", kwlist, &view, &sequence)) {
         return NULL;
     }
+    if (sequence) {
+        ok = scan_items((const uint8_t*)view.buf, view.len, 0, -1, NULL, NULL) == 0;
+    } else if (view.len > 0) {
+        ScanState st;
+        Py_ssize_t pos = 0;
+        ScanState_init(&st);
+        ok = (scan_item(&st, (const uint8_t*)view.buf, view.len, &pos) == SCAN_DONE) && (pos == view.len);
+        ScanState_clear(&st);
+    }
+    PyBuffer_Release(&view);
+    if (!ok) {
+        if (PyErr_Occurred() && !PyErr_ExceptionMatches(PyExc_ValueError)) {
+            // MemoryError
+            return NULL;
+        }
+        PyErr_Clear();
+    }
+    return PyBool_FromLong(ok);
+}
 
-    {
-	Py_ssize_t outlen = 0;
-	uintptr_t pos = 0;
-	void* out = NULL;
-	PyObject* obout = NULL;
-	int err;
 
-	// first pass just to count length
-	err = inner_dumps(optp, ob, NULL, &pos);
-	if (err != 0) {
-	    return NULL;
-	}
+// StreamDecoder: push parser for a CBOR Sequence that arrives in pieces,
+// as from a non-blocking socket. feed() appends to a buffer and next()
+// returns an item once all of its bytes are there. The ScanState of a
+// partly received item is kept between calls, so each byte is scanned
+// once however it is split up, and bytes of items already returned are
+// dropped the next time the buffer needs room.
+#define STREAM_BUFFER_INITIAL_SIZE 4096
+// an emptied buffer bigger than this is freed
+#define STREAM_BUFFER_KEEP_SIZE (1024 * 1024)
+// most room set aside at once for the rest of a long string being received
+#define STREAM_PREALLOC_MAX (64 * 1024 * 1024)
 
-	outlen = pos;
+typedef struct {
+    PyObject_HEAD
+    DecodeOptions opts;
+    uint8_t* buf;
+    Py_ssize_t size;
+    // buf[start:end] is what has been fed and not returned yet, the next
+    // item starts at start and has been scanned up to scanned
+    Py_ssize_t start;
+    Py_ssize_t scanned;
+    Py_ssize_t end;
+    ScanState st;
+    PyObject* module;  // owns opts.state
+    // in feed() or next(), which a hook or another thread may call too
+    int busy;
+    // the stream is not well-formed, nothing more can come out of it
+    int failed;
+} StreamDecoder;
 
-	out = PyMem_Malloc(outlen);
-	if (out == NULL) {
-	    PyErr_NoMemory();
-	    return NULL;
-	}
+static PyTypeObject StreamDecoderType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+};
 
-	err = inner_dumps(optp, ob, out, NULL);
-	if (err != 0) {
-	    PyMem_Free(out);
-	    return NULL;
-	}
+static int StreamDecoder_init(StreamDecoder* thiz, PyObject* args, PyObject* kwargs) {
+    int bytes_as_memoryview;
+    int err;
+    if (PyTuple_GET_SIZE(args) != 0) {
+        PyErr_SetString(PyExc_TypeError, "StreamDecoder() takes only keyword arguments");
+        return -1;
+    }
+    if (!claim_busy((PyObject*)thiz, &(thiz->busy))) {
+        PyErr_SetString(PyExc_RuntimeError, "StreamDecoder.__init__() called while it is in use");
+        return -1;
+    }
+    err = decoder_options_init(&(thiz->opts), thiz->module, kwargs, &bytes_as_memoryview);
+    if (!err && bytes_as_memoryview) {
+        PyErr_SetString(PyExc_ValueError, "StreamDecoder reuses its buffer, bytes_as_memoryview is not supported");
+        err = -1;
+    }
+    if (!err) {
+        ScanState_clear(&(thiz->st));
+        thiz->start = 0;
+        thiz->scanned = 0;
+        thiz->end = 0;
+        thiz->failed = 0;
+    }
+    release_busy((PyObject*)thiz, &(thiz->busy));
+    return err;
+}
 
-	// TODO: I wish there was a way to do this without this copy.
-	obout = PyBytes_FromStringAndSize(out, outlen);
-	PyMem_Free(out);
-	return obout;
+// Return 0 if the caller has the decoder to itself now, and must
+// release_busy() it when done.
+static int StreamDecoder_claim(StreamDecoder* thiz) {
+    if (!claim_busy((PyObject*)thiz, &(thiz->busy))) {
+        PyErr_SetString(PyExc_RuntimeError, "StreamDecoder already in use, by one of its own hooks or another thread");
+        return -1;
+    }
+    if (thiz->failed) {
+        release_busy((PyObject*)thiz, &(thiz->busy));
+        PyErr_SetString(PyExc_ValueError, "StreamDecoder stopped at data that is not well-formed CBOR");
+        return -1;
     }
+    return 0;
 }
 
-static PyObject*
-cbor_dump(PyObject* noself, PyObject* args, PyObject *kwargs) {
-    // args should be (obj, fp)
-    PyObject* ob;
-    PyObject* fp;
-    EncodeOptions opts = {0};
-    EncodeOptions *optp = &opts;
+// Make room for n more bytes at buf + end. Return 0 on success.
+static int StreamDecoder_reserve(StreamDecoder* thiz, Py_ssize_t n) {
+    Py_ssize_t held;
+    Py_ssize_t want;
+    uint8_t* nbuf;
+    if (thiz->size - thiz->end >= n) {
+        return 0;
+    }
+    held = thiz->end - thiz->start;
+    if (thiz->start > 0) {
+        memmove(thiz->buf, thiz->buf + thiz->start, held);
+        thiz->scanned -= thiz->start;
+        thiz->end = held;
+        thiz->start = 0;
+        if (thiz->size - thiz->end >= n) {
+            return 0;
+        }
+    }
+    if (n > PY_SSIZE_T_MAX - held) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    want = held + n;
+    if (thiz->st.skip > 0) {
+        // the rest of a long string is on its way, make room for all of it now
+        Py_ssize_t more = (thiz->st.skip < STREAM_PREALLOC_MAX) ? (Py_ssize_t)thiz->st.skip : STREAM_PREALLOC_MAX;
+        if (thiz->scanned + more > want) {
+            want = thiz->scanned + more;
+        }
+    }
+    if ((want < thiz->size * 2) && (thiz->size <= PY_SSIZE_T_MAX / 2)) {
+        want = thiz->size * 2;
+    }
+    if (want < STREAM_BUFFER_INITIAL_SIZE) {
+        want = STREAM_BUFFER_INITIAL_SIZE;
+    }
+    nbuf = (uint8_t*)PyMem_Realloc(thiz->buf, want);
+    if (nbuf == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    thiz->buf = nbuf;
+    thiz->size = want;
+    return 0;
+}
 
-    is_big_endian();
-    if (PyType_IsSubtype(Py_TYPE(args), &PyList_Type)) {
-	ob = PyList_GetItem(args, 0);
-	fp = PyList_GetItem(args, 1);
-    } else if (PyType_IsSubtype(Py_TYPE(args), &PyTuple_Type)) {
-	ob = PyTuple_GetItem(args, 0);
-	fp = PyTuple_GetItem(args, 1);
-    } else {
-	PyErr_Format(PyExc_ValueError, "args not list or tuple: %R\n", args);
-	return NULL;
+static PyObject* StreamDecoder_feed(StreamDecoder* thiz, PyObject* data) {
+    Py_buffer view;
+    int err;
+    if (PyObject_GetBuffer(data, &view, PyBUF_SIMPLE) != 0) {
+        return NULL;
     }
-    if ((ob == NULL) || (fp == NULL)) {
+    // other threads wait their turn, so each feed() lands whole
+    Py_BEGIN_CRITICAL_SECTION(thiz);
+    err = StreamDecoder_claim(thiz);
+    if (!err) {
+        err = StreamDecoder_reserve(thiz, view.len);
+        if (!err && (view.len > 0)) {
+            memcpy(thiz->buf + thiz->end, view.buf, view.len);
+            thiz->end += view.len;
+        }
+        release_busy((PyObject*)thiz, &(thiz->busy));
+    }
+    Py_END_CRITICAL_SECTION();
+    PyBuffer_Release(&view);
+    if (err) {
         return NULL;
     }
+    Py_RETURN_NONE;
+}
 
-    if (!_dumps_kwargs(optp, kwargs)) {
+// next item, or NULL with no error set if there isn't a whole one yet
+static PyObject* StreamDecoder_next_item(StreamDecoder* thiz) {
+    BufferReader br;
+    PyObject* out;
+    int r;
+    if (thiz->start == thiz->end) {
+        thiz->start = thiz->scanned = thiz->end = 0;
+        if (thiz->size > STREAM_BUFFER_KEEP_SIZE) {
+            PyMem_Free(thiz->buf);
+            thiz->buf = NULL;
+            thiz->size = 0;
+        }
         return NULL;
     }
+    r = scan_item(&(thiz->st), thiz->buf, thiz->end, &(thiz->scanned));
+    if (r == SCAN_NEED_MORE) {
+        return NULL;
+    }
+    if (r == SCAN_ERROR) {
+        thiz->failed = 1;
+        return NULL;
+    }
+    SET_READER_FUNCTIONS(&br, BufferReader);
+    br.raw = thiz->buf + thiz->start;
+    br.pos = br.raw;
+    br.end = thiz->buf + thiz->scanned;
+    thiz->opts.buffer_reader = &br;
+    out = buffer_loads(&(thiz->opts), &br);
+    thiz->opts.buffer_reader = NULL;
+    // a well-formed item that can't be decoded is skipped
+    thiz->start = thiz->scanned;
+    return out;
+}
 
-    {
-	// TODO: make this smarter, right now it is justt fp.write(dumps(ob))
-	Py_ssize_t outlen = 0;
-	uintptr_t pos = 0;
-	void* out = NULL;
-	int err;
+static PyObject* StreamDecoder_next(StreamDecoder* thiz) {
+    PyObject* out = NULL;
+    // as in feed(); a hook running Python code can let another thread in,
+    // which then finds the decoder busy
+    Py_BEGIN_CRITICAL_SECTION(thiz);
+    if (!StreamDecoder_claim(thiz)) {
+        out = StreamDecoder_next_item(thiz);
+        release_busy((PyObject*)thiz, &(thiz->busy));
+    }
+    Py_END_CRITICAL_SECTION();
+    return out;
+}
 
-	// first pass just to count length
-	err = inner_dumps(optp, ob, NULL, &pos);
-	if (err != 0) {
-	    return NULL;
-	}
+static PyObject* StreamDecoder_get_buffered(StreamDecoder* thiz, void* closure) {
+    Py_ssize_t n;
+    Py_BEGIN_CRITICAL_SECTION(thiz);
+    n = thiz->end - thiz->start;
+    Py_END_CRITICAL_SECTION();
+    return PyLong_FromSsize_t(n);
+}
 
-	outlen = pos;
+static int StreamDecoder_traverse(StreamDecoder* thiz, visitproc visit, void* arg) {
+    VISIT_HEAP_TYPE(thiz);
+    Py_VISIT(thiz->module);
+    Py_VISIT(thiz->opts.tag_decoders);
+    Py_VISIT(thiz->opts.tag_hook);
+    Py_VISIT(thiz->opts.object_hook);
+    return 0;
+}
 
-	out = PyMem_Malloc(outlen);
-	if (out == NULL) {
-	    PyErr_NoMemory();
-	    return NULL;
-	}
+static int StreamDecoder_clear(StreamDecoder* thiz) {
+    DecodeOptions_clear(&(thiz->opts));
+    Py_CLEAR(thiz->module);
+    return 0;
+}
 
-	err = inner_dumps(optp, ob, out, NULL);
-	if (err != 0) {
-	    PyMem_Free(out);
-	    return NULL;
-	}
+static void StreamDecoder_dealloc(StreamDecoder* thiz) {
+    PyObject_GC_UnTrack(thiz);
+    StreamDecoder_clear(thiz);
+    ScanState_clear(&(thiz->st));
+    PyMem_Free(thiz->buf);
+    cbor_object_free((PyObject*)thiz);
+}
 
-#if HAS_FILE_READER
-	if (PyFile_Check(fp)) {
-	    FILE* fout = PyFile_AsFile(fp);
-	    fwrite(out, 1, outlen, fout);
-	} else
-#endif
-	{
-	    PyObject* ret;
-            PyObject* obout = NULL;
-#if IS_PY3
-	    PyObject* writeStr = PyUnicode_FromString("write");
-#else
-	    PyObject* writeStr = PyString_FromString("write");
-#endif
-	    obout = PyBytes_FromStringAndSize(out, outlen);
-	    //logprintf("write %zd bytes to %p.write() as %p\n", outlen, fp, obout);
-	    ret = PyObject_CallMethodObjArgs(fp, writeStr, obout, NULL);
-	    Py_DECREF(writeStr);
-	    Py_DECREF(obout);
-	    if (ret != NULL) {
-		Py_DECREF(ret);
-	    } else {
-		// exception in fp.write()
-		PyMem_Free(out);
-		return NULL;
-	    }
-	    //logprintf("wrote %zd bytes to %p.write() as %p\n", outlen, fp, obout);
-	}
-	PyMem_Free(out);
+static PyObject* StreamDecoder_new(PyTypeObject* type, PyObject* args, PyObject* kwargs) {
+    StreamDecoder* thiz = (StreamDecoder*)PyType_GenericNew(type, args, kwargs);
+    if (thiz == NULL) {
+        return NULL;
+    }
+    ScanState_init(&(thiz->st));
+    thiz->module = own_module(type);
+    if (thiz->module == NULL) {
+        Py_DECREF(thiz);
+        return NULL;
     }
+    thiz->opts.state = cbor_state(thiz->module);
+    return (PyObject*)thiz;
+}
 
-    Py_RETURN_NONE;
+static PyMethodDef StreamDecoder_methods[] = {
+    {"feed", (PyCFunction)StreamDecoder_feed, METH_O,
+     "feed(data)\nAdd the bytes-like data to what is waiting to be decoded.\n"},
+    {NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+static PyGetSetDef StreamDecoder_getset[] = {
+    {"buffered", (getter)StreamDecoder_get_buffered, NULL,
+     "number of bytes fed that are not part of an item returned yet", NULL},
+    {NULL, NULL, NULL, NULL, NULL}  /* Sentinel */
+};
+
+// Fill in StreamDecoderType, for add_type()
+static void StreamDecoder_init_type(void) {
+    StreamDecoderType.tp_name = "cbor._cbor.StreamDecoder";
+    StreamDecoderType.tp_basicsize = sizeof(StreamDecoder);
+    StreamDecoderType.tp_dealloc = (destructor)StreamDecoder_dealloc;
+    StreamDecoderType.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC;
+    StreamDecoderType.tp_doc =
+        "StreamDecoder(**options)\n"
+        "Incremental decoder for a CBOR Sequence that arrives in pieces, as from a\n"
+        "non-blocking socket. feed() it bytes as they come; iterating over it returns\n"
+        "the items that are complete so far, and stops at one that isn't. Calls from\n"
+        "several threads take turns; one made while a hook is running raises RuntimeError.\n"
+        "options: key_cache_size, class_tags, raise_on_unknown_tag, tag_hook, object_hook,\n"
+        "semantic_tags, as for loads().";
+    StreamDecoderType.tp_traverse = (traverseproc)StreamDecoder_traverse;
+    StreamDecoderType.tp_clear = (inquiry)StreamDecoder_clear;
+    StreamDecoderType.tp_iter = PyObject_SelfIter;
+    StreamDecoderType.tp_iternext = (iternextfunc)StreamDecoder_next;
+    StreamDecoderType.tp_methods = StreamDecoder_methods;
+    StreamDecoderType.tp_getset = StreamDecoder_getset;
+    StreamDecoderType.tp_init = (initproc)StreamDecoder_init;
+    StreamDecoderType.tp_new = StreamDecoder_new;
 }
 
 
 static PyMethodDef CborMethods[] = {
-    {"loads",  cbor_loads, METH_VARARGS,
-        "parse cbor from data buffer to objects"},
+    {"loads", (PyCFunction)cbor_loads, METH_VARARGS|METH_KEYWORDS,
+        "parse cbor from data buffer to objects\n"
+        "loads(data, bytes_as_memoryview=False, key_cache_size=128, class_tags=None,\n"
+        "      raise_on_unknown_tag=False, tag_hook=None, object_hook=None, semantic_tags=False)\n"
+        "data: bytes, bytearray, memoryview, mmap or other contiguous buffer\n"
+        "bytes_as_memoryview: return byte strings as memoryview slices of data instead of copies\n"
+        "key_cache_size: remember this many short text map keys and return the same str\n"
+        "  object each time one repeats. 0 turns this off.\n"
+        "class_tags: list of cbor.tagmap.ClassTag; tagged items with their tag_number are\n"
+        "  returned as decode_function(value), as cbor.tagmap.TagMapper.loads() does\n"
+        "raise_on_unknown_tag: with class_tags, raise UnknownTagException for other tags\n"
+        "tag_hook: tag_hook(Tag) is returned in place of each Tag not handled otherwise\n"
+        "object_hook: object_hook(dict) is returned in place of each decoded dict\n"
+        "semantic_tags: decode tags 0 and 1 to datetime, 4 and 5 to Decimal, 35 to re.Pattern,\n"
+        "  37 to UUID and 258 to set\n"
+        "Strings referred to by tag 25 inside tag 256 (stringref) are always resolved.\n"},
     {"dumps", (PyCFunction)cbor_dumps, METH_VARARGS|METH_KEYWORDS,
-        "serialize python object to bytes"},
-    {"load",  cbor_load, METH_VARARGS,
+        "serialize python object to bytes\n"
+        "dumps(obj, sort_keys=False, float_mode='double', class_tags=None, default=None,\n"
+        "      semantic_tags=False, string_referencing=False, canonical=False)\n"
+        "float_mode: 'double' always writes float64, 'shortest' writes float16 or\n"
+        "  float32 when that decodes to exactly the same value\n"
+        "class_tags: list of cbor.tagmap.ClassTag; instances of their class_type are\n"
+        "  written as Tag(tag_number, encode_function(obj)), as cbor.tagmap.TagMapper.dumps() does\n"
+        "default: for an object dumps can't otherwise write, default(obj) is written instead\n"
+        "semantic_tags: write datetime, Decimal, UUID, str re.Pattern, set and frozenset\n"
+        "  as their standard tags\n"
+        "string_referencing: write repeats of a string as a tag 25 reference to the first\n"
+        "  one, all inside a tag 256 (stringref)\n"
+        "canonical: RFC 8949 core deterministic encoding; map keys (and semantic_tags set\n"
+        "  items) in bytewise order of their encoding, floats as float_mode='shortest'\n"},
+    {"dumps_into", (PyCFunction)cbor_dumps_into, METH_VARARGS|METH_KEYWORDS,
+     "Serialize python object into a writable buffer.\n"
+     "dumps_into(obj, buf, offset=0, **options)\n"
+     "buf: bytearray, memoryview, mmap or other writable C-contiguous buffer\n"
+     "options: as for dumps()\n"
+     "Writes the encoding of obj at buf[offset:] and returns how many bytes that took.\n"
+     "Raises BufferTooSmallError, with .required bytes from offset, if it doesn't fit; then\n"
+     "what was written to buf past offset is undefined.\n"},
+    {"load", (PyCFunction)cbor_load, METH_VARARGS|METH_KEYWORDS,
      "Parse cbor from data buffer to objects.\n"
-     "Takes a file-like object capable of .read(N)\n"},
+     "load(fp, consume_ahead=False, key_cache_size=128, class_tags=None, raise_on_unknown_tag=False,\n"
+     "     tag_hook=None, object_hook=None, semantic_tags=False)\n"
+     "Takes a file-like object capable of .read(N)\n"
+     "Reads ahead in blocks and uses fp.seek() or fp.peek() to leave fp\n"
+     "right after the object. If fp has neither, consume_ahead=True allows\n"
+     "reading ahead anyway and dropping whatever is past the object.\n"
+     "key_cache_size, class_tags, raise_on_unknown_tag, tag_hook, object_hook, semantic_tags:\n"
+     "  as for loads()\n"},
     {"dump", (PyCFunction)cbor_dump, METH_VARARGS|METH_KEYWORDS,
      "Serialize python object to bytes.\n"
-     "dump(obj, fp)\n"
-     "obj: object to output; fp: file-like object to .write() to\n"},
+     "dump(obj, fp, sort_keys=False, buffer_size=65536, float_mode='double', class_tags=None, default=None,\n"
+     "     semantic_tags=False, string_referencing=False, canonical=False)\n"
+     "obj: object to output; fp: file-like object to .write() to\n"
+     "sort_keys, float_mode, class_tags, default, semantic_tags, string_referencing, canonical:\n"
+     "  as for dumps()\n"
+     "buffer_size: fp.write() is called each time this many bytes are ready\n"},
+    {"iter_load", (PyCFunction)cbor_iter_load, METH_VARARGS|METH_KEYWORDS,
+     "Iterate over concatenated CBOR items (a CBOR Sequence, RFC 8742).\n"
+     "iter_load(fp, offsets=False, consume_ahead=True, key_cache_size=128, semantic_tags=False)\n"
+     "fp: file-like object capable of .read(N), or a buffer like loads() takes\n"
+     "offsets: yield (offset, item) where offset counts bytes from where iteration started\n"
+     "consume_ahead: read ahead on streams without seek() or peek(). Bytes read\n"
+     "  past the last item returned are lost if iteration stops before the end.\n"
+     "key_cache_size: as for loads(), one cache is shared by all items\n"
+     "semantic_tags: as for loads()\n"},
+    {"loads_seq", (PyCFunction)cbor_loads_seq, METH_VARARGS|METH_KEYWORDS,
+     "Iterate over concatenated CBOR items (a CBOR Sequence, RFC 8742) in a buffer.\n"
+     "loads_seq(data, offsets=False, key_cache_size=128, semantic_tags=False)\n"
+     "offsets: yield (offset, item) where offset is the item's position in data\n"
+     "key_cache_size: as for loads(), one cache is shared by all items\n"
+     "semantic_tags: as for loads()\n"},
+    {"scan", (PyCFunction)cbor_scan, METH_VARARGS|METH_KEYWORDS,
+     "Find where CBOR items end without decoding them.\n"
+     "scan(data, offset=0, count=-1)\n"
+     "Returns a list of the end offsets of up to count (all if -1) consecutive\n"
+     "items starting at offset. Raises ValueError if an item is not well-formed\n"
+     "or is cut off by the end of data.\n"},
+    {"validate", (PyCFunction)cbor_validate, METH_VARARGS|METH_KEYWORDS,
+     "Check that data is well-formed CBOR without decoding it.\n"
+     "validate(data, sequence=False)\n"
+     "Returns True if data is exactly one well-formed item, or with sequence=True\n"
+     "any number of them. scan() raises an error saying what is wrong.\n"},
     {NULL, NULL, 0, NULL}        /* Sentinel */
 };
 
+// Make the type proto describes ready and add it to module m as name. With
+// CBOR_HEAP_TYPES each module gets a heap type of its own made from proto,
+// otherwise proto is the type. Return 0 on success.
+static int add_type(PyObject* m, PyTypeObject* proto, const char* name) {
+    PyObject* type;
+#if CBOR_HEAP_TYPES
+    PyType_Slot slots[12];
+    PyType_Spec spec;
+    int n = 0;
+#define ADD_SLOT(id, field) \
+    if (proto->field != NULL) { slots[n].slot = id; slots[n].pfunc = (void*)proto->field; n++; }
+    ADD_SLOT(Py_tp_dealloc, tp_dealloc);
+    ADD_SLOT(Py_tp_doc, tp_doc);
+    ADD_SLOT(Py_tp_traverse, tp_traverse);
+    ADD_SLOT(Py_tp_clear, tp_clear);
+    ADD_SLOT(Py_tp_iter, tp_iter);
+    ADD_SLOT(Py_tp_iternext, tp_iternext);
+    ADD_SLOT(Py_tp_methods, tp_methods);
+    ADD_SLOT(Py_tp_getset, tp_getset);
+    ADD_SLOT(Py_tp_init, tp_init);
+    ADD_SLOT(Py_tp_new, tp_new);
+#undef ADD_SLOT
+    slots[n].slot = 0;
+    slots[n].pfunc = NULL;
+    spec.name = proto->tp_name;
+    spec.basicsize = (int)proto->tp_basicsize;
+    spec.itemsize = 0;
+    spec.flags = (unsigned int)proto->tp_flags;
+#ifdef Py_TPFLAGS_IMMUTABLETYPE
+    // like a static type, no setting attributes on it
+    spec.flags |= Py_TPFLAGS_IMMUTABLETYPE;
+#endif
+    spec.slots = slots;
+    type = PyType_FromModuleAndSpec(m, &spec, NULL);
+    if (type == NULL) {
+        return -1;
+    }
+#else
+    if (PyType_Ready(proto)) {
+        return -1;
+    }
+    type = (PyObject*)proto;
+    Py_INCREF(type);
+#endif
+    if (PyModule_AddObject(m, name, type)) {
+        Py_DECREF(type);
+        return -1;
+    }
+    return 0;
+}
+
+// Set up the types defined here and add the public ones to module m.
+// Return 0 on success.
+static int init_types(PyObject* m) {
+    if (SequenceIterator_init_type()) {
+        return -1;
+    }
+    if (Tag_init_type()) {
+        return -1;
+    }
+    Py_INCREF(&CborTagType);
+    if (PyModule_AddObject(m, "Tag", (PyObject*)&CborTagType)) {
+        Py_DECREF(&CborTagType);
+        return -1;
+    }
+    Encoder_init_type();
+    Decoder_init_type();
+    StreamDecoder_init_type();
+    if (add_type(m, &EncoderType, "Encoder") || add_type(m, &DecoderType, "Decoder") ||
+        add_type(m, &StreamDecoderType, "StreamDecoder")) {
+        return -1;
+    }
+    {
+        CborState* state = cbor_state(m);
+        if (state->UnknownTagException == NULL) {
+            state->UnknownTagException = PyErr_NewException("cbor._cbor.UnknownTagException", PyExc_BaseException, NULL);
+            if (state->UnknownTagException == NULL) {
+                return -1;
+            }
+        }
+        Py_INCREF(state->UnknownTagException);
+        if (PyModule_AddObject(m, "UnknownTagException", state->UnknownTagException)) {
+            Py_DECREF(state->UnknownTagException);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+#if IS_PY3
+static int cbor_traverse(PyObject* m, visitproc visit, void* arg) {
+    CborState* state = cbor_state(m);
+    if (state == NULL) {
+        return 0;
+    }
+    Py_VISIT(state->UnknownTagException);
+    Py_VISIT(state->semantic.decimal_type);
+    Py_VISIT(state->semantic.uuid_type);
+    Py_VISIT(state->semantic.uuid_unknown);
+    Py_VISIT(state->semantic.pattern_type);
+    Py_VISIT(state->semantic.re_compile);
+    return 0;
+}
+
+static int cbor_clear(PyObject* m) {
+    CborState* state = cbor_state(m);
+    if (state == NULL) {
+        return 0;
+    }
+    Py_CLEAR(state->UnknownTagException);
+    state->semantic.ready = 0;
+    Py_CLEAR(state->semantic.decimal_type);
+    Py_CLEAR(state->semantic.uuid_type);
+    Py_CLEAR(state->semantic.uuid_unknown);
+    Py_CLEAR(state->semantic.int_name);
+    Py_CLEAR(state->semantic.is_safe_name);
+    Py_CLEAR(state->semantic.pattern_type);
+    Py_CLEAR(state->semantic.re_compile);
+    return 0;
+}
+
+static void cbor_free(void* m) {
+    (void) cbor_clear((PyObject*)m);
+}
+#endif
+
 #ifdef Py_InitModule
 // Python 2.7
 PyMODINIT_FUNC
 init_cbor(void)
 {
-    (void) Py_InitModule("cbor._cbor", CborMethods);
+    PyObject* m = Py_InitModule("cbor._cbor", CborMethods);
+    if (m != NULL) {
+        (void) init_types(m);
+    }
 }
 #else
 // Python 3
+#if CBOR_HEAP_TYPES
+// multi-phase init, so each interpreter that imports the module gets its
+// own module object and state
+static PyModuleDef_Slot cbor_slots[] = {
+    {Py_mod_exec, (void*)init_types},
+#ifdef Py_mod_multiple_interpreters
+    // Tag is still a static type, shared, so subinterpreters must share the GIL
+    {Py_mod_multiple_interpreters, Py_MOD_MULTIPLE_INTERPRETERS_SUPPORTED},
+#endif
+#ifdef Py_mod_gil
+    // safe to run without the GIL in free-threaded builds
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+    {0, NULL}
+};
+#endif
+
+static PyModuleDef cbor_moduledef = {
+    PyModuleDef_HEAD_INIT,
+};
+
 PyMODINIT_FUNC
 PyInit__cbor(void)
 {
-    static PyModuleDef modef = {
-	PyModuleDef_HEAD_INIT,
-    };
-    //modef.m_base = PyModuleDef_HEAD_INIT;
-    modef.m_name = "cbor._cbor";
-    modef.m_doc = NULL;
-    modef.m_size = 0;
-    modef.m_methods = CborMethods;
-#ifdef Py_mod_exec
-    modef.m_slots = NULL; // Py >= 3.5
+    PyModuleDef* modef = &cbor_moduledef;
+    modef->m_name = "cbor._cbor";
+    modef->m_doc = NULL;
+    modef->m_size = sizeof(CborState);
+    modef->m_methods = CborMethods;
+#if CBOR_HEAP_TYPES
+    modef->m_slots = cbor_slots;
+#elif defined(Py_mod_exec)
+    modef->m_slots = NULL; // Py >= 3.5
 #else
-    modef.m_reload = NULL; // Py < 3.5
+    modef->m_reload = NULL; // Py < 3.5
+#endif
+    modef->m_traverse = cbor_traverse;
+    modef->m_clear = cbor_clear;
+    modef->m_free = cbor_free;
+#if CBOR_HEAP_TYPES
+    return PyModuleDef_Init(modef);
+#else
+    {
+        PyObject* m = PyModule_Create(modef);
+        if (m == NULL) {
+            return NULL;
+        }
+        if (init_types(m)) {
+            Py_DECREF(m);
+            return NULL;
+        }
+        return m;
+    }
 #endif
-    modef.m_traverse = NULL;
-    modef.m_clear = NULL;
-    modef.m_free = NULL;
-    return PyModule_Create(&modef);
 }
 #endif
 
@@ -2,18 +2,21 @@
 
 try:
     # try C library _cbor.so
-    from ._cbor import loads, dumps, load, dump
+    from ._cbor import loads, dumps, load, dump, iter_load, loads_seq, scan, validate, Encoder, Decoder, dumps_into, StreamDecoder
 except:
     # fall back to 100% python implementation
-    from .cbor import loads, dumps, load, dump
+    from .cbor import loads, dumps, load, dump, iter_load, loads_seq, scan, validate, Encoder, Decoder, dumps_into, StreamDecoder
 
-from .cbor import Tag
+from .cbor import Tag, BufferTooSmallError
 from .tagmap import TagMapper, ClassTag, UnknownTagException
+from .indexed import IndexedFile, IndexedWriter, build_index
 from .VERSION import __doc__ as __version__
 
 __all__ = [
-    'loads', 'dumps', 'load', 'dump',
+    'loads', 'dumps', 'load', 'dump', 'iter_load', 'loads_seq', 'scan', 'validate',
+    'Encoder', 'Decoder', 'dumps_into', 'BufferTooSmallError', 'StreamDecoder',
     'Tag',
     'TagMapper', 'ClassTag', 'UnknownTagException',
+    'IndexedFile', 'IndexedWriter', 'build_index',
     '__version__',
 ]
@@ -1,10 +1,12 @@
 #!python
 # -*- Python -*-
 
+import binascii
 import datetime
 import re
 import struct
 import sys
+import threading
 
 _IS_PY3 = sys.version_info[0] >= 3
 
@@ -57,12 +59,16 @@ CBOR_TAG_BASE64URL = 21
 CBOR_TAG_BASE64 = 22
 CBOR_TAG_BASE16 = 23
 CBOR_TAG_CBOR = 24 # following byte string is embedded CBOR data
+CBOR_TAG_STRINGREF = 25 # index of a string earlier in the enclosing namespace
 
 CBOR_TAG_URI = 32
 CBOR_TAG_BASE64URL = 33
 CBOR_TAG_BASE64 = 34
 CBOR_TAG_REGEX = 35
 CBOR_TAG_MIME = 36 # following text is MIME message, headers, separators and all
+CBOR_TAG_UUID = 37 # 16 byte string follows
+CBOR_TAG_STRINGREF_NAMESPACE = 256 # strings inside may be referred to by tag 25
+CBOR_TAG_SET = 258 # array of distinct items follows
 CBOR_TAG_CBOR_FILEHEADER = 55799 # can open a file with 0xd9d9f7
 
 _CBOR_TAG_BIGNUM_BYTES = struct.pack('B', CBOR_TAG | CBOR_TAG_BIGNUM)
@@ -90,22 +96,75 @@ def dumps_int(val):
 
 if _IS_PY3:
     def _dumps_bignum_to_bytearray(val):
-        out = []
-        while val > 0:
-            out.insert(0, val & 0x0ff)
-            val = val >> 8
-        return bytes(out)
+        return val.to_bytes((val.bit_length() + 7) // 8, 'big')
 else:
     def _dumps_bignum_to_bytearray(val):
-        out = []
-        while val > 0:
-            out.insert(0, chr(val & 0x0ff))
-            val = val >> 8
-        return b''.join(out)
+        hexval = '%x' % val
+        if len(hexval) & 1:
+            hexval = '0' + hexval
+        return binascii.unhexlify(hexval)
 
 
-def dumps_float(val):
-    return struct.pack("!Bd", CBOR_FLOAT64, val)
+def dumps_float(val, float_mode=None):
+    """
+    float_mode: 'double' (or None) always writes float64.
+    'shortest' writes float16 or float32 when that decodes to exactly the same value.
+    """
+    if float_mode is None or float_mode == 'double':
+        return struct.pack("!Bd", CBOR_FLOAT64, val)
+    if float_mode != 'shortest':
+        raise ValueError("float_mode must be 'double' or 'shortest', got {0!r}".format(float_mode))
+    bits = struct.unpack("!Q", struct.pack("!d", val))[0]
+    if val != val:
+        # NaN, keep the sign and payload bits
+        sign = bits >> 63
+        mant = bits & 0xfffffffffffff
+        if mant & 0x3ffffffffff == 0:
+            return struct.pack("!BH", CBOR_FLOAT16, (sign << 15) | 0x7c00 | (mant >> 42))
+        if mant & 0x1fffffff == 0:
+            return struct.pack("!BI", CBOR_FLOAT32, (sign << 31) | 0x7f800000 | (mant >> 29))
+        return struct.pack("!BQ", CBOR_FLOAT64, bits)
+    half = _float_to_half(val)
+    if half is not None:
+        return struct.pack("!BH", CBOR_FLOAT16, half)
+    if -_FLT_MAX <= val <= _FLT_MAX:
+        single = struct.pack("!f", val)
+        if struct.unpack("!f", single)[0] == val:
+            return struct.pack("B", CBOR_FLOAT32) + single
+    return struct.pack("!BQ", CBOR_FLOAT64, bits)
+
+
+_FLT_MAX = struct.unpack("!f", b'\x7f\x7f\xff\xff')[0]
+
+
+def _float_to_half(val):
+    "return float16 bits if val (not NaN) is exactly representable, else None"
+    if val in (float('inf'), float('-inf')):
+        return 0xfc00 if val < 0 else 0x7c00
+    if not (-65504.0 <= val <= 65504.0):
+        return None
+    single = struct.unpack("!I", struct.pack("!f", val))[0]
+    if struct.unpack("!f", struct.pack("!I", single))[0] != val:
+        return None
+    sign = (single >> 16) & 0x8000
+    exp = ((single >> 23) & 0xff) - 127
+    mant = single & 0x7fffff
+    if exp == -127 and mant == 0:
+        # +/- 0
+        return sign
+    if exp >= -14:
+        # normal float16, 10 bits of mantissa
+        if mant & 0x1fff:
+            return None
+        return sign | ((exp + 15) << 10) | (mant >> 13)
+    if exp >= -24:
+        # subnormal float16, value is (half mantissa) * 2^-24
+        shift = -1 - exp
+        mant |= 0x800000
+        if mant & ((1 << shift) - 1):
+            return None
+        return sign | (mant >> shift)
+    return None
 
 
 _CBOR_TAG_NEGBIGNUM_BYTES = struct.pack('B', CBOR_TAG | CBOR_TAG_NEGBIGNUM)
@@ -122,8 +181,7 @@ def _encode_type_num(cbor_type, val):
         return struct.pack('!BH', cbor_type | CBOR_UINT16_FOLLOWS, val)
     if val <= 0x0ffffffff:
         return struct.pack('!BI', cbor_type | CBOR_UINT32_FOLLOWS, val)
-    if (((cbor_type == CBOR_NEGINT) and (val <= 0x07fffffffffffffff)) or
-        ((cbor_type != CBOR_NEGINT) and (val <= 0x0ffffffffffffffff))):
+    if val <= 0x0ffffffffffffffff:
         return struct.pack('!BQ', cbor_type | CBOR_UINT64_FOLLOWS, val)
     if cbor_type != CBOR_NEGINT:
         raise Exception("value too big for CBOR unsigned number: {0!r}".format(val))
@@ -149,50 +207,85 @@ def dumps_string(val, is_text=None, is_bytes=None):
     return _encode_type_num(CBOR_TEXT, len(val)) + val
 
 
-def dumps_array(arr, sort_keys=False):
+def dumps_array(arr, sort_keys=False, float_mode=None, default=None):
     head = _encode_type_num(CBOR_ARRAY, len(arr))
-    parts = [dumps(x, sort_keys=sort_keys) for x in arr]
+    parts = [dumps(x, sort_keys=sort_keys, float_mode=float_mode, default=default) for x in arr]
     return head + b''.join(parts)
 
 
 if _IS_PY3:
-    def dumps_dict(d, sort_keys=False):
+    def dumps_dict(d, sort_keys=False, float_mode=None, default=None):
         head = _encode_type_num(CBOR_MAP, len(d))
         parts = [head]
-        if sort_keys:
+        if sort_keys is _CANONICAL:
+            for kb, v in _canonical_items(d.items(), float_mode, default):
+                parts.append(kb)
+                parts.append(dumps(v, sort_keys=sort_keys, float_mode=float_mode, default=default))
+        elif sort_keys:
             for k in sorted(d.keys()):
                 v = d[k]
-                parts.append(dumps(k, sort_keys=sort_keys))
-                parts.append(dumps(v, sort_keys=sort_keys))
+                parts.append(dumps(k, sort_keys=sort_keys, float_mode=float_mode, default=default))
+                parts.append(dumps(v, sort_keys=sort_keys, float_mode=float_mode, default=default))
         else:
             for k,v in d.items():
-                parts.append(dumps(k, sort_keys=sort_keys))
-                parts.append(dumps(v, sort_keys=sort_keys))
+                parts.append(dumps(k, sort_keys=sort_keys, float_mode=float_mode, default=default))
+                parts.append(dumps(v, sort_keys=sort_keys, float_mode=float_mode, default=default))
         return b''.join(parts)
 else:
-    def dumps_dict(d, sort_keys=False):
+    def dumps_dict(d, sort_keys=False, float_mode=None, default=None):
         head = _encode_type_num(CBOR_MAP, len(d))
         parts = [head]
-        if sort_keys:
+        if sort_keys is _CANONICAL:
+            for kb, v in _canonical_items(d.iteritems(), float_mode, default):
+                parts.append(kb)
+                parts.append(dumps(v, sort_keys=sort_keys, float_mode=float_mode, default=default))
+        elif sort_keys:
             for k in sorted(d.iterkeys()):
                 v = d[k]
-                parts.append(dumps(k, sort_keys=sort_keys))
-                parts.append(dumps(v, sort_keys=sort_keys))
+                parts.append(dumps(k, sort_keys=sort_keys, float_mode=float_mode, default=default))
+                parts.append(dumps(v, sort_keys=sort_keys, float_mode=float_mode, default=default))
         else:
             for k,v in d.iteritems():
-                parts.append(dumps(k, sort_keys=sort_keys))
-                parts.append(dumps(v, sort_keys=sort_keys))
+                parts.append(dumps(k, sort_keys=sort_keys, float_mode=float_mode, default=default))
+                parts.append(dumps(v, sort_keys=sort_keys, float_mode=float_mode, default=default))
         return b''.join(parts)
 
 
+# sort_keys for dumps(canonical=True)
+_CANONICAL = object()
+
+
+def _canonical_items(items, float_mode, default):
+    """
+    dumps(canonical=True): return [(encoded key, value), ...] for the
+    (key, value) pairs of items, in bytewise order of the encoded keys.
+    """
+    out = [(dumps(k, sort_keys=_CANONICAL, float_mode=float_mode, default=default), v) for k, v in items]
+    out.sort(key=lambda kv: kv[0])
+    for i in range(1, len(out)):
+        if out[i - 1][0] == out[i][0]:
+            raise ValueError('canonical encoding has two equal map keys or set items')
+    return out
+
+
 def dumps_bool(b):
     if b:
         return struct.pack('B', CBOR_TRUE)
     return struct.pack('B', CBOR_FALSE)
 
 
-def dumps_tag(t, sort_keys=False):
-    return _encode_type_num(CBOR_TAG, t.tag) + dumps(t.value, sort_keys=sort_keys)
+def _dumps_tag_head(tag):
+    if not _is_intish(tag):
+        raise ValueError('tag number must be an int, not {0}'.format(type(tag).__name__))
+    if tag < 0:
+        raise ValueError('tag cannot be a negative int')
+    if tag > 0x0ffffffffffffffff:
+        raise ValueError('tag number too large')
+    return _encode_type_num(CBOR_TAG, tag)
+
+
+def dumps_tag(t, sort_keys=False, float_mode=None, default=None):
+    return _dumps_tag_head(t.tag) + dumps(t.value, sort_keys=sort_keys, float_mode=float_mode, default=default)
     
 
 if _IS_PY3:
@@ -207,7 +300,34 @@ else:
         return isinstance(x, (int, long))
 
 
-def dumps(ob, sort_keys=False):
+def dumps(ob, sort_keys=False, float_mode=None, class_tags=None, default=None, semantic_tags=False,
+          string_referencing=False, canonical=False):
+    """
+    Serialize ob to bytes.
+    sort_keys: write dict items in sorted key order
+    float_mode: 'double' (default) or 'shortest', see dumps_float()
+    class_tags: list of cbor.tagmap.ClassTag to write instances of their class_type as tags
+    default: for an object dumps() can't otherwise write, default(ob) is written instead
+    semantic_tags: write datetime, Decimal, UUID, str re.Pattern, set and frozenset as their standard tags
+    string_referencing: write repeats of a string as a reference to the first one (tags 25 and 256)
+    canonical: RFC 8949 core deterministic encoding; dict keys (and semantic_tags set items)
+      in bytewise order of their encoding, floats as float_mode='shortest'
+    """
+    if canonical:
+        sort_keys, float_mode = _canonical_options(string_referencing)
+    mapper = None
+    if class_tags is not None:
+        mapper = _tag_mapper(class_tags)
+        ob = mapper.encode(ob)
+    if semantic_tags:
+        default = _semantic_default(default, sort_keys is _CANONICAL)
+    if (mapper is not None) and (default is not None):
+        default = _mapped_default(mapper, default)
+    if string_referencing:
+        # dicts come back in the order to write them, with default already applied
+        ob = _StringRefEncoder(sort_keys, default).namespace(ob)
+        sort_keys = False
+        default = None
     if ob is None:
         return struct.pack('B', CBOR_NULL)
     if isinstance(ob, bool):
@@ -215,29 +335,223 @@ def dumps(ob, sort_keys=False):
     if _is_stringish(ob):
         return dumps_string(ob)
     if isinstance(ob, (list, tuple)):
-        return dumps_array(ob, sort_keys=sort_keys)
+        return dumps_array(ob, sort_keys=sort_keys, float_mode=float_mode, default=default)
     # TODO: accept other enumerables and emit a variable length array
     if isinstance(ob, dict):
-        return dumps_dict(ob, sort_keys=sort_keys)
+        return dumps_dict(ob, sort_keys=sort_keys, float_mode=float_mode, default=default)
     if isinstance(ob, float):
-        return dumps_float(ob)
+        return dumps_float(ob, float_mode=float_mode)
     if _is_intish(ob):
         return dumps_int(ob)
     if isinstance(ob, Tag):
-        return dumps_tag(ob, sort_keys=sort_keys)
+        return dumps_tag(ob, sort_keys=sort_keys, float_mode=float_mode, default=default)
+    if default is not None:
+        return dumps(default(ob), sort_keys=sort_keys, float_mode=float_mode, default=default)
     raise Exception("don't know how to cbor serialize object of type %s", type(ob))
 
 
-# same basic signature as json.dump, but with no options (yet)
-def dump(obj, fp, sort_keys=False):
+def _canonical_options(string_referencing):
+    "(sort_keys, float_mode) for canonical=True"
+    if string_referencing:
+        raise ValueError("canonical and string_referencing can't be used together")
+    return _CANONICAL, 'shortest'
+
+
+_DUMP_BUFFER_SIZE = 64 * 1024
+
+
+class _ChunkWriter(object):
+    "Collect encoded parts and pass them to write() in chunks of about buffer_size bytes"
+    def __init__(self, write, buffer_size):
+        self.write = write
+        self.buffer_size = buffer_size
+        self.parts = []
+        self.size = 0
+
+    def append(self, part):
+        self.parts.append(part)
+        self.size += len(part)
+        if self.size >= self.buffer_size:
+            self.flush()
+
+    def flush(self):
+        if self.parts:
+            self.write(b''.join(self.parts))
+            self.parts = []
+            self.size = 0
+
+
+def _dump_parts(ob, out, sort_keys, float_mode, default):
+    # Containers are emitted piece by piece so that only one leaf value
+    # is held in memory at a time. Must produce the same bytes as dumps().
+    if isinstance(ob, (list, tuple)):
+        out.append(_encode_type_num(CBOR_ARRAY, len(ob)))
+        for x in ob:
+            _dump_parts(x, out, sort_keys, float_mode, default)
+    elif isinstance(ob, dict):
+        out.append(_encode_type_num(CBOR_MAP, len(ob)))
+        if sort_keys is _CANONICAL:
+            for kb, v in _canonical_items(ob.items(), float_mode, default):
+                out.append(kb)
+                _dump_parts(v, out, sort_keys, float_mode, default)
+            return
+        if sort_keys:
+            keys = sorted(ob.keys())
+        else:
+            keys = ob.keys()
+        for k in keys:
+            out.append(dumps(k, sort_keys=sort_keys, float_mode=float_mode, default=default))
+            _dump_parts(ob[k], out, sort_keys, float_mode, default)
+    elif isinstance(ob, Tag):
+        out.append(_dumps_tag_head(ob.tag))
+        _dump_parts(ob.value, out, sort_keys, float_mode, default)
+    else:
+        out.append(dumps(ob, sort_keys=sort_keys, float_mode=float_mode, default=default))
+
+
+if sys.version_info >= (3, 7):
+    _ordered_dict = dict
+else:
+    from collections import OrderedDict as _ordered_dict
+
+
+def _stringref_min_len(index):
+    "a string this long or longer goes in the stringref table as entry index"
+    if index < 24:
+        return 3
+    if index < 256:
+        return 4
+    if index < 65536:
+        return 5
+    if index < 0x100000000:
+        return 7
+    return 11
+
+
+class _StringRefEncoder(object):
+    """
+    dumps(string_referencing=True): a copy of the object tree with strings
+    seen before replaced by Tag(25, index), in the order dumps() writes them
+    (http://cbor.schmorp.de/stringref).
+    """
+    def __init__(self, sort_keys, default):
+        self.sort_keys = sort_keys
+        self.default = default
+        self.table = None
+
+    def namespace(self, ob):
+        "Tag(256, ob) with its own string table"
+        outer = self.table
+        self.table = {}
+        try:
+            return Tag(CBOR_TAG_STRINGREF_NAMESPACE, self.apply(ob))
+        finally:
+            self.table = outer
+
+    def apply(self, ob):
+        if _is_stringish(ob):
+            is_text = _is_unicode(ob)
+            # text and bytes are different entries even when equal in Python 2
+            key = (is_text, ob)
+            index = self.table.get(key)
+            if index is not None:
+                return Tag(CBOR_TAG_STRINGREF, index)
+            size = len(ob.encode('utf8')) if is_text else len(ob)
+            if size >= _stringref_min_len(len(self.table)):
+                self.table[key] = len(self.table)
+            return ob
+        if isinstance(ob, list):
+            return [self.apply(x) for x in ob]
+        if isinstance(ob, tuple):
+            return tuple(self.apply(x) for x in ob)
+        if isinstance(ob, dict):
+            out = _ordered_dict()
+            keys = sorted(ob.keys()) if self.sort_keys else ob.keys()
+            for k in keys:
+                # key before value, the order they are written in
+                rk = self.apply(k)
+                out[rk] = self.apply(ob[k])
+            return out
+        if isinstance(ob, Tag):
+            if ob.tag == CBOR_TAG_STRINGREF_NAMESPACE:
+                return self.namespace(ob.value)
+            return Tag(ob.tag, self.apply(ob.value))
+        if (ob is None) or isinstance(ob, (bool, float)):
+            return ob
+        if _is_intish(ob):
+            # bignum bytes are strings here too
+            if ob > 0xffffffffffffffff:
+                return Tag(CBOR_TAG_BIGNUM, self.apply(_dumps_bignum_to_bytearray(ob)))
+            if ob < -0x10000000000000000:
+                return Tag(CBOR_TAG_NEGBIGNUM, self.apply(_dumps_bignum_to_bytearray(-1 - ob)))
+            return ob
+        if self.default is not None:
+            return self.apply(self.default(ob))
+        raise Exception("don't know how to cbor serialize object of type %s", type(ob))
+
+
+# same basic signature as json.dump
+def dump(obj, fp, sort_keys=False, buffer_size=None, float_mode=None, class_tags=None, default=None,
+         semantic_tags=False, string_referencing=False, canonical=False):
     """
     obj: Python object to serialize
     fp: file-like object capable of .write(bytes)
+    buffer_size: fp.write() is called each time about this many bytes are ready (default 64 KiB)
+    sort_keys, float_mode, class_tags, default, semantic_tags, string_referencing, canonical: as for dumps()
     """
-    # this is kinda lame, but probably not inefficient for non-huge objects
-    # TODO: .write() to fp as we go as each inner object is serialized
-    blob = dumps(obj, sort_keys=sort_keys)
-    fp.write(blob)
+    if canonical:
+        sort_keys, float_mode = _canonical_options(string_referencing)
+    mapper = None
+    if class_tags is not None:
+        mapper = _tag_mapper(class_tags)
+        obj = mapper.encode(obj)
+    if semantic_tags:
+        default = _semantic_default(default, sort_keys is _CANONICAL)
+    if (mapper is not None) and (default is not None):
+        default = _mapped_default(mapper, default)
+    if string_referencing:
+        obj = _StringRefEncoder(sort_keys, default).namespace(obj)
+        sort_keys = False
+        default = None
+    if buffer_size is None:
+        buffer_size = _DUMP_BUFFER_SIZE
+    elif buffer_size <= 0:
+        raise ValueError("buffer_size must be positive, got {0!r}".format(buffer_size))
+    out = _ChunkWriter(fp.write, buffer_size)
+    _dump_parts(obj, out, sort_keys, float_mode, default)
+    out.flush()
+
+
+class BufferTooSmallError(ValueError):
+    "dumps_into(): the encoding needs .required bytes from offset, buf only has .available"
+    def __init__(self, required, available):
+        ValueError.__init__(self, 'encoding needs {0} bytes, buffer has {1}'.format(required, available))
+        self.required = required
+        self.available = available
+
+    def __reduce__(self):
+        return (type(self), (self.required, self.available))
+
+
+def dumps_into(obj, buf, offset=0, **options):
+    """
+    Serialize obj into buf[offset:] and return how many bytes that took.
+    buf: bytearray, memoryview, mmap or other writable buffer
+    options: as for dumps()
+    Raises BufferTooSmallError if it doesn't fit.
+    """
+    data = dumps(obj, **options)
+    view = memoryview(buf)
+    if view.readonly:
+        raise TypeError('dumps_into needs a writable buffer, got {0}'.format(type(buf).__name__))
+    if _IS_PY3 and (view.format != 'B' or view.ndim != 1):
+        view = view.cast('B')
+    if (offset < 0) or (offset > len(view)):
+        raise ValueError('offset {0} is outside of the buffer of {1} bytes'.format(offset, len(view)))
+    if len(data) > len(view) - offset:
+        raise BufferTooSmallError(len(data), len(view) - offset)
+    view[offset:offset + len(data)] = data
+    return len(data)
 
 
 class Tag(object):
@@ -253,22 +567,433 @@ class Tag(object):
             return False
         return (self.tag == other.tag) and (self.value == other.value)
 
+    def __ne__(self, other):
+        return not self.__eq__(other)
+
+    def __hash__(self):
+        return hash((self.tag, self.value))
+
+try:
+    # Use the C extension's Tag when there is one, so objects from either
+    # implementation can be passed to the other.
+    from ._cbor import Tag
+except ImportError:
+    pass
+
+
+class _ViewReader(StringIO):
+    "file-like over data which can return slices of data for loads(bytes_as_memoryview=True)"
+    def __init__(self, data):
+        StringIO.__init__(self, data)
+        self.view = memoryview(data).cast('B')
+
+
+def _tag_mapper(class_tags):
+    # here rather than at the top because cbor.tagmap imports this module
+    from .tagmap import TagMapper
+    return TagMapper(class_tags)
+
+
+def _mapped_default(mapper, default):
+    "wrap dumps(default=) so class_tags apply to what it returns too, as in the C encoder"
+    def mapped_default(ob):
+        return mapper.encode(default(ob))
+    return mapped_default
+
+
+class _DecodeHooks(object):
+    "loads() class_tags, raise_on_unknown_tag, tag_hook, object_hook and semantic_tags, applied to a decoded tree"
+    def __init__(self, class_tags, raise_on_unknown_tag, tag_hook, object_hook, semantic_tags=False):
+        self.decoders = None
+        if class_tags is not None:
+            # the first ClassTag for a tag number wins
+            self.decoders = {}
+            for ct in class_tags:
+                if (ct.decode_function is not None) and (ct.tag_number not in self.decoders):
+                    self.decoders[ct.tag_number] = ct.decode_function
+        self.raise_on_unknown_tag = raise_on_unknown_tag
+        self.tag_hook = tag_hook
+        self.object_hook = object_hook
+        self.semantic_tags = semantic_tags
+
+    def apply(self, ob, mapping=True):
+        # Bottom up, the order the C decoder calls them in. Like
+        # TagMapper.decode(), class_tags don't apply inside a tag.
+        # semantic_tags come after a ClassTag for the same tag number,
+        # as in dumps(), before everything else, and do apply inside a tag.
+        if isinstance(ob, list):
+            for i, v in enumerate(ob):
+                ob[i] = self.apply(v, mapping)
+            return ob
+        if isinstance(ob, dict):
+            if self.semantic_tags and any(isinstance(k, Tag) for k in ob):
+                ob = dict((self.apply(k, mapping), v) for k, v in ob.items())
+            for k, v in list(ob.items()):
+                ob[k] = self.apply(v, mapping)
+            if self.object_hook is not None:
+                return self.object_hook(ob)
+            return ob
+        if isinstance(ob, Tag):
+            decoder = None
+            if mapping and (self.decoders is not None):
+                decoder = self.decoders.get(ob.tag)
+            if (decoder is None) and self.semantic_tags and (ob.tag in _SEMANTIC_DECODERS):
+                return _SEMANTIC_DECODERS[ob.tag](self.apply(ob.value, mapping))
+            if mapping and (self.decoders is not None):
+                if (decoder is None) and self.raise_on_unknown_tag:
+                    from .tagmap import UnknownTagException
+                    raise UnknownTagException(str(ob.tag))
+                ob.value = self.apply(ob.value, False)
+                if decoder is not None:
+                    return decoder(ob.value)
+            else:
+                ob.value = self.apply(ob.value, mapping)
+            if self.tag_hook is not None:
+                return self.tag_hook(ob)
+        return ob
+
 
-def loads(data):
+def _decode_hooks(class_tags, raise_on_unknown_tag, tag_hook, object_hook, semantic_tags=False):
+    "return _DecodeHooks for loads() arguments, or None if there is nothing to do"
+    if (class_tags is None) and (tag_hook is None) and (object_hook is None) and not semantic_tags:
+        return None
+    if semantic_tags and not _IS_PY3:
+        raise NotImplementedError('semantic_tags needs Python 3')
+    return _DecodeHooks(class_tags, raise_on_unknown_tag, tag_hook, object_hook, semantic_tags)
+
+
+def loads(data, bytes_as_memoryview=False, key_cache_size=None, class_tags=None, raise_on_unknown_tag=False,
+          tag_hook=None, object_hook=None, semantic_tags=False):
     """
     Parse CBOR bytes and return Python objects.
+    data: bytes, bytearray, memoryview, mmap or other contiguous buffer
+    bytes_as_memoryview: return byte strings as memoryview slices of data instead of copies
+    key_cache_size: accepted for compatibility with the C implementation.
+    class_tags: list of cbor.tagmap.ClassTag; tags with their tag_number come back as decode_function(value)
+    raise_on_unknown_tag: with class_tags, raise UnknownTagException for any other tag
+    tag_hook: tag_hook(Tag) is returned in place of each Tag not handled otherwise
+    object_hook: object_hook(dict) is returned in place of each decoded dict
+    semantic_tags: decode tags 0 and 1 to datetime, 4 and 5 to Decimal, 35 to re.Pattern, 37 to UUID and 258 to set
+    Strings referred to by tag 25 inside tag 256 (stringref) are always resolved.
     """
+    hooks = _decode_hooks(class_tags, raise_on_unknown_tag, tag_hook, object_hook, semantic_tags)
+    return _loads_data(data, bytes_as_memoryview, hooks)
+
+
+def _loads_data(data, bytes_as_memoryview, hooks):
     if data is None:
         raise ValueError("got None for buffer to decode in loads")
-    fp = StringIO(data)
-    return _loads(fp)[0]
+    if bytes_as_memoryview:
+        fp = _ViewReader(data)
+    else:
+        fp = StringIO(data)
+    ob = _loads(fp)[0]
+    if hooks is not None:
+        ob = hooks.apply(ob)
+    return ob
 
 
-def load(fp):
+def load(fp, consume_ahead=False, key_cache_size=None, class_tags=None, raise_on_unknown_tag=False,
+         tag_hook=None, object_hook=None, semantic_tags=False):
     """
     Parse and return object from fp, a file-like object supporting .read(n)
+    consume_ahead, key_cache_size: accepted for compatibility with the C implementation.
+    This implementation only ever reads the bytes it needs.
+    class_tags, raise_on_unknown_tag, tag_hook, object_hook, semantic_tags: as for loads()
+    """
+    ob = _loads(fp)[0]
+    hooks = _decode_hooks(class_tags, raise_on_unknown_tag, tag_hook, object_hook, semantic_tags)
+    if hooks is not None:
+        ob = hooks.apply(ob)
+    return ob
+
+
+class _CountingReader(object):
+    "wrap fp.read() and count the bytes read"
+    def __init__(self, fp):
+        self.fp = fp
+        self.count = 0
+
+    def read(self, n):
+        data = self.fp.read(n)
+        self.count += len(data)
+        return data
+
+
+class Encoder(object):
+    """
+    dumps() with its options given once.
+    Encoder(**options).encode(obj) returns what dumps(obj, **options) would.
+    """
+    def __init__(self, **options):
+        # fail here on options dumps() doesn't take
+        dumps(None, **options)
+        self._options = options
+
+    def encode(self, obj):
+        return dumps(obj, **self._options)
+
+    def encode_into(self, obj, buf, offset=0):
+        return dumps_into(obj, buf, offset, **self._options)
+
+
+class Decoder(object):
+    """
+    loads() with its options given once.
+    Decoder(**options).decode(data) returns what loads(data, **options) would.
+    """
+    def __init__(self, bytes_as_memoryview=False, key_cache_size=None, class_tags=None, raise_on_unknown_tag=False,
+                 tag_hook=None, object_hook=None, semantic_tags=False):
+        self._bytes_as_memoryview = bytes_as_memoryview
+        self._hooks = _decode_hooks(class_tags, raise_on_unknown_tag, tag_hook, object_hook, semantic_tags)
+
+    def decode(self, data):
+        return _loads_data(data, self._bytes_as_memoryview, self._hooks)
+
+
+class StreamDecoder(object):
+    """
+    Incremental decoder for a CBOR Sequence that arrives in pieces, as from a
+    non-blocking socket. feed() it bytes as they come; iterating over it
+    returns the items that are complete so far, and stops at one that isn't.
+    options: as for loads(), except bytes_as_memoryview
+    """
+    def __init__(self, key_cache_size=None, class_tags=None, raise_on_unknown_tag=False,
+                 tag_hook=None, object_hook=None, semantic_tags=False):
+        self._hooks = _decode_hooks(class_tags, raise_on_unknown_tag, tag_hook, object_hook, semantic_tags)
+        self._buf = bytearray()
+        self._start = 0
+        self._failed = False
+
+    @property
+    def buffered(self):
+        "number of bytes fed that are not part of an item returned yet"
+        return len(self._buf) - self._start
+
+    def _check(self):
+        if self._failed:
+            raise ValueError('StreamDecoder stopped at data that is not well-formed CBOR')
+
+    def feed(self, data):
+        "Add the bytes-like data to what is waiting to be decoded."
+        self._check()
+        if self._start > 0:
+            del self._buf[:self._start]
+            self._start = 0
+        self._buf += data
+
+    def __iter__(self):
+        return self
+
+    def __next__(self):
+        self._check()
+        if self._start >= len(self._buf):
+            raise StopIteration
+        view = _scan_bytes(self._buf)
+        try:
+            end = _scan_item(view, self._start)
+        except _TruncatedError:
+            raise StopIteration
+        except ValueError:
+            self._failed = True
+            raise
+        finally:
+            if hasattr(view, 'release'):
+                view.release()
+        item = bytes(self._buf[self._start:end])
+        # a well-formed item that can't be decoded is skipped
+        self._start = end
+        return _loads_data(item, False, self._hooks)
+
+    next = __next__
+
+
+def iter_load(fp, offsets=False, consume_ahead=True, key_cache_size=None, semantic_tags=False):
+    """
+    Iterate over concatenated CBOR items (a CBOR Sequence, RFC 8742).
+    fp: file-like object supporting .read(n), or a buffer like loads() takes
+    offsets: yield (offset, item) where offset counts bytes from where iteration started
+    consume_ahead, key_cache_size: accepted for compatibility with the C implementation.
+    This implementation only ever reads the bytes it needs.
+    semantic_tags: as for loads()
+    """
+    hooks = _decode_hooks(None, False, None, None, semantic_tags)
+    if not hasattr(fp, 'read'):
+        fp = StringIO(fp)
+    fp = _CountingReader(fp)
+    while True:
+        offset = fp.count
+        tb = fp.read(1)
+        if len(tb) == 0:
+            return
+        ob = _loads_tb(fp, ord(tb))[0]
+        if hooks is not None:
+            ob = hooks.apply(ob)
+        if offsets:
+            yield (offset, ob)
+        else:
+            yield ob
+
+
+def loads_seq(data, offsets=False, key_cache_size=None, semantic_tags=False):
     """
-    return _loads(fp)[0]
+    Iterate over concatenated CBOR items (a CBOR Sequence, RFC 8742) in a buffer.
+    offsets: yield (offset, item) where offset is the item's position in data
+    key_cache_size: accepted for compatibility with the C implementation.
+    semantic_tags: as for loads()
+    """
+    if data is None:
+        raise ValueError("got None for buffer to decode in loads_seq")
+    return iter_load(StringIO(data), offsets=offsets, semantic_tags=semantic_tags)
+
+
+_SCAN_DEFINITE = 0
+_SCAN_INDEFINITE = 1
+_SCAN_INDEFINITE_MAP = 2
+_SCAN_CHUNKS = 3
+
+_HEAD_FORMATS = {
+    CBOR_UINT8_FOLLOWS: '!B',
+    CBOR_UINT16_FOLLOWS: '!H',
+    CBOR_UINT32_FOLLOWS: '!I',
+    CBOR_UINT64_FOLLOWS: '!Q',
+}
+
+
+def _scan_bytes(data):
+    "return something indexable by byte giving ints, without copying where possible"
+    if _IS_PY3:
+        view = memoryview(data)
+        if view.format != 'B' or view.ndim != 1:
+            view = view.cast('B')
+        return view
+    return bytearray(data)
+
+
+class _TruncatedError(ValueError):
+    "_scan_item() ran out of data, the item may yet be well-formed"
+
+
+def _scan_item(data, pos):
+    """
+    Walk one well-formed item starting at data[pos] without decoding it.
+    Return the offset just past it. Raise ValueError if it is malformed or truncated.
+    stack holds [kind, count, chunk_type] for each open container:
+    items still to come in a definite array or map, items so far in an indefinite one.
+    """
+    end = len(data)
+    stack = []
+    pending_tag = False
+    while True:
+        if pos >= end:
+            raise _TruncatedError("truncated CBOR item, data ends at {0}".format(end))
+        c = data[pos]
+        if c == CBOR_BREAK:
+            if (not stack) or pending_tag or stack[-1][0] == _SCAN_DEFINITE:
+                raise ValueError("unexpected BREAK at {0}".format(pos))
+            if stack[-1][0] == _SCAN_INDEFINITE_MAP and (stack[-1][1] & 1):
+                raise ValueError("map key with no value before BREAK at {0}".format(pos))
+            pos += 1
+            stack.pop()
+        else:
+            cbor_type = c & CBOR_TYPE_MASK
+            cbor_info = c & CBOR_INFO_BITS
+            start = pos
+            pos += 1
+            if cbor_info < CBOR_UINT8_FOLLOWS:
+                aux = cbor_info
+            elif cbor_info <= CBOR_UINT64_FOLLOWS:
+                fmt = _HEAD_FORMATS[cbor_info]
+                size = struct.calcsize(fmt)
+                if end - pos < size:
+                    raise _TruncatedError("truncated CBOR item, data ends at {0}".format(end))
+                aux = struct.unpack(fmt, bytes(data[pos:pos + size]))[0]
+                pos += size
+            elif cbor_info == CBOR_VAR_FOLLOWS:
+                aux = None
+            else:
+                raise ValueError("reserved additional information {0} at {1}".format(cbor_info, start))
+            if stack and stack[-1][0] == _SCAN_CHUNKS:
+                if cbor_type != stack[-1][2] or aux is None:
+                    raise ValueError("bad chunk {0:02x} in indefinite length string at {1}".format(c, start))
+            pending_tag = False
+            if cbor_type == CBOR_UINT or cbor_type == CBOR_NEGINT:
+                if aux is None:
+                    raise ValueError("indefinite length integer at {0}".format(start))
+            elif cbor_type == CBOR_BYTES or cbor_type == CBOR_TEXT:
+                if aux is None:
+                    stack.append([_SCAN_CHUNKS, 0, cbor_type])
+                    continue
+                if end - pos < aux:
+                    raise _TruncatedError("truncated CBOR item, data ends at {0}".format(end))
+                pos += aux
+            elif cbor_type == CBOR_ARRAY or cbor_type == CBOR_MAP:
+                if aux is None:
+                    kind = _SCAN_INDEFINITE_MAP if cbor_type == CBOR_MAP else _SCAN_INDEFINITE
+                    stack.append([kind, 0, None])
+                    continue
+                if cbor_type == CBOR_MAP:
+                    aux *= 2
+                if aux > 0:
+                    stack.append([_SCAN_DEFINITE, aux, None])
+                    continue
+            elif cbor_type == CBOR_TAG:
+                if aux is None:
+                    raise ValueError("indefinite length tag at {0}".format(start))
+                # the tagged item that follows completes this item
+                pending_tag = True
+                continue
+            else:
+                if cbor_info == CBOR_UINT8_FOLLOWS and aux < 32:
+                    raise ValueError("simple value {0} in two bytes at {1}".format(aux, start))
+        # an item (or string chunk) is complete, pop every container it completes
+        while stack:
+            frame = stack[-1]
+            if frame[0] != _SCAN_DEFINITE:
+                frame[1] += 1
+                break
+            frame[1] -= 1
+            if frame[1] > 0:
+                break
+            stack.pop()
+        if not stack:
+            return pos
+
+
+def scan(data, offset=0, count=-1):
+    """
+    Find where CBOR items end without decoding them.
+    Returns a list of the end offsets of up to count (all if -1) consecutive
+    items starting at offset. Raises ValueError if an item is not well-formed
+    or is cut off by the end of data.
+    """
+    data = _scan_bytes(data)
+    if offset < 0 or offset > len(data):
+        raise ValueError("offset {0} outside of data of length {1}".format(offset, len(data)))
+    out = []
+    pos = offset
+    while count != 0 and pos < len(data):
+        pos = _scan_item(data, pos)
+        out.append(pos)
+        if count > 0:
+            count -= 1
+    return out
+
+
+def validate(data, sequence=False):
+    """
+    Check that data is well-formed CBOR without decoding it.
+    Returns True if data is exactly one well-formed item, or with sequence=True
+    any number of them. scan() raises an error saying what is wrong.
+    """
+    data = _scan_bytes(data)
+    try:
+        if sequence:
+            scan(data)
+            return True
+        return len(data) > 0 and _scan_item(data, 0) == len(data)
+    except ValueError:
+        return False
 
 
 _MAX_DEPTH = 100
@@ -393,7 +1118,9 @@ def _loads_tb(fp, tb, limit=None, depth=0, returntags=False):
             if mant == 0:
                 val = float('Inf')
             else:
-                val = float('NaN')
+                # NaN, keep the sign and payload bits
+                bits = ((hibyte & 0x80) << 56) | (0x7ff << 52) | (mant << 42)
+                return (struct.unpack("!d", struct.pack("!Q", bits))[0], 3)
         else:
             val = (mant + 1024.0) * (2 ** (exp - 25))
         if hibyte & 0x80:
@@ -416,10 +1143,14 @@ def _loads_tb(fp, tb, limit=None, depth=0, returntags=False):
         return (-1 - aux, bytes_read)
     elif tag == CBOR_BYTES:
         ob, subpos = loads_bytes(fp, aux)
+        if aux is not None:
+            _stringref_note(ob, aux)
         return (ob, bytes_read + subpos)
     elif tag == CBOR_TEXT:
         raw, subpos = loads_bytes(fp, aux, btag=CBOR_TEXT)
         ob = raw.decode('utf8')
+        if aux is not None:
+            _stringref_note(ob, aux)
         return (ob, bytes_read + subpos)
     elif tag == CBOR_ARRAY:
         if aux is None:
@@ -430,6 +1161,12 @@ def _loads_tb(fp, tb, limit=None, depth=0, returntags=False):
             return _loads_var_map(fp, limit, depth, returntags, bytes_read)
         return _loads_map(fp, limit, depth, returntags, aux, bytes_read)
     elif tag == CBOR_TAG:
+        if aux == CBOR_TAG_STRINGREF_NAMESPACE:
+            ob, subpos = _loads_stringref_namespace(fp)
+            return ob, bytes_read + subpos
+        if (aux == CBOR_TAG_STRINGREF) and getattr(_stringrefs, 'tables', None):
+            ob, subpos = _loads_stringref(fp)
+            return ob, bytes_read + subpos
         ob, subpos = _loads(fp)
         bytes_read += subpos
         if returntags:
@@ -451,10 +1188,52 @@ def _loads_tb(fp, tb, limit=None, depth=0, returntags=False):
         raise ValueError("unknown cbor tag 7 byte: {:02x}".format(tb))
 
 
+# Per thread stack of the string tables of the stringref namespaces
+# (tag 256) being decoded, innermost last.
+_stringrefs = threading.local()
+
+
+def _stringref_note(ob, size):
+    "add string ob, size bytes encoded, to the current stringref table if there is one and it's long enough"
+    tables = getattr(_stringrefs, 'tables', None)
+    if tables:
+        table = tables[-1]
+        if size >= _stringref_min_len(len(table)):
+            table.append(ob)
+
+
+def _loads_stringref_namespace(fp):
+    tables = getattr(_stringrefs, 'tables', None)
+    if tables is None:
+        tables = _stringrefs.tables = []
+    tables.append([])
+    try:
+        return _loads(fp)
+    finally:
+        tables.pop()
+
+
+def _loads_stringref(fp):
+    index, subpos = _loads(fp)
+    table = _stringrefs.tables[-1]
+    if isinstance(index, bool) or not _is_intish(index) or (index < 0):
+        raise ValueError('stringref index is not an unsigned int: {0!r}'.format(index))
+    if index >= len(table):
+        raise ValueError('stringref {0} past the {1} strings so far'.format(index, len(table)))
+    return table[index], subpos
+
+
 def loads_bytes(fp, aux, btag=CBOR_BYTES):
     # TODO: limit to some maximum number of chunks and some maximum total bytes
     if aux is not None:
         # simple case
+        view = getattr(fp, 'view', None)
+        if (view is not None) and (btag == CBOR_BYTES):
+            # loads(bytes_as_memoryview=True), slice instead of copy
+            pos = fp.tell()
+            ob = view[pos:pos + aux]
+            fp.seek(aux, 1)
+            return (ob, aux)
         ob = fp.read(aux)
         return (ob, aux)
     # read chunks of bytes
@@ -477,34 +1256,168 @@ def loads_bytes(fp, aux, btag=CBOR_BYTES):
 
 if _IS_PY3:
     def _bytes_to_biguint(bs):
-        out = 0
-        for ch in bs:
-            out = out << 8
-            out = out | ch
-        return out
+        return int.from_bytes(bs, 'big')
 else:
     def _bytes_to_biguint(bs):
-        out = 0
-        for ch in bs:
-            out = out << 8
-            out = out | ord(ch)
-        return out
+        if not bs:
+            return 0
+        return long(binascii.hexlify(bs), 16)
 
 
 def tagify(ob, aux):
-    # TODO: make this extensible?
-    # cbor.register_tag_handler(tagnumber, tag_handler)
-    # where tag_handler takes (tagnumber, tagged_object)
-    if aux == CBOR_TAG_DATE_STRING:
-        # TODO: parse RFC3339 date string
-        pass
-    if aux == CBOR_TAG_DATE_ARRAY:
-        return datetime.datetime.utcfromtimestamp(ob)
+    # Other tags are left to loads(class_tags=, tag_hook=, semantic_tags=True)
     if aux == CBOR_TAG_BIGNUM:
         return _bytes_to_biguint(ob)
     if aux == CBOR_TAG_NEGBIGNUM:
         return -1 - _bytes_to_biguint(ob)
-    if aux == CBOR_TAG_REGEX:
-        # Is this actually a good idea? Should we just return the tag and the raw value to the user somehow?
-        return re.compile(ob)
     return Tag(aux, ob)
+
+
+# semantic_tags=True, the same conversions as the C implementation
+
+if _IS_PY3:
+    _UTC = datetime.timezone.utc
+else:
+    _UTC = None
+
+_RFC3339_RE = re.compile(
+    r'([0-9]{4})-([0-9]{2})-([0-9]{2})[Tt ]([0-9]{2}):([0-9]{2}):([0-9]{2})'
+    r'(?:\.([0-9]+))?(?:([Zz])|([+-])([0-9]{2}):([0-9]{2}))\Z')
+
+# |exponent| limit for tag 5, as in the C implementation
+_BIGFLOAT_MAX_EXPONENT = 65536
+
+
+def _datetime_to_rfc3339(dt):
+    "tag 0 text: whole minute UTC offsets are kept, naive is taken to be UTC, anything else becomes UTC"
+    minutes = 0
+    offset = dt.utcoffset()
+    if offset is not None:
+        seconds = (offset.days * 86400) + offset.seconds
+        if (seconds % 60) or offset.microseconds:
+            dt = dt.astimezone(_UTC)
+        else:
+            minutes = seconds // 60
+    text = '{0:04d}-{1:02d}-{2:02d}T{3:02d}:{4:02d}:{5:02d}'.format(
+        dt.year, dt.month, dt.day, dt.hour, dt.minute, dt.second)
+    if dt.microsecond:
+        text += '.{0:06d}'.format(dt.microsecond)
+    if minutes == 0:
+        return text + 'Z'
+    sign = '-' if minutes < 0 else '+'
+    minutes = abs(minutes)
+    return text + '{0}{1:02d}:{2:02d}'.format(sign, minutes // 60, minutes % 60)
+
+
+def _datetime_from_rfc3339(text):
+    m = _RFC3339_RE.match(text) if _is_unicode(text) else None
+    if m is None:
+        raise ValueError('tag 0 is not an RFC 3339 date-time: {0!r}'.format(text))
+    usec = 0
+    if m.group(7):
+        # truncate to microseconds
+        usec = int((m.group(7) + '00000')[:6])
+    tz = _UTC
+    if m.group(9):
+        oh, om = int(m.group(10)), int(m.group(11))
+        if (oh > 23) or (om > 59):
+            raise ValueError('tag 0 is not an RFC 3339 date-time: {0!r}'.format(text))
+        offset = ((oh * 60) + om) * 60
+        if offset:
+            if m.group(9) == '-':
+                offset = -offset
+            tz = datetime.timezone(datetime.timedelta(seconds=offset))
+    return datetime.datetime(int(m.group(1)), int(m.group(2)), int(m.group(3)),
+                             int(m.group(4)), int(m.group(5)), int(m.group(6)), usec, tz)
+
+
+def _semantic_value_error(tag, value):
+    return ValueError('bad value for tag {0}: {1}'.format(tag, type(value).__name__))
+
+
+def _datetime_from_timestamp(value):
+    if isinstance(value, bool) or not isinstance(value, (int, float)):
+        raise _semantic_value_error(CBOR_TAG_DATE_ARRAY, value)
+    return datetime.datetime.fromtimestamp(value, _UTC)
+
+
+def _decimal_from_tag(value):
+    if not (isinstance(value, list) and (len(value) == 2) and all(_is_intish(x) and not isinstance(x, bool) for x in value)):
+        raise _semantic_value_error(CBOR_TAG_DECIMAL, value)
+    import decimal
+    return decimal.Decimal('{1}E{0}'.format(*value))
+
+
+def _decimal_from_bigfloat(value):
+    if not (isinstance(value, list) and (len(value) == 2) and all(_is_intish(x) and not isinstance(x, bool) for x in value)):
+        raise _semantic_value_error(CBOR_TAG_BIGFLOAT, value)
+    import decimal
+    e, m = value
+    if abs(e) > _BIGFLOAT_MAX_EXPONENT:
+        raise ValueError('tag 5 exponent out of range')
+    if e >= 0:
+        return decimal.Decimal(str(m << e))
+    # m * 2**-k == m * 5**k * 10**-k
+    return decimal.Decimal('{0}E{1}'.format(m * (5 ** -e), e))
+
+
+def _regex_from_tag(value):
+    if not _is_unicode(value):
+        raise _semantic_value_error(CBOR_TAG_REGEX, value)
+    return re.compile(value)
+
+
+def _uuid_from_tag(value):
+    if not isinstance(value, (bytes, bytearray, memoryview)):
+        raise _semantic_value_error(CBOR_TAG_UUID, value)
+    import uuid
+    return uuid.UUID(bytes=bytes(value))
+
+
+def _set_from_tag(value):
+    if not isinstance(value, list):
+        raise _semantic_value_error(CBOR_TAG_SET, value)
+    return set(value)
+
+
+_SEMANTIC_DECODERS = {
+    CBOR_TAG_DATE_STRING: _datetime_from_rfc3339,
+    CBOR_TAG_DATE_ARRAY: _datetime_from_timestamp,
+    CBOR_TAG_DECIMAL: _decimal_from_tag,
+    CBOR_TAG_BIGFLOAT: _decimal_from_bigfloat,
+    CBOR_TAG_REGEX: _regex_from_tag,
+    CBOR_TAG_UUID: _uuid_from_tag,
+    CBOR_TAG_SET: _set_from_tag,
+}
+
+
+def _semantic_default(default, canonical=False):
+    "wrap dumps(default=) to first write the types semantic_tags=True covers"
+    if not _IS_PY3:
+        raise NotImplementedError('semantic_tags needs Python 3')
+    import decimal
+    import uuid
+    pattern_type = type(re.compile(''))
+    def semantic_default(ob):
+        if isinstance(ob, datetime.datetime):
+            return Tag(CBOR_TAG_DATE_STRING, _datetime_to_rfc3339(ob))
+        if isinstance(ob, (set, frozenset)):
+            if canonical:
+                items = _canonical_items(((x, x) for x in ob), 'shortest', semantic_default)
+                return Tag(CBOR_TAG_SET, [x for _, x in items])
+            return Tag(CBOR_TAG_SET, list(ob))
+        if isinstance(ob, decimal.Decimal):
+            sign, digits, exponent = ob.as_tuple()
+            if not _is_intish(exponent):
+                # NaN and infinities
+                return float(ob)
+            mantissa = int(''.join(str(d) for d in digits))
+            return Tag(CBOR_TAG_DECIMAL, [exponent, -mantissa if sign else mantissa])
+        if isinstance(ob, uuid.UUID):
+            return Tag(CBOR_TAG_UUID, ob.bytes)
+        if isinstance(ob, pattern_type) and _is_unicode(ob.pattern):
+            return Tag(CBOR_TAG_REGEX, ob.pattern)
+        if default is not None:
+            return default(ob)
+        raise Exception("don't know how to cbor serialize object of type %s", type(ob))
+    return semantic_default
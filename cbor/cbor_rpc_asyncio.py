@@ -0,0 +1,227 @@
+'''
+asyncio client for the CBOR-RPC protocol CborRpcClient speaks: requests
+{'id', 'method', 'params'}, responses {'id', 'result'} or {'id', 'error'}.
+
+Any number of calls share one connection. A call doesn't wait for the
+ones before it: requests made in the same turn of the event loop go out
+in one write, and responses are matched to calls by id in whatever order
+they come back.
+
+    client = AsyncCborRpcClient({'address': ('localhost', 5432)})
+    results = await asyncio.gather(*[client.call('get', [k]) for k in keys])
+    client.close()
+
+Python 3.7 or later.
+'''
+from __future__ import absolute_import
+import asyncio
+import logging
+import socket
+
+import cbor
+
+
+logger = logging.getLogger(__name__)
+
+
+class CborRpcError(Exception):
+    '''The server answered a call with an error message.'''
+
+
+_DEFAULT = object()
+
+
+def _time_out(fut):
+    if not fut.done():
+        fut.set_exception(asyncio.TimeoutError())
+
+
+class _CborRpcProtocol(asyncio.Protocol):
+    '''One connection: writes requests, decodes responses as they arrive.'''
+
+    def __init__(self, client):
+        self.client = client
+        self.transport = None
+        self.decoder = cbor.StreamDecoder()
+        # {id: future} of calls waiting for their response
+        self.pending = {}
+        self.writable = asyncio.Event()
+        self.writable.set()
+        # requests made since the last write, all written at once at the
+        # end of this turn of the event loop
+        self.outbox = []
+
+    def connection_made(self, transport):
+        self.transport = transport
+
+    def send(self, request):
+        if not self.outbox:
+            asyncio.get_running_loop().call_soon(self.flush)
+        self.outbox.append(request)
+
+    def flush(self):
+        if self.outbox and not self.transport.is_closing():
+            self.transport.write(b''.join(self.outbox))
+        self.outbox = []
+
+    def data_received(self, data):
+        self.decoder.feed(data)
+        try:
+            for response in self.decoder:
+                fut = self.pending.get(response.get('id')) if hasattr(response, 'get') else None
+                if fut is None:
+                    # the call timed out or was cancelled
+                    logger.debug('response to no call waiting: %r', response)
+                elif not fut.done():
+                    fut.set_result(response)
+        except Exception as ex:
+            logger.error('bad data from server, closing connection', exc_info=True)
+            self.fail(ConnectionError('bad data from server: {0}'.format(ex)))
+            self.transport.close()
+
+    def pause_writing(self):
+        self.writable.clear()
+
+    def resume_writing(self):
+        self.writable.set()
+
+    def connection_lost(self, exc):
+        self.fail(ConnectionError('connection to server lost: {0}'.format(exc or 'closed')))
+        # let anyone waiting to write find out
+        self.writable.set()
+        self.client._lost(self)
+
+    def fail(self, ex):
+        for fut in self.pending.values():
+            if not fut.done():
+                fut.set_exception(ex)
+        self.pending.clear()
+
+
+class AsyncCborRpcClient(object):
+    '''Pipelined, multiplexed CBOR-RPC client for asyncio.
+
+    config takes `addr_family` and `address` as for CborRpcClient, and:
+      `timeout`: seconds to wait for each response, None for no limit (default 10.0)
+      `max_in_flight`: most calls to have sent and not had a response to;
+        more wait for a turn before sending (default 1024)
+      `write_buffer_limit`: calls also wait to send while the connection has
+        more than this many bytes not yet written to the socket (default 1MB)
+
+    Calls are not retried. With several in flight on a connection that
+    breaks there is no telling which ones the server ran. Calls that were
+    waiting when it broke raise ConnectionError, and the next call
+    connects again.
+
+    .. automethod:: call
+    .. automethod:: close
+
+    '''
+
+    def __init__(self, config=None):
+        config = config or {}
+        self._socket_family = config.get('addr_family', socket.AF_INET)
+        self._socket_addr = config.get('address')
+        if self._socket_family != socket.AF_UNIX:
+            self._socket_addr = tuple(self._socket_addr)
+            assert len(self._socket_addr) == 2, 'address must be length-2 tuple ("hostname", port number), got {!r}'.format(self._socket_addr)
+        self._timeout = config.get('timeout', 10.0)
+        self._max_in_flight = int(config.get('max_in_flight', 1024))
+        self._write_buffer_limit = int(config.get('write_buffer_limit', 1024 * 1024))
+        self._encoder = cbor.Encoder()
+        self._message_count = 0
+        self._protocol = None
+        # made on first use, inside the event loop
+        self._connect_lock = None
+        self._in_flight = None
+
+    async def _conn(self):
+        # lazy connection opener
+        if self._protocol is None:
+            if self._connect_lock is None:
+                self._connect_lock = asyncio.Lock()
+            async with self._connect_lock:
+                if self._protocol is None:
+                    loop = asyncio.get_running_loop()
+                    if self._socket_family == socket.AF_UNIX:
+                        transport, protocol = await loop.create_unix_connection(
+                            lambda: _CborRpcProtocol(self), self._socket_addr)
+                    else:
+                        transport, protocol = await loop.create_connection(
+                            lambda: _CborRpcProtocol(self), self._socket_addr[0], self._socket_addr[1],
+                            family=self._socket_family)
+                        transport.get_extra_info('socket').setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+                    transport.set_write_buffer_limits(high=self._write_buffer_limit)
+                    self._protocol = protocol
+        return self._protocol
+
+    def _lost(self, protocol):
+        if self._protocol is protocol:
+            self._protocol = None
+
+    def close(self):
+        '''Close the connection to the server.
+
+        Calls waiting for a response raise ConnectionError. The next call
+        opens a new connection.
+
+        '''
+        if self._protocol is not None:
+            self._protocol.transport.close()
+            self._protocol = None
+
+    async def __aenter__(self):
+        return self
+
+    async def __aexit__(self, *args):
+        self.close()
+
+    async def call(self, method_name, params, timeout=_DEFAULT):
+        '''Call ``method_name(*params)`` on the server and return its result.
+
+        timeout: seconds to wait for the response, default from config
+
+        :raise CborRpcError: if the server response was a failure
+        :raise asyncio.TimeoutError: if there was no response in time
+        :raise ConnectionError: if the connection broke first
+
+        '''
+        if timeout is _DEFAULT:
+            timeout = self._timeout
+        if self._in_flight is None:
+            self._in_flight = asyncio.Semaphore(self._max_in_flight)
+        async with self._in_flight:
+            protocol = await self._conn()
+            if not protocol.writable.is_set():
+                await protocol.writable.wait()
+                if protocol.transport.is_closing():
+                    raise ConnectionError('connection to server lost')
+            self._message_count += 1
+            msg_id = self._message_count
+            loop = asyncio.get_running_loop()
+            fut = loop.create_future()
+            protocol.send(self._encoder.encode({
+                'id': msg_id,
+                'method': method_name,
+                'params': params,
+            }))
+            protocol.pending[msg_id] = fut
+            timer = loop.call_later(timeout, _time_out, fut) if timeout is not None else None
+            try:
+                response = await fut
+            finally:
+                protocol.pending.pop(msg_id, None)
+                if timer is not None:
+                    timer.cancel()
+        if 'result' in response:
+            return response['result']
+        errormessage = response.get('error')
+        if errormessage and hasattr(errormessage, 'get'):
+            errormessage = errormessage.get('message')
+        if not errormessage:
+            errormessage = repr(response)
+        raise CborRpcError(errormessage)
+
+    # same name and arguments as CborRpcClient
+    _rpc = call
+
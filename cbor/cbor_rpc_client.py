@@ -1,7 +1,10 @@
 from __future__ import absolute_import
+import errno
 import logging
 import random
+import select
 import socket
+import threading
 import time
 
 import cbor
@@ -20,22 +23,207 @@ class SocketReader(object):
 
     def read(self, num):
         start = time.time()
-        data = self.socket.recv(num)
-        while len(data) < num:
-            now = time.time()
-            if now > (start + self.timeout_seconds):
+        data = bytearray(num)
+        view = memoryview(data)
+        pos = 0
+        while pos < num:
+            if time.time() > (start + self.timeout_seconds):
                 break
-            ndat = self.socket.recv(num - len(data))
-            if ndat:
-                data += ndat
-        return data
+            got = self.socket.recv_into(view[pos:])
+            if not got:
+                # closed
+                break
+            pos += got
+        return bytes(data[:pos])
+
+
+def _ready(sock, write, timeout):
+    '''Wait up to timeout seconds (None: forever) for sock to be readable, or
+    writable too if write. Returns (readable, writable).'''
+    if hasattr(select, 'poll'):
+        # unlike select(), works for any file descriptor number
+        events = select.POLLIN | (select.POLLOUT if write else 0)
+        poller = select.poll()
+        poller.register(sock, events)
+        ready = poller.poll(None if timeout is None else timeout * 1000.0)
+        revents = ready[0][1] if ready else 0
+        return (bool(revents & (select.POLLIN | select.POLLERR | select.POLLHUP)),
+                bool(revents & select.POLLOUT))
+    readable, writable, _ = select.select([sock], [sock] if write else [], [], timeout)
+    return bool(readable), bool(writable)
+
+
+_NOTHING = object()
+
+_WOULD_BLOCK = (errno.EAGAIN, errno.EWOULDBLOCK)
+
+
+class _Connection(object):
+    '''One socket to the server and the response data read from it.'''
+
+    def __init__(self, sock, generation, buffer_size):
+        self.socket = sock
+        # waits go through _ready(), so a send never blocks on a full buffer
+        sock.setblocking(False)
+        self.generation = generation
+        # recv_into() this, instead of allocating for each read
+        self.buf = bytearray(buffer_size)
+        self.view = memoryview(self.buf)
+        self.decoder = cbor.StreamDecoder()
+        self.last_used = time.time()
+        # the whole request went out in the last exchange()
+        self.sent = False
+
+    def healthy(self, idle_timeout):
+        '''True if this idle connection looks fit to use again.'''
+        if (idle_timeout is not None) and (time.time() - self.last_used > idle_timeout):
+            return False
+        if self.decoder.buffered:
+            return False
+        try:
+            readable, _ = _ready(self.socket, False, 0)
+        except (socket.error, ValueError):
+            return False
+        # Nothing is owed to an idle connection. If it's readable the server
+        # closed it, reset it, or sent something no call is waiting for.
+        return not readable
+
+    def exchange(self, data, msg_ids, timeout):
+        '''Send the request data and return {id: response} for msg_ids.'''
+        out = {}
+        view = memoryview(data)
+        self.sent = False
+        try:
+            sent = self.socket.send(view)
+        except socket.error as ex:
+            if ex.errno not in _WOULD_BLOCK:
+                raise
+            sent = 0
+        while sent < len(data):
+            # A big batch: read responses while writing, so the server
+            # never stalls on us not reading, with us stalled on it.
+            readable, writable = _ready(self.socket, True, timeout)
+            if not (readable or writable):
+                raise socket.timeout('timed out')
+            if readable:
+                self.recv(out, msg_ids, timeout)
+            if writable:
+                sent += self.socket.send(view[sent:])
+        self.sent = True
+        self.collect(out, msg_ids)
+        while len(out) < len(msg_ids):
+            self.recv(out, msg_ids, timeout)
+        return out
+
+    def recv(self, out, msg_ids, timeout):
+        while True:
+            try:
+                got = self.socket.recv_into(self.buf)
+                break
+            except socket.error as ex:
+                if ex.errno not in _WOULD_BLOCK:
+                    raise
+            if not _ready(self.socket, False, timeout)[0]:
+                raise socket.timeout('timed out')
+        if not got:
+            raise EOFError('connection closed by server')
+        self.decoder.feed(self.view[:got])
+        self.collect(out, msg_ids)
+
+    def collect(self, out, msg_ids):
+        while len(out) < len(msg_ids):
+            response = next(self.decoder, _NOTHING)
+            if response is _NOTHING:
+                return
+            msg_id = response.get('id') if hasattr(response, 'get') else None
+            if msg_id in msg_ids:
+                out[msg_id] = response
+            else:
+                logger.debug('response to no call waiting: %r', response)
+
+    def close(self):
+        try:
+            self.socket.shutdown(socket.SHUT_RDWR)
+            self.socket.close()
+        except socket.error:
+            logger.warn('error closing client socket', exc_info=True)
+
+
+def _response_result(response):
+    '''result from response, or raise Exception(error message).'''
+    if 'result' in response:
+        return response['result']
+    errormessage = response.get('error')
+    if errormessage and hasattr(errormessage,'get'):
+        errormessage = errormessage.get('message')
+    if not errormessage:
+        errormessage = repr(response)
+    raise Exception(errormessage)
+
+
+class CborRpcBatchCall(object):
+    '''One call in a CborRpcBatch. Its result() is ready once the batch is sent.'''
+
+    def __init__(self, msg_id, method_name, params):
+        self.id = msg_id
+        self.method = method_name
+        self.params = params
+        self.response = None
+
+    def result(self):
+        '''Return the result, or raise Exception(error message) as _rpc() does.'''
+        if self.response is None:
+            raise Exception('batch not sent yet')
+        return _response_result(self.response)
+
+
+class CborRpcBatch(object):
+    '''Calls to send in one write, from CborRpcClient.batch().
+
+        with client.batch() as batch:
+            calls = [batch.call('get', [k]) for k in keys]
+        values = [c.result() for c in calls]
+
+    The calls go out when the with block ends, unless it raised.
+
+    '''
+
+    def __init__(self, client):
+        self._client = client
+        self._calls = []
+
+    def call(self, method_name, params):
+        '''Add ``method_name(*params)``. Returns its CborRpcBatchCall.'''
+        call = CborRpcBatchCall(self._client._next_id(), method_name, params)
+        self._calls.append(call)
+        return call
+
+    _rpc = call
+
+    def send(self):
+        '''Send the calls added so far and wait for all their responses.'''
+        calls, self._calls = self._calls, []
+        if not calls:
+            return
+        buf = b''.join([cbor.dumps({'id': c.id, 'method': c.method, 'params': c.params}) for c in calls])
+        responses = self._client._exchange(buf, set([c.id for c in calls]),
+                                           'batch of {0}'.format(len(calls)))
+        for call in calls:
+            call.response = responses[call.id]
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_value, tb):
+        if exc_type is None:
+            self.send()
 
 
 class CborRpcClient(object):
     '''Base class for all client objects.
 
     This provides common `addr_family`, `address`, and `registry_addresses`
-    configuration parameters, and manages the connection back to the server.
+    configuration parameters, and manages the connections to the server.
 
     Automatic retry and time based fallback is managed from
     configuration parameters `retries` (default 5), and
@@ -44,8 +232,27 @@ class CborRpcClient(object):
     3; wait 4s; try 4; wait 8s; try 5; FAIL. Total time waited just
     under base_retry_seconds * (2 ** retries).
 
+    A client is safe to share between threads. Each call borrows a
+    connection from a pool, opening one if none is idle, up to
+    `max_connections` (default 8); more calls wait for one to be
+    returned. An idle connection is checked before it is used again and
+    dropped if the server closed it or it was idle over `idle_timeout`
+    seconds (default 60, None for no limit). A connection is dropped
+    after any error on it, and a call that failed on a reused connection
+    is first retried at once on a new one, without using up a retry.
+
+    `timeout` (default None, no limit) is the seconds to wait on each
+    socket read or write. A call that times out waiting for its response
+    is not retried, as the server may still be running it.
+    `buffer_size` (default 64KB) is the size of each connection's
+    receive buffer.
+
+    A subclass that talks to the server itself can still use `_conn()`
+    and `rfile`, one socket of the client's own, apart from the pool.
+
     .. automethod:: __init__
     .. automethod:: _rpc
+    .. automethod:: batch
     .. automethod:: close
 
     '''
@@ -66,41 +273,148 @@ class CborRpcClient(object):
         self._message_count = 0
         self._retries = config.get('retries', 5)
         self._base_retry_seconds = float(config.get('base_retry_seconds', 0.5))
+        self._timeout = config.get('timeout')
+        self._max_connections = int(config.get('max_connections', 8))
+        self._idle_timeout = config.get('idle_timeout', 60.0)
+        self._buffer_size = int(config.get('buffer_size', 64 * 1024))
+        self._lock = threading.Lock()
+        self._returned = threading.Condition(self._lock)
+        # connections not in use, most recently used last
+        self._idle = []
+        # connections open, idle or in use
+        self._open = 0
+        # bumped by close(), connections from before it are closed when returned
+        self._generation = 0
+
+    def _next_id(self):
+        with self._lock:
+            self._message_count += 1
+            return self._message_count
 
     def _conn(self):
-        # lazy socket opener
+        # lazy opener of the client's own socket, for rfile
         if self._socket is None:
-            try:
-                self._socket = socket.create_connection(self._socket_addr)
-                self._local_addr = self._socket.getsockname()
-            except:
-                logger.error('error connecting to %r:%r', self._socket_addr[0],
-                             self._socket_addr[1], exc_info=True)
-                raise
+            self._socket = self._new_socket()
         return self._socket
 
+    @property
+    def rfile(self):
+        if self._rfile is None:
+            self._rfile = SocketReader(self._conn())
+        return self._rfile
+
+    def _new_socket(self):
+        # new socket to the server
+        try:
+            if self._socket_family == socket.AF_UNIX:
+                sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+                sock.settimeout(self._timeout)
+                sock.connect(self._socket_addr)
+            else:
+                sock = socket.create_connection(self._socket_addr, self._timeout)
+                sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            self._local_addr = sock.getsockname()
+        except:
+            logger.error('error connecting to %r', self._socket_addr, exc_info=True)
+            raise
+        return sock
+
+    def _checkout(self):
+        '''Borrow a connection. Returns (connection, whether it was used before).'''
+        while True:
+            with self._lock:
+                while (not self._idle) and (self._open >= self._max_connections):
+                    self._returned.wait()
+                if self._idle:
+                    conn = self._idle.pop()
+                else:
+                    conn = None
+                    self._open += 1
+                generation = self._generation
+            if conn is None:
+                try:
+                    return _Connection(self._new_socket(), generation, self._buffer_size), False
+                except:
+                    self._checkin(None)
+                    raise
+            if conn.healthy(self._idle_timeout):
+                return conn, True
+            logger.debug('dropping stale connection')
+            self._checkin(conn, False)
+
+    def _checkin(self, conn, ok=False):
+        '''Give back a connection, to reuse if ok or else to close.'''
+        with self._lock:
+            if ok and (conn.generation == self._generation):
+                conn.last_used = time.time()
+                self._idle.append(conn)
+                conn = None
+            else:
+                self._open -= 1
+            self._returned.notify()
+        if conn is not None:
+            conn.close()
+
     def close(self):
-        '''Close the connection to the server.
+        '''Close the connections to the server.
 
-        The next RPC call will reopen the connection.
+        Connections in use are closed when their calls finish. The next
+        RPC call will open a new connection.
 
         '''
+        with self._lock:
+            self._generation += 1
+            idle, self._idle = self._idle, []
+            self._open -= len(idle)
+            self._returned.notify_all()
+        for conn in idle:
+            conn.close()
         if self._socket is not None:
             self._rfile = None
             try:
                 self._socket.shutdown(socket.SHUT_RDWR)
                 self._socket.close()
             except socket.error:
-                logger.warn('error closing lockd client socket',
-                            exc_info=True)
+                logger.warn('error closing client socket', exc_info=True)
             self._socket = None
 
-    @property
-    def rfile(self):
-        if self._rfile is None:
-            conn = self._conn()
-            self._rfile = SocketReader(conn)
-        return self._rfile
+    def _exchange(self, buf, msg_ids, what):
+        # send request(s) buf, return {id: response} with retries
+        mlog = logging.getLogger('cborrpc')
+        tryn = 0
+        delay = self._base_retry_seconds
+        retry_fresh = True
+        while True:
+            conn = None
+            reused = False
+            try:
+                conn, reused = self._checkout()
+                responses = conn.exchange(buf, msg_ids, self._timeout)
+                self._checkin(conn, True)
+                mlog.debug('responses %r', responses)
+                return responses
+            except Exception as ex:
+                if conn is not None:
+                    self._checkin(conn, False)
+                if isinstance(ex, socket.timeout) and (conn is not None) and conn.sent:
+                    # the server has the request and may still be running it
+                    logger.error('timed out waiting for %r', what)
+                    raise
+                if reused and retry_fresh:
+                    # the server may have closed it since the health check
+                    retry_fresh = False
+                    logger.debug('ex in %r (%s) on reused connection, retrying',
+                                 what, ex, exc_info=True)
+                    continue
+                if tryn < self._retries:
+                    tryn += 1
+                    logger.debug('ex in %r (%s), retrying %s in %s sec...',
+                                 what, ex, tryn, delay, exc_info=True)
+                    time.sleep(delay)
+                    delay *= 2
+                    continue
+                logger.error('failed in rpc %r', what, exc_info=True)
+                raise
 
     def _rpc(self, method_name, params):
         '''Call a method on the server.
@@ -112,51 +426,26 @@ class CborRpcClient(object):
         :raise Exception: if the server response was a failure
 
         '''
-        mlog = logging.getLogger('cborrpc')
-        tryn = 0
-        delay = self._base_retry_seconds
-        self._message_count += 1
         message = {
-            'id': self._message_count,
+            'id': self._next_id(),
             'method': method_name,
             'params': params
         }
-        mlog.debug('request %r', message)
-        buf = cbor.dumps(message)
+        logging.getLogger('cborrpc').debug('request %r', message)
+        responses = self._exchange(cbor.dumps(message), set([message['id']]), method_name)
+        # From here on out we got a response, the server didn't have
+        # some weird intermittent error or non-connectivity, it gave us
+        # an error message. We don't retry that, we raise it to the user.
+        return _response_result(responses[message['id']])
 
-        errormessage = None
-        while True:
-            try:
-                conn = self._conn()
-                conn.send(buf)
-                response = cbor.load(self.rfile)
-                mlog.debug('response %r', response)
-                assert response['id'] == message['id']
-                if 'result' in response:
-                    return response['result']
-                # From here on out we got a response, the server
-                # didn't have some weird intermittent error or
-                # non-connectivity, it gave us an error message. We
-                # don't retry that, we raise it to the user.
-                errormessage = response.get('error')
-                if errormessage and hasattr(errormessage,'get'):
-                    errormessage = errormessage.get('message')
-                if not errormessage:
-                    errormessage = repr(response)
-                break
-            except Exception as ex:
-                if tryn < self._retries:
-                    tryn += 1
-                    logger.debug('ex in %r (%s), retrying %s in %s sec...',
-                                 method_name, ex, tryn, delay, exc_info=True)
-                    self.close()
-                    time.sleep(delay)
-                    delay *= 2
-                    continue
-                logger.error('failed in rpc %r %r', method_name, params,
-                             exc_info=True)
-                raise
-        raise Exception(errormessage)
+    def batch(self):
+        '''Collect calls to send in one write on one connection.
+
+        Returns a CborRpcBatch, to use in a with block. The responses are
+        read as they come, in any order. Retries resend the whole batch.
+
+        '''
+        return CborRpcBatch(self)
 
 
 if __name__ == '__main__':
@@ -172,4 +461,3 @@ if __name__ == '__main__':
     #print(client._rpc(u'ping', []))
     #print(client._rpc(u'gnip', []))
     client.close()
-        
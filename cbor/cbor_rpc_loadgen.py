@@ -0,0 +1,115 @@
+'''
+Load generator for CBOR-RPC servers: keeps a fixed number of calls in
+flight for a while, then reports throughput and latency percentiles.
+
+    python -m cbor.cbor_rpc_loadgen [--address host:port] [--connections N]
+        [--concurrency C[,C...]] [--duration SECONDS] [--payload BYTES]
+
+With no --address it starts a CborRpcServer on loopback in a child
+process, so client and server don't share a CPU, and calls its echo().
+Each --concurrency level is run in turn.
+
+Python 3.7 or later.
+'''
+from __future__ import absolute_import
+import argparse
+import asyncio
+import multiprocessing
+import time
+
+from .cbor_rpc_asyncio import AsyncCborRpcClient
+from .cbor_rpc_server import CborRpcServer, echo, ping
+
+
+def _serve(conn):
+    '''Child process: echo server on a free loopback port.'''
+    async def main():
+        server = await CborRpcServer({}, {'echo': echo, 'ping': ping}).start()
+        conn.send(server.address)
+        conn.close()
+        await server.serve_forever()
+    try:
+        asyncio.run(main())
+    except KeyboardInterrupt:
+        pass
+
+
+def percentile(ordered, q):
+    '''q (0..1) percentile of a sorted list.'''
+    if not ordered:
+        return 0.0
+    return ordered[min(len(ordered) - 1, int(q * len(ordered)))]
+
+
+async def run_load(address, connections, concurrency, duration, method, params):
+    '''Keep concurrency calls in flight over connections for duration seconds.
+
+    Returns (number of calls, seconds taken, sorted list of latencies in seconds).
+
+    '''
+    clients = [AsyncCborRpcClient({'address': address, 'max_in_flight': concurrency})
+               for _ in range(connections)]
+    for client in clients:
+        await client.call(method, params)
+    latencies = []
+    clock = time.perf_counter
+    deadline = clock() + duration
+
+    async def worker(client):
+        while True:
+            start = clock()
+            if start >= deadline:
+                return
+            await client.call(method, params)
+            latencies.append(clock() - start)
+    start = clock()
+    await asyncio.gather(*[worker(clients[i % connections]) for i in range(concurrency)])
+    elapsed = clock() - start
+    for client in clients:
+        client.close()
+    latencies.sort()
+    return len(latencies), elapsed, latencies
+
+
+def main(argv=None):
+    ap = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    ap.add_argument('--address', help='host:port of the server (default: start one on loopback)')
+    ap.add_argument('--connections', type=int, default=1)
+    ap.add_argument('--concurrency', default='1,16,64,256',
+                    help='calls in flight, or comma separated levels to run in turn')
+    ap.add_argument('--duration', type=float, default=5.0, help='seconds per level')
+    ap.add_argument('--method', default='echo')
+    ap.add_argument('--payload', type=int, default=64, help='bytes of params per call')
+    args = ap.parse_args(argv)
+
+    server = None
+    if args.address:
+        host, port = args.address.rsplit(':', 1)
+        address = (host or '127.0.0.1', int(port))
+    else:
+        parent, child = multiprocessing.Pipe()
+        server = multiprocessing.Process(target=_serve, args=(child,), daemon=True)
+        server.start()
+        address = tuple(parent.recv())
+    params = [b'x' * args.payload] if args.method == 'echo' else []
+
+    print('{0:>11} {1:>11} {2:>10} {3:>10} {4:>10} {5:>10}'.format(
+        'concurrency', 'calls/s', 'p50 ms', 'p99 ms', 'p99.9 ms', 'max ms'))
+    try:
+        for concurrency in [int(c) for c in args.concurrency.split(',')]:
+            calls, elapsed, latencies = asyncio.run(run_load(
+                address, args.connections, concurrency, args.duration, args.method, params))
+            print('{0:11d} {1:11.0f} {2:10.3f} {3:10.3f} {4:10.3f} {5:10.3f}'.format(
+                concurrency, calls / elapsed,
+                percentile(latencies, 0.5) * 1000,
+                percentile(latencies, 0.99) * 1000,
+                percentile(latencies, 0.999) * 1000,
+                latencies[-1] * 1000 if latencies else 0.0))
+    finally:
+        if server is not None:
+            server.terminate()
+            server.join()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,238 @@
+'''
+asyncio server for the CBOR-RPC protocol CborRpcClient and
+AsyncCborRpcClient speak: requests {'id', 'method', 'params'}, responses
+{'id', 'result'} or {'id', 'error': {'message'}}.
+
+    server = CborRpcServer({'address': ('127.0.0.1', 5432)})
+
+    @server.method
+    def get(key):
+        return table[key]
+
+    server.run()
+
+Handlers are called as handler(*params). A handler that returns an
+awaitable is awaited, and other requests are handled meanwhile, so its
+response may come back after ones to later requests. Clients match
+responses by id. Responses ready in the same turn of the event loop go
+out in one write.
+
+Python 3.7 or later.
+'''
+from __future__ import absolute_import
+import asyncio
+import inspect
+import logging
+import socket
+
+import cbor
+
+
+logger = logging.getLogger(__name__)
+
+
+def _error_message(ex):
+    return str(ex) or type(ex).__name__
+
+
+class _CborRpcServerProtocol(asyncio.Protocol):
+    '''One client connection.'''
+
+    def __init__(self, server):
+        self.server = server
+        self.transport = None
+        self.decoder = cbor.StreamDecoder()
+        # responses not written yet, all written at the end of this turn of the event loop
+        self.outbox = []
+        # handlers still running
+        self.tasks = set()
+
+    def connection_made(self, transport):
+        self.transport = transport
+        sock = transport.get_extra_info('socket')
+        if (sock is not None) and (sock.family != socket.AF_UNIX):
+            sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+
+    def data_received(self, data):
+        self.decoder.feed(data)
+        try:
+            for request in self.decoder:
+                self.handle(request)
+        except Exception:
+            logger.warning('bad data from client, closing connection', exc_info=True)
+            self.transport.close()
+
+    def handle(self, request):
+        if not isinstance(request, dict):
+            raise ValueError('request is not a map: {0!r}'.format(request))
+        msg_id = request.get('id')
+        method = request.get('method')
+        params = request.get('params')
+        if params is None:
+            params = []
+        handler = self.server.handlers.get(method)
+        if handler is None:
+            self.send_error(msg_id, 'no such method {0!r}'.format(method))
+            return
+        try:
+            result = handler(*params)
+        except Exception as ex:
+            logger.debug('error in %r', method, exc_info=True)
+            self.send_error(msg_id, _error_message(ex))
+            return
+        if inspect.isawaitable(result):
+            task = asyncio.ensure_future(self.finish(msg_id, method, result))
+            self.tasks.add(task)
+            task.add_done_callback(self.tasks.discard)
+        else:
+            self.send_result(msg_id, result)
+
+    async def finish(self, msg_id, method, awaitable):
+        try:
+            result = await awaitable
+        except asyncio.CancelledError:
+            raise
+        except Exception as ex:
+            logger.debug('error in %r', method, exc_info=True)
+            self.send_error(msg_id, _error_message(ex))
+            return
+        self.send_result(msg_id, result)
+
+    def send_result(self, msg_id, result):
+        try:
+            response = self.server.encoder.encode({'id': msg_id, 'result': result})
+        except Exception as ex:
+            logger.debug('could not encode result', exc_info=True)
+            self.send_error(msg_id, 'could not encode result: {0}'.format(_error_message(ex)))
+            return
+        self.send(response)
+
+    def send_error(self, msg_id, message):
+        self.send(self.server.encoder.encode({'id': msg_id, 'error': {'message': message}}))
+
+    def send(self, response):
+        if not self.outbox:
+            asyncio.get_running_loop().call_soon(self.flush)
+        self.outbox.append(response)
+
+    def flush(self):
+        if self.outbox and not self.transport.is_closing():
+            self.transport.write(b''.join(self.outbox))
+        self.outbox = []
+
+    def pause_writing(self):
+        # client isn't reading its responses, stop reading its requests
+        self.transport.pause_reading()
+
+    def resume_writing(self):
+        self.transport.resume_reading()
+
+    def connection_lost(self, exc):
+        for task in self.tasks:
+            task.cancel()
+        self.server.connections.discard(self)
+
+
+class CborRpcServer(object):
+    '''CBOR-RPC server on asyncio.
+
+    config:
+      `addr_family`: socket.AF_INET (default), AF_INET6 or AF_UNIX
+      `address`: ('host', port), port 0 for any free one; or a path for AF_UNIX
+      `backlog`: listen() backlog (default 1024)
+    handlers: {method name: function}; more can be added with method()
+
+    .. automethod:: method
+    .. automethod:: start
+    .. automethod:: serve_forever
+    .. automethod:: run
+    .. automethod:: close
+
+    '''
+
+    def __init__(self, config=None, handlers=None):
+        config = config or {}
+        self._socket_family = config.get('addr_family', socket.AF_INET)
+        self._socket_addr = config.get('address', ('127.0.0.1', 0))
+        self._backlog = int(config.get('backlog', 1024))
+        self.handlers = dict(handlers or {})
+        self.encoder = cbor.Encoder()
+        self.connections = set()
+        self._server = None
+        # where it is listening, once started
+        self.address = None
+
+    def method(self, fn=None, name=None):
+        '''Register fn as the handler for method name (default fn.__name__).
+
+        Works as a decorator, with or without arguments.
+
+        '''
+        if fn is None:
+            return lambda fn: self.method(fn, name)
+        self.handlers[name or fn.__name__] = fn
+        return fn
+
+    def _protocol(self):
+        protocol = _CborRpcServerProtocol(self)
+        self.connections.add(protocol)
+        return protocol
+
+    async def start(self):
+        '''Start listening. Returns self.'''
+        loop = asyncio.get_running_loop()
+        if self._socket_family == socket.AF_UNIX:
+            self._server = await loop.create_unix_server(self._protocol, self._socket_addr, backlog=self._backlog)
+        else:
+            host, port = self._socket_addr
+            self._server = await loop.create_server(
+                self._protocol, host, port, family=self._socket_family, backlog=self._backlog)
+        self.address = self._server.sockets[0].getsockname()
+        if self._socket_family != socket.AF_UNIX:
+            self.address = self.address[:2]
+        logger.info('CBOR-RPC server listening on %r', self.address)
+        return self
+
+    async def serve_forever(self):
+        if self._server is None:
+            await self.start()
+        try:
+            await self._server.serve_forever()
+        finally:
+            self.close()
+
+    def run(self):
+        '''serve_forever() in a new event loop, until interrupted.'''
+        try:
+            asyncio.run(self.serve_forever())
+        except KeyboardInterrupt:
+            pass
+
+    def close(self):
+        '''Stop listening and close every client connection.'''
+        if self._server is not None:
+            self._server.close()
+            self._server = None
+        for protocol in list(self.connections):
+            protocol.transport.close()
+
+
+def echo(*params):
+    return list(params)
+
+
+def ping():
+    return u'pong'
+
+
+if __name__ == '__main__':
+    # python -m cbor.cbor_rpc_server [host:port]
+    # Serves echo() and ping(), for trying out clients.
+    import sys
+    logging.basicConfig(level=logging.INFO)
+    host, port = '127.0.0.1', 5432
+    if len(sys.argv) > 1:
+        host, port = sys.argv[1].split(':')
+        host = host or '127.0.0.1'
+        port = int(port)
+    CborRpcServer({'address': (host, port)}, {'echo': echo, 'ping': ping}).run()
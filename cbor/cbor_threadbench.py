@@ -0,0 +1,87 @@
+'''
+Throughput of dumps() and loads() from 1 to N threads at once.
+
+    python -m cbor.cbor_threadbench [--threads N[,N...]] [--duration SECONDS]
+        [--size small|medium|large]
+
+Each thread encodes or decodes the same object over and over for a while;
+the total calls per second, and how that compares with one thread, are
+printed for each thread count. With the GIL it stays near 1x; a
+free-threaded Python should get close to the number of threads.
+'''
+from __future__ import absolute_import
+import argparse
+import os
+import sys
+import threading
+import time
+
+from . import dumps, loads
+
+
+def sample(size):
+    '''An object like an RPC message: a map of short strings, ints, floats and lists.'''
+    item = {u'id': 12345, u'name': u'widget', u'price': 9.75, u'tags': [u'a', u'bc', u'def'],
+            u'ok': True, u'blob': b'\x00' * 16}
+    count = {'small': 1, 'medium': 20, 'large': 1000}[size]
+    return {u'items': [dict(item, id=i) for i in range(count)], u'total': count}
+
+
+def run_threads(fn, arg, threads, duration):
+    '''Call fn(arg) in a loop in threads threads for duration seconds.
+
+    Returns total calls per second.
+
+    '''
+    counts = [0] * threads
+    start = threading.Event()
+    clock = time.perf_counter if hasattr(time, 'perf_counter') else time.time
+
+    def work(n):
+        calls = 0
+        start.wait()
+        deadline = clock() + duration
+        while clock() < deadline:
+            for _ in range(100):
+                fn(arg)
+            calls += 100
+        counts[n] = calls
+    workers = [threading.Thread(target=work, args=(n,)) for n in range(threads)]
+    for t in workers:
+        t.start()
+    began = clock()
+    start.set()
+    for t in workers:
+        t.join()
+    return sum(counts) / (clock() - began)
+
+
+def main(argv=None):
+    cpus = os.cpu_count() if hasattr(os, 'cpu_count') else 4
+    default_threads = [1]
+    while default_threads[-1] * 2 <= (cpus or 4):
+        default_threads.append(default_threads[-1] * 2)
+    ap = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    ap.add_argument('--threads', default=','.join(str(n) for n in default_threads),
+                    help='comma separated thread counts to run in turn')
+    ap.add_argument('--duration', type=float, default=2.0, help='seconds per run')
+    ap.add_argument('--size', default='medium', choices=['small', 'medium', 'large'])
+    args = ap.parse_args(argv)
+
+    ob = sample(args.size)
+    blob = dumps(ob)
+    gil = getattr(sys, '_is_gil_enabled', lambda: True)()
+    print('{0} bytes per object, GIL {1}'.format(len(blob), 'enabled' if gil else 'disabled'))
+    print('{0:>7} {1:>12} {2:>7} {3:>12} {4:>7}'.format('threads', 'dumps/s', 'x', 'loads/s', 'x'))
+    base = None
+    for threads in [int(n) for n in args.threads.split(',')]:
+        rates = (run_threads(dumps, ob, threads, args.duration),
+                 run_threads(loads, blob, threads, args.duration))
+        if base is None:
+            base = rates
+        print('{0:7d} {1:12.0f} {2:7.2f} {3:12.0f} {4:7.2f}'.format(
+            threads, rates[0], rates[0] / base[0], rates[1], rates[1] / base[1]))
+
+
+if __name__ == '__main__':
+    main()
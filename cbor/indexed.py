@@ -0,0 +1,284 @@
+try:
+    # try C library _cbor.so
+    from ._cbor import loads, dumps, scan
+except:
+    # fall back to 100% python implementation
+    from .cbor import loads, dumps, scan
+
+import array
+import mmap
+import os
+import sys
+
+
+# Sidecar index for a file of concatenated CBOR records (a CBOR Sequence).
+#
+# Index file format:
+#   8 bytes magic b'CBORIDX\x01'
+#   then one 8 byte big-endian unsigned integer per record: the offset of
+#   the end of that record in the data file. Record i starts where record
+#   i-1 ends (record 0 starts at 0) and the last end is how much of the
+#   data file is indexed.
+#
+# The data file is assumed to only ever be appended to. Opening it again
+# after records were appended scans just the new bytes and appends their
+# ends to the index.
+
+INDEX_MAGIC = b'CBORIDX\x01'
+INDEX_SUFFIX = '.idx'
+
+# scan() this many records at a time while building an index
+_SCAN_BATCH = 65536
+
+try:
+    _OFFSET_TYPECODE = 'Q'
+    array.array(_OFFSET_TYPECODE)
+except ValueError:
+    # Python 2 has no 'Q'
+    _OFFSET_TYPECODE = 'L'
+assert array.array(_OFFSET_TYPECODE).itemsize == 8, 'need an 8 byte array type for offsets'
+
+_NEED_SWAP = sys.byteorder == 'little'
+
+
+def _offsets_to_bytes(offsets):
+    out = array.array(_OFFSET_TYPECODE, offsets)
+    if _NEED_SWAP:
+        out.byteswap()
+    if hasattr(out, 'tobytes'):
+        return out.tobytes()
+    return out.tostring()
+
+
+def _offsets_from_bytes(data):
+    out = array.array(_OFFSET_TYPECODE)
+    if hasattr(out, 'frombytes'):
+        out.frombytes(data)
+    else:
+        out.fromstring(data)
+    if _NEED_SWAP:
+        out.byteswap()
+    return out
+
+
+def _read_index(index_path):
+    "return offsets array from index_path, or None if it is missing or not an index"
+    try:
+        with open(index_path, 'rb') as fin:
+            data = fin.read()
+    except (IOError, OSError):
+        return None
+    if not data.startswith(INDEX_MAGIC):
+        return None
+    # drop a partial trailing entry from an interrupted append
+    end = len(INDEX_MAGIC) + ((len(data) - len(INDEX_MAGIC)) // 8) * 8
+    return _offsets_from_bytes(data[len(INDEX_MAGIC):end])
+
+
+def _write_index(index_path, offsets):
+    with open(index_path, 'wb') as fout:
+        fout.write(INDEX_MAGIC)
+        fout.write(_offsets_to_bytes(offsets))
+
+
+def _append_index(index_path, offsets):
+    with open(index_path, 'ab') as fout:
+        fout.write(_offsets_to_bytes(offsets))
+
+
+def _scan_ends(data, start):
+    """
+    return list of the ends of whole records in data after start.
+    Stops at an incomplete record at the end of data (it may still be
+    being written) or at a malformed one (nothing after it can be found).
+    """
+    ends = []
+    pos = start
+    while pos < len(data):
+        try:
+            batch = scan(data, offset=pos, count=_SCAN_BATCH)
+        except ValueError:
+            # find the good records before the bad one
+            batch = []
+            while True:
+                try:
+                    batch.extend(scan(data, offset=pos, count=1))
+                except ValueError:
+                    break
+                pos = batch[-1]
+            ends.extend(batch)
+            break
+        ends.extend(batch)
+        pos = batch[-1]
+    return ends
+
+
+def _map_file(fin):
+    "return read-only mmap of open file fin, or b'' for an empty file"
+    size = os.fstat(fin.fileno()).st_size
+    if size == 0:
+        return b''
+    return mmap.mmap(fin.fileno(), 0, access=mmap.ACCESS_READ)
+
+
+def build_index(path, index_path=None):
+    """
+    Create or extend the sidecar index for the CBOR Sequence file at path.
+    index_path defaults to path + '.idx'.
+    Returns the number of records indexed.
+    """
+    if index_path is None:
+        index_path = path + INDEX_SUFFIX
+    with open(path, 'rb') as fin:
+        data = _map_file(fin)
+        try:
+            return len(_update_index(data, index_path))
+        finally:
+            if not isinstance(data, bytes):
+                data.close()
+
+
+def _update_index(data, index_path):
+    "bring index at index_path up to date with data, return offsets array"
+    offsets = _read_index(index_path)
+    if (offsets is None) or (len(offsets) > 0 and offsets[-1] > len(data)):
+        # missing, or data file is shorter than what the index covers: start over
+        offsets = array.array(_OFFSET_TYPECODE, _scan_ends(data, 0))
+        _write_index(index_path, offsets)
+        return offsets
+    indexed = offsets[-1] if len(offsets) > 0 else 0
+    ends = _scan_ends(data, indexed)
+    if ends:
+        _append_index(index_path, ends)
+        offsets.extend(ends)
+    return offsets
+
+
+class IndexedWriter(object):
+    '''
+    Append records to a CBOR Sequence file, keeping its sidecar index up to date.
+
+    with IndexedWriter('records.cbor') as out:
+        out.write(record)
+    '''
+    def __init__(self, path, index_path=None, sort_keys=False):
+        self.path = path
+        self.index_path = index_path or (path + INDEX_SUFFIX)
+        self.sort_keys = sort_keys
+        if os.path.exists(self.path):
+            # catch up with anything appended without updating the index
+            build_index(self.path, self.index_path)
+        else:
+            _write_index(self.index_path, [])
+        self._data = open(self.path, 'ab')
+        self._index = open(self.index_path, 'ab')
+        self._pos = os.fstat(self._data.fileno()).st_size
+
+    def write(self, ob):
+        "append one record, return (start, end) byte offsets of it in the data file"
+        blob = dumps(ob, sort_keys=self.sort_keys)
+        start = self._pos
+        self._data.write(blob)
+        self._pos += len(blob)
+        self._index.write(_offsets_to_bytes([self._pos]))
+        return start, self._pos
+
+    def flush(self):
+        # data before index, so the index never points past the data
+        self._data.flush()
+        self._index.flush()
+
+    def close(self):
+        if self._data is not None:
+            self.flush()
+            self._data.close()
+            self._index.close()
+            self._data = None
+            self._index = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+
+class IndexedFile(object):
+    '''
+    Random access to the records of a CBOR Sequence file through its sidecar index.
+    The data file is mmap()ed and only the records asked for are decoded.
+
+    with IndexedFile('records.cbor') as records:
+        print(len(records), records[123456], records[-10:])
+
+    update: extend (or create) the index to cover records appended since it
+    was written. With update=False the index file must already exist.
+    '''
+    def __init__(self, path, index_path=None, update=True):
+        self.path = path
+        self.index_path = index_path or (path + INDEX_SUFFIX)
+        self._fin = open(path, 'rb')
+        self._map()
+        if update:
+            self._offsets = _update_index(self._data, self.index_path)
+        else:
+            self._offsets = _read_index(self.index_path)
+            if self._offsets is None:
+                self.close()
+                raise ValueError('no index at {0!r}'.format(self.index_path))
+
+    def _map(self):
+        self._data = _map_file(self._fin)
+        self._view = memoryview(self._data)
+
+    def _unmap(self):
+        if hasattr(self._view, 'release'):
+            self._view.release()
+        if not isinstance(self._data, bytes):
+            self._data.close()
+
+    def refresh(self):
+        "pick up records appended to the data file since it was opened, return the new len()"
+        self._unmap()
+        self._map()
+        self._offsets = _update_index(self._data, self.index_path)
+        return len(self._offsets)
+
+    def __len__(self):
+        return len(self._offsets)
+
+    def span(self, i):
+        "return (start, end) byte offsets of record i in the data file"
+        if i < 0:
+            i += len(self._offsets)
+        if (i < 0) or (i >= len(self._offsets)):
+            raise IndexError('record index out of range')
+        start = self._offsets[i - 1] if i > 0 else 0
+        return start, self._offsets[i]
+
+    def raw(self, i):
+        "return memoryview of the encoded bytes of record i"
+        start, end = self.span(i)
+        return self._view[start:end]
+
+    def __getitem__(self, i):
+        if isinstance(i, slice):
+            return [loads(self.raw(j)) for j in range(*i.indices(len(self._offsets)))]
+        return loads(self.raw(i))
+
+    def __iter__(self):
+        for i in range(len(self._offsets)):
+            yield loads(self.raw(i))
+
+    def close(self):
+        if self._fin is None:
+            return
+        self._unmap()
+        self._fin.close()
+        self._fin = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
@@ -22,11 +22,9 @@ class ClassTag(object):
         self.decode_function = decode_function
 
 
-# TODO: This would be more efficient if it moved into cbor.py and
-# cbormodule.c, happening inline so that there is only one traversal
-# of the objects. But that would require two implementations. When
-# this API has been used more and can be considered settled I should
-# do that. -- Brian Olson 20140917_172229
+# dumps(class_tags=) and loads(class_tags=) in cbormodule.c translate
+# inline while encoding or decoding, so there is only one traversal of
+# the objects. The pure Python ones call encode() and decode() below.
 class TagMapper(object):
     '''
     Translate Python objects and CBOR tagged data.
@@ -93,16 +91,16 @@ class TagMapper(object):
         return obj
 
     def dump(self, obj, fp):
-        dump(self.encode(obj), fp)
+        dump(obj, fp, class_tags=self.class_tags)
 
     def dumps(self, obj):
-        return dumps(self.encode(obj))
+        return dumps(obj, class_tags=self.class_tags)
 
     def load(self, fp):
-        return self.decode(load(fp))
+        return load(fp, class_tags=self.class_tags, raise_on_unknown_tag=self.raise_on_unknown_tag)
 
     def loads(self, blob):
-        return self.decode(loads(blob))
+        return loads(blob, class_tags=self.class_tags, raise_on_unknown_tag=self.raise_on_unknown_tag)
 
 
 class WrappedCBOR(ClassTag):
@@ -138,5 +136,9 @@ Tag(24L, '\xa1Aa\x83\x01\x02\x03')
         return dumps(Tag(CBOR_TAG_CBOR, dumps(ob)))
 
 
-class UnknownTagException(BaseException):
-    pass
+try:
+    # the C decoder raises this one
+    from ._cbor import UnknownTagException
+except ImportError:
+    class UnknownTagException(BaseException):
+        pass
@@ -1,12 +1,17 @@
 #!python
 # -*- coding: utf-8 -*-
 
+import array
 import base64
 import datetime
 import json
 import logging
+import mmap
+import pickle
 import random
+import struct
 import sys
+import tempfile
 import time
 import unittest
 import zlib
@@ -19,16 +24,38 @@ from cbor.cbor import dumps as pydumps
 from cbor.cbor import loads as pyloads
 from cbor.cbor import dump as pydump
 from cbor.cbor import load as pyload
+from cbor.cbor import iter_load as pyiter_load
+from cbor.cbor import loads_seq as pyloads_seq
+from cbor.cbor import scan as pyscan
+from cbor.cbor import validate as pyvalidate
+from cbor.cbor import Encoder as pyEncoder
+from cbor.cbor import Decoder as pyDecoder
+from cbor.cbor import dumps_into as pydumps_into
+from cbor.cbor import BufferTooSmallError
+from cbor.cbor import StreamDecoder as pyStreamDecoder
 from cbor.cbor import Tag
+from cbor.tagmap import ClassTag
 try:
     from cbor._cbor import dumps as cdumps
     from cbor._cbor import loads as cloads
     from cbor._cbor import dump as cdump
     from cbor._cbor import load as cload
+    from cbor._cbor import iter_load as citer_load
+    from cbor._cbor import loads_seq as cloads_seq
+    from cbor._cbor import scan as cscan
+    from cbor._cbor import validate as cvalidate
+    from cbor._cbor import Encoder as cEncoder
+    from cbor._cbor import Decoder as cDecoder
+    from cbor._cbor import dumps_into as cdumps_into
+    from cbor._cbor import StreamDecoder as cStreamDecoder
 except ImportError:
     # still test what we can without C fast mode
     logger.warn('testing without C accelerated CBOR', exc_info=True)
     cdumps, cloads, cdump, cload = None, None, None, None
+    citer_load, cloads_seq = None, None
+    cscan, cvalidate = None, None
+    cEncoder, cDecoder, cdumps_into = None, None, None
+    cStreamDecoder = None
 
 
 _IS_PY3 = sys.version_info[0] >= 3
@@ -44,8 +71,8 @@ else:
 
 class TestRoot(object):
     @classmethod
-    def loads(cls, *args):
-        return cls._ld[0](*args)
+    def loads(cls, *args, **kwargs):
+        return cls._ld[0](*args, **kwargs)
     @classmethod
     def dumps(cls, *args, **kwargs):
         return cls._ld[1](*args, **kwargs)
@@ -53,12 +80,36 @@ class TestRoot(object):
     def speediterations(cls):
         return cls._ld[2]
     @classmethod
-    def load(cls, *args):
-        return cls._ld[3](*args)
+    def load(cls, *args, **kwargs):
+        return cls._ld[3](*args, **kwargs)
     @classmethod
     def dump(cls, *args, **kwargs):
         return cls._ld[4](*args, **kwargs)
     @classmethod
+    def iter_load(cls, *args, **kwargs):
+        return cls._ld[5](*args, **kwargs)
+    @classmethod
+    def loads_seq(cls, *args, **kwargs):
+        return cls._ld[6](*args, **kwargs)
+    @classmethod
+    def scan(cls, *args, **kwargs):
+        return cls._ld[7](*args, **kwargs)
+    @classmethod
+    def validate(cls, *args, **kwargs):
+        return cls._ld[8](*args, **kwargs)
+    @classmethod
+    def encoder(cls, *args, **kwargs):
+        return cls._ld[9](*args, **kwargs)
+    @classmethod
+    def decoder(cls, *args, **kwargs):
+        return cls._ld[10](*args, **kwargs)
+    @classmethod
+    def dumps_into(cls, *args, **kwargs):
+        return cls._ld[11](*args, **kwargs)
+    @classmethod
+    def stream_decoder(cls, *args, **kwargs):
+        return cls._ld[12](*args, **kwargs)
+    @classmethod
     def testable(cls):
         ok = (cls._ld[0] is not None) and (cls._ld[1] is not None) and (cls._ld[3] is not None) and (cls._ld[4] is not None)
         if not ok:
@@ -68,16 +119,16 @@ class TestRoot(object):
 # Can't set class level function pointers, because then they expect a
 # (cls) first argument. So, toss them in a list to hide them.
 class TestPyPy(TestRoot):
-    _ld = [pyloads, pydumps, 1000, pyload, pydump]
+    _ld = [pyloads, pydumps, 1000, pyload, pydump, pyiter_load, pyloads_seq, pyscan, pyvalidate, pyEncoder, pyDecoder, pydumps_into, pyStreamDecoder]
 
 class TestPyC(TestRoot):
-    _ld = [pyloads, cdumps, 2000, pyload, cdump]
+    _ld = [pyloads, cdumps, 2000, pyload, cdump, pyiter_load, pyloads_seq, pyscan, pyvalidate, cEncoder, pyDecoder, cdumps_into, pyStreamDecoder]
 
 class TestCPy(TestRoot):
-    _ld = [cloads, pydumps, 2000, cload, pydump]
+    _ld = [cloads, pydumps, 2000, cload, pydump, citer_load, cloads_seq, cscan, cvalidate, pyEncoder, cDecoder, pydumps_into, cStreamDecoder]
 
 class TestCC(TestRoot):
-    _ld = [cloads, cdumps, 150000, cload, cdump]
+    _ld = [cloads, cdumps, 150000, cload, cdump, citer_load, cloads_seq, cscan, cvalidate, cEncoder, cDecoder, cdumps_into, cStreamDecoder]
 
 
 if _IS_PY3:
@@ -231,6 +282,33 @@ class XTestCBOR(object):
             jbps=json_byte_count / json_load_time
         ))
 
+    def test_decode_speed(self):
+        "decode throughput for many small documents and one large one"
+        if not self.testable(): return
+        icount = self.speediterations()
+        small = [{'id': i, 'name': 'item {0}'.format(i), 'price': i * 0.25, 'tags': ['a', 'b'], 'ok': True, 'n': -i}
+                 for i in _range(icount)]
+        sers = [self.dumps(ob) for ob in small]
+        large = self.dumps(small)
+        st = time.time()
+        out = [self.loads(b) for b in sers]
+        small_time = time.time() - st
+        assert out == small
+        st = time.time()
+        out = self.loads(large)
+        large_time = time.time() - st
+        assert out == small
+        small_bytes = sum(map(len, sers))
+        sys.stderr.write(
+            'decode {n} small docs in {st:.3f} secs ({sops:.0f}/sec, {sbps:.1f}MB/s), one {lb} byte doc in {lt:.3f} secs ({lbps:.1f}MB/s)\n'.format(
+            n=len(sers),
+            st=small_time,
+            sops=len(sers) / small_time,
+            sbps=small_bytes / small_time / 1e6,
+            lb=len(large),
+            lt=large_time,
+            lbps=len(large) / large_time / 1e6))
+
     def test_loads_none(self):
         if not self.testable(): return
         try:
@@ -256,6 +334,500 @@ class XTestCBOR(object):
             pass
         assert obs2 == self.test_objects
 
+    def test_dump_chunks(self):
+        "dump() should write in bounded chunks which add up to dumps()"
+        if not self.testable(): return
+        ob = [{u'k{0}'.format(i): [i, u'v' * (i % 50), b'b' * (i % 30)]} for i in _range(3000)]
+        ob.append(Tag(1234, ob[:100]))
+        chunks = []
+        class ChunkFile(object):
+            def write(self, b):
+                chunks.append(bytes(b))
+        self.dump(ob, ChunkFile(), buffer_size=1024)
+        assert len(chunks) > 10, len(chunks)
+        assert max(map(len, chunks)) < 2048, max(map(len, chunks))
+        assert b''.join(chunks) == self.dumps(ob)
+        assert self.loads(b''.join(chunks)) == ob
+
+    def test_load_streams(self):
+        "load() must leave seekable, peekable and plain streams right after each object"
+        if not self.testable(): return
+        obs = self.test_objects + [[u'x' * 3000, b'y' * 70000, {u'z': list(_range(1000))}]]
+        blob = b''.join([self.dumps(ob) for ob in obs])
+        for wrap in (StringIO, _peek_stream, _plain_stream):
+            fin = wrap(blob)
+            obs2 = []
+            try:
+                while True:
+                    obs2.append(self.load(fin))
+            except EOFError:
+                pass
+            assert obs2 == obs, wrap
+        # with consume_ahead a plain stream may be read past the object
+        fin = _plain_stream(self.dumps(obs))
+        assert self.load(fin, consume_ahead=True) == obs
+
+    def test_loads_buffers(self):
+        "loads() from any contiguous buffer, including sliced memoryview and mmap"
+        if not self.testable(): return
+        ob = [u'hello', b'world' * 100, {u'a': [1, 2.5, None]}]
+        ser = self.dumps(ob)
+        padded = b'junk' + ser + b'more junk'
+        assert self.loads(memoryview(ser)) == ob
+        assert self.loads(memoryview(padded)[4:4 + len(ser)]) == ob
+        assert self.loads(array.array('B', ser)) == ob
+        with tempfile.TemporaryFile() as tf:
+            tf.write(padded)
+            tf.flush()
+            mm = mmap.mmap(tf.fileno(), 0, access=mmap.ACCESS_READ)
+            try:
+                assert self.loads(memoryview(mm)[4:4 + len(ser)]) == ob
+                ob2 = self.loads(memoryview(mm)[4:4 + len(ser)], bytes_as_memoryview=True)
+                assert isinstance(ob2[1], memoryview)
+                assert ob2[1] == ob[1]
+                assert ob2[0] == ob[0]
+                ob2[1].release()
+            finally:
+                mm.close()
+
+    def test_iter_load(self):
+        "CBOR Sequence: concatenated items from a stream or a buffer"
+        if not self.testable(): return
+        sers = [self.dumps(ob) for ob in self.test_objects]
+        blob = b''.join(sers)
+        offsets = [sum(map(len, sers[:i])) for i in _range(len(sers))]
+        for wrap in (StringIO, _peek_stream, _plain_stream, bytes, bytearray, memoryview):
+            assert list(self.iter_load(wrap(blob))) == self.test_objects, wrap
+            assert list(self.iter_load(wrap(blob), offsets=True)) == list(zip(offsets, self.test_objects)), wrap
+        assert list(self.loads_seq(blob)) == self.test_objects
+        assert list(self.loads_seq(bytearray(blob), offsets=True)) == list(zip(offsets, self.test_objects))
+        assert list(self.loads_seq(b'')) == []
+        # stopping early leaves a seekable stream right after the last item
+        fin = StringIO(blob)
+        it = self.iter_load(fin)
+        assert next(it) == self.test_objects[0]
+        assert next(it) == self.test_objects[1]
+        if hasattr(it, 'close'):
+            it.close()
+            assert fin.tell() == offsets[2]
+        # a truncated last item is an error, not a clean end
+        try:
+            list(self.loads_seq(blob + self.dumps([1, 2, 3])[:-1]))
+            assert False, 'expected error on truncated item'
+        except (ValueError, LookupError, EOFError, IndexError, struct.error):
+            pass
+
+    def test_scan(self):
+        "item boundaries and well-formedness without decoding"
+        if not self.testable(): return
+        sers = [self.dumps(ob) for ob in self.test_objects]
+        blob = b''.join(sers)
+        ends = [sum(map(len, sers[:i + 1])) for i in _range(len(sers))]
+        assert self.scan(blob) == ends
+        assert self.scan(bytearray(blob), offset=ends[0], count=2) == ends[1:3]
+        assert self.scan(memoryview(blob)[ends[1]:]) == [x - ends[1] for x in ends[2:]]
+        assert self.scan(b'') == []
+        assert self.validate(blob, sequence=True)
+        assert self.validate(b'', sequence=True)
+        assert not self.validate(b'')
+        for ser in sers:
+            assert self.validate(ser), hexstr(ser)
+            if len(ser) > 1:
+                assert not self.validate(ser[:-1]), hexstr(ser)
+        assert not self.validate(sers[0] + sers[1])
+        # indefinite length, nested, tagged
+        for good in (b'\x9f\x01\x9f\xff\xff', b'\xbf\x61a\x01\xff', b'\x5f\x41a\x42bc\xff',
+                     b'\x7f\xff', b'\xc1\xc2\x41\x00', b'\xf8\x20', b'\x82\x80\xa1\x00\x80'):
+            assert self.validate(good), hexstr(good)
+        for bad in (b'\xff', b'\x9f\x01', b'\x1c', b'\x5e', b'\xdd\x00', b'\x1f', b'\xdf\x00',
+                    b'\xbf\x01\xff', b'\x9f\xc1\xff', b'\x5f\x61a\xff', b'\x5f\x5f\xff\xff',
+                    b'\xf8\x01', b'\x82\x01', b'\x43ab', b'\x1a\x00\x00', b'\xa1\x01'):
+            assert not self.validate(bad), hexstr(bad)
+            try:
+                self.scan(bad)
+                assert False, 'expected error scanning ' + hexstr(bad)
+            except ValueError:
+                pass
+        # deeper than the C decoder's recursion goes, still no problem to scan
+        deep = b'\x81' * 100000 + b'\x00'
+        assert self.scan(deep) == [len(deep)]
+
+    def test_float_mode(self):
+        if not self.testable(): return
+        def from_bits(bits):
+            return struct.unpack('!d', struct.pack('!Q', bits))[0]
+        def to_bits(val):
+            return struct.unpack('!Q', struct.pack('!d', val))[0]
+        expected = [
+            (0.0, 'f90000'), (-0.0, 'f98000'), (1.5, 'f93e00'), (65504.0, 'f97bff'),
+            (2.0 ** -24, 'f90001'), (-2.0 ** -14, 'f98400'), (2.0 ** -25, 'fa33000000'),
+            (65505.0, 'fa477fe100'), (100000.0, 'fa47c35000'), (3.4028234663852886e+38, 'fa7f7fffff'),
+            (float('inf'), 'f97c00'), (float('-inf'), 'f9fc00'), (float('nan'), 'f97e00'),
+            (from_bits(0xfff8000000000000), 'f9fe00'), (from_bits(0x7ff8000020000000), 'fa7fc00001'),
+            (from_bits(0x7ff8000000000001), 'fb7ff8000000000001'),
+            (0.1, 'fb3fb999999999999a'), (1e300, 'fb7e37e43c8800759c'), (1e-300, 'fb01a56e1fc2f8f359'),
+        ]
+        for val, hexout in expected:
+            ser = self.dumps(val, float_mode='shortest')
+            assert base64.b16encode(ser).decode('ascii').lower() == hexout, (val, hexstr(ser), hexout)
+            assert to_bits(self.loads(ser)) == to_bits(val), (val, hexstr(ser))
+        for val in [random.uniform(-1e6, 1e6) for _ in _range(200)] + [float(i) / 64 for i in _range(-2000, 2000)]:
+            ser = self.dumps([val], float_mode='shortest')
+            assert to_bits(self.loads(ser)[0]) == to_bits(val), (val, hexstr(ser))
+        assert self.dumps(1.5) == self.dumps(1.5, float_mode='double') == b'\xfb\x3f\xf8\x00\x00\x00\x00\x00\x00'
+        ob = {'a': [1.0, 0.5, Tag(1000, 2.5)], 'b': 0.1}
+        fout = StringIO()
+        self.dump(ob, fout, float_mode='shortest')
+        assert fout.getvalue() == self.dumps(ob, float_mode='shortest')
+        assert self.loads(fout.getvalue()) == ob
+        self.assertRaises(ValueError, self.dumps, 1.0, float_mode='half')
+
+    def test_text(self):
+        if not self.testable(): return
+        # ASCII and not, with the odd character at every position around 8 and 16 byte blocks
+        obs = [u'', u'a', u'\u00e9']
+        for n in _range(1, 40):
+            obs.append(u'x' * n)
+            for i in _range(n):
+                obs.append(u'x' * i + u'\u00e9' + u'x' * (n - i - 1))
+                obs.append(u'x' * i + u'\U0001f600' + u'x' * (n - i - 1))
+        ser = self.dumps(obs)
+        assert self.loads(ser) == obs
+        assert self.loads(self.dumps({u'k\u00e9y': obs})) == {u'k\u00e9y': obs}
+        for ob in obs:
+            assert self.dumps(ob) == pydumps(ob), repr(ob)
+        for bad in (b'\x62\xc3\x28', b'\x71' + b'x' * 16 + b'\xff', b'\x61\x80'):
+            try:
+                self.loads(bad)
+                assert False, 'expected error on bad utf-8 ' + hexstr(bad)
+            except (ValueError, RuntimeError):
+                pass
+
+    def test_bignum(self):
+        if not self.testable(): return
+        obs = []
+        for bits in (63, 64, 65, 128, 184, 192, 256, 512, 4096, 100000):
+            for delta in (-1, 0, 1):
+                obs.append((1 << bits) + delta)
+                obs.append(-(1 << bits) + delta)
+        for ob in obs:
+            ser = self.dumps(ob)
+            assert ser == pydumps(ob), repr(ob)
+            assert self.loads(ser) == ob, repr(ob)
+        # 2**64-1 and -2**64 are the last plain ints, then bignum bytes
+        assert self.dumps(0xffffffffffffffff) == b'\x1b' + b'\xff' * 8
+        assert self.dumps(-0x10000000000000000) == b'\x3b' + b'\xff' * 8
+        assert self.dumps(0x10000000000000000) == b'\xc2\x49\x01' + b'\x00' * 8
+        assert self.dumps(-0x10000000000000001) == b'\xc3\x49\x01' + b'\x00' * 8
+        # 24 byte and longer, zero length, leading zeros, indefinite length bytes
+        assert self.loads(b'\xc2\x58\x18' + b'\xff' * 24) == (1 << 192) - 1
+        assert self.loads(b'\xc2\x40') == 0
+        assert self.loads(b'\xc3\x40') == -1
+        assert self.loads(b'\xc2\x43\x00\x00\x01') == 1
+        assert self.loads(b'\xc2\x5f\x41\x01\x42\x00\x00\xff') == 0x10000
+        assert self.loads(b'\xc3\x5f\x41\x01\x42\x00\x00\xff') == -0x10001
+        assert self.loads(b'\xc2\x5f\xff') == 0
+        # bigger than dump()'s whole buffer
+        for ob in ((1 << (8 * 5000)) - 1, -(1 << 100000)):
+            fob = StringIO()
+            self.dump(ob, fob, buffer_size=64)
+            assert fob.getvalue() == pydumps(ob), repr(ob)
+
+    def test_hooks(self):
+        if not self.testable(): return
+        def default(ob):
+            if isinstance(ob, _Point):
+                return Tag(4000, [ob.x, ob.y])
+            if isinstance(ob, (set, frozenset)):
+                return sorted(ob)
+            raise TypeError('cannot encode {0!r}'.format(ob))
+        ob = {u'p': [_Point(i, -i) for i in _range(100)], u's': set([3, 1, 2])}
+        ser = self.dumps(ob, default=default)
+        assert ser == pydumps(ob, default=default)
+        fout = StringIO()
+        self.dump(ob, fout, default=default)
+        assert fout.getvalue() == ser
+        self.assertRaises(TypeError, self.dumps, [_Point(1, 2), object()], default=default)
+        # default that never gets anywhere
+        self.assertRaises(RuntimeError, self.dumps, _Point(1, 2), default=lambda x: x)
+        # class_tags apply to what default returns
+        point_tag = [ClassTag(4000, _Point, lambda p: u'a', None)]
+        mapped = self.dumps([object()], class_tags=point_tag, default=lambda x: _Point(0, 0))
+        assert mapped == b'\x81\xd9\x0f\xa0\x61\x61'
+        assert mapped == pydumps([object()], class_tags=point_tag, default=lambda x: _Point(0, 0))
+        fout = StringIO()
+        self.dump([object()], fout, class_tags=point_tag, default=lambda x: [_Point(0, 0)])
+        assert fout.getvalue() == b'\x81\x81\xd9\x0f\xa0\x61\x61'
+
+        def tag_hook(t):
+            if t.tag == 4000:
+                return tuple(t.value)
+            return t
+        expected = {u'p': [(i, -i) for i in _range(100)], u's': [1, 2, 3]}
+        assert self.loads(ser, tag_hook=tag_hook) == expected
+        assert self.load(StringIO(ser), tag_hook=tag_hook) == expected
+        assert self.loads(self.dumps(Tag(1001, Tag(2000, 5))), tag_hook=lambda t: t.value + 1) == 7
+        # inner dicts first
+        seen = []
+        def object_hook(d):
+            seen.append(sorted(d.keys()))
+            return len(d)
+        assert self.loads(self.dumps({u'a': {u'b': 1, u'c': 2}, u'd': [{}]}), object_hook=object_hook) == 2
+        assert seen == [[u'b', u'c'], [], [u'a', u'd']]
+        # input that can't be read doesn't keep the hooks
+        if hasattr(sys, 'getrefcount'):
+            before = sys.getrefcount(tag_hook)
+            for _ in _range(100):
+                self.assertRaises((TypeError, ValueError), self.loads, 123, tag_hook=tag_hook)
+                self.assertRaises(AttributeError, self.load, 123, tag_hook=tag_hook)
+            assert sys.getrefcount(tag_hook) == before
+
+    def test_semantic_tags(self):
+        if not self.testable(): return
+        if not _IS_PY3: return
+        import decimal
+        import re
+        import uuid
+        utc = datetime.timezone.utc
+        ob = [
+            datetime.datetime(2013, 3, 21, 20, 4, 0, tzinfo=utc),
+            datetime.datetime(1984, 1, 24, 23, 22, 21, 5000, tzinfo=datetime.timezone(datetime.timedelta(hours=-5, minutes=-30))),
+            decimal.Decimal('273.15'),
+            decimal.Decimal('-1E+100'),
+            uuid.UUID('12345678-1234-5678-1234-567812345678'),
+            re.compile(u'a+b'),
+            set([1, u'x']),
+            {u'when': [datetime.datetime(2000, 1, 1, tzinfo=utc)]},
+        ]
+        ser = self.dumps(ob, semantic_tags=True)
+        assert ser == pydumps(ob, semantic_tags=True)
+        assert self.loads(ser, semantic_tags=True) == ob
+        assert list(self.loads_seq(ser * 2, semantic_tags=True)) == [ob, ob]
+        fout = StringIO()
+        self.dump(ob, fout, semantic_tags=True)
+        assert fout.getvalue() == ser
+        # off by default, both ways
+        assert self.loads(ser)[0] == Tag(0, u'2013-03-21T20:04:00Z')
+        self.assertRaises(Exception, self.dumps, ob)
+        # frozenset comes back as set, naive datetime as UTC, NaN as float
+        assert self.loads(self.dumps(frozenset([1]), semantic_tags=True), semantic_tags=True) == set([1])
+        naive = self.dumps(datetime.datetime(2000, 1, 1, 12, 30), semantic_tags=True)
+        assert self.loads(naive) == Tag(0, u'2000-01-01T12:30:00Z')
+        # offsets that aren't whole minutes are converted to UTC
+        odd = datetime.datetime(2000, 1, 1, tzinfo=datetime.timezone(datetime.timedelta(seconds=30)))
+        assert self.loads(self.dumps(odd, semantic_tags=True)) == Tag(0, u'1999-12-31T23:59:30Z')
+        assert self.dumps(decimal.Decimal('NaN'), semantic_tags=True) == self.dumps(float('nan'))
+        # bytes patterns are left to default
+        self.assertRaises(Exception, self.dumps, re.compile(b'x'), semantic_tags=True)
+        assert self.dumps(re.compile(b'x'), semantic_tags=True, default=lambda p: p.pattern) == self.dumps(b'x')
+        # tags only written by other encoders
+        when = datetime.datetime(2017, 7, 14, 2, 40, tzinfo=utc)
+        for tag, expected in (
+                (Tag(1, 1500000000), when),
+                (Tag(1, 1500000000.5), when + datetime.timedelta(microseconds=500000)),
+                (Tag(0, u'2017-07-14t02:40:00.000000999z'), when),
+                (Tag(0, u'2017-07-14 04:40:00+02:00'), when),
+                (Tag(5, [-2, 3]), decimal.Decimal('0.75')),
+                (Tag(5, [3, -3]), decimal.Decimal('-24')),
+                (Tag(258, []), set()),
+                ({Tag(37, b'\x01' * 16): 1}, {uuid.UUID(bytes=b'\x01' * 16): 1})):
+            assert self.loads(self.dumps(tag), semantic_tags=True) == expected, tag
+        for bad in (Tag(0, u'2017-07-14T02:40:00'), Tag(0, u'2017-13-14T02:40:00Z'), Tag(0, 1),
+                    Tag(1, u'x'), Tag(4, [1]), Tag(5, [1 << 80, 1]), Tag(37, u'x'), Tag(258, 1)):
+            self.assertRaises(ValueError, self.loads, self.dumps(bad), semantic_tags=True)
+        # a ClassTag for a semantic tag number wins both ways
+        point_tag = [ClassTag(4, _Point, lambda p: [p.x, p.y], lambda v: tuple(v))]
+        ser = self.dumps([_Point(1, 2), decimal.Decimal('1.5'), ob[4]], class_tags=point_tag, semantic_tags=True)
+        assert ser.startswith(b'\x83\xc4\x82\x01\x02')
+        assert self.loads(ser, class_tags=point_tag, semantic_tags=True) == [(1, 2), (-1, 15), ob[4]]
+
+    def test_string_referencing(self):
+        if not self.testable(): return
+        hosts = [u'host-{0}.example.com'.format(i % 7) for i in _range(100)]
+        ob = [{u'host': h, u'status': u'OK', u'raw': b'\x00\x01\x02', u'n': i} for i, h in enumerate(hosts)]
+        ob.append([1 << 70, 1 << 70, -(1 << 70), b'OK', u'OK'])
+        for sort_keys in (False, True):
+            ser = self.dumps(ob, sort_keys=sort_keys, string_referencing=True)
+            assert ser == pydumps(ob, sort_keys=sort_keys, string_referencing=True)
+            assert len(ser) < len(self.dumps(ob)) * 0.6
+            assert self.loads(ser) == ob
+            assert self.load(StringIO(ser)) == ob
+            assert list(self.loads_seq(ser + ser)) == [ob, ob]
+            fout = StringIO()
+            self.dump(ob, fout, sort_keys=sort_keys, string_referencing=True)
+            assert fout.getvalue() == ser
+        # same object back for every reference
+        out = self.loads(self.dumps([u'abcd', u'abcd'], string_referencing=True))
+        assert out[0] is out[1]
+        # strings default and class_tags produce are in the table too
+        ser = self.dumps([_Point(1, 2), u'point'], default=lambda p: [u'point', p.x, p.y], string_referencing=True)
+        assert self.loads(ser) == [[u'point', 1, 2], u'point']
+        assert ser.endswith(b'\xd8\x19\x00')
+        # an indefinite length string isn't, nor are its chunks
+        assert self.loads(b'\xd9\x01\x00\x83\x7f\x63aaa\xff\x63aaa\xd8\x19\x00') == [u'aaa'] * 3
+        # outside a namespace tag 25 is just a tag
+        assert self.loads(b'\xd8\x19\x00') == Tag(25, 0)
+        # tag numbers too big for a C long
+        for tag in (2**63, 2**64 - 1):
+            ser = self.dumps(Tag(tag, u'x'), string_referencing=True)
+            assert ser == pydumps(Tag(tag, u'x'), string_referencing=True)
+            assert self.loads(ser) == Tag(tag, u'x')
+        for bad in (b'\xd9\x01\x00\x81\xd8\x19\x00', b'\xd9\x01\x00\x82\x63aaa\xd8\x19\x61x'):
+            self.assertRaises(ValueError, self.loads, bad)
+
+    def test_canonical(self):
+        if not self.testable(): return
+        ob = {100: 1, u'aa': 2, -1: 3, u'z': 4, 10: 5, b'x': 6, (1, 2): 7, 1.5: {u'b': 1.0, u'a': [0.1]}}
+        ser = self.dumps(ob, canonical=True)
+        assert ser == pydumps(ob, canonical=True)
+        # 10, 100, -1, h'78', "z", "aa", [1, 2], 1.5 as float16 with its map's keys sorted too
+        assert ser == (b'\xa8\x0a\x05\x18\x64\x01\x20\x03\x41x\x06\x61z\x04\x62aa\x02\x82\x01\x02\x07'
+                       b'\xf9\x3e\x00\xa2\x61a\x81\xfb\x3f\xb9\x99\x99\x99\x99\x99\x9a\x61b\xf9\x3c\x00')
+        # insertion order and sort_keys don't matter
+        rev = dict(reversed(list(ob.items())))
+        assert self.dumps(rev, canonical=True, sort_keys=True) == ser
+        fout = StringIO()
+        self.dump(ob, fout, canonical=True)
+        assert fout.getvalue() == ser
+        # keys that only differ once encoded
+        self.assertRaises(ValueError, self.dumps, {1: 0, _Point(1, 2): 0}, canonical=True, default=lambda p: 1)
+        self.assertRaises(ValueError, self.dumps, [], canonical=True, string_referencing=True)
+        if _IS_PY3:
+            ser = self.dumps({frozenset([3, 1, u'a', -2]): [1, 2]}, canonical=True, semantic_tags=True)
+            assert ser == b'\xa1\xd9\x01\x02\x84\x01\x03\x21\x61a\x82\x01\x02'
+            assert ser == pydumps({frozenset([3, 1, u'a', -2]): [1, 2]}, canonical=True, semantic_tags=True)
+
+    def test_encoder_decoder(self):
+        if not self.testable(): return
+        recs = [{u'id': i, u'name': u'x' * (i % 40), u'vals': [i, -i, 1.5], u'': None} for i in _range(200)]
+        enc = self.encoder(sort_keys=True, float_mode='shortest')
+        dec = self.decoder(object_hook=lambda d: d.get(u'id', d))
+        for rec in recs:
+            ser = enc.encode(rec)
+            assert ser == self.dumps(rec, sort_keys=True, float_mode='shortest')
+            assert dec.decode(ser) == rec[u'id']
+        dec = self.decoder()
+        assert [dec.decode(enc.encode(rec)) for rec in recs] == recs
+        # bigger than the buffer the Encoder keeps, then small again
+        big = [b'x' * 1000] * 2000
+        assert dec.decode(enc.encode(big)) == big
+        assert enc.encode(1) == b'\x01'
+        out = self.decoder(bytes_as_memoryview=True).decode(bytearray(self.dumps([b'abc'])))
+        assert isinstance(out[0], memoryview) and out[0] == b'abc'
+        self.assertRaises((ValueError, EOFError), dec.decode, b'\x82\x01')
+        assert dec.decode(b'\x82\x01\x02') == [1, 2]
+        # called again from inside default and object_hook
+        enc = self.encoder(default=lambda p: Tag(1000, enc.encode([p.x, p.y])))
+        ser = enc.encode([_Point(1, 2), _Point(3, 4)])
+        assert self.loads(ser) == [Tag(1000, self.dumps([1, 2])), Tag(1000, self.dumps([3, 4]))]
+        dec = self.decoder(object_hook=lambda d: dec.decode(d[u'inner']) if u'inner' in d else d)
+        assert dec.decode(self.dumps([{u'inner': self.dumps({u'a': 1})}, {u'b': 2}])) == [{u'a': 1}, {u'b': 2}]
+        self.assertRaises(TypeError, self.encoder, True)
+        # C objects whose __init__() was skipped have the default options
+        if cEncoder is not None:
+            bare = cEncoder.__new__(cEncoder)
+            assert bare.encode([1, u'a']) == self.dumps([1, u'a'])
+            buf = bytearray(10)
+            assert bare.encode_into([1], buf) == 2 and buf[:2] == b'\x81\x01'
+            assert cDecoder.__new__(cDecoder).decode(b'\x81\x01') == [1]
+
+    def test_dumps_into(self):
+        if not self.testable(): return
+        ob = {u'id': 7, u'method': u'get', u'params': [b'x' * 300, 1.5, {u'k': [1, 2, 3]}]}
+        ser = self.dumps(ob, sort_keys=True)
+        buf = bytearray(1000)
+        n = self.dumps_into(ob, buf, sort_keys=True)
+        assert n == len(ser) and bytes(buf[:n]) == ser
+        assert self.dumps_into(ob, buf, n, sort_keys=True) == n
+        assert bytes(buf[n:2 * n]) == ser
+        assert self.dumps_into(ob, memoryview(buf)[100:], offset=2) == n
+        assert bytes(buf[102:102 + n]) == ser
+        assert self.encoder(sort_keys=True).encode_into(ob, buf, 1000 - n) == n
+        assert bytes(buf[-n:]) == ser
+        assert self.dumps_into(b'x' * 40, array.array('b', [0] * 50)) == 42
+        for size, offset in ((0, 0), (n - 1, 0), (n, 1), (20, 5), (1000, 999)):
+            try:
+                self.dumps_into(ob, bytearray(size), offset)
+                assert False, 'expected BufferTooSmallError'
+            except BufferTooSmallError as e:
+                assert (e.required, e.available) == (n, size - offset), (e.required, e.available)
+        try:
+            self.encoder().encode_into([b'x' * 100000], bytearray(10))
+            assert False, 'expected BufferTooSmallError'
+        except BufferTooSmallError as e:
+            assert e.required == len(self.dumps([b'x' * 100000]))
+        self.assertRaises(ValueError, self.dumps_into, 1, buf, 1001)
+        self.assertRaises(ValueError, self.dumps_into, 1, buf, -1)
+        self.assertRaises(TypeError, self.dumps_into, 1, b'read only')
+
+    def test_stream_decoder(self):
+        if not self.testable(): return
+        obs = [{u'id': i, u'method': u'get', u'params': [i, u'x' * i]} for i in _range(50)]
+        obs += [b'\x00' * 100000, [1, [2, [3]]], Tag(1000, u'tagged'), 1.5, None, u'', 0]
+        ser = b''.join(self.dumps(ob) for ob in obs)
+        # indefinite length array and chunked text
+        ser += b'\x9f\x01\x7f\x61a\x62bc\xff\xff'
+        obs.append([1, u'abc'])
+        for step in (1, 2, 7, 1000, 70000, len(ser)):
+            dec = self.stream_decoder()
+            out = []
+            for i in _range(0, len(ser), step):
+                dec.feed(ser[i:i + step])
+                out.extend(dec)
+            assert out == obs, step
+            assert dec.buffered == 0
+            assert list(dec) == []
+        dec = self.stream_decoder(object_hook=lambda d: d.get(u'id', d))
+        dec.feed(memoryview(ser)[:200])
+        assert dec.buffered == 200
+        first = list(dec)
+        assert first == list(_range(len(first))) and dec.buffered < 200
+        # an item that can't be decoded is skipped, one that isn't well-formed stops the stream
+        dec = self.stream_decoder(tag_hook=lambda t: 1 // 0)
+        dec.feed(self.dumps([Tag(1000, 1), 2]) + self.dumps(3) + b'\x1c\x01')
+        self.assertRaises(ZeroDivisionError, next, dec)
+        assert next(dec) == 3
+        self.assertRaises(ValueError, next, dec)
+        self.assertRaises(ValueError, dec.feed, b'\x01')
+
+    def test_stream_decoder_deep(self):
+        if not self.testable(): return
+        # well-formed, but nested too deep to decode: the item fails
+        # (RecursionError is a RuntimeError) and the stream goes on
+        dec = self.stream_decoder()
+        for deep in (b'\x81' * 200000 + b'\x00', b'\xc6' * 200000 + b'\x00', b'\xa1\x00' * 200000 + b'\x00'):
+            dec.feed(deep + self.dumps([1]))
+            self.assertRaises(RuntimeError, next, dec)
+            assert next(dec) == [1]
+            self.assertRaises(RuntimeError, self.loads, deep)
+        assert dec.buffered == 0
+
+    def test_key_cache(self):
+        if not self.testable(): return
+        long_key = 'k' * 40
+        recs = [{'id': i, u'n\u00e4me': 'x', long_key: i, '': 0, 7: 'int key'} for i in _range(300)]
+        ser = self.dumps(recs)
+        for kw in ({}, {'key_cache_size': 0}, {'key_cache_size': 1}, {'key_cache_size': 1000000}):
+            assert self.loads(ser, **kw) == recs, kw
+            assert self.load(StringIO(ser), **kw) == recs, kw
+            assert list(self.loads_seq(ser, **kw)) == [recs], kw
+        # indefinite length map keys go through the cache too
+        assert self.loads(b'\x82\xbf\x61a\x01\xff\xbf\x61a\x02\xff') == [{'a': 1}, {'a': 2}]
+        if self._ld[0] is cloads:
+            out = self.loads(ser)
+            assert [k for k in out[-2] if k == 'id'][0] is [k for k in out[-1] if k == 'id'][0]
+            out = self.loads(ser, key_cache_size=0)
+            assert [k for k in out[0] if k == 'id'][0] is not [k for k in out[-1] if k == 'id'][0]
+            # shared across the items of a sequence
+            items = list(self.loads_seq(b''.join(self.dumps({'id': i}) for i in _range(100))))
+            assert list(items[-2])[0] is list(items[-1])[0]
+        # a bad key still fails
+        try:
+            self.loads(b'\xa1\x62\xff\xfe\x01')
+            assert False, 'expected error on bad utf-8 key'
+        except (ValueError, RuntimeError):
+            pass
+
     # TODO: find more bad strings with which to fuzz CBOR
     def test_badread(self):
         if not self.testable(): return
@@ -275,12 +847,38 @@ class XTestCBOR(object):
         # Tag(0,...) because there was a bug around that.
         xb = self.dumps(Tag(0, datetime.datetime(1984,1,24,23,22,21).isoformat()))
 
+    def test_tag(self):
+        if not self.testable(): return
+        ob = Tag(1000, [1, Tag(1001, u'a')])
+        assert self.loads(self.dumps(ob)) == ob
+        assert Tag(1, 2) == Tag(1, 2)
+        assert Tag(1, 2) != Tag(1, 3)
+        assert Tag(1, 2) != Tag(2, 2)
+        assert Tag(1, 2) != (1, 2)
+        assert hash(Tag(1, u'a')) == hash(Tag(1, u'a'))
+        assert {Tag(1, u'a'): 1}[Tag(1, u'a')] == 1
+        assert repr(Tag(1, 2)) == 'Tag(1, 2)'
+        assert pickle.loads(pickle.dumps(ob)) == ob
+        t = Tag()
+        assert (t.tag, t.value) == (None, None)
+        t.tag = 5
+        t.value = u'x'
+        assert self.dumps(t) == self.dumps(Tag(tag=5, value=u'x'))
+        assert self.dumps(Tag(0xffffffffffffffff, 1)) == b'\xdb' + b'\xff' * 8 + b'\x01'
+        for bad in (Tag(-1, 1), Tag(u'x', 1), Tag(1 << 64, 1)):
+            self.assertRaises(ValueError, self.dumps, bad)
+        if cloads is not None:
+            # one Tag type shared by both implementations
+            from cbor._cbor import Tag as CTag
+            assert Tag is CTag
+
     def test_sortkeys(self):
         if not self.testable(): return
         obytes = []
         xbytes = []
         for n in _range(2, 27):
-            ob = {u'{:02x}'.format(x):x for x in _range(n)}
+            # insert in reverse so that insertion ordered dicts don't come out sorted
+            ob = {u'{:02x}'.format(x):x for x in reversed(_range(n))}
             obytes.append(self.dumps(ob, sort_keys=True))
             xbytes.append(self.dumps(ob, sort_keys=False))
         allOGood = True
@@ -324,6 +922,13 @@ b'\xb8\x19b00\x00b01\x01b02\x02b03\x03b04\x04b05\x05b06\x06b07\x07b08\x08b09\tb0
 b'\xb8\x1ab00\x00b01\x01b02\x02b03\x03b04\x04b05\x05b06\x06b07\x07b08\x08b09\tb0a\nb0b\x0bb0c\x0cb0d\rb0e\x0eb0f\x0fb10\x10b11\x11b12\x12b13\x13b14\x14b15\x15b16\x16b17\x17b18\x18\x18b19\x18\x19',
 ]
 
+class _Point(object):
+    "for test_hooks"
+    def __init__(self, x, y):
+        self.x = x
+        self.y = y
+
+
 def gen_sorted_bytes():
     for n in _range(2, 27):
         sys.stdout.write(repr(cbor.dumps({u'{:02x}'.format(x):x for x in _range(n)}, sort_keys=True)) + ',\n')
@@ -333,6 +938,34 @@ def gen_unsorted_bytes():
         sys.stdout.write(repr(cbor.dumps({u'{:02x}'.format(x):x for x in _range(n)}, sort_keys=False)) + ',\n')
 
 
+if _IS_PY3:
+    import io
+
+    class _NoSeekRaw(io.RawIOBase):
+        def __init__(self, blob):
+            self._fin = io.BytesIO(blob)
+        def readable(self):
+            return True
+        def readinto(self, b):
+            data = self._fin.read(min(len(b), 1000))
+            b[:len(data)] = data
+            return len(data)
+
+    def _peek_stream(blob):
+        "non-seekable stream with peek(), like a socket or pipe"
+        return io.BufferedReader(_NoSeekRaw(blob))
+else:
+    _peek_stream = StringIO
+
+
+class _plain_stream(object):
+    "only has read()"
+    def __init__(self, blob):
+        self._fin = StringIO(blob)
+    def read(self, n):
+        return self._fin.read(n)
+
+
 class TestCBORPyPy(unittest.TestCase, XTestCBOR, TestPyPy):
     pass
 
@@ -387,6 +1020,9 @@ def _randTag(randob=_randob):
     # need to be adjusted to only assign unclaimed tags for Tag<->Tag
     # encode-decode testing.
     t.tag = random.randint(37, 1000000)
+    while t.tag == 256:
+        # stringref namespace, always decoded
+        t.tag = random.randint(37, 1000000)
     t.value = randob()
     return t
 
@@ -0,0 +1,102 @@
+import os
+import shutil
+import tempfile
+import unittest
+
+
+from cbor import dumps, IndexedFile, IndexedWriter, build_index
+from cbor.indexed import INDEX_MAGIC
+
+
+def _record(i):
+    return {'id': i, 'name': 'record {0}'.format(i), 'data': [i, i * 2.5, b'x' * (i % 7)]}
+
+
+class TestIndexed(unittest.TestCase):
+    def setUp(self):
+        self.dir = tempfile.mkdtemp()
+        self.path = os.path.join(self.dir, 'records.cbor')
+
+    def tearDown(self):
+        shutil.rmtree(self.dir)
+
+    def _append_raw(self, obs):
+        "append records without touching the index"
+        with open(self.path, 'ab') as fout:
+            for ob in obs:
+                fout.write(dumps(ob))
+
+    def test_write_and_read(self):
+        with IndexedWriter(self.path) as out:
+            spans = [out.write(_record(i)) for i in range(1000)]
+        with IndexedFile(self.path, update=False) as records:
+            assert len(records) == 1000
+            assert records[0] == _record(0)
+            assert records[567] == _record(567)
+            assert records[-1] == _record(999)
+            assert records[10:13] == [_record(i) for i in range(10, 13)]
+            assert records.span(567) == spans[567]
+            assert bytes(records.raw(3)) == dumps(_record(3))
+            assert list(records) == [_record(i) for i in range(1000)]
+            self.assertRaises(IndexError, records.__getitem__, 1000)
+
+    def test_incremental(self):
+        self._append_raw(_record(i) for i in range(100))
+        assert build_index(self.path) == 100
+        index_size = os.path.getsize(self.path + '.idx')
+        assert index_size == len(INDEX_MAGIC) + 8 * 100
+        with open(self.path + '.idx', 'rb') as fin:
+            before = fin.read()
+        self._append_raw(_record(i) for i in range(100, 150))
+        with IndexedFile(self.path) as records:
+            assert len(records) == 150
+            assert records[149] == _record(149)
+            # appended to, not rewritten
+            with open(self.path + '.idx', 'rb') as fin:
+                assert fin.read().startswith(before)
+            self._append_raw([_record(150)])
+            assert records.refresh() == 151
+            assert records[150] == _record(150)
+        # the writer picks up where unindexed appends left off
+        self._append_raw([_record(151)])
+        with IndexedWriter(self.path) as out:
+            assert out.write(_record(152))[0] == os.path.getsize(self.path)
+        with IndexedFile(self.path, update=False) as records:
+            assert records[-2:] == [_record(151), _record(152)]
+
+    def test_partial_tail(self):
+        self._append_raw(_record(i) for i in range(10))
+        with open(self.path, 'ab') as fout:
+            fout.write(dumps(_record(10))[:-3])
+        with IndexedFile(self.path) as records:
+            # last record is still being written
+            assert len(records) == 10
+        with open(self.path, 'ab') as fout:
+            fout.write(dumps(_record(10))[-3:])
+        with IndexedFile(self.path) as records:
+            assert len(records) == 11
+            assert records[10] == _record(10)
+
+    def test_rebuild(self):
+        self._append_raw(_record(i) for i in range(20))
+        build_index(self.path)
+        # data file replaced with a shorter one
+        os.unlink(self.path)
+        self._append_raw(_record(i) for i in range(5))
+        with IndexedFile(self.path) as records:
+            assert len(records) == 5
+        with open(self.path + '.idx', 'wb') as fout:
+            fout.write(b'not an index')
+        with IndexedFile(self.path) as records:
+            assert records[4] == _record(4)
+
+    def test_empty(self):
+        open(self.path, 'wb').close()
+        with IndexedFile(self.path) as records:
+            assert len(records) == 0
+            assert list(records) == []
+        self.assertRaises(ValueError, IndexedFile, self.path, index_path=self.path + '.none', update=False)
+
+
+if __name__ == '__main__':
+  unittest.main()
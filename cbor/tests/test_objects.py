@@ -3,10 +3,16 @@ import sys
 import unittest
 
 
+import cbor
+from cbor.cbor import dumps as pydumps, loads as pyloads
 from cbor.tagmap import ClassTag, TagMapper, Tag, UnknownTagException
+try:
+    from cbor._cbor import dumps as cdumps, loads as cloads
+except ImportError:
+    cdumps, cloads = None, None
 
 #try:
-from cbor.tests.test_cbor import TestPyPy, hexstr
+from cbor.tests.test_cbor import TestPyPy, hexstr, StringIO
 #except ImportError:
 #    from .test_cbor import TestPyPy, hexstr
 
@@ -31,6 +37,10 @@ class SomeType(object):
         return isinstance(other, type(self)) and (self.__dict__ == other.__dict__)
 
 
+class SubType(SomeType):
+    pass
+
+
 class UnknownType(object):
     pass
 
@@ -41,6 +51,9 @@ known_tags = [
 
 
 class TestObjects(unittest.TestCase):
+    loads_impls = [pyloads] + ([cloads] if cloads is not None else [])
+    dumps_impls = [pydumps] + ([cdumps] if cdumps is not None else [])
+
     def setUp(self):
         self.tx = TagMapper(known_tags)
 
@@ -75,7 +88,34 @@ class TestObjects(unittest.TestCase):
             self._oso(Tag(1234, 'aoeu'))
         except UnknownTagException as ute:
             ok = True
-        ok = False
+        assert ok
+
+    def test_nested(self):
+        ob = {'a': [SomeType(1, 2), [SomeType(u'x', [3]), 4]], 'b': SomeType(None, {'c': 5})}
+        self._oso(ob)
+        # isinstance() match, comes back as what from_cbor makes
+        assert self.tx.loads(self.tx.dumps([SubType(6, 7)])) == [SomeType(6, 7)]
+        ser = self.tx.dumps(ob)
+        # both implementations write and read the same thing
+        for dumps in self.dumps_impls:
+            assert dumps(ob, class_tags=known_tags) == ser
+        for loads in self.loads_impls:
+            assert loads(ser, class_tags=known_tags) == self.tx.loads(ser)
+            assert loads(ser) == cbor.loads(ser)
+
+    def test_file(self):
+        ob = [SomeType(1, 2), {'x': SomeType(3, 4)}]
+        fp = StringIO()
+        self.tx.dump(ob, fp)
+        assert fp.getvalue() == self.tx.dumps(ob)
+        fp.seek(0)
+        assert self.tx.load(fp) == ob
+
+    def test_unk_tag_fail_impls(self):
+        ser = cbor.dumps([Tag(1234, 'aoeu')])
+        for loads in self.loads_impls:
+            self.assertRaises(UnknownTagException, loads, ser, class_tags=known_tags, raise_on_unknown_tag=True)
+            assert loads(ser, class_tags=known_tags) == [Tag(1234, 'aoeu')]
 
 
 if __name__ == '__main__':
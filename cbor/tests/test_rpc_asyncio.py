@@ -0,0 +1,137 @@
+#!python
+from __future__ import absolute_import
+import logging
+import socket
+import sys
+import unittest
+
+import cbor
+
+logger = logging.getLogger(__name__)
+
+if sys.version_info >= (3, 7):
+    import asyncio
+    from cbor.cbor_rpc_asyncio import AsyncCborRpcClient, CborRpcError
+else:
+    asyncio = None
+
+
+class _TestServerProtocol(object):
+    '''
+    Answers echo(*params) with params, error() with an error, and
+    hold(n) only once n calls are waiting, in reverse order.
+    drop() closes the connection, sleep() never answers.
+    '''
+    def __init__(self, server):
+        self.server = server
+        self.held = []
+
+    def connection_made(self, transport):
+        self.transport = transport
+        self.decoder = cbor.StreamDecoder()
+        self.server.transports.append(transport)
+
+    def data_received(self, data):
+        self.decoder.feed(data)
+        for req in self.decoder:
+            method = req['method']
+            if method == 'echo':
+                self.reply({'id': req['id'], 'result': req['params']})
+            elif method == 'error':
+                self.reply({'id': req['id'], 'error': {'message': 'no good'}})
+            elif method == 'hold':
+                self.held.append(req)
+                self.server.max_held = max(self.server.max_held, len(self.held))
+                if len(self.held) >= req['params'][0]:
+                    for held in reversed(self.held):
+                        self.reply({'id': held['id'], 'result': held['params']})
+                    self.held = []
+            elif method == 'drop':
+                self.transport.close()
+                return
+
+    def reply(self, response):
+        self.transport.write(cbor.dumps(response))
+
+    def connection_lost(self, exc):
+        pass
+
+    def eof_received(self):
+        pass
+
+    def pause_writing(self):
+        pass
+
+    def resume_writing(self):
+        pass
+
+
+class _TestServer(object):
+    def __init__(self, loop):
+        self.max_held = 0
+        self.transports = []
+        self.server = loop.run_until_complete(
+            loop.create_server(lambda: _TestServerProtocol(self), '127.0.0.1', 0))
+        self.address = self.server.sockets[0].getsockname()[:2]
+
+    def close(self):
+        self.server.close()
+        for transport in self.transports:
+            transport.close()
+
+
+class TestAsyncCborRpcClient(unittest.TestCase):
+    def setUp(self):
+        if asyncio is None:
+            self.skipTest('needs Python 3.7')
+        self.loop = asyncio.new_event_loop()
+        asyncio.set_event_loop(self.loop)
+        self.server = _TestServer(self.loop)
+
+    def tearDown(self):
+        self.server.close()
+        # let the transports finish closing
+        self.loop.run_until_complete(asyncio.sleep(0.01))
+        self.loop.close()
+        asyncio.set_event_loop(None)
+
+    def run_calls(self, *calls):
+        return self.loop.run_until_complete(asyncio.gather(*calls, return_exceptions=True))
+
+    def client(self, **config):
+        config['address'] = self.server.address
+        return AsyncCborRpcClient(config)
+
+    def test_pipelined(self):
+        client = self.client()
+        out = self.run_calls(*[client.call('echo', [i, u'x' * i]) for i in range(500)])
+        assert out == [[i, u'x' * i] for i in range(500)]
+        # answered in reverse order, matched by id
+        out = self.run_calls(*[client._rpc('hold', [50, i]) for i in range(50)])
+        assert out == [[50, i] for i in range(50)]
+        client.close()
+
+    def test_errors(self):
+        client = self.client(timeout=0.2)
+        out = self.run_calls(client.call('error', []), client.call('sleep', []),
+                             client.call('echo', [1]), client.call('hold', [3]))
+        assert isinstance(out[0], CborRpcError) and str(out[0]) == 'no good'
+        assert isinstance(out[1], asyncio.TimeoutError)
+        assert out[2] == [1]
+        assert isinstance(out[3], asyncio.TimeoutError)
+        out = self.run_calls(client.call('hold', [100], timeout=None), client.call('drop', []))
+        assert all(isinstance(ex, ConnectionError) for ex in out), out
+        # connects again
+        assert self.run_calls(client.call('echo', [2])) == [[2]]
+        client.close()
+
+    def test_max_in_flight(self):
+        client = self.client(max_in_flight=4, timeout=2)
+        out = self.run_calls(*[client.call('hold', [4, i]) for i in range(40)])
+        assert out == [[4, i] for i in range(40)]
+        assert self.server.max_held == 4
+        client.close()
+
+
+if __name__ == '__main__':
+    unittest.main()
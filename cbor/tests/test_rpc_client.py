@@ -0,0 +1,157 @@
+#!python
+from __future__ import absolute_import
+import logging
+import socket
+import sys
+import threading
+import time
+import unittest
+
+import cbor
+from cbor.cbor_rpc_client import CborRpcClient
+
+logger = logging.getLogger(__name__)
+
+if sys.version_info >= (3, 7):
+    import asyncio
+    from cbor.tests.test_rpc_server import _test_server
+else:
+    asyncio = None
+
+
+class TestCborRpcClient(unittest.TestCase):
+    def setUp(self):
+        if asyncio is None:
+            self.skipTest('test server needs Python 3.7')
+        # server loop in another thread, blocking clients in this one
+        self.loop = asyncio.new_event_loop()
+        self.server = self.loop.run_until_complete(_test_server().start())
+        self.thread = threading.Thread(target=self.loop.run_forever)
+        self.thread.start()
+
+    def tearDown(self):
+        self.loop.call_soon_threadsafe(self.loop.stop)
+        self.thread.join()
+        self.server.close()
+        # let the transports finish closing
+        self.loop.run_until_complete(asyncio.sleep(0.01))
+        self.loop.close()
+
+    def client(self, **config):
+        config['address'] = self.server.address
+        config.setdefault('retries', 0)
+        return CborRpcClient(config)
+
+    def in_loop(self, fn):
+        done = threading.Event()
+
+        def run():
+            fn()
+            done.set()
+        self.loop.call_soon_threadsafe(run)
+        done.wait()
+
+    def test_rpc(self):
+        client = self.client()
+        assert client._rpc(u'add', [u'a', u'b']) == u'ab'
+        with self.assertRaises(Exception) as cm:
+            client._rpc(u'fail', [u'no good'])
+        assert str(cm.exception) == 'no good'
+        assert client._rpc(u'echo', [3]) == [3]
+        # one connection, reused
+        assert len(self.server.connections) == 1
+        client.close()
+
+    def test_batch(self):
+        client = self.client()
+        with client.batch() as batch:
+            calls = [batch.call(u'echo', [i]) for i in range(100)]
+            late = batch._rpc(u'slow', [0.01, u'late'])
+            failed = batch.call(u'fail', [u'no good'])
+            with self.assertRaises(Exception):
+                late.result()
+        assert [c.result() for c in calls] == [[i] for i in range(100)]
+        assert late.result() == u'late'
+        with self.assertRaises(Exception) as cm:
+            failed.result()
+        assert str(cm.exception) == 'no good'
+        # not sent if the block raises
+        with self.assertRaises(KeyError):
+            with client.batch() as batch:
+                unsent = batch.call(u'echo', [1])
+                raise KeyError()
+        with self.assertRaises(Exception):
+            unsent.result()
+        client.close()
+
+    def test_big_batch(self):
+        # more than fits in socket buffers both ways
+        client = self.client()
+        blob = b'x' * 1000
+        with client.batch() as batch:
+            calls = [batch.call(u'echo', [i, blob]) for i in range(20000)]
+        assert all(c.result() == [i, blob] for i, c in enumerate(calls))
+        client.close()
+
+    def test_threads(self):
+        client = self.client(max_connections=3)
+        errors = []
+
+        def work(n):
+            try:
+                for i in range(200):
+                    assert client._rpc(u'add', [n, i]) == n + i
+            except Exception as ex:
+                errors.append(ex)
+        threads = [threading.Thread(target=work, args=(n,)) for n in range(8)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        assert not errors, errors
+        assert 1 <= len(self.server.connections) <= 3
+        client.close()
+
+    def test_stale_connection(self):
+        client = self.client(base_retry_seconds=5)
+        assert client._rpc(u'echo', [1]) == [1]
+        # server drops the idle connection; next call gets a new one, no retry wait
+        self.in_loop(lambda: [p.transport.close() for p in list(self.server.connections)])
+        time.sleep(0.05)
+        start = time.time()
+        assert client._rpc(u'echo', [2]) == [2]
+        assert time.time() - start < 1
+        client.close()
+
+    def test_timeout_not_retried(self):
+        runs = []
+
+        @self.server.method
+        async def counted(seconds):
+            runs.append(seconds)
+            await asyncio.sleep(seconds)
+            return seconds
+        # the server has the request, so a timeout waiting for the response doesn't resend it
+        client = self.client(timeout=0.1, retries=2, base_retry_seconds=0.01)
+        with self.assertRaises(socket.timeout):
+            client._rpc(u'counted', [0.3])
+        time.sleep(0.3)
+        assert runs == [0.3]
+        client.close()
+        # no timeout by default
+        client = self.client()
+        assert client._rpc(u'counted', [0.2]) == 0.2
+        client.close()
+
+    def test_own_socket(self):
+        # a subclass can still talk to the server directly, with _conn() and rfile
+        client = self.client()
+        client._conn().sendall(cbor.dumps({u'id': 1, u'method': u'echo', u'params': [1]}))
+        assert cbor.load(client.rfile) == {u'id': 1, u'result': [1]}
+        assert client._rpc(u'echo', [2]) == [2]
+        client.close()
+        assert client._socket is None
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,129 @@
+#!python
+from __future__ import absolute_import
+import logging
+import sys
+import unittest
+
+logger = logging.getLogger(__name__)
+
+if sys.version_info >= (3, 7):
+    import asyncio
+    from cbor.cbor_rpc_asyncio import AsyncCborRpcClient, CborRpcError
+    from cbor.cbor_rpc_server import CborRpcServer, echo
+else:
+    asyncio = None
+
+
+def _test_server():
+    server = CborRpcServer({}, {'echo': echo})
+
+    @server.method
+    def add(a, b):
+        return a + b
+
+    @server.method(name='fail')
+    def _fail(message):
+        raise ValueError(message)
+
+    @server.method
+    def unencodable():
+        return object()
+
+    @server.method
+    async def slow(seconds, x):
+        await asyncio.sleep(seconds)
+        return x
+
+    @server.method
+    async def slow_fail():
+        await asyncio.sleep(0)
+        raise KeyError()
+
+    return server
+
+
+class TestCborRpcServer(unittest.TestCase):
+    def setUp(self):
+        if asyncio is None:
+            self.skipTest('needs Python 3.7')
+        self.loop = asyncio.new_event_loop()
+        asyncio.set_event_loop(self.loop)
+        self.server = self.loop.run_until_complete(_test_server().start())
+
+    def tearDown(self):
+        self.server.close()
+        # let the transports finish closing
+        self.loop.run_until_complete(asyncio.sleep(0.01))
+        self.loop.close()
+        asyncio.set_event_loop(None)
+
+    def run_calls(self, *calls):
+        return self.loop.run_until_complete(asyncio.gather(*calls, return_exceptions=True))
+
+    def client(self, **config):
+        config['address'] = self.server.address
+        return AsyncCborRpcClient(config)
+
+    def test_handlers(self):
+        client = self.client()
+        out = self.run_calls(
+            client.call('echo', [1, u'a']),
+            client.call('add', [2, 3]),
+            client.call('slow', [0.01, u'z']),
+            client.call('fail', [u'no good']),
+            client.call('slow_fail', []),
+            client.call('nope', []),
+            client.call('add', [1]),
+            client.call('unencodable', []),
+            client.call('echo', None),
+        )
+        assert out[:3] == [[1, u'a'], 5, u'z'], out
+        assert str(out[3]) == 'no good'
+        assert str(out[4]) == 'KeyError'
+        assert "no such method 'nope'" in str(out[5])
+        assert 'argument' in str(out[6])
+        assert 'could not encode result' in str(out[7])
+        assert all(isinstance(ex, CborRpcError) for ex in out[3:8]), out
+        assert out[8] == []
+        client.close()
+
+    def test_out_of_order(self):
+        client = self.client()
+        done = []
+
+        async def call(method, params):
+            done.append(await client.call(method, params))
+        self.run_calls(call('slow', [0.05, 1]), call('echo', [2]), call('slow', [0, 3]))
+        assert done == [[2], 3, 1], done
+        client.close()
+
+    def test_pipelined(self):
+        client = self.client()
+        writes = []
+        self.run_calls(client.call('echo', []))
+        protocol = next(iter(self.server.connections))
+        transport_write = protocol.transport.write
+
+        def write(data):
+            writes.append(len(data))
+            transport_write(data)
+        protocol.transport.write = write
+        out = self.run_calls(*[client.call('echo', [i]) for i in range(1000)])
+        assert out == [[i] for i in range(1000)]
+        # responses go out batched, not one write each
+        assert len(writes) < 100, len(writes)
+        client.close()
+
+    def test_bad_data(self):
+        client = self.client()
+        self.run_calls(client.call('echo', []))
+        protocol = next(iter(self.server.connections))
+        protocol.data_received(b'\x01')
+        assert protocol.transport.is_closing()
+        out = self.run_calls(client.call('echo', [1]))
+        assert isinstance(out[0], ConnectionError), out
+        client.close()
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,199 @@
+#!python
+from __future__ import absolute_import
+import logging
+import threading
+import time
+import unittest
+
+from cbor.tests.test_cbor import _randob
+
+
+logger = logging.getLogger(__name__)
+
+
+try:
+    from cbor._cbor import dumps as cdumps
+    from cbor._cbor import loads as cloads
+    from cbor._cbor import iter_load as citer_load
+    from cbor._cbor import Encoder as cEncoder
+    from cbor._cbor import Decoder as cDecoder
+    from cbor._cbor import StreamDecoder as cStreamDecoder
+except ImportError:
+    cdumps = None
+
+
+_THREADS = 8
+_ROUNDS = 200
+
+
+def _run_threads(fn, count=_THREADS):
+    '''Run fn(n) in count threads at once, return the exceptions they raised.'''
+    errors = []
+    start = threading.Event()
+
+    def run(n):
+        start.wait()
+        try:
+            fn(n)
+        except Exception as ex:
+            logger.error('thread %d failed', n, exc_info=True)
+            errors.append(ex)
+    threads = [threading.Thread(target=run, args=(n,)) for n in range(count)]
+    for t in threads:
+        t.start()
+    start.set()
+    for t in threads:
+        t.join()
+    return errors
+
+
+class Yielding(object):
+    '''Encoded by a default function that gives other threads a turn.'''
+    def __init__(self, value):
+        self.value = value
+
+
+def _yielding_default(ob):
+    time.sleep(0)
+    return {u'yielding': ob.value}
+
+
+class TestThreads(unittest.TestCase):
+    def setUp(self):
+        if cdumps is None:
+            self.skipTest('no C extension')
+        self.obs = [_randob() for _ in range(50)]
+        self.blobs = [cdumps(ob, sort_keys=True) for ob in self.obs]
+
+    def test_dumps_loads(self):
+        def work(n):
+            for _ in range(_ROUNDS):
+                for ob, blob in zip(self.obs, self.blobs):
+                    assert cdumps(ob, sort_keys=True) == blob
+                    assert cloads(blob) == ob
+        assert not _run_threads(work)
+
+    def test_shared_encoder_decoder(self):
+        enc = cEncoder(sort_keys=True, default=_yielding_default)
+        dec = cDecoder()
+
+        def work(n):
+            for i in range(_ROUNDS):
+                k = (n + i) % len(self.obs)
+                assert enc.encode(self.obs[k]) == self.blobs[k]
+                assert dec.decode(self.blobs[k]) == self.obs[k]
+                # switches threads mid-encode, so others find enc busy
+                blob = enc.encode([n, Yielding(i), Yielding([i])])
+                assert dec.decode(blob) == [n, {u'yielding': i}, {u'yielding': [i]}]
+        assert not _run_threads(work)
+
+    def test_shared_stream_decoder(self):
+        dec = cStreamDecoder()
+        out = []
+        producers_done = threading.Event()
+
+        def consume():
+            while True:
+                done = producers_done.is_set()
+                out.extend(dec)
+                if done:
+                    return
+                time.sleep(0)
+
+        def produce(n):
+            for i in range(_ROUNDS):
+                dec.feed(cdumps([n, i, self.obs[i % len(self.obs)]]))
+        consumer = threading.Thread(target=consume)
+        consumer.start()
+        errors = _run_threads(produce)
+        producers_done.set()
+        consumer.join()
+        assert not errors
+        assert dec.buffered == 0
+        assert sorted((x[0], x[1]) for x in out) == [(n, i) for n in range(_THREADS) for i in range(_ROUNDS)]
+        assert all(x[2] == self.obs[x[1] % len(self.obs)] for x in out)
+
+    def test_reinit_while_busy(self):
+        # A call that finds the object busy keeps using the hooks it started
+        # with after __init__() in another thread replaced them.
+        first_in = threading.Event()
+        first_go = threading.Event()
+        second_in = threading.Event()
+        second_go = threading.Event()
+
+        def make_hook(ret):
+            def hook(ob):
+                ob = ret(ob)
+                if ob in (u'first', {u'who': u'first'}):
+                    first_in.set()
+                    first_go.wait()
+                elif ob in (u'second', {u'who': u'second'}):
+                    second_in.set()
+                    second_go.wait()
+                return ob
+            return hook
+
+        def check(call, first, second, reinit):
+            out = []
+            a = threading.Thread(target=call, args=(first,))
+            b = threading.Thread(target=lambda: out.append(call(second)))
+            a.start()
+            first_in.wait()
+            b.start()
+            second_in.wait()
+            first_go.set()
+            a.join()
+            reinit()
+            [object() for _ in range(1000)]
+            second_go.set()
+            b.join()
+            for ev in (first_in, first_go, second_in, second_go):
+                ev.clear()
+            return out
+
+        dec = cDecoder(object_hook=make_hook(lambda ob: ob))
+        out = check(dec.decode, cdumps({u'who': u'first'}),
+                    cdumps([{u'who': u'second'}, {u'then': 1}]), dec.__init__)
+        assert out == [[{u'who': u'second'}, {u'then': 1}]]
+
+        enc = cEncoder(default=make_hook(lambda ob: ob.value))
+        out = check(lambda v: enc.encode(Yielding(v)) if v == u'first' else enc.encode([Yielding(v), Yielding(1)]),
+                    u'first', u'second', enc.__init__)
+        assert out == [cdumps([u'second', 1])]
+
+    def test_dict_changed(self):
+        d = {}
+
+        def default(ob):
+            d[len(d) + 100] = 1
+            return 0
+        d.update({i: i for i in range(5)})
+        d[5] = Yielding(0)
+        with self.assertRaises(RuntimeError):
+            cdumps(d, default=default)
+
+    def test_sequence_iterator_reentered(self):
+        class Reentering(object):
+            '''File whose read() uses the iterator reading it.'''
+            def __init__(self, data):
+                self.data = data
+
+            def read(self, n):
+                out, self.data = self.data[:n], self.data[n:]
+                if out:
+                    errors.append(self.reenter())
+                return out
+
+            def reenter(self):
+                try:
+                    next(it)
+                except RuntimeError as ex:
+                    return ex
+        errors = []
+        it = citer_load(Reentering(cdumps(1) + cdumps(2)), consume_ahead=False)
+        assert list(it) == [1, 2]
+        assert errors and all(isinstance(ex, RuntimeError) for ex in errors), errors
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -20,16 +20,15 @@ _IS_PY3 = sys.version_info[0] >= 3
 logger = logging.getLogger(__name__)
 
 
-#from cbor.cbor import dumps as pydumps
+from cbor.cbor import dumps as pydumps
 from cbor.cbor import loads as pyloads
 try:
-    #from cbor._cbor import dumps as cdumps
+    from cbor._cbor import dumps as cdumps
     from cbor._cbor import loads as cloads
 except ImportError:
     # still test what we can without C fast mode
     logger.warn('testing without C accelerated CBOR', exc_info=True)
-    #cdumps, cloads = None, None
-    cloads = None
+    cdumps, cloads = None, None
 from cbor import Tag
 
 
@@ -50,6 +49,27 @@ _DIAGNOSTIC_TESTS = {
 }
 
 
+# Examples from the stringref spec, http://cbor.schmorp.de/stringref
+# (hex, decoded, written) and dumps(written or decoded, string_referencing=True) == hex
+_STRINGREF_VECTORS = [
+    ('d9010098204131433232324333333341344335353543363636433737374338383843393939436161614362626243636363'
+     '436464644365656543666666436767674368686843696969436a6a6a436b6b6b436c6c6c436d6d6d436e6e6e436f6f6f'
+     '437070704371717143727272d819014473737373d8191743727272d8191818',
+     [b'1', b'222', b'333', b'4', b'555', b'666', b'777', b'888', b'999', b'aaa', b'bbb', b'ccc', b'ddd',
+      b'eee', b'fff', b'ggg', b'hhh', b'iii', b'jjj', b'kkk', b'lll', b'mmm', b'nnn', b'ooo', b'ppp',
+      b'qqq', b'rrr', b'333', b'ssss', b'qqq', b'rrr', b'ssss'], None),
+    ('d9010083a3646e616d6568436f636b7461696c65636f756e741901a16472616e6b04a3d8190304d81902190138d81900'
+     '6442617468a3d819021902b3d8190064466f6f64d8190304',
+     [{u'name': u'Cocktail', u'count': 417, u'rank': 4},
+      {u'rank': 4, u'count': 312, u'name': u'Bath'},
+      {u'count': 691, u'name': u'Food', u'rank': 4}], None),
+    # a nested namespace starts over, the outer one carries on after it
+    ('d901008563616161d81900d9010082636161616362626263626262d81901',
+     [u'aaa', u'aaa', [u'aaa', u'bbb'], u'bbb', u'bbb'],
+     [u'aaa', u'aaa', Tag(256, [u'aaa', u'bbb']), u'bbb', u'bbb']),
+]
+
+
 # We expect these to raise exception because they encode reserved/unused codes in the spec.
 # ['hex'] values of tests we expect to raise
 _EXPECT_EXCEPTION = set(['f0', 'f818', 'f8ff'])
@@ -136,6 +156,17 @@ class TestVectors(unittest.TestCase):
 
             assert not anyerr
 
+        def test_stringref_vectors(self):
+            for rhex, decoded, written in _STRINGREF_VECTORS:
+                cbdata = base64.b16decode(rhex.upper())
+                for loads, dumps in ((pyloads, pydumps), (cloads, cdumps)):
+                    if loads is None:
+                        continue
+                    assert loads(cbdata) == decoded
+                    if _IS_PY3 or not isinstance(decoded[0], dict):
+                        # needs dicts that keep their order
+                        assert dumps(written or decoded, string_referencing=True) == cbdata
+
 
 if __name__ == '__main__':
     logging.basicConfig(level=logging.DEBUG)
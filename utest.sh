@@ -4,8 +4,18 @@ python -m cbor.tests.test_cbor
 python -m cbor.tests.test_objects
 python -m cbor.tests.test_usage
 python -m cbor.tests.test_vectors
+python -m cbor.tests.test_indexed
+python -m cbor.tests.test_rpc_asyncio
+python -m cbor.tests.test_rpc_server
+python -m cbor.tests.test_rpc_client
+python -m cbor.tests.test_threads
 
 #python cbor/tests/test_cbor.py
 #python cbor/tests/test_objects.py
 #python cbor/tests/test_usage.py
 #python cbor/tests/test_vectors.py
+#python cbor/tests/test_indexed.py
+#python cbor/tests/test_rpc_asyncio.py
+#python cbor/tests/test_rpc_server.py
+#python cbor/tests/test_rpc_client.py
+#python cbor/tests/test_threads.py